@@ -40,6 +40,10 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#if defined(HAVE_MMAP) && !defined(HAVE_W32_SYSTEM)
+# include <sys/mman.h>
+# define USE_MMAP 1
+#endif
 #ifdef HAVE_W32_SYSTEM
 # ifdef HAVE_WINSOCK2_H
 #  include <winsock2.h>
@@ -70,12 +74,33 @@
    instead of the internal buffers. */
 #define IOBUF_ZEROCOPY_THRESHOLD_SIZE 1024
 
+/* Regular files opened with iobuf_open are only mapped into memory
+   if they have at least this size.  */
+#define IOBUF_MMAP_MIN_SIZE (1024*1024)
+
+/* Unless the buffer size has been set explicitly, the buffer for an
+   input file smaller than the standard buffer is only as large as
+   the file (rounded up to IOBUF_MIN_BUFFER_SIZE).  Files of at least
+   IOBUF_LARGE_FILE_SIZE get a buffer of IOBUF_LARGE_BUFFER_SIZE.
+   Filters pushed on top inherit the size unless they process bulk
+   data (see IOBUFCTRL_BUFHINT).  */
+#define IOBUF_MIN_BUFFER_SIZE   (4*1024)
+#define IOBUF_LARGE_FILE_SIZE   (16*1024*1024)
+#define IOBUF_LARGE_BUFFER_SIZE (256*1024)
+
 /*-- End configurable part.  --*/
 
 /* The size of the iobuffers.  This can be changed using the
  * iobuf_set_buffer_size function.  */
 static unsigned int iobuf_buffer_size = DEFAULT_IOBUF_BUFFER_SIZE;
 
+/* Set if the buffer size has been set by iobuf_set_buffer_size.  */
+static int iobuf_buffer_size_fixed;
+
+/* Whether iobuf_open may map regular files into memory.  This can be
+ * changed using the iobuf_enable_mmap function.  */
+static int iobuf_use_mmap;
+
 
 #ifdef HAVE_W32_SYSTEM
 # define FD_FOR_STDIN  (GetStdHandle (STD_INPUT_HANDLE))
@@ -98,6 +123,9 @@ typedef struct
   char peeked[32];     /* Read ahead buffer.  */
   byte npeeked;        /* Number of bytes valid in peeked.  */
   byte upeeked;        /* Number of bytes used from peeked.  */
+  byte *map;           /* If not NULL the file is mapped at this address.  */
+  size_t maplen;       /* Length of the mapping.  */
+  size_t mappos;       /* Read position in the mapping.  */
   char fname[1];       /* Name of the file.  */
 } file_filter_ctx_t;
 
@@ -166,6 +194,7 @@ block_filter_ctx_t;
 /* Local prototypes.  */
 static int underflow (iobuf_t a, int clear_pending_eof);
 static int underflow_target (iobuf_t a, int clear_pending_eof, size_t target);
+static void reclaim_buffer (iobuf_t a);
 static iobuf_t do_iobuf_fdopen (gnupg_fd_t fp, const char *mode, int keep_open);
 
 
@@ -465,7 +494,33 @@ file_filter (void *opaque, int control, iobuf_t chain, byte * buf,
 
   (void)chain; /* Not used.  */
 
-  if (control == IOBUFCTRL_UNDERFLOW)
+  if (a->map && (control == IOBUFCTRL_UNDERFLOW
+                 || control == IOBUFCTRL_LEND
+                 || control == IOBUFCTRL_PEEK))
+    {
+      /* The file is mapped; there is no need to call read.  */
+      log_assert (size);
+      nbytes = a->maplen - a->mappos;
+      if (nbytes > size)
+        nbytes = size;
+      if (control == IOBUFCTRL_PEEK)
+        memcpy (buf, a->map + a->mappos, nbytes);
+      else if (!nbytes)
+        {
+          a->eof_seen = 1;
+          rc = -1;
+        }
+      else
+        {
+          if (control == IOBUFCTRL_LEND)
+            *(byte **)buf = a->map + a->mappos;
+          else
+            memcpy (buf, a->map + a->mappos, nbytes);
+          a->mappos += nbytes;
+        }
+      *ret_len = nbytes;
+    }
+  else if (control == IOBUFCTRL_UNDERFLOW)
     {
       log_assert (size); /* We need a buffer.  */
       if (a->npeeked > a->upeeked)
@@ -619,6 +674,8 @@ file_filter (void *opaque, int control, iobuf_t chain, byte * buf,
       a->no_cache = 0;
       a->npeeked = 0;
       a->upeeked = 0;
+      if (a->map)
+        *ret_len = IOBUFCTRL_LEND;
     }
   else if (control == IOBUFCTRL_PEEK)
     {
@@ -692,6 +749,16 @@ file_filter (void *opaque, int control, iobuf_t chain, byte * buf,
     }
   else if (control == IOBUFCTRL_FREE)
     {
+#ifdef USE_MMAP
+      if (a->map)
+        {
+          munmap (a->map, a->maplen);
+          a->map = NULL;
+          /* Leave the file position where a reader would expect it.  */
+          if (a->keep_open)
+            lseek (f, a->mappos, SEEK_SET);
+        }
+#endif
       if (f != FD_FOR_STDIN && f != FD_FOR_STDOUT)
 	{
 	  if (DBG_IOBUF)
@@ -1210,9 +1277,7 @@ block_filter (void *opaque, int control, iobuf_t chain, byte * buffer,
 unsigned int
 iobuf_set_buffer_size (unsigned int kilobyte)
 {
-  static int used;
-
-  if (!used && kilobyte)
+  if (!iobuf_buffer_size_fixed && kilobyte)
     {
       if (kilobyte < 4)
         kilobyte = 4;
@@ -1220,12 +1285,66 @@ iobuf_set_buffer_size (unsigned int kilobyte)
         kilobyte = 16*1024;
 
       iobuf_buffer_size = kilobyte * 1024;
-      used = 1;
+      iobuf_buffer_size_fixed = 1;
     }
   return iobuf_buffer_size / 1024;
 }
 
 
+/* Allow iobuf_open to map regular files into memory if ENABLE is
+ * true.  Large files are then read without read(2) calls and their
+ * data is handed directly to the readers of the iobuf.  Note that a
+ * file which is truncated while it is mapped results in a SIGBUS.  */
+void
+iobuf_enable_mmap (int enable)
+{
+  iobuf_use_mmap = !!enable;
+}
+
+
+/* Try to map the file opened for FCX.  Does nothing if mapping is
+ * not enabled or not possible; the file is then read as usual.  */
+static void
+file_filter_map (file_filter_ctx_t *fcx)
+{
+#ifdef USE_MMAP
+  struct stat st;
+  void *p;
+
+  fcx->map = NULL;
+  fcx->maplen = 0;
+  fcx->mappos = 0;
+  if (!iobuf_use_mmap || fcx->print_only_name)
+    return;
+
+  /* Pipes, devices and small files are read the usual way.  */
+  if (fstat (fcx->fp, &st) || !S_ISREG (st.st_mode)
+      || st.st_size < IOBUF_MMAP_MIN_SIZE
+      || (uint64_t)st.st_size > (size_t)(-1))
+    return;
+
+  p = mmap (NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fcx->fp, 0);
+  if (p == MAP_FAILED)
+    {
+      if (DBG_IOBUF)
+        log_debug ("%s: mmap failed: %s\n", fcx->fname, strerror (errno));
+      return;
+    }
+# ifdef MADV_SEQUENTIAL
+  madvise (p, (size_t)st.st_size, MADV_SEQUENTIAL);
+# endif
+  fcx->map = p;
+  fcx->maplen = (size_t)st.st_size;
+  if (DBG_IOBUF)
+    log_debug ("%s: mapped %zu bytes\n", fcx->fname, fcx->maplen);
+#else
+  fcx->map = NULL;
+  fcx->maplen = 0;
+  fcx->mappos = 0;
+#endif
+}
+
+
 #define MAX_IOBUF_DESC 32
 /*
  * Fill the buffer by the description of iobuf A.
@@ -1267,6 +1386,82 @@ iobuf_print_chain (iobuf_t a)
   return 0;
 }
 
+/* Print the statistics of the filter A in debug mode.  */
+static void
+print_stats (iobuf_t a)
+{
+  byte desc[MAX_IOBUF_DESC];
+
+  if (DBG_IOBUF && a->stat_calls)
+    log_debug ("iobuf-%d.%d: '%s' buffer size %lu: %lu calls, %llu bytes\n",
+               a->no, a->subno, iobuf_desc (a, desc), (ulong)a->d.size,
+               a->stat_calls, (unsigned long long)a->stat_bytes);
+}
+
+
+/* Replace the still empty buffer of A by one of SIZE bytes.  */
+static void
+resize_empty_buffer (iobuf_t a, size_t size)
+{
+  if (size == a->d.size)
+    return;
+  log_assert (!a->d.len);
+  xfree (a->d.buf);
+  a->d.buf = xmalloc (size);
+  a->d.size = size;
+}
+
+
+/* Resize the still empty buffer of the input file A according to the
+ * length of the file.  MAPPED is set if the file is mapped into
+ * memory and the buffer is thus rarely used.  */
+static void
+adapt_buffer_size (iobuf_t a, int mapped)
+{
+  uint64_t filelen;
+  size_t size;
+
+  if (iobuf_buffer_size_fixed)
+    return;
+
+  filelen = iobuf_get_filelength (a);
+  if (!filelen)
+    return;  /* Unknown length (e.g. a fifo).  */
+  if (filelen < iobuf_buffer_size)
+    size = ((filelen + IOBUF_MIN_BUFFER_SIZE - 1)
+            / IOBUF_MIN_BUFFER_SIZE * IOBUF_MIN_BUFFER_SIZE);
+  else if (filelen >= IOBUF_LARGE_FILE_SIZE && !mapped
+           && IOBUF_LARGE_BUFFER_SIZE > iobuf_buffer_size)
+    size = IOBUF_LARGE_BUFFER_SIZE;
+  else
+    return;
+
+  resize_empty_buffer (a, size);
+}
+
+
+/* Adapt the buffer size of the just pushed filter A to the way the
+ * filter uses its buffer (see IOBUFCTRL_BUFHINT).  The buffer of a
+ * bulk filter is at least of the standard size; it is larger if the
+ * stream below already uses a larger buffer.  For example, a
+ * decompression filter on top of a small file gets a full-size
+ * buffer because it produces more data than it reads.  */
+static void
+adapt_filter_buffer_size (iobuf_t a)
+{
+  size_t hint = 0;
+
+  if (iobuf_buffer_size_fixed || !a->filter
+      || (a->use != IOBUF_INPUT && a->use != IOBUF_OUTPUT))
+    return;
+
+  if (a->filter (a->filter_ov, IOBUFCTRL_BUFHINT, a->chain, NULL, &hint))
+    return;
+  if (hint == IOBUF_BUFHINT_BULK && a->d.size < iobuf_buffer_size)
+    resize_empty_buffer (a, iobuf_buffer_size);
+}
+
+
 iobuf_t
 iobuf_alloc (int use, size_t bufsize)
 {
@@ -1316,6 +1511,8 @@ iobuf_close (iobuf_t a)
 	log_debug ("iobuf-%d.%d: close '%s'\n",
 		   a->no, a->subno, iobuf_desc (a, desc));
 
+      reclaim_buffer (a);
+      print_stats (a);
       if (a->filter && (rc2 = a->filter (a->filter_ov, IOBUFCTRL_FREE,
 					 a->chain, NULL, &dummy_len)))
 	log_error ("IOBUFCTRL_FREE failed on close: %s\n", gpg_strerror (rc));
@@ -1467,7 +1664,15 @@ do_open (const char *fname, int special_filenames,
     a->real_fname = xstrdup (fname);
   a->filter = file_filter;
   a->filter_ov = fcx;
+  if (use == IOBUF_INPUT)
+    file_filter_map (fcx);
+  else
+    fcx->map = NULL;
   file_filter (fcx, IOBUFCTRL_INIT, NULL, NULL, &len);
+  if (len == IOBUFCTRL_LEND)
+    a->filter_lends = 1;
+  if (use == IOBUF_INPUT && !print_only)
+    adapt_buffer_size (a, !!fcx->map);
   if (DBG_IOBUF)
     log_debug ("iobuf-%d.%d: open '%s' desc=%s fd=%d\n",
 	       a->no, a->subno, fname, iobuf_desc (a, desc),
@@ -1508,6 +1713,7 @@ do_iobuf_fdopen (gnupg_fd_t fp, const char *mode, int keep_open)
   fcx->fp = fp;
   fcx->print_only_name = 1;
   fcx->keep_open = keep_open;
+  fcx->map = NULL;
   sprintf (fcx->fname, "[fd %d]", FD_DBG (fp));
   a->filter = file_filter;
   a->filter_ov = fcx;
@@ -1775,6 +1981,10 @@ iobuf_push_filter2 (iobuf_t a,
   a->filter_ov = NULL;
   a->filter_ov_owner = 0;
   a->filter_eof = 0;
+  a->filter_lends = 0;
+  a->own_buf = NULL;
+  a->stat_calls = 0;
+  a->stat_bytes = 0;
   if (a->use == IOBUF_OUTPUT_TEMP)
     {
       /* A TEMP filter buffers any data sent to it; it does not
@@ -1839,6 +2049,12 @@ iobuf_push_filter2 (iobuf_t a,
   if (a->filter && (rc = a->filter (a->filter_ov, IOBUFCTRL_INIT, a->chain,
 				    NULL, &dummy_len)))
     log_error ("IOBUFCTRL_INIT failed: %s\n", gpg_strerror (rc));
+  else
+    {
+      if (a->use == IOBUF_INPUT && dummy_len == IOBUFCTRL_LEND)
+        a->filter_lends = 1;
+      adapt_filter_buffer_size (a);
+    }
   return rc;
 }
 
@@ -1881,6 +2097,9 @@ iobuf_pop_filter (iobuf_t a, int (*f) (void *opaque, int control,
   if (!b)
     log_bug ("iobuf_pop_filter(): filter function not found\n");
 
+  reclaim_buffer (b);
+  print_stats (b);
+
   /* Flush this stream if it is an output stream ... */
   if (a->use == IOBUF_OUTPUT && (rc = filter_flush (b)))
     {
@@ -1930,6 +2149,29 @@ iobuf_pop_filter (iobuf_t a, int (*f) (void *opaque, int control,
 }
 
 
+/* If A's buffer has been lent by its filter (see IOBUFCTRL_LEND),
+ * move the unconsumed data back into A's own buffer and switch to
+ * that buffer.  */
+static void
+reclaim_buffer (iobuf_t a)
+{
+  size_t n;
+
+  if (!a->own_buf)
+    return;
+
+  log_assert (a->d.start <= a->d.len);
+  n = a->d.len - a->d.start;
+  log_assert (n <= a->d.size);
+  if (n)
+    memcpy (a->own_buf, a->d.buf + a->d.start, n);
+  a->d.buf = a->own_buf;
+  a->d.start = 0;
+  a->d.len = n;
+  a->own_buf = NULL;
+}
+
+
 /****************
  * read underflow: read at least one byte into the buffer and return
  * the first byte or -1 on EOF.
@@ -1968,6 +2210,9 @@ underflow_target (iobuf_t a, int clear_pending_eof, size_t target)
 
   a->e_d.used = 0;
 
+  /* Give a lent buffer back to the filter before calling it again.  */
+  reclaim_buffer (a);
+
   /* If there is still some buffered data, then move it to the start
    * of the buffer and try to fill the end of the buffer.  (This is
    * useful if we are called from iobuf_peek().)  */
@@ -1996,6 +2241,7 @@ underflow_target (iobuf_t a, int clear_pending_eof, size_t target)
 	  if (DBG_IOBUF)
 	    log_debug ("iobuf-%d.%d: filter popped (pending EOF returned)\n",
 		       a->no, a->subno);
+	  print_stats (a);
 	  xfree (a->d.buf);
 	  xfree (a->real_fname);
 	  memcpy (a, b, sizeof *a);
@@ -2044,6 +2290,7 @@ underflow_target (iobuf_t a, int clear_pending_eof, size_t target)
       else
         {
           size_t tmplen;
+          size_t oldlen = a->d.len;
 
           /* If no buffered data and drain buffer has been setup, and
            * drain buffer is largish, read data directly to drain buffer. */
@@ -2063,8 +2310,38 @@ underflow_target (iobuf_t a, int clear_pending_eof, size_t target)
                               a->e_d.buf, &len);
               log_assert (len <= tmplen);
               a->e_d.used = len;
+              a->stat_bytes += len;
               len = 0;
             }
+          else if (a->d.len == 0 && a->filter_lends
+                   && len == a->d.size)
+            {
+              byte *lent = NULL;
+
+              if (DBG_IOBUF)
+                log_debug ("iobuf-%d.%d: underflow:"
+                           " A->FILTER (%lu bytes, lent buffer)\n",
+                           a->no, a->subno, (ulong)len);
+
+              tmplen = len;
+              rc = a->filter (a->filter_ov, IOBUFCTRL_LEND, a->chain,
+                              (byte *)&lent, &len);
+              log_assert (len <= tmplen);
+              if (len)
+                {
+                  log_assert (lent);
+                  a->own_buf = a->d.buf;
+                  a->d.buf = lent;
+                  /* The filter may release the buffer on EOF or
+                   * error; thus we need to take a copy right away.  */
+                  if (rc)
+                    {
+                      a->d.len = len;
+                      reclaim_buffer (a);
+                      len = 0;
+                    }
+                }
+            }
           else
             {
               if (DBG_IOBUF)
@@ -2076,6 +2353,8 @@ underflow_target (iobuf_t a, int clear_pending_eof, size_t target)
                               &a->d.buf[a->d.len], &len);
               log_assert (len <= tmplen);
             }
+          a->stat_calls++;
+          a->stat_bytes += a->d.len + len - oldlen;
         }
       a->d.len += len;
 
@@ -2093,6 +2372,9 @@ underflow_target (iobuf_t a, int clear_pending_eof, size_t target)
 	{
 	  size_t dummy_len = 0;
 
+	  print_stats (a);
+	  a->stat_calls = 0;
+
 	  /* Tell the filter to free itself */
 	  if ((rc = a->filter (a->filter_ov, IOBUFCTRL_FREE, a->chain,
 			       NULL, &dummy_len)))
@@ -2198,6 +2480,8 @@ filter_flush (iobuf_t a)
 
   len = src_len;
   rc = a->filter (a->filter_ov, IOBUFCTRL_FLUSH, a->chain, src_buf, &len);
+  a->stat_calls++;
+  a->stat_bytes += len;
   if (!rc && len != src_len)
     {
       log_info ("filter_flush did not write all!\n");
@@ -2722,6 +3006,12 @@ iobuf_seek (iobuf_t a, off_t newpos)
 
       b = a->filter_ov;
 
+      if (b->map)
+        {
+          b->mappos = newpos < b->maplen? (size_t)newpos : b->maplen;
+          b->eof_seen = 0;
+        }
+      else
 #ifdef HAVE_W32_SYSTEM
       if (SetFilePointer (b->fp, newpos, NULL, FILE_BEGIN) == 0xffffffff)
 	{
@@ -2737,6 +3027,11 @@ iobuf_seek (iobuf_t a, off_t newpos)
 	}
 #endif
       /* Discard the buffer it is not a temp stream.  */
+      if (a->own_buf)
+        {
+          a->d.buf = a->own_buf;
+          a->own_buf = NULL;
+        }
       a->d.len = 0;
     }
   a->d.start = 0;
@@ -107,9 +107,14 @@ enum
     IOBUFCTRL_DESC	= 5,
     IOBUFCTRL_CANCEL    = 6,
     IOBUFCTRL_PEEK      = 7,
+    IOBUFCTRL_LEND      = 8,
+    IOBUFCTRL_BUFHINT   = 9,
     IOBUFCTRL_USER	= 16
   };
 
+/* Values for IOBUFCTRL_BUFHINT.  */
+#define IOBUF_BUFHINT_BULK 1
+
 
 /* Command codes for iobuf_ioctl.  */
 typedef enum
@@ -236,6 +241,22 @@ struct iobuf_struct
      return the EOF.  */
   int error;
 
+  /* Statistics shown in debug mode when the filter is removed: the
+     number of calls to FILTER to read or write data and the number
+     of bytes transferred by these calls.  */
+  unsigned long stat_calls;
+  off_t stat_bytes;
+
+  /* Whether FILTER implements IOBUFCTRL_LEND.  This is set by the
+     filter's IOBUFCTRL_INIT handler.  */
+  int filter_lends;
+
+  /* If not NULL, D.BUF currently points to a buffer lent by FILTER
+     (see IOBUFCTRL_LEND) and this is the iobuf's own buffer.  The
+     own buffer is put back, along with any unconsumed data, before
+     the filter is called again or the iobuf is released.  */
+  byte *own_buf;
+
   /* The callback function to read data from the filter, etc.  See
      iobuf_filter_push for details.  */
   int (*filter) (void *opaque, int control,
@@ -280,6 +301,10 @@ extern int iobuf_debug_mode;
  * returning the current value.  */
 unsigned int iobuf_set_buffer_size (unsigned int kilobyte);
 
+/* Allow iobuf_open to map large regular files into memory if ENABLE
+ * is true.  Pipes and special files are always read.  */
+void iobuf_enable_mmap (int enable);
+
 /* Returns whether the specified filename corresponds to a pipe.  In
    particular, this function checks if FNAME is "-" and, if special
    filenames are enabled (see check_special_filename), whether
@@ -392,7 +417,9 @@ int iobuf_cancel (iobuf_t iobuf);
 
      IOBUFCTRL_INIT: Called this value just before the filter is
        linked into the pipeline. This can be used to initialize
-       internal data structures.
+       internal data structures.  *LEN is 0 on entry; an input
+       filter which implements IOBUFCTRL_LEND sets it to
+       IOBUFCTRL_LEND.
 
      IOBUFCTRL_FREE: Called with this value just before the filter is
        removed from the pipeline.  Normally used to release internal
@@ -411,6 +438,26 @@ int iobuf_cancel (iobuf_t iobuf);
        is that if an error occurs and no data has yet been written, it
        is essential that *LEN be set to 0!
 
+     IOBUFCTRL_LEND: Like IOBUFCTRL_UNDERFLOW but instead of copying
+       the data into the iobuf's buffer, the filter fills a buffer it
+       owns and stores its address at (byte **)BUF.  *LEN is the
+       maximum number of bytes the iobuf accepts and must be set to
+       the number of bytes in the lent buffer.  The lent buffer must
+       stay valid and unchanged until the filter is called again;
+       the iobuf only reads from it.  This saves a copy for filters
+       which keep their data in a buffer anyway (e.g. to hand it to
+       another thread).  It is only used if the filter announced
+       support in IOBUFCTRL_INIT and only when the iobuf's buffer is
+       empty.
+
+     IOBUFCTRL_BUFHINT: Called right after IOBUFCTRL_INIT to learn
+       how the filter uses its buffer.  *LEN is 0 on entry.  A
+       filter which transforms bulk data, like a cipher or a
+       compression filter, sets it to IOBUF_BUFHINT_BULK and gets a
+       buffer of at least the standard size even if the stream below
+       uses a smaller one.  Other filters leave *LEN unchanged and
+       use the buffer size of the stream below.
+
      IOBUFCTRL_FLUSH: Called with this value to write out any
        collected data.  *LEN is the number of bytes in BUF that need
        to be written out.  Returns 0 on success and a GPG_ERR_* code
@@ -37,10 +37,15 @@
 
 #define MAX_LINELEN 20000
 
+/* The number of full radix64 lines collected before they are written
+   to the output in one go.  */
+#define ARMOR_LINES_PER_WRITE 16
+
 static const byte bintoasc[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
                                "abcdefghijklmnopqrstuvwxyz"
                                "0123456789+/";
 static u32 asctobin[4][256]; /* runtime initialized */
+static byte bintoasc2[4096][2]; /* runtime initialized */
 static int is_initialized;
 
 
@@ -190,6 +195,14 @@ initialize(void)
 	asctobin[3][*s] = i << (3 * 6);
       }
 
+    /* Build the helptable for bin to radix64 conversion which maps 12
+       bits to two characters at once.  */
+    for (i=0; i < DIM (bintoasc2); i++)
+      {
+        bintoasc2[i][0] = bintoasc[i >> 6];
+        bintoasc2[i][1] = bintoasc[i & 077];
+      }
+
     is_initialized=1;
 }
 
@@ -885,30 +898,38 @@ radix64_read( armor_filter_context_t *afx, IOBUF a, size_t *retn,
 		&& afx->buffer_pos + (16 - 1) < afx->buffer_len
 		&& n + 12 < size)
 	      {
-		/* Fast path for radix64 to binary conversion.  */
+		/* Fast path for radix64 to binary conversion.  Decode as
+		   many groups of 16 characters from the current line as
+		   possible before going back to the main loop.  */
 		u32 b0,b1,b2,b3;
+		const byte *p;
 
-		/* Speculatively load 15 more input bytes.  */
-		b0 = binc << (3 * 6);
-		b0 |= asctobin[2][afx->buffer[afx->buffer_pos + 0]];
-		b0 |= asctobin[1][afx->buffer[afx->buffer_pos + 1]];
-		b0 |= asctobin[0][afx->buffer[afx->buffer_pos + 2]];
-		b1  = asctobin[3][afx->buffer[afx->buffer_pos + 3]];
-		b1 |= asctobin[2][afx->buffer[afx->buffer_pos + 4]];
-		b1 |= asctobin[1][afx->buffer[afx->buffer_pos + 5]];
-		b1 |= asctobin[0][afx->buffer[afx->buffer_pos + 6]];
-		b2  = asctobin[3][afx->buffer[afx->buffer_pos + 7]];
-		b2 |= asctobin[2][afx->buffer[afx->buffer_pos + 8]];
-		b2 |= asctobin[1][afx->buffer[afx->buffer_pos + 9]];
-		b2 |= asctobin[0][afx->buffer[afx->buffer_pos + 10]];
-		b3  = asctobin[3][afx->buffer[afx->buffer_pos + 11]];
-		b3 |= asctobin[2][afx->buffer[afx->buffer_pos + 12]];
-		b3 |= asctobin[1][afx->buffer[afx->buffer_pos + 13]];
-		b3 |= asctobin[0][afx->buffer[afx->buffer_pos + 14]];
-
-		/* Check if any of the input bytes were invalid. */
-		if( (b0 | b1 | b2 | b3) != 0xffffffffUL )
+		for (;;)
 		  {
+		    p = afx->buffer + afx->buffer_pos;
+
+		    /* Speculatively load 15 more input bytes.  */
+		    b0 = binc << (3 * 6);
+		    b0 |= asctobin[2][p[0]];
+		    b0 |= asctobin[1][p[1]];
+		    b0 |= asctobin[0][p[2]];
+		    b1  = asctobin[3][p[3]];
+		    b1 |= asctobin[2][p[4]];
+		    b1 |= asctobin[1][p[5]];
+		    b1 |= asctobin[0][p[6]];
+		    b2  = asctobin[3][p[7]];
+		    b2 |= asctobin[2][p[8]];
+		    b2 |= asctobin[1][p[9]];
+		    b2 |= asctobin[0][p[10]];
+		    b3  = asctobin[3][p[11]];
+		    b3 |= asctobin[2][p[12]];
+		    b3 |= asctobin[1][p[13]];
+		    b3 |= asctobin[0][p[14]];
+
+		    /* Check if any of the input bytes were invalid. */
+		    if( (b0 | b1 | b2 | b3) == 0xffffffffUL )
+		      break;
+
 		    /* All 16 bytes are valid. */
 		    buf[n + 0] = b0 >> (2 * 8);
 		    buf[n + 1] = b0 >> (1 * 8);
@@ -924,6 +945,21 @@ radix64_read( armor_filter_context_t *afx, IOBUF a, size_t *retn,
 		    buf[n + 11] = b3 >> (0 * 8);
 		    afx->buffer_pos += 16 - 1;
 		    n += 12;
+
+		    /* Continue with the next group if it is complete and
+		       starts with a valid character.  */
+		    if( afx->buffer_pos + 16 >= afx->buffer_len
+			|| n + 12 >= size )
+		      break;
+		    binc = asctobin[0][afx->buffer[afx->buffer_pos]];
+		    if( binc == 0xffffffffUL )
+		      break;
+		    afx->buffer_pos++;
+		  }
+
+		if( (b0 | b1 | b2 | b3) != 0xffffffffUL )
+		  {
+		    /* The last group has been consumed.  */
 		    continue;
 		  }
 		else if( b0 == 0xffffffffUL )
@@ -1175,11 +1211,13 @@ armor_output_buf_as_radix64 (armor_filter_context_t *afx, IOBUF a,
 			     byte *buf, size_t size)
 {
   byte radbuf[sizeof (afx->radbuf)];
-  byte outbuf[64 + sizeof (afx->eol)];
+  byte outbuf[4 + sizeof (afx->eol)];
+  byte lines[ARMOR_LINES_PER_WRITE * (64 + sizeof (afx->eol))];
+  byte *p;
   unsigned int eollen = strlen (afx->eol);
   u32 in, in2;
   int idx, idx2;
-  int i;
+  int i, line;
 
   idx = afx->idx;
   idx2 = afx->idx2;
@@ -1218,41 +1256,38 @@ armor_output_buf_as_radix64 (armor_filter_context_t *afx, IOBUF a,
 
   if (size >= (64/4)*3)
     {
-      /* preload eol to outbuf buffer */
-      memcpy (outbuf + 64, afx->eol, sizeof(afx->eol));
-
       do
 	{
 	  /* idx and idx2 == 0 */
-
-	  for (i = 0; i < (64/8); i++)
+	  p = lines;
+	  for (line = 0; line < ARMOR_LINES_PER_WRITE && size >= (64/4)*3;
+	       line++)
 	    {
-	      in = (u32)buf[0] << (2 * 8);
-	      in |= (u32)buf[1] << (1 * 8);
-	      in |= (u32)buf[2] << (0 * 8);
-	      in2 = (u32)buf[3] << (2 * 8);
-	      in2 |= (u32)buf[4] << (1 * 8);
-	      in2 |= (u32)buf[5] << (0 * 8);
-	      outbuf[i*8+0] = bintoasc[(in >> 18) & 077];
-	      outbuf[i*8+1] = bintoasc[(in >> 12) & 077];
-	      outbuf[i*8+2] = bintoasc[(in >> 6) & 077];
-	      outbuf[i*8+3] = bintoasc[(in >> 0) & 077];
-	      outbuf[i*8+4] = bintoasc[(in2 >> 18) & 077];
-	      outbuf[i*8+5] = bintoasc[(in2 >> 12) & 077];
-	      outbuf[i*8+6] = bintoasc[(in2 >> 6) & 077];
-	      outbuf[i*8+7] = bintoasc[(in2 >> 0) & 077];
-	      buf+=6;
-	      size-=6;
+	      for (i = 0; i < (64/8); i++)
+		{
+		  in = (u32)buf[0] << (2 * 8);
+		  in |= (u32)buf[1] << (1 * 8);
+		  in |= (u32)buf[2] << (0 * 8);
+		  in2 = (u32)buf[3] << (2 * 8);
+		  in2 |= (u32)buf[4] << (1 * 8);
+		  in2 |= (u32)buf[5] << (0 * 8);
+		  memcpy (p + 0, bintoasc2[(in >> 12) & 07777], 2);
+		  memcpy (p + 2, bintoasc2[(in >> 0) & 07777], 2);
+		  memcpy (p + 4, bintoasc2[(in2 >> 12) & 07777], 2);
+		  memcpy (p + 6, bintoasc2[(in2 >> 0) & 07777], 2);
+		  p += 8;
+		  buf += 6;
+		  size -= 6;
+		}
+
+	      /* pgp doesn't like 72 here */
+	      memcpy (p, afx->eol, eollen);
+	      p += eollen;
 	    }
 
-	  /* pgp doesn't like 72 here */
-	  iobuf_write (a, outbuf, 64 + eollen);
+	  iobuf_write (a, lines, p - lines);
 	}
       while (size >= (64/4)*3);
-
-      /* restore eol for tail handling */
-      if (size)
-	memcpy (outbuf + 4, afx->eol, sizeof (afx->eol));
     }
 
   for (; size; buf++, size--)
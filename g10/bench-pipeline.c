@@ -0,0 +1,549 @@
+/* bench-pipeline.c - Throughput benchmark for the gpg filter stack
+ * Copyright (C) 2026 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* This program runs synthetic data through the same filters gpg uses
+ * and reports the throughput.  It is built and run by "make bench".
+ * Each operation is run in two directions: "enc" builds a message
+ * from a literal data packet the way encrypt.c does, "dec" processes
+ * that message with mainproc.c the way decrypt.c does and writes the
+ * plaintext to the null device.  The "sha256" and "sha512" operations
+ * hash the data the way sign.c does.  Public key operations take a
+ * constant time per message and are not covered.
+ *
+ * For each operation and size one colon delimited line is printed:
+ *
+ *   bench:OPERATION:SIZE:ITERATIONS:REAL_MS:CPU_MS:MBPS
+ *
+ * SIZE is the size of the plaintext in bytes, REAL_MS and CPU_MS are
+ * the total elapsed and process CPU times for all iterations and MBPS
+ * is the throughput in 10^6 bytes per second of elapsed time.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/time.h>
+#include <npth.h>
+
+#define INCLUDED_BY_MAIN_MODULE 1
+#include "gpg.h"
+#include "../common/util.h"
+#include "../common/init.h"
+#include "../common/iobuf.h"
+#include "options.h"
+#include "packet.h"
+#include "filter.h"
+#include "main.h"
+
+#define PGM "bench-pipeline"
+
+#ifdef HAVE_W32_SYSTEM
+#define NAME_OF_DEV_NULL "nul"
+#else
+#define NAME_OF_DEV_NULL "/dev/null"
+#endif
+
+/* Flags describing the message built by an operation.  */
+#define BENCH_ARMOR  1
+#define BENCH_CFB    2  /* CFB with MDC.  */
+#define BENCH_AEAD   4  /* OCB.  */
+#define BENCH_ZIP    8
+#define BENCH_ZLIB  16
+#define BENCH_BZIP2 32
+#define BENCH_HASH  64  /* Only hash the data.  */
+
+static struct
+{
+  const char *name;
+  unsigned int flags;
+  int md_algo;
+} operations[] =
+  {
+    { "literal",    0 },
+    { "armor",      BENCH_ARMOR },
+    { "zip",        BENCH_ZIP },
+    { "zlib",       BENCH_ZLIB },
+#ifdef HAVE_BZIP2
+    { "bzip2",      BENCH_BZIP2 },
+#endif
+    { "cfb",        BENCH_CFB },
+    { "aead",       BENCH_AEAD },
+    { "aead-zlib-armor", BENCH_AEAD | BENCH_ZLIB | BENCH_ARMOR },
+    { "sha256",     BENCH_HASH, GCRY_MD_SHA256 },
+    { "sha512",     BENCH_HASH, GCRY_MD_SHA512 },
+    { NULL }
+  };
+
+static int verbose;
+static int iterations = 3;
+
+/* The session key used for all encryptions.  */
+static DEK bench_dek;
+
+
+/* The default sizes in KiB.  */
+static unsigned long default_sizes[] = { 16, 1024, 16384 };
+
+
+int g10_errors_seen = 0;
+int assert_signer_true = 0;
+int assert_pubkey_algo_false = 0;
+
+
+void
+g10_exit (int rc)
+{
+  exit (rc);
+}
+
+
+/* Return the elapsed time in milliseconds.  */
+static double
+real_ms (void)
+{
+  struct timeval tv;
+
+  gettimeofday (&tv, NULL);
+  return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
+
+/* Return the used CPU time in milliseconds.  */
+static double
+cpu_ms (void)
+{
+  return clock () * 1000.0 / CLOCKS_PER_SEC;
+}
+
+
+/* Fill BUFFER with LENGTH bytes of data which compress like text.  */
+static void
+make_data (byte *buffer, size_t length)
+{
+  static const char words[] =
+    "the quick brown fox jumps over the lazy dog while a crypto "
+    "engine shovels bytes through a stack of filters and hashes ";
+  size_t i;
+  byte rnd[64];
+
+  gcry_create_nonce (rnd, sizeof rnd);
+  for (i=0; i < length; i++)
+    {
+      /* Mix in some noise so that the compression ratio is realistic
+       * and not absurdly high.  */
+      if (!(i % 64))
+        gcry_create_nonce (rnd, sizeof rnd);
+      buffer[i] = (i % 7)? words[(i + rnd[i % 64]) % (sizeof words - 1)]
+                         : rnd[i % 64];
+    }
+}
+
+
+/* Return the compression algorithm for FLAGS or -1.  */
+static int
+compress_algo_for (unsigned int flags)
+{
+  if ((flags & BENCH_ZIP))
+    return COMPRESS_ALGO_ZIP;
+  if ((flags & BENCH_ZLIB))
+    return COMPRESS_ALGO_ZLIB;
+  if ((flags & BENCH_BZIP2))
+    return COMPRESS_ALGO_BZIP2;
+  return -1;
+}
+
+
+/* Build a message from the data in INP according to FLAGS and write
+ * it to OUT.  This is a stripped down version of encrypt_simple.  */
+static gpg_error_t
+encode_message (unsigned int flags, iobuf_t out, iobuf_t inp, size_t length)
+{
+  gpg_error_t err;
+  armor_filter_context_t *afx = NULL;
+  compress_filter_context_t zfx;
+  cipher_filter_context_t cfx;
+  PKT_plaintext *pt;
+  PACKET pkt;
+  int algo;
+
+  memset (&zfx, 0, sizeof zfx);
+  memset (&cfx, 0, sizeof cfx);
+
+  if ((flags & BENCH_ARMOR))
+    {
+      afx = new_armor_context ();
+      push_armor_filter (afx, out);
+    }
+
+  if ((flags & (BENCH_CFB|BENCH_AEAD)))
+    {
+      cfx.dek = &bench_dek;
+      bench_dek.use_aead = (flags & BENCH_AEAD)? AEAD_ALGO_OCB : 0;
+      bench_dek.use_mdc = !bench_dek.use_aead;
+      iobuf_push_filter (out,
+                         bench_dek.use_aead? cipher_filter_aead
+                         /**/              : cipher_filter_cfb,
+                         &cfx);
+    }
+
+  algo = compress_algo_for (flags);
+  if (algo != -1)
+    {
+      zfx.new_ctb = !!cfx.dek;
+      push_compress_filter (out, &zfx, algo);
+    }
+
+  pt = xmalloc_clear (sizeof *pt + 5);
+  pt->namelen = 5;
+  memcpy (pt->name, "bench", 5);
+  pt->timestamp = make_timestamp ();
+  pt->mode = 'b';
+  pt->len = algo == -1 && !cfx.dek? length : 0;
+  pt->new_ctb = !pt->len;
+  pt->buf = inp;
+  init_packet (&pkt);
+  pkt.pkttype = PKT_PLAINTEXT;
+  pkt.pkt.plaintext = pt;
+  err = build_packet (out, &pkt);
+  if (err)
+    log_error ("build_packet failed: %s\n", gpg_strerror (err));
+  pt->buf = NULL;
+  free_packet (&pkt, NULL);
+
+  /* Pop the filters so that the message is complete.  */
+  iobuf_flush_temp (out);
+  release_armor_context (afx);
+  return err;
+}
+
+
+/* Process the message in INP like decrypt_message does.  The
+ * plaintext is written to the null device.  */
+static gpg_error_t
+decode_message (ctrl_t ctrl, unsigned int flags, iobuf_t inp)
+{
+  armor_filter_context_t *afx = NULL;
+  gpg_error_t err;
+
+  if ((flags & BENCH_ARMOR))
+    {
+      afx = new_armor_context ();
+      push_armor_filter (afx, inp);
+    }
+  if ((flags & (BENCH_CFB|BENCH_AEAD)))
+    err = proc_encryption_packets (ctrl, NULL, inp, NULL, NULL);
+  else
+    err = proc_packets (ctrl, NULL, inp);
+  release_armor_context (afx);
+  return err;
+}
+
+
+/* Hash the data from INP the way sign.c does.  */
+static gpg_error_t
+hash_data (int md_algo, iobuf_t inp)
+{
+  gpg_error_t err;
+  md_filter_context_t mfx;
+  md_thd_filter_context_t mfx2 = NULL;
+  gcry_md_hd_t md;
+  size_t bufsize = iobuf_set_buffer_size (0) * 1024;
+
+  err = gcry_md_open (&md, md_algo, 0);
+  if (err)
+    return err;
+
+  if ((opt.compat_flags & COMPAT_PARALLELIZED))
+    {
+      iobuf_push_filter (inp, md_thd_filter, &mfx2);
+      md_thd_filter_set_md (mfx2, md);
+    }
+  else
+    {
+      memset (&mfx, 0, sizeof mfx);
+      mfx.md = md;
+      iobuf_push_filter (inp, md_filter, &mfx);
+    }
+  while (iobuf_read (inp, NULL, bufsize) != -1)
+    ;
+  if (mfx2)
+    iobuf_pop_filter (inp, md_thd_filter, &mfx2);
+  gcry_md_final (md);
+  gcry_md_close (md);
+  return 0;
+}
+
+
+/* Print the result line for operation NAME.  */
+static void
+print_result (const char *name, size_t size, double real, double cpu)
+{
+  printf ("bench:%s:%zu:%d:%.1f:%.1f:%.2f\n", name, size, iterations,
+          real, cpu,
+          real > 0? (double)size * iterations / (real * 1000.0) : 0.0);
+  fflush (stdout);
+}
+
+
+/* Run operation IDX for a plaintext of SIZE bytes.  */
+static gpg_error_t
+run_operation (ctrl_t ctrl, int idx, const byte *data, size_t size)
+{
+  gpg_error_t err = 0;
+  unsigned int flags = operations[idx].flags;
+  iobuf_t inp, out;
+  byte *msg = NULL;
+  size_t msglen = 0;
+  double t_real, t_cpu;
+  char name[64];
+  int i;
+
+  /* Encode.  The first iteration is not timed; it creates the
+   * message for the decoding.  */
+  t_real = t_cpu = 0;
+  for (i=0; i <= iterations && !err; i++)
+    {
+      double r0, c0;
+
+      inp = iobuf_temp_with_content ((const char *)data, size);
+      out = i? iobuf_create (NAME_OF_DEV_NULL, 0) : iobuf_temp ();
+      if (!out)
+        {
+          err = gpg_error_from_syserror ();
+          iobuf_close (inp);
+          break;
+        }
+      r0 = real_ms ();
+      c0 = cpu_ms ();
+      if ((flags & BENCH_HASH))
+        err = hash_data (operations[idx].md_algo, inp);
+      else
+        err = encode_message (flags, out, inp, size);
+      if (i)
+        {
+          iobuf_close (out);
+          t_real += real_ms () - r0;
+          t_cpu += cpu_ms () - c0;
+        }
+      else
+        {
+          msglen = iobuf_get_temp_length (out);
+          msg = xmalloc (msglen? msglen : 1);
+          iobuf_temp_to_buffer (out, msg, msglen);
+          iobuf_close (out);
+        }
+      iobuf_close (inp);
+    }
+  if (err)
+    goto leave;
+  if ((flags & BENCH_HASH))
+    {
+      print_result (operations[idx].name, size, t_real, t_cpu);
+      goto leave;
+    }
+  snprintf (name, sizeof name, "%s-enc", operations[idx].name);
+  print_result (name, size, t_real, t_cpu);
+  if (verbose)
+    log_info ("%s: %zu bytes message for %zu bytes plaintext\n",
+              operations[idx].name, msglen, size);
+
+  /* Decode.  */
+  t_real = t_cpu = 0;
+  for (i=0; i < iterations && !err; i++)
+    {
+      double r0, c0;
+
+      inp = iobuf_temp_with_content ((const char *)msg, msglen);
+      r0 = real_ms ();
+      c0 = cpu_ms ();
+      err = decode_message (ctrl, flags, inp);
+      iobuf_close (inp);
+      t_real += real_ms () - r0;
+      t_cpu += cpu_ms () - c0;
+    }
+  if (err)
+    goto leave;
+  snprintf (name, sizeof name, "%s-dec", operations[idx].name);
+  print_result (name, size, t_real, t_cpu);
+
+ leave:
+  if (err)
+    log_error ("operation %s failed: %s\n",
+               operations[idx].name, gpg_strerror (err));
+  xfree (msg);
+  return err;
+}
+
+
+static void
+usage (int rc)
+{
+  int i;
+
+  fprintf (rc? stderr : stdout,
+           "usage: " PGM " [options] [operations]\n"
+           "Options:\n"
+           "  --sizes LIST     comma separated sizes in KiB\n"
+           "  --iterations N   run each operation N times (default 3)\n"
+           "  --threads N      use N threads where supported\n"
+           "  --verbose        print more diagnostics\n"
+           "Operations:\n");
+  for (i=0; operations[i].name; i++)
+    fprintf (rc? stderr : stdout, "  %s\n", operations[i].name);
+  exit (rc);
+}
+
+
+int
+main (int argc, char **argv)
+{
+  gpg_error_t err;
+  ctrl_t ctrl;
+  unsigned long *sizes = default_sizes;
+  int nsizes = DIM (default_sizes);
+  int threads = 0;
+  char *keyhex;
+  byte *data;
+  size_t maxsize;
+  int i, j, any;
+  int failed = 0;
+
+  early_system_init ();
+  log_set_prefix (PGM, GPGRT_LOG_WITH_PREFIX);
+  init_common_subsystems (&argc, &argv);
+
+  if (!gcry_check_version (NEED_LIBGCRYPT_VERSION))
+    log_fatal ("%s is too old (need %s, have %s)\n", "libgcrypt",
+               NEED_LIBGCRYPT_VERSION, gcry_check_version (NULL));
+  gcry_control (GCRYCTL_DISABLE_SECMEM, 0);
+  npth_init ();
+  gpgrt_set_syscall_clamp (npth_unprotect, npth_protect);
+
+  if (argc)
+    { argc--; argv++; }
+  while (argc && argv[0][0] == '-' && argv[0][1] == '-')
+    {
+      if (!strcmp (*argv, "--"))
+        {
+          argc--; argv++;
+          break;
+        }
+      else if (!strcmp (*argv, "--help"))
+        usage (0);
+      else if (!strcmp (*argv, "--verbose"))
+        {
+          verbose++;
+          argc--; argv++;
+        }
+      else if (!strcmp (*argv, "--iterations") && argc > 1)
+        {
+          iterations = atoi (argv[1]);
+          if (iterations < 1)
+            iterations = 1;
+          argc -= 2; argv += 2;
+        }
+      else if (!strcmp (*argv, "--threads") && argc > 1)
+        {
+          threads = atoi (argv[1]);
+          argc -= 2; argv += 2;
+        }
+      else if (!strcmp (*argv, "--sizes") && argc > 1)
+        {
+          const char *s = argv[1];
+
+          nsizes = 1;
+          for (; *s; s++)
+            if (*s == ',')
+              nsizes++;
+          sizes = xcalloc (nsizes, sizeof *sizes);
+          for (s=argv[1], i=0; i < nsizes; i++)
+            {
+              sizes[i] = strtoul (s, (char **)&s, 10);
+              if (*s == ',')
+                s++;
+            }
+          argc -= 2; argv += 2;
+        }
+      else
+        usage (1);
+    }
+
+  opt.quiet = !verbose;
+  opt.verbose = verbose > 1;
+  opt.batch = 1;
+  opt.answer_yes = 1;
+  opt.compress_level = -1;
+  opt.bz2_compress_level = -1;
+  opt.chunk_size = 22;  /* As set by gpg.  */
+  opt.outfile = NAME_OF_DEV_NULL;
+  if (threads > 1)
+    {
+      opt.aead_threads = threads;
+      opt.compress_threads = threads;
+      opt.compat_flags |= COMPAT_PARALLELIZED;
+    }
+
+  /* A random AES-256 session key which mainproc gets via the
+   * override session key mechanism.  */
+  bench_dek.algo = CIPHER_ALGO_AES256;
+  bench_dek.keylen = 32;
+  gcry_randomize (bench_dek.key, bench_dek.keylen, GCRY_STRONG_RANDOM);
+  keyhex = xmalloc (3 + 2 * bench_dek.keylen + 1);
+  snprintf (keyhex, 4, "%d:", bench_dek.algo);
+  bin2hex (bench_dek.key, bench_dek.keylen, keyhex + strlen (keyhex));
+  opt.override_session_key = keyhex;
+
+  ctrl = xcalloc (1, sizeof *ctrl);
+  ctrl->magic = SERVER_CONTROL_MAGIC;
+
+  maxsize = 0;
+  for (j=0; j < nsizes; j++)
+    if (sizes[j] * 1024 > maxsize)
+      maxsize = sizes[j] * 1024;
+  data = xmalloc (maxsize? maxsize : 1);
+  make_data (data, maxsize);
+
+  for (i=0; operations[i].name; i++)
+    {
+      if (argc)
+        {
+          for (any=j=0; j < argc; j++)
+            if (!strcmp (argv[j], operations[i].name))
+              any = 1;
+          if (!any)
+            continue;
+        }
+      for (j=0; j < nsizes; j++)
+        {
+          err = run_operation (ctrl, i, data, sizes[j] * 1024);
+          if (err)
+            failed = 1;
+        }
+    }
+
+  xfree (data);
+  xfree (ctrl);
+  xfree (keyhex);
+  if (sizes != default_sizes)
+    xfree (sizes);
+  return failed;
+}
@@ -70,6 +70,11 @@ struct keyboxd_local_s
   /* Flag indicating that a search reset is required.  */
   unsigned int need_search_reset : 1;
 
+  /* Flag indicating that the server has been asked whether it
+   * supports "SEARCH --all --inquire" and the answer.  */
+  unsigned int search_all_checked : 1;
+  unsigned int search_all_supported : 1;
+
 };
 
 
@@ -77,6 +82,83 @@ struct keyboxd_local_s
 static unsigned int in_transaction;
 
 
+/* A keyblock fetched by keydb_prefetch.  */
+struct prefetch_item_s
+{
+  unsigned char ubid[UBID_LEN];
+  char *blob;        /* The keyblock in OpenPGP binary format.  */
+  size_t bloblen;
+  struct kbx_opgp_keyinfo_s *keys;  /* Fingerprints of all keys.  */
+  unsigned int nkeys;
+};
+
+/* The keyblocks fetched by keydb_prefetch along with the search
+ * descriptions used.  The object is reference counted so that a
+ * handle still iterating over it is not affected by an update of the
+ * database which invalidates the cache.  */
+struct prefetch_cache_s
+{
+  unsigned int refcount;
+  KEYDB_SEARCH_DESC *descs;
+  size_t ndescs;
+  struct prefetch_item_s *items;
+  size_t nitems;
+  size_t itemssize;
+};
+typedef struct prefetch_cache_s *prefetch_cache_t;
+
+/* The current prefetch cache or NULL.  The cache is not updated by
+ * changes done by other processes and it also answers the searches
+ * for keys which were not found; thus it is only kept until
+ * keydb_prefetch_done is called.  */
+static prefetch_cache_t prefetch_cache;
+
+
+
+/* Drop a reference to the prefetch cache PC.  */
+static void
+release_prefetch_cache (prefetch_cache_t pc)
+{
+  size_t n;
+
+  if (!pc)
+    return;
+  log_assert (pc->refcount);
+  if (--pc->refcount)
+    return;
+  for (n=0; n < pc->nitems; n++)
+    {
+      xfree (pc->items[n].blob);
+      xfree (pc->items[n].keys);
+    }
+  xfree (pc->items);
+  xfree (pc->descs);
+  xfree (pc);
+}
+
+
+/* Forget about all prefetched keyblocks.  This needs to be called
+ * before the database is modified.  */
+static void
+invalidate_prefetch_cache (void)
+{
+  release_prefetch_cache (prefetch_cache);
+  prefetch_cache = NULL;
+}
+
+
+/* Stop serving the searches on HD from the prefetch cache.  */
+static void
+drop_handle_prefetch (KEYDB_HANDLE hd)
+{
+  release_prefetch_cache (hd->prefetch);
+  hd->prefetch = NULL;
+  xfree (hd->prefetch_desc);
+  hd->prefetch_desc = NULL;
+  hd->prefetch_ndesc = 0;
+}
+
+
 
 
 /* Deinitialize all session resources pertaining to the keyboxd.  */
@@ -86,6 +168,8 @@ gpg_keyboxd_deinit_session_data (ctrl_t ctrl)
   keyboxd_local_t kbl;
   gpg_error_t err;
 
+  invalidate_prefetch_cache ();
+
   while ((kbl = ctrl->keyboxd_local))
     {
       ctrl->keyboxd_local = kbl->next;
@@ -106,6 +190,7 @@ gpg_keyboxd_deinit_session_data (ctrl_t ctrl)
                 log_error ("error committing last transaction: %s\n",
                             gpg_strerror (err));
               in_transaction = 0;
+              keydb_end_resource_change ();
             }
           assuan_release (kbl->ctx);
           kbl->ctx = NULL;
@@ -168,7 +253,12 @@ create_new_context (ctrl_t ctrl, assuan_context_t *r_ctx)
 
       if ((opt.import_options & IMPORT_BULK) && !in_transaction)
         {
-          err = assuan_transact (ctx, "TRANSACTION begin",
+          char line[ASSUAN_LINELENGTH];
+
+          snprintf (line, sizeof line,
+                    "TRANSACTION --bulk --batch-size=%u begin",
+                    opt.import_batch_size);
+          err = assuan_transact (ctx, line,
                                  NULL, NULL, NULL, NULL, NULL, NULL);
           if (err)
             {
@@ -266,6 +356,8 @@ keydb_new (ctrl_t ctrl)
   if (DBG_CLOCK)
     log_clock ("keydb_new");
 
+  keydb_save_resource_state ();
+
   hd = xtrycalloc (1, sizeof *hd);
   if (!hd)
     {
@@ -318,6 +410,7 @@ keydb_release (KEYDB_HANDLE hd)
         log_clock ("close_context (found)");
       if (!kbl->is_active)
         log_fatal ("closing inactive keyboxd context %p\n", kbl);
+      drop_handle_prefetch (hd);
       kbl->is_active = 0;
       hd->kbl = NULL;
       hd->ctrl = NULL;
@@ -390,6 +483,14 @@ keydb_default_status_cb (void *opaque, const char *line)
     log_info (_("Note: %s\n"), s);
   else if ((s = has_leading_keyword (line, "WARNING")))
     log_info (_("WARNING: %s\n"), s);
+  else if ((s = has_leading_keyword (line, "BATCH_COMMITTED")) && opt.verbose)
+    {
+      unsigned long n, total, msecs;
+
+      if (sscanf (s, "%lu %lu %lu", &n, &total, &msecs) == 3)
+        log_info (_("%lu keys committed (%lu total, %lu keys/s)\n"),
+                  n, total, msecs? n * 1000 / msecs : n);
+    }
 
   return 0;
 }
@@ -452,6 +553,7 @@ keydb_update_keyblock (ctrl_t ctrl, KEYDB_HANDLE hd, kbnode_t kb)
   if (!hd)
     return gpg_error (GPG_ERR_INV_ARG);
 
+  keydb_begin_resource_change ();
   if (!hd->use_keyboxd)
     {
       err = internal_keydb_update_keyblock (ctrl, hd, kb);
@@ -468,6 +570,7 @@ keydb_update_keyblock (ctrl_t ctrl, KEYDB_HANDLE hd, kbnode_t kb)
   if (err)
     goto leave;
 
+  invalidate_prefetch_cache ();
   parm.ctx = hd->kbl->ctx;
   parm.data = iobuf_get_temp_buffer (iobuf);
   parm.datalen = iobuf_get_temp_length (iobuf);
@@ -478,6 +581,7 @@ keydb_update_keyblock (ctrl_t ctrl, KEYDB_HANDLE hd, kbnode_t kb)
 
 
  leave:
+  keydb_end_resource_change ();
   iobuf_close (iobuf);
   return err;
 }
@@ -504,6 +608,7 @@ keydb_insert_keyblock (KEYDB_HANDLE hd, kbnode_t kb)
   if (!hd)
     return gpg_error (GPG_ERR_INV_ARG);
 
+  keydb_begin_resource_change ();
   if (!hd->use_keyboxd)
     {
       err = internal_keydb_insert_keyblock (hd, kb);
@@ -520,6 +625,7 @@ keydb_insert_keyblock (KEYDB_HANDLE hd, kbnode_t kb)
   if (err)
     goto leave;
 
+  invalidate_prefetch_cache ();
   parm.ctx = hd->kbl->ctx;
   parm.data = iobuf_get_temp_buffer (iobuf);
   parm.datalen = iobuf_get_temp_length (iobuf);
@@ -529,6 +635,7 @@ keydb_insert_keyblock (KEYDB_HANDLE hd, kbnode_t kb)
                          keydb_default_status_cb, hd);
 
  leave:
+  keydb_end_resource_change ();
   iobuf_close (iobuf);
   return err;
 }
@@ -549,6 +656,7 @@ keydb_delete_keyblock (KEYDB_HANDLE hd)
   if (!hd)
     return gpg_error (GPG_ERR_INV_ARG);
 
+  keydb_begin_resource_change ();
   if (!hd->use_keyboxd)
     {
       err = internal_keydb_delete_keyblock (hd);
@@ -567,6 +675,7 @@ keydb_delete_keyblock (KEYDB_HANDLE hd)
       goto leave;
     }
 
+  invalidate_prefetch_cache ();
   bin2hex (hd->last_ubid, UBID_LEN, hexubid);
   snprintf (line, sizeof line, "DELETE %s", hexubid);
   err = assuan_transact (hd->kbl->ctx, line,
@@ -575,6 +684,7 @@ keydb_delete_keyblock (KEYDB_HANDLE hd)
                          keydb_default_status_cb, hd);
 
  leave:
+  keydb_end_resource_change ();
   return err;
 }
 
@@ -608,6 +718,7 @@ keydb_search_reset (KEYDB_HANDLE hd)
    * ubid flag so that after a reset a delete can't be performed.  */
   hd->kbl->need_search_reset = 1;
   hd->last_ubid_valid = 0;
+  drop_handle_prefetch (hd);
   err = 0;
 
  leave:
@@ -676,6 +787,418 @@ search_status_cb (void *opaque, const char *line)
 }
 
 
+/* Return true if the search description DESC is supported by the
+ * prefetch cache.  */
+static int
+prefetchable_desc_p (KEYDB_SEARCH_DESC *desc)
+{
+  return (desc->mode == KEYDB_SEARCH_MODE_FPR
+          || desc->mode == KEYDB_SEARCH_MODE_LONG_KID);
+}
+
+
+/* Return true if DESC matches the key KEY.  */
+static int
+prefetch_key_matches_p (KEYDB_SEARCH_DESC *desc,
+                        struct kbx_opgp_keyinfo_s *key)
+{
+  switch (desc->mode)
+    {
+    case KEYDB_SEARCH_MODE_FPR:
+      return (desc->fprlen == key->fprlen
+              && !memcmp (desc->u.fpr, key->fpr, key->fprlen));
+    case KEYDB_SEARCH_MODE_LONG_KID:
+      return (desc->u.kid[0] == buf32_to_u32 (key->keyid)
+              && desc->u.kid[1] == buf32_to_u32 (key->keyid + 4));
+    default:
+      return 0;
+    }
+}
+
+
+/* Return true if one of the keys of ITEM matches one of the NDESC
+ * search descriptions DESC.  */
+static int
+prefetch_item_matches_p (struct prefetch_item_s *item,
+                         KEYDB_SEARCH_DESC *desc, size_t ndesc)
+{
+  unsigned int k;
+  size_t i;
+
+  for (k=0; k < item->nkeys; k++)
+    for (i=0; i < ndesc; i++)
+      if (prefetch_key_matches_p (desc + i, item->keys + k))
+        return 1;
+  return 0;
+}
+
+
+/* Return true if the prefetch cache PC has all keyblocks matching
+ * the NDESC search descriptions DESC.  */
+static int
+prefetch_covers_p (prefetch_cache_t pc, KEYDB_SEARCH_DESC *desc,
+                   size_t ndesc)
+{
+  size_t i, j;
+
+  if (!pc || !ndesc)
+    return 0;
+
+  for (i=0; i < ndesc; i++)
+    {
+      if (!prefetchable_desc_p (desc + i))
+        return 0;
+      for (j=0; j < pc->ndescs; j++)
+        if (pc->descs[j].mode == desc[i].mode
+            && (desc[i].mode == KEYDB_SEARCH_MODE_FPR
+                ? (pc->descs[j].fprlen == desc[i].fprlen
+                   && !memcmp (pc->descs[j].u.fpr, desc[i].u.fpr,
+                               desc[i].fprlen))
+                : (pc->descs[j].u.kid[0] == desc[i].u.kid[0]
+                   && pc->descs[j].u.kid[1] == desc[i].u.kid[1])))
+          break;
+      if (j == pc->ndescs)
+        return 0;
+    }
+  return 1;
+}
+
+
+/* Return the next keyblock from the prefetch cache which matches the
+ * search descriptions stored in HD.  */
+static gpg_error_t
+search_prefetched (KEYDB_HANDLE hd)
+{
+  prefetch_cache_t pc = hd->prefetch;
+  KEYDB_SEARCH_DESC *desc = hd->prefetch_desc;
+  size_t ndesc = hd->prefetch_ndesc;
+  struct prefetch_item_s *item;
+  size_t i;
+  unsigned int k;
+  u32 kid[2];
+
+  for (; hd->prefetch_idx < pc->nitems; hd->prefetch_idx++)
+    {
+      item = pc->items + hd->prefetch_idx;
+      for (k=0; k < item->nkeys; k++)
+        {
+          for (i=0; i < ndesc; i++)
+            if (prefetch_key_matches_p (desc + i, item->keys + k))
+              break;
+          if (i < ndesc)
+            break;
+        }
+      if (k == item->nkeys)
+        continue;
+
+      kid[0] = buf32_to_u32 (item->keys[0].keyid);
+      kid[1] = buf32_to_u32 (item->keys[0].keyid + 4);
+      for (i=0; i < ndesc; i++)
+        if (desc[i].skipfnc
+            && desc[i].skipfnc (desc[i].skipfncvalue, kid, 0))
+          break;
+      if (i < ndesc)
+        continue;  /* Callback told us to skip this one.  */
+
+      memcpy (hd->last_ubid, item->ubid, UBID_LEN);
+      hd->last_ubid_valid = 1;
+      hd->last_uid_no = 0;
+      hd->last_pk_no = k + 1;
+      hd->kbl->search_result = iobuf_temp_with_content (item->blob,
+                                                        item->bloblen);
+      hd->prefetch_idx++;
+      if (DBG_KEYDB)
+        log_printhex (hd->last_ubid, 20, "found prefetched UBID (%d,%d):",
+                      hd->last_uid_no, hd->last_pk_no);
+      return 0;
+    }
+
+  return gpg_error (GPG_ERR_NOT_FOUND);
+}
+
+
+/* Communication object for the prefetch SEARCH command.  */
+struct prefetch_parm_s
+{
+  assuan_context_t ctx;
+  prefetch_cache_t pc;
+  unsigned char *ubids;   /* The UBIDs from the status lines.  */
+  size_t nubids;
+  size_t ubidssize;
+};
+
+
+/* Handle the inquiries from the prefetch SEARCH command.  */
+static gpg_error_t
+prefetch_inq_cb (void *opaque, const char *line)
+{
+  struct prefetch_parm_s *parm = opaque;
+  gpg_error_t err;
+  membuf_t mb;
+  char buf[MAX_FINGERPRINT_LEN * 2 + 4];
+  KEYDB_SEARCH_DESC *desc;
+  char *data;
+  size_t i, datalen;
+
+  if (!has_leading_keyword (line, "PATTERNS"))
+    return gpg_error (GPG_ERR_ASS_UNKNOWN_INQUIRE);
+
+  init_membuf (&mb, 1024);
+  for (i=0; i < parm->pc->ndescs; i++)
+    {
+      desc = parm->pc->descs + i;
+      if (desc->mode == KEYDB_SEARCH_MODE_FPR)
+        {
+          log_assert (desc->fprlen <= MAX_FINGERPRINT_LEN);
+          strcpy (buf, "0x");
+          bin2hex (desc->u.fpr, desc->fprlen, buf + 2);
+        }
+      else
+        snprintf (buf, sizeof buf, "0x%08lX%08lX",
+                  (ulong)desc->u.kid[0], (ulong)desc->u.kid[1]);
+      put_membuf_str (&mb, buf);
+      put_membuf (&mb, "\n", 1);
+    }
+  data = get_membuf (&mb, &datalen);
+  if (!data)
+    return gpg_error_from_syserror ();
+  err = assuan_send_data (parm->ctx, data, datalen);
+  xfree (data);
+  return err;
+}
+
+
+/* Status callback for the prefetch SEARCH command.  */
+static gpg_error_t
+prefetch_status_cb (void *opaque, const char *line)
+{
+  struct prefetch_parm_s *parm = opaque;
+  const char *s;
+  unsigned char *tmp;
+
+  if ((s = has_leading_keyword (line, "PUBKEY_INFO")))
+    {
+      if (atoi (s) != PUBKEY_TYPE_OPGP)
+        return gpg_error (GPG_ERR_WRONG_BLOB_TYPE);
+      while (*s && !spacep (s))
+        s++;
+      if (parm->nubids == parm->ubidssize)
+        {
+          tmp = xtryrealloc (parm->ubids,
+                             (parm->ubidssize + 32) * UBID_LEN);
+          if (!tmp)
+            return gpg_error_from_syserror ();
+          parm->ubids = tmp;
+          parm->ubidssize += 32;
+        }
+      if (!hex2fixedbuf (s, parm->ubids + parm->nubids * UBID_LEN, UBID_LEN))
+        return gpg_error (GPG_ERR_INV_VALUE);
+      parm->nubids++;
+      return 0;
+    }
+
+  return keydb_default_status_cb (opaque, line);
+}
+
+
+/* Add the keyblock (BLOB,BLOBLEN) with UBID to the prefetch cache PC.
+ * BLOB is taken over by this function.  */
+static gpg_error_t
+add_prefetch_item (prefetch_cache_t pc, const unsigned char *ubid,
+                   char *blob, size_t bloblen)
+{
+  gpg_error_t err;
+  struct prefetch_item_s *item;
+  size_t n;
+
+  /* A keyblock matching several patterns may be returned more than
+   * once.  */
+  for (n=0; n < pc->nitems; n++)
+    if (!memcmp (pc->items[n].ubid, ubid, UBID_LEN))
+      {
+        xfree (blob);
+        return 0;
+      }
+
+  if (pc->nitems == pc->itemssize)
+    {
+      item = xtryrealloc (pc->items, (pc->itemssize + 32) * sizeof *item);
+      if (!item)
+        {
+          err = gpg_error_from_syserror ();
+          xfree (blob);
+          return err;
+        }
+      pc->items = item;
+      pc->itemssize += 32;
+    }
+  item = pc->items + pc->nitems;
+  memset (item, 0, sizeof *item);
+  err = kbx_get_opgp_keyinfo (blob, bloblen, &item->keys, &item->nkeys);
+  if (err)
+    {
+      xfree (blob);
+      return err;
+    }
+  memcpy (item->ubid, ubid, UBID_LEN);
+  item->blob = blob;
+  item->bloblen = bloblen;
+  pc->nitems++;
+  return 0;
+}
+
+
+/* Fetch all keyblocks matching one of the NDESC search descriptions
+ * DESC with a single request to the keyboxd and keep them for use by
+ * subsequent calls to keydb_search.  Only fingerprint and long keyid
+ * searches are considered; other descriptions are ignored.  This is
+ * a no-op if the keyboxd is not used or if it can't send the data
+ * via a separate stream.  */
+gpg_error_t
+keydb_prefetch (ctrl_t ctrl, KEYDB_SEARCH_DESC *desc, size_t ndesc)
+{
+  gpg_error_t err, err2;
+  KEYDB_HANDLE hd = NULL;
+  prefetch_cache_t pc = NULL;
+  struct prefetch_parm_s parm = { NULL };
+  char *buffer;
+  size_t i, len;
+
+  if (!opt.use_keyboxd || !ndesc)
+    return 0;
+  if (prefetch_covers_p (prefetch_cache, desc, ndesc))
+    return 0;  /* Already there.  */
+
+  if (DBG_CLOCK)
+    log_clock ("%s enter", __func__);
+
+  pc = xtrycalloc (1, sizeof *pc);
+  if (!pc)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  pc->refcount = 1;
+  pc->descs = xtrycalloc (ndesc, sizeof *pc->descs);
+  if (!pc->descs)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  for (i=0; i < ndesc; i++)
+    if (prefetchable_desc_p (desc + i))
+      {
+        pc->descs[pc->ndescs] = desc[i];
+        pc->descs[pc->ndescs].skipfnc = NULL;
+        pc->descs[pc->ndescs].skipfncvalue = NULL;
+        pc->ndescs++;
+      }
+  if (!pc->ndescs)
+    {
+      err = 0;
+      goto leave;
+    }
+
+  hd = keydb_new (ctrl);
+  if (!hd)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  if (!kbx_client_data_use_stream (hd->kbl->kcd))
+    {
+      /* With D-lines we can't receive several keyblocks at once.  */
+      err = 0;
+      goto leave;
+    }
+
+  /* An older keyboxd ignores --all and returns only the first match;
+   * the other keys would then be cached as not existing.  */
+  if (!hd->kbl->search_all_checked)
+    {
+      hd->kbl->search_all_supported
+        = (!assuan_transact (hd->kbl->ctx,
+                             "GETINFO cmd_has_option SEARCH all",
+                             NULL, NULL, NULL, NULL, NULL, NULL)
+           && !assuan_transact (hd->kbl->ctx,
+                                "GETINFO cmd_has_option SEARCH inquire",
+                                NULL, NULL, NULL, NULL, NULL, NULL));
+      hd->kbl->search_all_checked = 1;
+    }
+  if (!hd->kbl->search_all_supported)
+    {
+      err = 0;  /* Use single searches.  */
+      goto leave;
+    }
+
+  parm.ctx = hd->kbl->ctx;
+  parm.pc = pc;
+  err = kbx_client_data_cmd_inq (hd->kbl->kcd,
+                                 "SEARCH --openpgp --all --inquire",
+                                 prefetch_inq_cb, &parm,
+                                 prefetch_status_cb, &parm);
+  /* The keyblocks are sent in the order of the status lines.  We
+   * need to read them even after an error to keep the data stream in
+   * sync.  */
+  for (i=0; i < parm.nubids; i++)
+    {
+      err2 = kbx_client_data_wait (hd->kbl->kcd, &buffer, &len);
+      if (err2)
+        {
+          if (!err)
+            err = err2;
+        }
+      else if (err)
+        xfree (buffer);
+      else
+        err = add_prefetch_item (pc, parm.ubids + i * UBID_LEN, buffer, len);
+    }
+  if (gpg_err_code (err) == GPG_ERR_NOT_FOUND)
+    err = 0;  /* An empty result is a valid result.  */
+  if (err)
+    goto leave;
+
+  /* The patterns without a returned keyblock are taken as not found.
+   * Make sure the server really processed our patterns before we
+   * rely on that.  */
+  for (i=0; i < pc->nitems; i++)
+    if (!prefetch_item_matches_p (pc->items + i, pc->descs, pc->ndescs))
+      {
+        log_info ("keyboxd returned an unexpected keyblock"
+                  " - prefetch ignored\n");
+        goto leave;
+      }
+
+  if (DBG_KEYDB)
+    log_debug ("%s: %zu keyblocks prefetched for %zu patterns\n",
+               __func__, pc->nitems, pc->ndescs);
+  invalidate_prefetch_cache ();
+  prefetch_cache = pc;
+  pc = NULL;
+
+ leave:
+  if (err)
+    log_error ("error prefetching keyblocks: %s\n", gpg_strerror (err));
+  xfree (parm.ubids);
+  release_prefetch_cache (pc);
+  keydb_release (hd);
+  if (DBG_CLOCK)
+    log_clock ("%s leave%s", __func__, err? " (failed)":"");
+  return err;
+}
+
+
+/* Forget the keyblocks fetched by keydb_prefetch.  This should be
+ * called as soon as the caller is done with the lookups it prefetched
+ * the keys for.  Handles still iterating over the keyblocks are not
+ * affected.  */
+void
+keydb_prefetch_done (void)
+{
+  invalidate_prefetch_cache ();
+}
+
+
 /* Search the database for keys matching the search description.  If
  * the DB contains any legacy keys, these are silently ignored.
  *
@@ -737,6 +1260,32 @@ keydb_search (KEYDB_HANDLE hd, KEYDB_SEARCH_DESC *desc,
       hd->kbl->search_result = NULL;
     }
 
+  /* Serve the search from the prefetched keyblocks if they cover all
+   * search descriptions.  A NEXT continues with the cache.  */
+  if (hd->kbl->need_search_reset
+      && prefetch_covers_p (prefetch_cache, desc, ndesc))
+    {
+      drop_handle_prefetch (hd);
+      hd->prefetch_desc = xtrycalloc (ndesc, sizeof *desc);
+      if (!hd->prefetch_desc)
+        {
+          err = gpg_error_from_syserror ();
+          goto leave;
+        }
+      memcpy (hd->prefetch_desc, desc, ndesc * sizeof *desc);
+      hd->prefetch_ndesc = ndesc;
+      hd->prefetch = prefetch_cache;
+      hd->prefetch->refcount++;
+      hd->prefetch_idx = 0;
+      hd->kbl->need_search_reset = 0;
+    }
+  if (hd->prefetch)
+    {
+      hd->last_ubid_valid = 0;
+      err = search_prefetched (hd);
+      goto leave;
+    }
+
   /* Check whether this is a NEXT search.  */
   if (!hd->kbl->need_search_reset)
     {
@@ -23,6 +23,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <npth.h>
 
 #include "gpg.h"
 #include "../common/status.h"
@@ -38,6 +39,64 @@
  * be a multiple of the OCB blocksize (16 byte).  */
 #define AEAD_ENC_BUFFER_SIZE (64*1024)
 
+/* The largest chunk size we encrypt using worker threads.  Each
+ * worker needs two chunk buffers and thus larger chunks (which
+ * require --allow-large-chunks) are always encrypted by the main
+ * thread.  */
+#define AEAD_THD_MAX_CHUNKSIZE (16*1024*1024)
+
+
+/* The states of a chunk processed by the worker threads.  */
+enum aead_job_states
+  {
+    AEAD_JOB_FREE = 0,  /* The slot is not used.  */
+    AEAD_JOB_FILL,      /* The main thread copies plaintext into it. */
+    AEAD_JOB_QUEUED,    /* The chunk waits for a worker.  */
+    AEAD_JOB_RUNNING,   /* A worker is encrypting the chunk.  */
+    AEAD_JOB_DONE       /* Ciphertext and tag are ready to be written. */
+  };
+
+
+/* A chunk processed by the worker threads.  */
+struct aead_job_s
+{
+  enum aead_job_states state;
+  uint64_t chunkindex;  /* The index of this chunk.  */
+  size_t len;           /* The used length of BUFFER.  */
+  gpg_error_t err;      /* The error code from the worker.  */
+  byte tag[16];         /* The authentication tag of the chunk.  */
+  byte *buffer;         /* A buffer of CHUNKSIZE bytes.  */
+};
+
+
+/* A worker thread with its own cipher handle.  */
+struct aead_worker_s
+{
+  cipher_filter_context_t *cfx;
+  gcry_cipher_hd_t cipher_hd;
+  npth_t thd;
+  unsigned int started : 1;
+};
+
+
+/* The context for encrypting chunks with worker threads.  The main
+ * thread fills the chunks of the ring buffer JOBS in order, the
+ * workers encrypt them in any order and the main thread writes them
+ * out again in order.  Thus the output is the same as with the
+ * serial code.  */
+struct cipher_aead_thd_s
+{
+  npth_mutex_t mutex;
+  npth_cond_t  cond;   /* Signaled on each state change of a job.  */
+  int stop;            /* Tell the workers to terminate.  */
+  int njobs;           /* The size of the JOBS ring buffer.  */
+  struct aead_job_s *jobs;
+  int fill_idx;        /* The job currently filled by the main thread. */
+  int write_idx;       /* The next job to write out.  */
+  int nworkers;
+  struct aead_worker_s workers[1];
+};
+
 
 /* Wrapper around iobuf_write to make sure that a proper error code is
  * always returned.  */
@@ -55,12 +114,13 @@ my_iobuf_write (iobuf_t a, const void *buffer, size_t buflen)
 }
 
 
-/* Set the nonce and the additional data for the current chunk.  If
- * FINAL is set the final AEAD chunk is processed.  This also reset
- * the encryption machinery so that the handle can be used for a new
- * chunk.  */
+/* Set the nonce and the additional data for chunk CHUNKINDEX on the
+ * cipher handle HD.  If FINAL is set the final AEAD chunk is
+ * processed.  This also reset the encryption machinery so that the
+ * handle can be used for a new chunk.  */
 static gpg_error_t
-set_nonce_and_ad (cipher_filter_context_t *cfx, int final)
+set_chunk_nonce_and_ad (cipher_filter_context_t *cfx, gcry_cipher_hd_t hd,
+                        uint64_t chunkindex, int final)
 {
   gpg_error_t err;
   unsigned char nonce[16];
@@ -83,18 +143,18 @@ set_nonce_and_ad (cipher_filter_context_t *cfx, int final)
       BUG ();
     }
 
-  nonce[i++] ^= cfx->chunkindex >> 56;
-  nonce[i++] ^= cfx->chunkindex >> 48;
-  nonce[i++] ^= cfx->chunkindex >> 40;
-  nonce[i++] ^= cfx->chunkindex >> 32;
-  nonce[i++] ^= cfx->chunkindex >> 24;
-  nonce[i++] ^= cfx->chunkindex >> 16;
-  nonce[i++] ^= cfx->chunkindex >>  8;
-  nonce[i++] ^= cfx->chunkindex;
+  nonce[i++] ^= chunkindex >> 56;
+  nonce[i++] ^= chunkindex >> 48;
+  nonce[i++] ^= chunkindex >> 40;
+  nonce[i++] ^= chunkindex >> 32;
+  nonce[i++] ^= chunkindex >> 24;
+  nonce[i++] ^= chunkindex >> 16;
+  nonce[i++] ^= chunkindex >>  8;
+  nonce[i++] ^= chunkindex;
 
   if (DBG_CRYPTO)
     log_printhex (nonce, 15, "nonce:");
-  err = gcry_cipher_setiv (cfx->cipher_hd, nonce, i);
+  err = gcry_cipher_setiv (hd, nonce, i);
   if (err)
     return err;
 
@@ -103,14 +163,14 @@ set_nonce_and_ad (cipher_filter_context_t *cfx, int final)
   ad[2] = cfx->dek->algo;
   ad[3] = cfx->dek->use_aead;
   ad[4] = cfx->chunkbyte;
-  ad[5] = cfx->chunkindex >> 56;
-  ad[6] = cfx->chunkindex >> 48;
-  ad[7] = cfx->chunkindex >> 40;
-  ad[8] = cfx->chunkindex >> 32;
-  ad[9] = cfx->chunkindex >> 24;
-  ad[10]= cfx->chunkindex >> 16;
-  ad[11]= cfx->chunkindex >>  8;
-  ad[12]= cfx->chunkindex;
+  ad[5] = chunkindex >> 56;
+  ad[6] = chunkindex >> 48;
+  ad[7] = chunkindex >> 40;
+  ad[8] = chunkindex >> 32;
+  ad[9] = chunkindex >> 24;
+  ad[10]= chunkindex >> 16;
+  ad[11]= chunkindex >>  8;
+  ad[12]= chunkindex;
   if (final)
     {
       ad[13] = cfx->total >> 56;
@@ -124,7 +184,319 @@ set_nonce_and_ad (cipher_filter_context_t *cfx, int final)
     }
   if (DBG_CRYPTO)
     log_printhex (ad, final? 21 : 13, "authdata:");
-  return gcry_cipher_authenticate (cfx->cipher_hd, ad, final? 21 : 13);
+  return gcry_cipher_authenticate (hd, ad, final? 21 : 13);
+}
+
+
+/* Set the nonce and the additional data for the current chunk.  If
+ * FINAL is set the final AEAD chunk is processed.  This also reset
+ * the encryption machinery so that the handle can be used for a new
+ * chunk.  */
+static gpg_error_t
+set_nonce_and_ad (cipher_filter_context_t *cfx, int final)
+{
+  return set_chunk_nonce_and_ad (cfx, cfx->cipher_hd, cfx->chunkindex, final);
+}
+
+
+static void
+lock_thd (struct cipher_aead_thd_s *thd)
+{
+  int rc = npth_mutex_lock (&thd->mutex);
+  if (rc)
+    log_fatal ("%s: failed to acquire mutex: %s\n", __func__,
+               gpg_strerror (gpg_error_from_errno (rc)));
+}
+
+
+static void
+unlock_thd (struct cipher_aead_thd_s *thd)
+{
+  int rc = npth_mutex_unlock (&thd->mutex);
+  if (rc)
+    log_fatal ("%s: failed to release mutex: %s\n", __func__,
+               gpg_strerror (gpg_error_from_errno (rc)));
+}
+
+
+/* Return the state of JOB.  */
+static enum aead_job_states
+get_job_state (struct cipher_aead_thd_s *thd, struct aead_job_s *job)
+{
+  enum aead_job_states state;
+
+  lock_thd (thd);
+  state = job->state;
+  unlock_thd (thd);
+  return state;
+}
+
+
+/* Set the state of JOB to STATE and wake up the waiting threads.  */
+static void
+set_job_state (struct cipher_aead_thd_s *thd, struct aead_job_s *job,
+               enum aead_job_states state)
+{
+  lock_thd (thd);
+  job->state = state;
+  npth_cond_broadcast (&thd->cond);
+  unlock_thd (thd);
+}
+
+
+/* The worker thread.  It takes queued chunks, encrypts them in place
+ * and computes their tags.  */
+static void *
+aead_worker_thread (void *arg)
+{
+  struct aead_worker_s *w = arg;
+  cipher_filter_context_t *cfx = w->cfx;
+  struct cipher_aead_thd_s *thd = cfx->thd;
+  struct aead_job_s *job;
+  gpg_error_t err;
+  int i;
+
+  lock_thd (thd);
+  for (;;)
+    {
+      /* Take the oldest queued chunk.  */
+      job = NULL;
+      for (i=0; i < thd->njobs; i++)
+        {
+          struct aead_job_s *j = thd->jobs + (thd->write_idx+i) % thd->njobs;
+          if (j->state == AEAD_JOB_QUEUED)
+            {
+              job = j;
+              break;
+            }
+        }
+      if (!job)
+        {
+          if (thd->stop)
+            break;
+          npth_cond_wait (&thd->cond, &thd->mutex);
+          continue;
+        }
+      job->state = AEAD_JOB_RUNNING;
+      unlock_thd (thd);
+
+      err = set_chunk_nonce_and_ad (cfx, w->cipher_hd, job->chunkindex, 0);
+      if (!err)
+        {
+          gcry_cipher_final (w->cipher_hd);
+          npth_unprotect ();
+          err = gcry_cipher_encrypt (w->cipher_hd, job->buffer, job->len,
+                                     NULL, 0);
+          if (!err)
+            err = gcry_cipher_gettag (w->cipher_hd, job->tag, 16);
+          npth_protect ();
+        }
+
+      lock_thd (thd);
+      job->err = err;
+      job->state = AEAD_JOB_DONE;
+      npth_cond_broadcast (&thd->cond);
+    }
+  unlock_thd (thd);
+
+  return NULL;
+}
+
+
+/* Stop the worker threads and release the context.  */
+static void
+release_aead_threads (cipher_filter_context_t *cfx)
+{
+  struct cipher_aead_thd_s *thd = cfx->thd;
+  int i;
+
+  if (!thd)
+    return;
+
+  lock_thd (thd);
+  thd->stop = 1;
+  npth_cond_broadcast (&thd->cond);
+  unlock_thd (thd);
+
+  for (i=0; i < thd->nworkers; i++)
+    {
+      if (thd->workers[i].started)
+        npth_join (thd->workers[i].thd, NULL);
+      gcry_cipher_close (thd->workers[i].cipher_hd);
+    }
+  if (thd->jobs)
+    {
+      for (i=0; i < thd->njobs; i++)
+        xfree (thd->jobs[i].buffer);
+      xfree (thd->jobs);
+    }
+  npth_cond_destroy (&thd->cond);
+  npth_mutex_destroy (&thd->mutex);
+  xfree (thd);
+  cfx->thd = NULL;
+}
+
+
+/* Create NTHREADS worker threads to encrypt the chunks using
+ * CIPHERMODE.  */
+static gpg_error_t
+start_aead_threads (cipher_filter_context_t *cfx, int nthreads,
+                    enum gcry_cipher_modes ciphermode)
+{
+  gpg_error_t err;
+  struct cipher_aead_thd_s *thd;
+  npth_attr_t tattr;
+  int rc, i;
+
+  thd = xtrycalloc (1, sizeof *thd + (nthreads-1) * sizeof *thd->workers);
+  if (!thd)
+    return gpg_error_from_syserror ();
+  rc = npth_mutex_init (&thd->mutex, NULL);
+  if (rc)
+    {
+      xfree (thd);
+      return gpg_error_from_errno (rc);
+    }
+  rc = npth_cond_init (&thd->cond, NULL);
+  if (rc)
+    {
+      npth_mutex_destroy (&thd->mutex);
+      xfree (thd);
+      return gpg_error_from_errno (rc);
+    }
+  cfx->thd = thd;
+
+  /* Two chunks per worker so that the main thread can fill and write
+   * chunks while all workers are busy.  */
+  thd->njobs = 2 * nthreads;
+  thd->jobs = xtrycalloc (thd->njobs, sizeof *thd->jobs);
+  if (!thd->jobs)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  for (i=0; i < thd->njobs; i++)
+    {
+      thd->jobs[i].buffer = xtrymalloc (cfx->chunksize);
+      if (!thd->jobs[i].buffer)
+        {
+          err = gpg_error_from_syserror ();
+          goto leave;
+        }
+    }
+
+  thd->nworkers = nthreads;
+  for (i=0; i < thd->nworkers; i++)
+    {
+      thd->workers[i].cfx = cfx;
+      err = openpgp_cipher_open (&thd->workers[i].cipher_hd,
+                                 cfx->dek->algo,
+                                 ciphermode,
+                                 GCRY_CIPHER_SECURE);
+      if (!err)
+        err = gcry_cipher_setkey (thd->workers[i].cipher_hd,
+                                  cfx->dek->key, cfx->dek->keylen);
+      if (err)
+        goto leave;
+    }
+
+  rc = npth_attr_init (&tattr);
+  if (rc)
+    {
+      err = gpg_error_from_errno (rc);
+      goto leave;
+    }
+  npth_attr_setdetachstate (&tattr, NPTH_CREATE_JOINABLE);
+  for (i=0; i < thd->nworkers; i++)
+    {
+      rc = npth_create (&thd->workers[i].thd, &tattr,
+                        aead_worker_thread, thd->workers + i);
+      if (rc)
+        {
+          err = gpg_error_from_errno (rc);
+          break;
+        }
+      thd->workers[i].started = 1;
+    }
+  npth_attr_destroy (&tattr);
+
+  if (DBG_FILTER && !err)
+    log_debug ("started %d AEAD worker threads\n", thd->nworkers);
+
+ leave:
+  if (err)
+    {
+      log_error ("error starting AEAD worker threads: %s\n",
+                 gpg_strerror (err));
+      release_aead_threads (cfx);
+    }
+  return err;
+}
+
+
+/* Write the chunks finished by the workers in order to stream A.  If
+ * WAIT is 1 wait for the oldest pending chunk; if WAIT is 2 wait for
+ * all pending chunks.  */
+static gpg_error_t
+write_finished_jobs (cipher_filter_context_t *cfx, iobuf_t a, int wait)
+{
+  struct cipher_aead_thd_s *thd = cfx->thd;
+  struct aead_job_s *job;
+  gpg_error_t err = 0;
+
+  for (;;)
+    {
+      job = thd->jobs + thd->write_idx;
+      lock_thd (thd);
+      while (wait && (job->state == AEAD_JOB_QUEUED
+                      || job->state == AEAD_JOB_RUNNING))
+        npth_cond_wait (&thd->cond, &thd->mutex);
+      if (job->state != AEAD_JOB_DONE)
+        {
+          unlock_thd (thd);
+          break;
+        }
+      unlock_thd (thd);
+
+      /* The workers don't touch a finished job and thus we don't
+       * need to hold the lock while writing.  */
+      err = job->err;
+      if (err)
+        log_error ("encrypting chunk %ju failed: %s\n",
+                   (uintmax_t)job->chunkindex, gpg_strerror (err));
+      else
+        {
+          if (DBG_FILTER)
+            log_debug ("writing chunk %ju (%zu bytes)\n",
+                       (uintmax_t)job->chunkindex, job->len);
+          err = my_iobuf_write (a, job->buffer, job->len);
+          if (!err)
+            err = my_iobuf_write (a, job->tag, 16);
+        }
+      job->len = 0;
+      set_job_state (thd, job, AEAD_JOB_FREE);
+      thd->write_idx = (thd->write_idx + 1) % thd->njobs;
+      if (err)
+        break;
+      if (wait == 1)
+        wait = 0;
+    }
+
+  return err;
+}
+
+
+/* Hand the chunk JOB over to the workers.  */
+static void
+queue_job (cipher_filter_context_t *cfx, struct aead_job_s *job)
+{
+  struct cipher_aead_thd_s *thd = cfx->thd;
+
+  job->chunkindex = cfx->chunkindex++;
+  job->err = 0;
+  cfx->total += job->len;
+  set_job_state (thd, job, AEAD_JOB_QUEUED);
+  thd->fill_idx = (thd->fill_idx + 1) % thd->njobs;
 }
 
 
@@ -198,6 +570,22 @@ write_header (cipher_filter_context_t *cfx, iobuf_t a)
   if (err)
     return err;
 
+  if (opt.aead_threads > 1)
+    {
+      if (cfx->chunksize > AEAD_THD_MAX_CHUNKSIZE)
+        {
+          if (opt.verbose)
+            log_info ("chunk size too large for --aead-threads"
+                      " - not using threads\n");
+        }
+      else
+        {
+          err = start_aead_threads (cfx, opt.aead_threads, ciphermode);
+          if (err)
+            goto leave;
+        }
+    }
+
   cfx->wrote_header = 1;
 
  leave:
@@ -396,6 +784,58 @@ do_flush (cipher_filter_context_t *cfx, iobuf_t a, byte *buf, size_t size)
 }
 
 
+/* The flush sub-function of cipher_filter_aead used with worker
+ * threads.  */
+static gpg_error_t
+do_flush_thd (cipher_filter_context_t *cfx, iobuf_t a, byte *buf, size_t size)
+{
+  struct cipher_aead_thd_s *thd = cfx->thd;
+  struct aead_job_s *job;
+  gpg_error_t err = 0;
+  size_t n;
+
+  if (DBG_FILTER)
+    log_debug ("flushing %zu bytes (threaded)\n", size);
+  while (size)
+    {
+      job = thd->jobs + thd->fill_idx;
+      if (job->state != AEAD_JOB_FILL)
+        {
+          /* If the slot is still in use all slots are in use and
+           * we need to write out the oldest chunk first.  */
+          if (get_job_state (thd, job) != AEAD_JOB_FREE)
+            {
+              err = write_finished_jobs (cfx, a, 1);
+              if (err)
+                goto leave;
+            }
+          log_assert (job->state == AEAD_JOB_FREE);
+          job->len = 0;
+          set_job_state (thd, job, AEAD_JOB_FILL);
+        }
+
+      n = cfx->chunksize - job->len;
+      if (n > size)
+        n = size;
+      memcpy (job->buffer + job->len, buf, n);
+      job->len += n;
+      buf  += n;
+      size -= n;
+
+      if (job->len == cfx->chunksize)
+        {
+          queue_job (cfx, job);
+          err = write_finished_jobs (cfx, a, 0);
+          if (err)
+            goto leave;
+        }
+    }
+
+ leave:
+  return err;
+}
+
+
 /* The core of the free sub-function of cipher_filter_aead.   */
 static gpg_error_t
 do_free (cipher_filter_context_t *cfx, iobuf_t a)
@@ -405,7 +845,24 @@ do_free (cipher_filter_context_t *cfx, iobuf_t a)
   if (DBG_FILTER)
     log_debug ("do_free: buflen=%zu\n", cfx->buflen);
 
-  if (cfx->chunklen || cfx->buflen)
+  if (cfx->thd)
+    {
+      struct aead_job_s *job = cfx->thd->jobs + cfx->thd->fill_idx;
+
+      /* Queue the last and possible partial chunk and write out all
+       * pending chunks.  */
+      if (job->state == AEAD_JOB_FILL)
+        {
+          if (job->len)
+            queue_job (cfx, job);
+          else
+            set_job_state (cfx->thd, job, AEAD_JOB_FREE);
+        }
+      err = write_finished_jobs (cfx, a, 2);
+      if (err)
+        goto leave;
+    }
+  else if (cfx->chunklen || cfx->buflen)
     {
       if (DBG_FILTER)
         log_debug ("encrypting last %zu bytes of the last chunk\n",cfx->buflen);
@@ -448,6 +905,7 @@ do_free (cipher_filter_context_t *cfx, iobuf_t a)
   err = write_final_chunk (cfx, a);
 
  leave:
+  release_aead_threads (cfx);
   xfree (cfx->buffer);
   cfx->buffer = NULL;
   gcry_cipher_close (cfx->cipher_hd);
@@ -475,6 +933,8 @@ cipher_filter_aead (void *opaque, int control,
     {
       if (!cfx->wrote_header && (rc=write_header (cfx, a)))
         ;
+      else if (cfx->thd)
+        rc = do_flush_thd (cfx, a, buf, size);
       else
         rc = do_flush (cfx, a, buf, size);
     }
@@ -486,6 +946,10 @@ cipher_filter_aead (void *opaque, int control,
     {
       mem2str (buf, "cipher_filter_aead", *ret_len);
     }
+  else if (control == IOBUFCTRL_BUFHINT)
+    {
+      *ret_len = IOBUF_BUFHINT_BULK;
+    }
   else if (control == IOBUFCTRL_INIT)
     {
       write_status_printf (STATUS_BEGIN_ENCRYPTION, "0 %d %d",
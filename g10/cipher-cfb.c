@@ -179,6 +179,10 @@ cipher_filter_cfb (void *opaque, int control,
     {
       mem2str (buf, "cipher_filter_cfb", *ret_len);
     }
+  else if (control == IOBUFCTRL_BUFHINT)
+    {
+      *ret_len = IOBUF_BUFHINT_BULK;
+    }
   else if (control == IOBUFCTRL_INIT)
     {
       write_status_printf (STATUS_BEGIN_ENCRYPTION, "%d %d",
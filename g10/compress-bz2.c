@@ -269,5 +269,7 @@ compress_filter_bz2( void *opaque, int control,
     }
   else if( control == IOBUFCTRL_DESC )
     mem2str (buf, "compress_filter", *ret_len);
+  else if( control == IOBUFCTRL_BUFHINT )
+    *ret_len = IOBUF_BUFHINT_BULK;
   return rc;
 }
@@ -33,6 +33,7 @@
 #ifdef HAVE_ZIP
 # include <zlib.h>
 #endif
+#include <npth.h>
 
 #include "gpg.h"
 #include "../common/util.h"
@@ -54,20 +55,92 @@ int compress_filter_bz2( void *opaque, int control,
 			 IOBUF a, byte *buf, size_t *ret_len);
 
 #ifdef HAVE_ZIP
-static void
-init_compress( compress_filter_context_t *zfx, z_stream *zs )
-{
-    int rc;
-    int level;
 
+/* The size of the blocks compressed by the worker threads.  */
+#define ZIP_THD_BLOCKSIZE (128*1024)
+
+
+enum zip_job_states
+  {
+    ZIP_JOB_FREE = 0,  /* Owned by the main thread.  */
+    ZIP_JOB_QUEUED,    /* Waiting for a worker.  */
+    ZIP_JOB_RUNNING,   /* Being compressed by a worker.  */
+    ZIP_JOB_DONE       /* Waiting to be written by the main thread.  */
+  };
+
+
+/* A block of data compressed by the worker threads.  */
+struct zip_job_s
+{
+  enum zip_job_states state;
+  int final;          /* This is the last block of the stream.  */
+  int zrc;            /* The zlib return code from the worker.  */
+  size_t dictlen;     /* Length of the dictionary at the start of INBUF.  */
+  size_t inlen;       /* Length of the data following the dictionary.  */
+  size_t outlen;      /* Used length of OUTBUF.  */
+  uLong check;        /* The Adler-32 checksum of the data.  */
+  byte *inbuf;        /* DICTSIZE + ZIP_THD_BLOCKSIZE bytes.  */
+  byte *outbuf;       /* OUTSIZE bytes.  */
+};
+
+
+/* A worker thread with its own deflate stream.  */
+struct zip_worker_s
+{
+  struct compress_thd_s *thd;
+  z_stream zs;
+  npth_t thd_id;
+  unsigned int initialized : 1;
+  unsigned int started : 1;
+};
+
+
+/* The context for compressing with worker threads (pigz style).  The
+ * main thread splits the data into blocks, each prefixed with the
+ * end of the preceding block as dictionary.  The workers deflate
+ * the blocks independently and terminate all but the last block
+ * with a sync flush, so that their output written in order by the
+ * main thread forms a single deflate stream.  */
+struct compress_thd_s
+{
+  npth_mutex_t mutex;
+  npth_cond_t  cond;   /* Signaled on each state change of a job.  */
+  int stop;            /* Tell the workers to terminate.  */
+  int algo;            /* COMPRESS_ALGO_ZIP or COMPRESS_ALGO_ZLIB.  */
+  size_t dictsize;     /* The size of the deflate window.  */
+  size_t outsize;      /* The allocated size of the output buffers.  */
+  uLong check;         /* The Adler-32 checksum of all written blocks.  */
+  int njobs;           /* The size of the JOBS ring buffer.  */
+  struct zip_job_s *jobs;
+  int fill_idx;        /* The job currently filled by the main thread. */
+  int write_idx;       /* The next job to write out.  */
+  int prev_idx;        /* The last queued job or -1.  */
+  int filling;         /* The job at FILL_IDX has been started.  */
+  int nworkers;
+  struct zip_worker_s workers[1];
+};
+
+
+/* Return the compression level to use for zlib.  */
+static int
+get_compress_level (void)
+{
     if( opt.compress_level >= 1 && opt.compress_level <= 9 )
-	level = opt.compress_level;
+	return opt.compress_level;
     else if( opt.compress_level == -1 )
-	level = Z_DEFAULT_COMPRESSION;
+	return Z_DEFAULT_COMPRESSION;
     else {
 	log_error("invalid compression level; using default level\n");
-	level = Z_DEFAULT_COMPRESSION;
+	return Z_DEFAULT_COMPRESSION;
     }
+}
+
+
+static void
+init_compress( compress_filter_context_t *zfx, z_stream *zs )
+{
+    int rc;
+    int level = get_compress_level ();
 
     if( (rc = zfx->algo == 1? deflateInit2( zs, level, Z_DEFLATED,
 					    -13, 8, Z_DEFAULT_STRATEGY)
@@ -127,6 +200,448 @@ do_compress( compress_filter_context_t *zfx, z_stream *zs, int flush, IOBUF a )
     return 0;
 }
 
+
+static void
+lock_thd (struct compress_thd_s *thd)
+{
+  int rc = npth_mutex_lock (&thd->mutex);
+  if (rc)
+    log_fatal ("%s: failed to acquire mutex: %s\n", __func__,
+               gpg_strerror (gpg_error_from_errno (rc)));
+}
+
+
+static void
+unlock_thd (struct compress_thd_s *thd)
+{
+  int rc = npth_mutex_unlock (&thd->mutex);
+  if (rc)
+    log_fatal ("%s: failed to release mutex: %s\n", __func__,
+               gpg_strerror (gpg_error_from_errno (rc)));
+}
+
+
+/* Return the state of JOB.  */
+static enum zip_job_states
+get_job_state (struct compress_thd_s *thd, struct zip_job_s *job)
+{
+  enum zip_job_states state;
+
+  lock_thd (thd);
+  state = job->state;
+  unlock_thd (thd);
+  return state;
+}
+
+
+/* Set the state of JOB to STATE and wake up the waiting threads.  */
+static void
+set_job_state (struct compress_thd_s *thd, struct zip_job_s *job,
+               enum zip_job_states state)
+{
+  lock_thd (thd);
+  job->state = state;
+  npth_cond_broadcast (&thd->cond);
+  unlock_thd (thd);
+}
+
+
+/* Deflate the block JOB using the stream of worker W.  */
+static void
+compress_job (struct zip_worker_s *w, struct zip_job_s *job)
+{
+  z_stream *zs = &w->zs;
+  int zrc;
+
+  zrc = deflateReset (zs);
+  if (zrc == Z_OK && job->dictlen)
+    zrc = deflateSetDictionary (zs, BYTEF_CAST (job->inbuf), job->dictlen);
+  if (zrc == Z_OK)
+    {
+      zs->next_in = BYTEF_CAST (job->inbuf + job->dictlen);
+      zs->avail_in = job->inlen;
+      zs->next_out = BYTEF_CAST (job->outbuf);
+      zs->avail_out = w->thd->outsize;
+      zrc = deflate (zs, job->final? Z_FINISH : Z_SYNC_FLUSH);
+      if (job->final && zrc == Z_STREAM_END)
+        zrc = Z_OK;
+      else if (zrc == Z_OK && (zs->avail_in || !zs->avail_out))
+        zrc = Z_BUF_ERROR;  /* OUTSIZE is too short; can't happen.  */
+      job->outlen = w->thd->outsize - zs->avail_out;
+    }
+  if (w->thd->algo == COMPRESS_ALGO_ZLIB)
+    job->check = adler32 (adler32 (0, Z_NULL, 0),
+                          BYTEF_CAST (job->inbuf + job->dictlen), job->inlen);
+  job->zrc = zrc;
+}
+
+
+/* The worker thread.  It takes queued blocks and deflates them.  */
+static void *
+zip_worker_thread (void *arg)
+{
+  struct zip_worker_s *w = arg;
+  struct compress_thd_s *thd = w->thd;
+  struct zip_job_s *job;
+  int i;
+
+  lock_thd (thd);
+  for (;;)
+    {
+      /* Take the oldest queued block.  */
+      job = NULL;
+      for (i=0; i < thd->njobs; i++)
+        {
+          struct zip_job_s *j = thd->jobs + (thd->write_idx+i) % thd->njobs;
+          if (j->state == ZIP_JOB_QUEUED)
+            {
+              job = j;
+              break;
+            }
+        }
+      if (!job)
+        {
+          if (thd->stop)
+            break;
+          npth_cond_wait (&thd->cond, &thd->mutex);
+          continue;
+        }
+      job->state = ZIP_JOB_RUNNING;
+      unlock_thd (thd);
+
+      npth_unprotect ();
+      compress_job (w, job);
+      npth_protect ();
+
+      lock_thd (thd);
+      job->state = ZIP_JOB_DONE;
+      npth_cond_broadcast (&thd->cond);
+    }
+  unlock_thd (thd);
+
+  return NULL;
+}
+
+
+/* Stop the worker threads and release the context.  */
+static void
+release_compress_threads (compress_filter_context_t *zfx)
+{
+  struct compress_thd_s *thd = zfx->thd;
+  int i;
+
+  if (!thd)
+    return;
+
+  lock_thd (thd);
+  thd->stop = 1;
+  npth_cond_broadcast (&thd->cond);
+  unlock_thd (thd);
+
+  for (i=0; i < thd->nworkers; i++)
+    {
+      if (thd->workers[i].started)
+        npth_join (thd->workers[i].thd_id, NULL);
+      if (thd->workers[i].initialized)
+        deflateEnd (&thd->workers[i].zs);
+    }
+  if (thd->jobs)
+    {
+      for (i=0; i < thd->njobs; i++)
+        {
+          xfree (thd->jobs[i].inbuf);
+          xfree (thd->jobs[i].outbuf);
+        }
+      xfree (thd->jobs);
+    }
+  npth_cond_destroy (&thd->cond);
+  npth_mutex_destroy (&thd->mutex);
+  xfree (thd);
+  zfx->thd = NULL;
+}
+
+
+/* Create NTHREADS worker threads to deflate the data.  */
+static gpg_error_t
+start_compress_threads (compress_filter_context_t *zfx, int nthreads)
+{
+  gpg_error_t err = 0;
+  struct compress_thd_s *thd;
+  npth_attr_t tattr;
+  int level = get_compress_level ();
+  int wbits = zfx->algo == COMPRESS_ALGO_ZIP? 13 : 15;
+  int rc, i;
+
+  thd = xtrycalloc (1, sizeof *thd + (nthreads-1) * sizeof *thd->workers);
+  if (!thd)
+    return gpg_error_from_syserror ();
+  rc = npth_mutex_init (&thd->mutex, NULL);
+  if (rc)
+    {
+      xfree (thd);
+      return gpg_error_from_errno (rc);
+    }
+  rc = npth_cond_init (&thd->cond, NULL);
+  if (rc)
+    {
+      npth_mutex_destroy (&thd->mutex);
+      xfree (thd);
+      return gpg_error_from_errno (rc);
+    }
+  zfx->thd = thd;
+  thd->algo = zfx->algo;
+  thd->dictsize = (size_t)1 << wbits;
+  thd->check = adler32 (0, Z_NULL, 0);
+  thd->prev_idx = -1;
+
+  /* The raw deflate streams of the workers use the same window size
+   * as the serial code.  The ZLIB header and trailer are written by
+   * the main thread.  */
+  thd->nworkers = nthreads;
+  for (i=0; i < thd->nworkers; i++)
+    {
+      thd->workers[i].thd = thd;
+      rc = deflateInit2 (&thd->workers[i].zs, level, Z_DEFLATED, -wbits, 8,
+                         Z_DEFAULT_STRATEGY);
+      if (rc != Z_OK)
+        {
+          err = gpg_error (rc == Z_MEM_ERROR? GPG_ERR_ENOMEM
+                           /**/             : GPG_ERR_INTERNAL);
+          goto leave;
+        }
+      thd->workers[i].initialized = 1;
+    }
+  /* Room for a sync flush marker and some slack.  */
+  thd->outsize = deflateBound (&thd->workers[0].zs, ZIP_THD_BLOCKSIZE) + 64;
+
+  /* Two blocks per worker so that the main thread can fill and write
+   * blocks while all workers are busy.  */
+  thd->njobs = 2 * nthreads;
+  thd->jobs = xtrycalloc (thd->njobs, sizeof *thd->jobs);
+  if (!thd->jobs)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  for (i=0; i < thd->njobs; i++)
+    {
+      thd->jobs[i].inbuf = xtrymalloc (thd->dictsize + ZIP_THD_BLOCKSIZE);
+      thd->jobs[i].outbuf = xtrymalloc (thd->outsize);
+      if (!thd->jobs[i].inbuf || !thd->jobs[i].outbuf)
+        {
+          err = gpg_error_from_syserror ();
+          goto leave;
+        }
+    }
+
+  rc = npth_attr_init (&tattr);
+  if (rc)
+    {
+      err = gpg_error_from_errno (rc);
+      goto leave;
+    }
+  npth_attr_setdetachstate (&tattr, NPTH_CREATE_JOINABLE);
+  for (i=0; i < thd->nworkers; i++)
+    {
+      rc = npth_create (&thd->workers[i].thd_id, &tattr,
+                        zip_worker_thread, thd->workers + i);
+      if (rc)
+        {
+          err = gpg_error_from_errno (rc);
+          break;
+        }
+      thd->workers[i].started = 1;
+    }
+  npth_attr_destroy (&tattr);
+
+  if (DBG_FILTER && !err)
+    log_debug ("started %d compression threads\n", thd->nworkers);
+
+ leave:
+  if (err)
+    {
+      log_info ("error starting compression threads: %s\n",
+                gpg_strerror (err));
+      release_compress_threads (zfx);
+    }
+  return err;
+}
+
+
+/* Write the ZLIB header matching the parameters of the workers.
+ * This is the same header deflateInit would create.  */
+static int
+write_zlib_header (IOBUF a)
+{
+  int level = get_compress_level ();
+  unsigned int header;
+  byte hdr[2];
+
+  if (level == Z_DEFAULT_COMPRESSION)
+    level = 6;
+  header = (Z_DEFLATED + ((15-8) << 4)) << 8;
+  header |= (level < 2? 0 : level < 6? 1 : level == 6? 2 : 3) << 6;
+  header += 31 - (header % 31);
+  hdr[0] = header >> 8;
+  hdr[1] = header;
+  return iobuf_write (a, hdr, 2);
+}
+
+
+/* Write the blocks finished by the workers in order to stream A.  If
+ * WAIT is 1 wait for the oldest pending block; if WAIT is 2 wait for
+ * all pending blocks.  */
+static int
+write_finished_jobs (compress_filter_context_t *zfx, IOBUF a, int wait)
+{
+  struct compress_thd_s *thd = zfx->thd;
+  struct zip_job_s *job;
+  int rc = 0;
+
+  for (;;)
+    {
+      job = thd->jobs + thd->write_idx;
+      lock_thd (thd);
+      while (wait && (job->state == ZIP_JOB_QUEUED
+                      || job->state == ZIP_JOB_RUNNING))
+        npth_cond_wait (&thd->cond, &thd->mutex);
+      if (job->state != ZIP_JOB_DONE)
+        {
+          unlock_thd (thd);
+          break;
+        }
+      unlock_thd (thd);
+
+      /* The workers don't touch a finished job and thus we don't
+       * need to hold the lock while writing.  */
+      if (job->zrc != Z_OK)
+        {
+          log_error ("zlib deflate problem: rc=%d\n", job->zrc);
+          write_status_error ("zlib.deflate", gpg_error (GPG_ERR_INTERNAL));
+          g10_exit (2);
+        }
+      if (DBG_FILTER)
+        log_debug ("writing compressed block (%zu bytes -> %zu bytes)\n",
+                   job->inlen, job->outlen);
+      if (thd->algo == COMPRESS_ALGO_ZLIB)
+        thd->check = adler32_combine (thd->check, job->check, job->inlen);
+      if ((rc = iobuf_write (a, job->outbuf, job->outlen)))
+        log_error ("deflate: iobuf_write failed\n");
+      lock_thd (thd);
+      job->state = ZIP_JOB_FREE;
+      thd->write_idx = (thd->write_idx + 1) % thd->njobs;
+      unlock_thd (thd);
+      if (rc)
+        break;
+      if (wait == 1)
+        wait = 0;
+    }
+
+  return rc;
+}
+
+
+/* Return the job to be filled by the main thread or NULL on a write
+ * error.  A new job is primed with the dictionary from the preceding
+ * block.  The data of the preceding job is left intact until the
+ * current job has been queued and thus we may read it while a worker
+ * is still compressing it.  */
+static struct zip_job_s *
+get_fill_job (compress_filter_context_t *zfx, IOBUF a)
+{
+  struct compress_thd_s *thd = zfx->thd;
+  struct zip_job_s *job = thd->jobs + thd->fill_idx;
+
+  if (thd->filling)
+    return job;
+
+  /* Only the main thread sets a job to free; thus it suffices to
+   * wait for the oldest job if the ring is full.  */
+  while (get_job_state (thd, job) != ZIP_JOB_FREE)
+    if (write_finished_jobs (zfx, a, 1))
+      return NULL;
+
+  job->dictlen = 0;
+  job->inlen = 0;
+  if (thd->prev_idx != -1)
+    {
+      struct zip_job_s *prev = thd->jobs + thd->prev_idx;
+      size_t n = prev->dictlen + prev->inlen;
+
+      job->dictlen = n < thd->dictsize? n : thd->dictsize;
+      memcpy (job->inbuf, prev->inbuf + n - job->dictlen, job->dictlen);
+    }
+  thd->filling = 1;
+  return job;
+}
+
+
+/* Hand the job being filled over to the workers.  */
+static void
+queue_job (compress_filter_context_t *zfx, int final)
+{
+  struct compress_thd_s *thd = zfx->thd;
+  struct zip_job_s *job = thd->jobs + thd->fill_idx;
+
+  job->final = final;
+  set_job_state (thd, job, ZIP_JOB_QUEUED);
+  thd->prev_idx = thd->fill_idx;
+  thd->fill_idx = (thd->fill_idx + 1) % thd->njobs;
+  thd->filling = 0;
+}
+
+
+/* Threaded version of do_compress for Z_NO_FLUSH.  */
+static int
+do_compress_thd (compress_filter_context_t *zfx, byte *buf, size_t size,
+                 IOBUF a)
+{
+  struct zip_job_s *job;
+  size_t n;
+
+  while (size)
+    {
+      if (!(job = get_fill_job (zfx, a)))
+        return -1;
+      n = ZIP_THD_BLOCKSIZE - job->inlen;
+      if (n > size)
+        n = size;
+      memcpy (job->inbuf + job->dictlen + job->inlen, buf, n);
+      job->inlen += n;
+      buf += n;
+      size -= n;
+      if (job->inlen == ZIP_THD_BLOCKSIZE)
+        queue_job (zfx, 0);
+    }
+
+  return write_finished_jobs (zfx, a, 0);
+}
+
+
+/* Threaded version of do_compress for Z_FINISH.  */
+static int
+finish_compress_thd (compress_filter_context_t *zfx, IOBUF a)
+{
+  struct compress_thd_s *thd = zfx->thd;
+  byte trailer[4];
+  int rc;
+
+  if (!get_fill_job (zfx, a))
+    return -1;
+  queue_job (zfx, 1);
+  rc = write_finished_jobs (zfx, a, 2);
+  if (!rc && thd->algo == COMPRESS_ALGO_ZLIB)
+    {
+      trailer[0] = thd->check >> 24;
+      trailer[1] = thd->check >> 16;
+      trailer[2] = thd->check >> 8;
+      trailer[3] = thd->check;
+      rc = iobuf_write (a, trailer, 4);
+    }
+  return rc;
+}
+
+
 static void
 init_uncompress( compress_filter_context_t *zfx, z_stream *zs )
 {
@@ -259,14 +774,26 @@ compress_filter( void *opaque, int control,
 	    pkt.pkt.compressed = &cd;
 	    if( build_packet( a, &pkt ))
 		log_bug("build_packet(PKT_COMPRESSED) failed\n");
-	    zs = zfx->opaque = xmalloc_clear( sizeof *zs );
-	    init_compress( zfx, zs );
+	    if (opt.compress_threads > 1
+                && !start_compress_threads (zfx, opt.compress_threads)) {
+		if (zfx->algo == COMPRESS_ALGO_ZLIB
+		    && (rc = write_zlib_header (a)))
+		    return rc;
+	    }
+	    else {
+		zs = zfx->opaque = xmalloc_clear( sizeof *zs );
+		init_compress( zfx, zs );
+	    }
 	    zfx->status = 2;
 	}
 
-	zs->next_in = BYTEF_CAST (buf);
-	zs->avail_in = size;
-	rc = do_compress( zfx, zs, Z_NO_FLUSH, a );
+	if (zfx->thd)
+	    rc = do_compress_thd (zfx, buf, size, a);
+	else {
+	    zs->next_in = BYTEF_CAST (buf);
+	    zs->avail_in = size;
+	    rc = do_compress( zfx, zs, Z_NO_FLUSH, a );
+	}
     }
     else if( control == IOBUFCTRL_FREE ) {
 	if( zfx->status == 1 ) {
@@ -275,6 +802,10 @@ compress_filter( void *opaque, int control,
 	    zfx->opaque = NULL;
 	    xfree(zfx->outbuf); zfx->outbuf = NULL;
 	}
+	else if( zfx->status == 2 && zfx->thd ) {
+	    finish_compress_thd (zfx, a);
+	    release_compress_threads (zfx);
+	}
 	else if( zfx->status == 2 ) {
 	    zs->next_in = BYTEF_CAST (buf);
 	    zs->avail_in = 0;
@@ -289,6 +820,8 @@ compress_filter( void *opaque, int control,
     }
     else if( control == IOBUFCTRL_DESC )
         mem2str (buf, "compress_filter", *ret_len);
+    else if( control == IOBUFCTRL_BUFHINT )
+        *ret_len = IOBUF_BUFHINT_BULK;
     return rc;
 }
 #endif /*HAVE_ZIP*/
@@ -23,6 +23,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <npth.h>
 
 #include "gpg.h"
 #include "../common/util.h"
@@ -40,6 +41,59 @@ static int mdc_decode_filter ( void *opaque, int control, IOBUF a,
 static int decode_filter ( void *opaque, int control, IOBUF a,
 					byte *buf, size_t *ret_len);
 
+
+/* The largest chunk size we decrypt using worker threads.  This
+ * needs to match the limit used for encryption.  */
+#define AEAD_THD_MAX_CHUNKSIZE (16*1024*1024)
+
+/* The states of a chunk processed by the worker threads.  */
+enum aead_job_states
+  {
+    AEAD_JOB_FREE = 0,  /* The slot is not used.  */
+    AEAD_JOB_QUEUED,    /* The chunk waits for a worker.  */
+    AEAD_JOB_RUNNING,   /* A worker is decrypting the chunk.  */
+    AEAD_JOB_DONE       /* The chunk has been decrypted and checked.  */
+  };
+
+/* A chunk processed by the worker threads.  */
+struct aead_job_s
+{
+  enum aead_job_states state;
+  uint64_t chunkindex;  /* The index of this chunk.  */
+  size_t len;           /* The length of the data without the tag.  */
+  size_t off;           /* The number of bytes already returned.  */
+  gpg_error_t err;      /* The error code from the worker.  */
+  byte *buffer;         /* A buffer of CHUNKSIZE+32 bytes.  */
+};
+
+/* A worker thread with its own cipher handle.  */
+struct aead_worker_s
+{
+  struct decode_filter_context_s *dfx;
+  gcry_cipher_hd_t cipher_hd;
+  npth_t thd;
+  unsigned int started : 1;
+};
+
+/* The context for decrypting chunks with worker threads.  The main
+ * thread reads the chunks into the ring buffer JOBS, the workers
+ * decrypt them and check their tags in any order, and the main
+ * thread returns the plaintext of the checked chunks in order.  */
+struct aead_thd_s
+{
+  npth_mutex_t mutex;
+  npth_cond_t  cond;   /* Signaled on each state change of a job.  */
+  int stop;            /* Tell the workers to terminate.  */
+  int njobs;           /* The size of the JOBS ring buffer.  */
+  struct aead_job_s *jobs;
+  int fill_idx;        /* The next job to be read by the main thread. */
+  int read_idx;        /* The next job to return plaintext from.  */
+  gpg_error_t err;     /* A sticky error code.  */
+  unsigned int eof : 1;  /* The final tag has been checked.  */
+  int nworkers;
+  struct aead_worker_s workers[1];
+};
+
 /* Our context object.  */
 struct decode_filter_context_s
 {
@@ -99,10 +153,17 @@ struct decode_filter_context_s
   /* Remaining bytes in the packet according to the packet header.
    * Not used if PARTIAL is true.  */
   size_t length;
+
+  /* If not NULL the AEAD chunks are decrypted by a set of worker
+   * threads (option --aead-threads).  */
+  struct aead_thd_s *thd;
 };
 typedef struct decode_filter_context_s *decode_filter_ctx_t;
 
 
+static void release_aead_threads (decode_filter_ctx_t dfx);
+
+
 /* Helper to release the decode context.  */
 static void
 release_dfx_context (decode_filter_ctx_t dfx)
@@ -113,6 +174,7 @@ release_dfx_context (decode_filter_ctx_t dfx)
   log_assert (dfx->refcount);
   if ( !--dfx->refcount )
     {
+      release_aead_threads (dfx);
       gcry_cipher_close (dfx->cipher_hd);
       dfx->cipher_hd = NULL;
       gcry_md_close (dfx->mdc_hash);
@@ -122,12 +184,13 @@ release_dfx_context (decode_filter_ctx_t dfx)
 }
 
 
-/* Set the nonce and the additional data for the current chunk.  This
- * also reset the decryption machinery so that the handle can be
- * used for a new chunk.  If FINAL is set the final AEAD chunk is
- * processed.  */
+/* Set the nonce and the additional data for chunk CHUNKINDEX on the
+ * cipher handle HD.  This also reset the decryption machinery so
+ * that the handle can be used for a new chunk.  If FINAL is set the
+ * final AEAD chunk is processed.  */
 static gpg_error_t
-aead_set_nonce_and_ad (decode_filter_ctx_t dfx, int final)
+aead_set_chunk_nonce_and_ad (decode_filter_ctx_t dfx, gcry_cipher_hd_t hd,
+                             uint64_t chunkindex, int final)
 {
   gpg_error_t err;
   unsigned char ad[21];
@@ -149,18 +212,18 @@ aead_set_nonce_and_ad (decode_filter_ctx_t dfx, int final)
     default:
       BUG ();
     }
-  nonce[i++] ^= dfx->chunkindex >> 56;
-  nonce[i++] ^= dfx->chunkindex >> 48;
-  nonce[i++] ^= dfx->chunkindex >> 40;
-  nonce[i++] ^= dfx->chunkindex >> 32;
-  nonce[i++] ^= dfx->chunkindex >> 24;
-  nonce[i++] ^= dfx->chunkindex >> 16;
-  nonce[i++] ^= dfx->chunkindex >>  8;
-  nonce[i++] ^= dfx->chunkindex;
+  nonce[i++] ^= chunkindex >> 56;
+  nonce[i++] ^= chunkindex >> 48;
+  nonce[i++] ^= chunkindex >> 40;
+  nonce[i++] ^= chunkindex >> 32;
+  nonce[i++] ^= chunkindex >> 24;
+  nonce[i++] ^= chunkindex >> 16;
+  nonce[i++] ^= chunkindex >>  8;
+  nonce[i++] ^= chunkindex;
 
   if (DBG_CRYPTO)
     log_printhex (nonce, i, "nonce:");
-  err = gcry_cipher_setiv (dfx->cipher_hd, nonce, i);
+  err = gcry_cipher_setiv (hd, nonce, i);
   if (err)
     return err;
 
@@ -169,14 +232,14 @@ aead_set_nonce_and_ad (decode_filter_ctx_t dfx, int final)
   ad[2] = dfx->cipher_algo;
   ad[3] = dfx->aead_algo;
   ad[4] = dfx->chunkbyte;
-  ad[5] = dfx->chunkindex >> 56;
-  ad[6] = dfx->chunkindex >> 48;
-  ad[7] = dfx->chunkindex >> 40;
-  ad[8] = dfx->chunkindex >> 32;
-  ad[9] = dfx->chunkindex >> 24;
-  ad[10]= dfx->chunkindex >> 16;
-  ad[11]= dfx->chunkindex >>  8;
-  ad[12]= dfx->chunkindex;
+  ad[5] = chunkindex >> 56;
+  ad[6] = chunkindex >> 48;
+  ad[7] = chunkindex >> 40;
+  ad[8] = chunkindex >> 32;
+  ad[9] = chunkindex >> 24;
+  ad[10]= chunkindex >> 16;
+  ad[11]= chunkindex >>  8;
+  ad[12]= chunkindex;
   if (final)
     {
       ad[13] = dfx->total >> 56;
@@ -190,7 +253,19 @@ aead_set_nonce_and_ad (decode_filter_ctx_t dfx, int final)
     }
   if (DBG_CRYPTO)
     log_printhex (ad, final? 21 : 13, "authdata:");
-  return gcry_cipher_authenticate (dfx->cipher_hd, ad, final? 21 : 13);
+  return gcry_cipher_authenticate (hd, ad, final? 21 : 13);
+}
+
+
+/* Set the nonce and the additional data for the current chunk.  This
+ * also reset the decryption machinery so that the handle can be
+ * used for a new chunk.  If FINAL is set the final AEAD chunk is
+ * processed.  */
+static gpg_error_t
+aead_set_nonce_and_ad (decode_filter_ctx_t dfx, int final)
+{
+  return aead_set_chunk_nonce_and_ad (dfx, dfx->cipher_hd,
+                                      dfx->chunkindex, final);
 }
 
 
@@ -218,6 +293,237 @@ aead_checktag (decode_filter_ctx_t dfx, int final, const void *tagbuf)
 }
 
 
+static void
+lock_thd (struct aead_thd_s *thd)
+{
+  int rc = npth_mutex_lock (&thd->mutex);
+  if (rc)
+    log_fatal ("%s: failed to acquire mutex: %s\n", __func__,
+               gpg_strerror (gpg_error_from_errno (rc)));
+}
+
+
+static void
+unlock_thd (struct aead_thd_s *thd)
+{
+  int rc = npth_mutex_unlock (&thd->mutex);
+  if (rc)
+    log_fatal ("%s: failed to release mutex: %s\n", __func__,
+               gpg_strerror (gpg_error_from_errno (rc)));
+}
+
+
+/* Set the state of JOB to STATE and wake up the waiting threads.  */
+static void
+set_job_state (struct aead_thd_s *thd, struct aead_job_s *job,
+               enum aead_job_states state)
+{
+  lock_thd (thd);
+  job->state = state;
+  npth_cond_broadcast (&thd->cond);
+  unlock_thd (thd);
+}
+
+
+/* The worker thread.  It takes queued chunks, decrypts them in place
+ * and checks their tags.  */
+static void *
+aead_worker_thread (void *arg)
+{
+  struct aead_worker_s *w = arg;
+  decode_filter_ctx_t dfx = w->dfx;
+  struct aead_thd_s *thd = dfx->thd;
+  struct aead_job_s *job;
+  gpg_error_t err;
+  int i;
+
+  lock_thd (thd);
+  for (;;)
+    {
+      /* Take the oldest queued chunk.  */
+      job = NULL;
+      for (i=0; i < thd->njobs; i++)
+        {
+          struct aead_job_s *j = thd->jobs + (thd->read_idx+i) % thd->njobs;
+          if (j->state == AEAD_JOB_QUEUED)
+            {
+              job = j;
+              break;
+            }
+        }
+      if (!job)
+        {
+          if (thd->stop)
+            break;
+          npth_cond_wait (&thd->cond, &thd->mutex);
+          continue;
+        }
+      job->state = AEAD_JOB_RUNNING;
+      unlock_thd (thd);
+
+      err = aead_set_chunk_nonce_and_ad (dfx, w->cipher_hd,
+                                         job->chunkindex, 0);
+      if (!err)
+        {
+          gcry_cipher_final (w->cipher_hd);
+          npth_unprotect ();
+          err = gcry_cipher_decrypt (w->cipher_hd, job->buffer, job->len,
+                                     NULL, 0);
+          if (!err)
+            err = gcry_cipher_checktag (w->cipher_hd,
+                                        job->buffer + job->len, 16);
+          npth_protect ();
+        }
+      /* Never release unauthenticated plaintext.  */
+      if (err)
+        wipememory (job->buffer, job->len);
+
+      lock_thd (thd);
+      job->err = err;
+      job->state = AEAD_JOB_DONE;
+      npth_cond_broadcast (&thd->cond);
+    }
+  unlock_thd (thd);
+
+  return NULL;
+}
+
+
+/* Stop the worker threads and release the context.  */
+static void
+release_aead_threads (decode_filter_ctx_t dfx)
+{
+  struct aead_thd_s *thd = dfx->thd;
+  int i;
+
+  if (!thd)
+    return;
+
+  lock_thd (thd);
+  thd->stop = 1;
+  npth_cond_broadcast (&thd->cond);
+  unlock_thd (thd);
+
+  for (i=0; i < thd->nworkers; i++)
+    {
+      if (thd->workers[i].started)
+        npth_join (thd->workers[i].thd, NULL);
+      gcry_cipher_close (thd->workers[i].cipher_hd);
+    }
+  if (thd->jobs)
+    {
+      for (i=0; i < thd->njobs; i++)
+        xfree (thd->jobs[i].buffer);
+      xfree (thd->jobs);
+    }
+  npth_cond_destroy (&thd->cond);
+  npth_mutex_destroy (&thd->mutex);
+  xfree (thd);
+  dfx->thd = NULL;
+}
+
+
+/* Create NTHREADS worker threads to decrypt the chunks using
+ * CIPHERMODE and the key from DEK.  */
+static gpg_error_t
+start_aead_threads (decode_filter_ctx_t dfx, int nthreads,
+                    enum gcry_cipher_modes ciphermode, DEK *dek)
+{
+  gpg_error_t err;
+  struct aead_thd_s *thd;
+  npth_attr_t tattr;
+  int rc, i;
+
+  thd = xtrycalloc (1, sizeof *thd + (nthreads-1) * sizeof *thd->workers);
+  if (!thd)
+    return gpg_error_from_syserror ();
+  rc = npth_mutex_init (&thd->mutex, NULL);
+  if (rc)
+    {
+      xfree (thd);
+      return gpg_error_from_errno (rc);
+    }
+  rc = npth_cond_init (&thd->cond, NULL);
+  if (rc)
+    {
+      npth_mutex_destroy (&thd->mutex);
+      xfree (thd);
+      return gpg_error_from_errno (rc);
+    }
+  dfx->thd = thd;
+
+  /* Two chunks per worker so that the main thread can read ahead and
+   * return plaintext while all workers are busy.  */
+  thd->njobs = 2 * nthreads;
+  thd->jobs = xtrycalloc (thd->njobs, sizeof *thd->jobs);
+  if (!thd->jobs)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  for (i=0; i < thd->njobs; i++)
+    {
+      thd->jobs[i].buffer = xtrymalloc (dfx->chunksize + 32);
+      if (!thd->jobs[i].buffer)
+        {
+          err = gpg_error_from_syserror ();
+          goto leave;
+        }
+    }
+
+  thd->nworkers = nthreads;
+  for (i=0; i < thd->nworkers; i++)
+    {
+      thd->workers[i].dfx = dfx;
+      err = openpgp_cipher_open (&thd->workers[i].cipher_hd,
+                                 dfx->cipher_algo,
+                                 ciphermode,
+                                 GCRY_CIPHER_SECURE);
+      if (!err)
+        {
+          err = gcry_cipher_setkey (thd->workers[i].cipher_hd,
+                                    dek->key, dek->keylen);
+          if (gpg_err_code (err) == GPG_ERR_WEAK_KEY)
+            err = 0;  /* Already reported for the main handle.  */
+        }
+      if (err)
+        goto leave;
+    }
+
+  rc = npth_attr_init (&tattr);
+  if (rc)
+    {
+      err = gpg_error_from_errno (rc);
+      goto leave;
+    }
+  npth_attr_setdetachstate (&tattr, NPTH_CREATE_JOINABLE);
+  for (i=0; i < thd->nworkers; i++)
+    {
+      rc = npth_create (&thd->workers[i].thd, &tattr,
+                        aead_worker_thread, thd->workers + i);
+      if (rc)
+        {
+          err = gpg_error_from_errno (rc);
+          break;
+        }
+      thd->workers[i].started = 1;
+    }
+  npth_attr_destroy (&tattr);
+
+  if (DBG_FILTER && !err)
+    log_debug ("started %d AEAD worker threads\n", thd->nworkers);
+
+ leave:
+  if (err)
+    {
+      log_error ("error starting AEAD worker threads: %s\n",
+                 gpg_strerror (err));
+      release_aead_threads (dfx);
+    }
+  return err;
+}
+
+
 /****************
  * Decrypt the data, specified by ED with the key DEK.  On return
  * COMPLIANCE_ERROR is set to true iff the decryption can claim that
@@ -397,6 +703,22 @@ decrypt_data (ctrl_t ctrl, void *procctx, PKT_encrypted *ed, DEK *dek,
           goto leave;
         }
 
+      if (opt.aead_threads > 1)
+        {
+          if (dfx->chunksize > AEAD_THD_MAX_CHUNKSIZE)
+            {
+              if (opt.verbose)
+                log_info ("chunk size too large for --aead-threads"
+                          " - not using threads\n");
+            }
+          else
+            {
+              rc = start_aead_threads (dfx, opt.aead_threads,
+                                       ciphermode, dek);
+              if (rc)
+                goto leave;
+            }
+        }
     }
   else /* CFB encryption.  */
     {
@@ -881,6 +1203,187 @@ aead_underflow (decode_filter_ctx_t dfx, iobuf_t a, byte *buf, size_t *ret_len)
 }
 
 
+/* Read the next chunk including its tag into the free JOB and queue
+ * it for the workers.  The 16 bytes following the chunk are kept in
+ * the holdback buffer because they are either the start of the next
+ * chunk or the final tag.  If only the final tag is left JOB is not
+ * queued.  */
+static gpg_error_t
+read_aead_chunk (decode_filter_ctx_t dfx, iobuf_t a, struct aead_job_s *job)
+{
+  struct aead_thd_s *thd = dfx->thd;
+  size_t n;
+
+  memcpy (job->buffer, dfx->holdback, dfx->holdbacklen);
+  n = fill_buffer (dfx, a, job->buffer, dfx->chunksize + 32,
+                   dfx->holdbacklen);
+  dfx->holdbacklen = 0;
+  if (n < 16)
+    return gpg_error (GPG_ERR_TRUNCATED);
+  memcpy (dfx->holdback, job->buffer + n - 16, 16);
+  dfx->holdbacklen = 16;
+  n -= 16;
+
+  if (!n)
+    {
+      log_assert (dfx->eof_seen);
+      if (DBG_FILTER)
+        log_debug ("eof seen: holdback has the final tag\n");
+      return 0;
+    }
+  if (n <= 16)
+    {
+      /* Not enough data for a chunk and its tag.  */
+      return gpg_error (GPG_ERR_TRUNCATED);
+    }
+
+  job->len = n - 16;
+  job->off = 0;
+  job->err = 0;
+  job->chunkindex = dfx->chunkindex++;
+  dfx->total += job->len;
+  if (DBG_FILTER)
+    log_debug ("queuing chunk %llu (%zu bytes)%s\n",
+               (unsigned long long)job->chunkindex, job->len,
+               dfx->eof_seen? " eof":"");
+  set_job_state (thd, job, AEAD_JOB_QUEUED);
+  thd->fill_idx = (thd->fill_idx + 1) % thd->njobs;
+  return 0;
+}
+
+
+/* The core of the AEAD decryption with worker threads.  This is the
+ * underflow function of the aead_decode_filter if --aead-threads is
+ * used.  Other than the serial code this returns only plaintext of
+ * chunks with a valid tag.  */
+static gpg_error_t
+aead_underflow_thd (decode_filter_ctx_t dfx, iobuf_t a,
+                    byte *buf, size_t *ret_len)
+{
+  struct aead_thd_s *thd = dfx->thd;
+  const size_t size = *ret_len; /* The allocated size of BUF.  */
+  gpg_error_t err = 0;
+  size_t totallen = 0; /* The number of bytes to return.  */
+  struct aead_job_s *job;
+  enum aead_job_states state;
+  size_t n;
+
+  if (thd->err)
+    {
+      err = thd->err;
+      goto leave;
+    }
+  if (thd->eof)
+    {
+      err = gpg_error (GPG_ERR_EOF);
+      goto leave;
+    }
+
+  while (totallen < size)
+    {
+      /* Read ahead as many chunks as we have free slots.  Only the
+       * main thread sets a job to free and thus we don't need to take
+       * the lock for this test.  */
+      while (!dfx->eof_seen
+             && thd->jobs[thd->fill_idx].state == AEAD_JOB_FREE)
+        {
+          err = read_aead_chunk (dfx, a, thd->jobs + thd->fill_idx);
+          if (err)
+            goto leave;
+        }
+
+      /* Wait for the oldest chunk but only if we have nothing to
+       * return yet.  */
+      job = thd->jobs + thd->read_idx;
+      lock_thd (thd);
+      while (!totallen && (job->state == AEAD_JOB_QUEUED
+                           || job->state == AEAD_JOB_RUNNING))
+        npth_cond_wait (&thd->cond, &thd->mutex);
+      state = job->state;
+      unlock_thd (thd);
+
+      if (state != AEAD_JOB_DONE)
+        break;
+
+      if (job->err)
+        {
+          err = job->err;
+          if (gpg_err_code (err) == GPG_ERR_CHECKSUM)
+            {
+              log_error ("gcry_cipher_checktag failed: %s\n",
+                         gpg_strerror (err));
+              write_status_error ("aead_checktag", err);
+              dfx->checktag_failed = 1;
+            }
+          else
+            log_error ("gcry_cipher_decrypt failed: %s\n",
+                       gpg_strerror (err));
+          goto leave;
+        }
+
+      n = job->len - job->off;
+      if (n > size - totallen)
+        n = size - totallen;
+      memcpy (buf + totallen, job->buffer + job->off, n);
+      job->off += n;
+      totallen += n;
+      if (job->off == job->len)
+        {
+          set_job_state (thd, job, AEAD_JOB_FREE);
+          thd->read_idx = (thd->read_idx + 1) % thd->njobs;
+        }
+    }
+
+  if (!totallen && state == AEAD_JOB_FREE)
+    {
+      /* All chunks have been returned - check the final chunk.  */
+      log_assert (dfx->eof_seen && dfx->holdbacklen == 16);
+      if (DBG_FILTER)
+        log_debug ("checking the final tag: chunkindex=%llu total=%llu\n",
+                   (unsigned long long)dfx->chunkindex,
+                   (unsigned long long)dfx->total);
+      err = aead_set_nonce_and_ad (dfx, 1);
+      if (err)
+        goto leave;
+      gcry_cipher_final (dfx->cipher_hd);
+      /* Decrypt an empty string (using HOLDBACK as a dummy).  */
+      err = gcry_cipher_decrypt (dfx->cipher_hd, dfx->holdback, 0, NULL, 0);
+      if (err)
+        {
+          log_error ("gcry_cipher_decrypt failed (final): %s\n",
+                     gpg_strerror (err));
+          goto leave;
+        }
+      err = aead_checktag (dfx, 1, dfx->holdback);
+      if (err)
+        goto leave;
+      thd->eof = 1;
+      err = gpg_error (GPG_ERR_EOF);
+    }
+
+ leave:
+  if (DBG_FILTER)
+    log_debug ("aead_underflow_thd: returning %zu (%s)\n",
+               totallen, gpg_strerror (err));
+
+  /* In case of an auth error we map the error code to the same as
+   * used by the MDC decryption.  */
+  if (gpg_err_code (err) == GPG_ERR_CHECKSUM)
+    err = gpg_error (GPG_ERR_BAD_SIGNATURE);
+
+  if (err && gpg_err_code (err) != GPG_ERR_EOF)
+    {
+      thd->err = err;
+      memset (buf, 0, size);
+      totallen = 0;
+    }
+
+  *ret_len = totallen;
+
+  return err;
+}
+
+
 /* The IOBUF filter used to decrypt AEAD encrypted data.  */
 static int
 aead_decode_filter (void *opaque, int control, IOBUF a,
@@ -889,7 +1392,15 @@ aead_decode_filter (void *opaque, int control, IOBUF a,
   decode_filter_ctx_t dfx = opaque;
   int rc = 0;
 
-  if ( control == IOBUFCTRL_UNDERFLOW && dfx->eof_seen )
+  if ( control == IOBUFCTRL_UNDERFLOW && dfx->thd )
+    {
+      log_assert (a);
+
+      rc = aead_underflow_thd (dfx, a, buf, ret_len);
+      if (gpg_err_code (rc) == GPG_ERR_EOF)
+        rc = -1; /* We need to use the old convention in the filter.  */
+    }
+  else if ( control == IOBUFCTRL_UNDERFLOW && dfx->eof_seen )
     {
       *ret_len = 0;
       rc = -1;
@@ -911,6 +1422,10 @@ aead_decode_filter (void *opaque, int control, IOBUF a,
     {
       mem2str (buf, "aead_decode_filter", *ret_len);
     }
+  else if ( control == IOBUFCTRL_BUFHINT )
+    {
+      *ret_len = IOBUF_BUFHINT_BULK;
+    }
 
   return rc;
 }
@@ -1003,6 +1518,10 @@ mdc_decode_filter (void *opaque, int control, IOBUF a,
     {
       mem2str (buf, "mdc_decode_filter", *ret_len);
     }
+  else if ( control == IOBUFCTRL_BUFHINT )
+    {
+      *ret_len = IOBUF_BUFHINT_BULK;
+    }
   return rc;
 }
 
@@ -1047,5 +1566,9 @@ decode_filter( void *opaque, int control, IOBUF a, byte *buf, size_t *ret_len)
     {
       mem2str (buf, "decode_filter", *ret_len);
     }
+  else if ( control == IOBUFCTRL_BUFHINT )
+    {
+      *ret_len = IOBUF_BUFHINT_BULK;
+    }
   return rc;
 }
@@ -329,6 +329,10 @@ do_delete_key (ctrl_t ctrl, const char *username, int secret, int force,
           if (opt.verbose)
             log_info (_("ownertrust information cleared\n"));
         }
+
+      /* A deleted introducer requires a full check next time.  */
+      if (!secret && pk && !opt.dry_run && thiskeyonly != 2)
+        revalidation_note_key (ctrl, pk);
     }
 
  leave:
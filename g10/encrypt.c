@@ -1269,6 +1269,10 @@ encrypt_filter (void *opaque, int control,
     {
       mem2str (buf, "encrypt_filter", *ret_len);
     }
+  else if ( control == IOBUFCTRL_BUFHINT )
+    {
+      *ret_len = IOBUF_BUFHINT_BULK;
+    }
   return rc;
 }
 
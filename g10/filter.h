@@ -23,14 +23,32 @@
 #include "../common/types.h"
 #include "dek.h"
 
+/* The maximum number of digest algorithms hashed in separate
+ * threads.  */
+#define MD_THD_MAX_ALGOS 8
+
 typedef struct {
     gcry_md_hd_t md;      /* catch all */
     gcry_md_hd_t md2;     /* if we want to calculate an alternate hash */
     size_t maxbuf_size;
+    /* If not empty, these per-algorithm contexts have been hashed
+     * instead of MD (see md_thd_split_md).  */
+    gcry_md_hd_t algo_md[MD_THD_MAX_ALGOS+1];
 } md_filter_context_t;
 
 typedef struct md_thd_filter_context *md_thd_filter_context_t;
 void md_thd_filter_set_md (md_thd_filter_context_t mfx, gcry_md_hd_t md);
+gpg_error_t md_thd_filter_use_md (md_thd_filter_context_t mfx,
+                                  gcry_md_hd_t md, gcry_md_hd_t *algo_md);
+void md_thd_split_md (gcry_md_hd_t md, gcry_md_hd_t *algo_md);
+void md_thd_close_algo_md (gcry_md_hd_t *algo_md);
+gcry_md_hd_t md_thd_select_md (gcry_md_hd_t md, gcry_md_hd_t *algo_md,
+                               int algo);
+gpg_error_t md_thd_open (md_thd_filter_context_t *r_mfx, gcry_md_hd_t md,
+                         gcry_md_hd_t *algo_md);
+gpg_error_t md_thd_write (md_thd_filter_context_t mfx,
+                          const void *buf, size_t len);
+void md_thd_close (md_thd_filter_context_t mfx);
 
 typedef struct {
     int  refcount;          /* Initialized to 1.  */
@@ -87,6 +105,7 @@ struct compress_filter_context_s {
     int algo1hack;
     int new_ctb;
     void (*release)(struct compress_filter_context_s*);
+    struct compress_thd_s *thd; /* Used with --compress-threads.  */
 };
 typedef struct compress_filter_context_s compress_filter_context_t;
 
@@ -137,6 +156,10 @@ typedef struct
   size_t bufsize;  /* Allocated length.  */
   size_t buflen;   /* Used length.       */
 
+  /* If not NULL the AEAD chunks are encrypted by a set of worker
+   * threads (option --aead-threads).  */
+  struct cipher_aead_thd_s *thd;
+
 } cipher_filter_context_t;
 
 
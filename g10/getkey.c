@@ -367,6 +367,82 @@ get_pubkey_for_sig (ctrl_t ctrl, PKT_public_key *pk, PKT_signature *sig,
 }
 
 
+/* Ask the keyboxd for the keys used to issue the signatures in
+ * KEYBLOCK with one request so that the following signature checks
+ * don't need a round trip for each issuer.  The descriptions are
+ * build the same way as in get_pubkey_for_sig.  Errors are ignored
+ * because the keys are then looked up individually.  */
+void
+prefetch_sig_issuers (ctrl_t ctrl, kbnode_t keyblock)
+{
+  KEYDB_SEARCH_DESC *desc = NULL;
+  size_t ndesc = 0;
+  size_t descsize = 0;
+  size_t i;
+  kbnode_t node;
+  PKT_signature *sig;
+  const byte *fpr;
+  size_t fprlen;
+  u32 mainkid[2];
+
+  if (!opt.use_keyboxd)
+    return;
+
+  node = find_kbnode (keyblock, PKT_PUBLIC_KEY);
+  if (!node)
+    return;
+  keyid_from_pk (node->pkt->pkt.public_key, mainkid);
+
+  for (node = keyblock; node; node = node->next)
+    {
+      if (node->pkt->pkttype != PKT_SIGNATURE)
+        continue;
+      sig = node->pkt->pkt.signature;
+      if (sig->keyid[0] == mainkid[0] && sig->keyid[1] == mainkid[1])
+        continue;  /* Self-signatures are checked using KEYBLOCK.  */
+
+      if (ndesc == descsize)
+        {
+          KEYDB_SEARCH_DESC *tmp;
+
+          tmp = xtryrealloc (desc, (descsize + 32) * sizeof *desc);
+          if (!tmp)
+            goto leave;
+          desc = tmp;
+          descsize += 32;
+        }
+      memset (desc + ndesc, 0, sizeof *desc);
+      fpr = issuer_fpr_raw (sig, &fprlen);
+      if (fpr && (fprlen == 32 || fprlen == 20 || fprlen == 16))
+        {
+          desc[ndesc].mode = KEYDB_SEARCH_MODE_FPR;
+          memcpy (desc[ndesc].u.fpr, fpr, fprlen);
+          desc[ndesc].fprlen = fprlen;
+        }
+      else
+        {
+          desc[ndesc].mode = KEYDB_SEARCH_MODE_LONG_KID;
+          desc[ndesc].u.kid[0] = sig->keyid[0];
+          desc[ndesc].u.kid[1] = sig->keyid[1];
+        }
+
+      for (i=0; i < ndesc; i++)
+        if (desc[i].mode == desc[ndesc].mode
+            && !memcmp (&desc[i].u, &desc[ndesc].u, sizeof desc[i].u)
+            && desc[i].fprlen == desc[ndesc].fprlen)
+          break;
+      if (i == ndesc)
+        ndesc++;
+    }
+
+  if (ndesc > 1)
+    keydb_prefetch (ctrl, desc, ndesc);
+
+ leave:
+  xfree (desc);
+}
+
+
 /* Return the public key with the key id KEYID and store it at PK.
  * The resources in *PK should be released using
  * release_public_key_parts().  This function also stores a copy of
@@ -3630,6 +3706,10 @@ merge_selfsigs (ctrl_t ctrl, kbnode_t keyblock)
       BUG ();
     }
 
+  /* Verify the self-signatures in advance so that the code below
+   * takes them from the cache.  */
+  check_self_sigs_parallel (ctrl, keyblock);
+
   merge_selfsigs_main (ctrl, keyblock, &revoked, &rinfo);
 
   /* Now merge in the data from each of the subkeys.  */
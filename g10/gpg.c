@@ -50,6 +50,7 @@
 #include "options.h"
 #include "keydb.h"
 #include "trustdb.h"
+#include "tdbio.h"
 #include "filter.h"
 #include "../common/ttyio.h"
 #include "../common/i18n.h"
@@ -62,6 +63,7 @@
 #include "call-dirmngr.h"
 #include "tofu.h"
 #include "objcache.h"
+#include "sigcache.h"
 #include "../common/init.h"
 #include "../common/mbox-util.h"
 #include "../common/zb32.h"
@@ -109,6 +111,13 @@ enum cmd_and_opt_values
     oMaxOutput,
     oInputSizeHint,
     oChunkSize,
+    oAEADThreads,
+    oMmapInput,
+    oMmapKeybox,
+    oMmapTrustDB,
+    oSearchThreads,
+    oPersistentSigCache,
+    oVerifyThreads,
     oSigNotation,
     oCertNotation,
     oShowNotation,
@@ -271,6 +280,7 @@ enum cmd_and_opt_values
     oCompressLevel,
     oBZ2CompressLevel,
     oBZ2DecompressLowmem,
+    oCompressThreads,
     oPassphrase,
     oPassphraseFD,
     oPassphraseFile,
@@ -733,6 +743,7 @@ static gpgrt_opt_t opts[] = {
   ARGPARSE_s_n (oNoAutoCheckTrustDB, "no-auto-check-trustdb", "@"),
   ARGPARSE_s_s (oForceOwnertrust, "force-ownertrust", "@"),
   ARGPARSE_s_n (oNoAutoTrustNewKey, "no-auto-trust-new-key", "@"),
+  ARGPARSE_s_n (oMmapTrustDB, "mmap-trustdb", "@"),
 #endif
   ARGPARSE_s_s (oAddDesigRevoker, "add-desig-revoker", "@"),
   ARGPARSE_s_s (oAssertSigner,    "assert-signer", "@"),
@@ -790,12 +801,19 @@ static gpgrt_opt_t opts[] = {
   ARGPARSE_s_n (oMangleDosFilenames,      "mangle-dos-filenames", "@"),
   ARGPARSE_s_n (oNoMangleDosFilenames, "no-mangle-dos-filenames", "@"),
   ARGPARSE_s_i (oChunkSize, "chunk-size", "@"),
+  ARGPARSE_s_i (oAEADThreads, "aead-threads", "@"),
+  ARGPARSE_s_n (oMmapInput, "mmap-input", "@"),
+  ARGPARSE_s_n (oMmapKeybox, "mmap-keybox", "@"),
+  ARGPARSE_s_i (oSearchThreads, "search-threads", "@"),
+  ARGPARSE_s_n (oPersistentSigCache, "persistent-sig-cache", "@"),
+  ARGPARSE_s_i (oVerifyThreads, "verify-threads", "@"),
   ARGPARSE_s_n (oNoSymkeyCache, "no-symkey-cache", "@"),
   ARGPARSE_s_n (oSkipVerify, "skip-verify", "@"),
   ARGPARSE_s_n (oListOnly, "list-only", "@"),
   ARGPARSE_s_i (oCompress, NULL,
                 N_("|N|set compress level to N (0 disables)")),
   ARGPARSE_s_i (oCompressLevel, "compress-level", "@"),
+  ARGPARSE_s_i (oCompressThreads, "compress-threads", "@"),
   ARGPARSE_s_i (oBZ2CompressLevel, "bzip2-compress-level", "@"),
   ARGPARSE_s_n (oDisableSignerUID, "disable-signer-uid", "@"),
 
@@ -2516,6 +2534,7 @@ main (int argc, char **argv)
     opt.import_options = (IMPORT_REPAIR_KEYS
                           | IMPORT_COLLAPSE_UIDS
                           | IMPORT_COLLAPSE_SUBKEYS);
+    opt.import_batch_size = DEFAULT_IMPORT_BATCH_SIZE;
     opt.export_options = EXPORT_ATTRIBUTES;
     opt.keyserver_options.import_options = (IMPORT_REPAIR_KEYS
 					    | IMPORT_REPAIR_PKS_SUBKEY_BUG
@@ -2829,6 +2848,30 @@ main (int argc, char **argv)
             opt.chunk_size = pargs.r.ret_int;
             break;
 
+          case oAEADThreads:
+            opt.aead_threads = pargs.r.ret_int;
+            break;
+
+          case oMmapInput:
+            iobuf_enable_mmap (1);
+            break;
+
+          case oMmapKeybox:
+            keybox_enable_mmap (1);
+            break;
+
+          case oSearchThreads:
+            opt.search_threads = pargs.r.ret_int;
+            break;
+
+          case oPersistentSigCache:
+            opt.flags.persistent_sig_cache = 1;
+            break;
+
+          case oVerifyThreads:
+            opt.verify_threads = pargs.r.ret_int;
+            break;
+
 	  case oQuiet: opt.quiet = 1; break;
 	  case oNoTTY: tty_no_terminal(1); break;
 	  case oDryRun: opt.dry_run = 1; break;
@@ -3024,6 +3067,7 @@ main (int argc, char **argv)
 
 #ifndef NO_TRUST_MODELS
 	  case oTrustDBName: trustdb_name = pargs.r.ret_str; break;
+	  case oMmapTrustDB: tdbio_enable_mmap (1); break;
 
 #endif /*!NO_TRUST_MODELS*/
 	  case oDefaultKey:
@@ -3324,6 +3368,7 @@ main (int argc, char **argv)
 	  case oCompressLevel: opt.compress_level = pargs.r.ret_int; break;
 	  case oBZ2CompressLevel: opt.bz2_compress_level = pargs.r.ret_int; break;
 	  case oBZ2DecompressLowmem: opt.bz2_decompress_lowmem=1; break;
+	  case oCompressThreads: opt.compress_threads = pargs.r.ret_int; break;
 	  case oPassphrase:
             set_passphrase_from_string (pargs.r_type ? pargs.r.ret_str : "");
 	    break;
@@ -4187,6 +4232,51 @@ main (int argc, char **argv)
         log_info (_("chunk size invalid - using %d\n"), opt.chunk_size);
       }
 
+    /* Check the number of AEAD threads.  Please fix also the man page
+     * if you change the limit.  */
+    if (opt.aead_threads < 0)
+      opt.aead_threads = 0;
+    else if (opt.aead_threads > 64)
+      {
+        opt.aead_threads = 64;
+        log_info ("number of AEAD threads too large - using %d\n",
+                  opt.aead_threads);
+      }
+
+    /* Check the number of keybox search threads.  Please fix also the
+     * man page if you change the limit.  */
+    if (opt.search_threads < 0)
+      opt.search_threads = 0;
+    else if (opt.search_threads > 64)
+      {
+        opt.search_threads = 64;
+        log_info ("number of search threads too large - using %d\n",
+                  opt.search_threads);
+      }
+    keybox_set_search_threads (opt.search_threads);
+
+    /* Check the number of signature verification threads.  Please fix
+     * also the man page if you change the limit.  */
+    if (opt.verify_threads < 0)
+      opt.verify_threads = 0;
+    else if (opt.verify_threads > 64)
+      {
+        opt.verify_threads = 64;
+        log_info ("number of verify threads too large - using %d\n",
+                  opt.verify_threads);
+      }
+
+    /* Check the number of compression threads.  Please fix also the
+     * man page if you change the limit.  */
+    if (opt.compress_threads < 0)
+      opt.compress_threads = 0;
+    else if (opt.compress_threads > 64)
+      {
+        opt.compress_threads = 64;
+        log_info ("number of compression threads too large - using %d\n",
+                  opt.compress_threads);
+      }
+
     /* We don't support all possible commands with multifile yet */
     if(multifile)
       {
@@ -5670,6 +5760,10 @@ g10_exit( int rc )
     write_status_failure ("gpg-exit", gpg_error (GPG_ERR_GENERAL));
 
   gcry_control (GCRYCTL_UPDATE_RANDOM_SEED_FILE);
+#ifndef NO_TRUST_MODELS
+  tdb_flush_wot_pending ();
+#endif
+  sigcache_flush ();
   if (DBG_CLOCK)
     log_clock ("stop");
 
@@ -5678,6 +5772,10 @@ g10_exit( int rc )
       keydb_dump_stats ();
       sig_check_dump_stats ();
       objcache_dump_stats ();
+      sigcache_dump_stats ();
+#ifndef NO_TRUST_MODELS
+      tdbio_dump_stats ();
+#endif
       gcry_control (GCRYCTL_DUMP_MEMORY_STATS);
       gcry_control (GCRYCTL_DUMP_RANDOM_STATS);
     }
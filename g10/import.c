@@ -164,6 +164,7 @@ cleanup_import_globals (void)
 int
 parse_import_options(char *str,unsigned int *options,int noisy)
 {
+  char *batch_size = NULL;
   struct parse_options import_opts[]=
     {
       {"import-local-sigs",IMPORT_LOCAL_SIGS,NULL,
@@ -178,7 +179,7 @@ parse_import_options(char *str,unsigned int *options,int noisy)
       {"fast-import",IMPORT_FAST,NULL,
        N_("do not update the trustdb after import")},
 
-      {"bulk-import",IMPORT_BULK, NULL,
+      {"bulk-import",IMPORT_BULK, &batch_size,
        N_("enable bulk import mode")},
 
       {"import-show",IMPORT_SHOW,NULL,
@@ -256,6 +257,18 @@ parse_import_options(char *str,unsigned int *options,int noisy)
   else
     *options |= saved_import_clean;
 
+  if (rc && batch_size)
+    {
+      if (!digitp (batch_size))
+        {
+          if (noisy)
+            log_info (_("invalid value for option '%s'\n"), "bulk-import");
+          rc = 0;
+        }
+      else
+        opt.import_batch_size = strtoul (batch_size, NULL, 10);
+    }
+
 
   if (rc && (*options & IMPORT_RESTORE))
     {
@@ -2297,7 +2310,7 @@ import_one_real (ctrl_t ctrl,
 
           clear_ownertrusts (ctrl, pk);
           if (non_self_or_utk)
-            revalidation_mark (ctrl);
+            revalidation_mark_key (ctrl, pk);
         }
 
       /* Release the handle and thus unlock the keyring asap.  */
@@ -2391,7 +2404,9 @@ import_one_real (ctrl_t ctrl,
             log_error (_("error writing keyring '%s': %s\n"),
                        keydb_get_resource_name (hd), gpg_strerror (err));
           else if (non_self_or_utk)
-            revalidation_mark (ctrl);
+            revalidation_mark_key (ctrl, pk);
+          else
+            revalidation_note_key (ctrl, pk);
 
           /* Release the handle and thus unlock the keyring asap.  */
           keydb_release (hd);
@@ -3776,7 +3791,7 @@ import_revoke_cert (ctrl_t ctrl, kbnode_t node, unsigned int options,
       if (get_ownertrust (ctrl, pk) == TRUST_ULTIMATE)
         clear_ownertrusts (ctrl, pk);
 
-      revalidation_mark (ctrl);
+      revalidation_mark_key (ctrl, pk);
     }
   stats->n_revoc++;
 
@@ -3818,6 +3833,8 @@ chk_self_sigs (ctrl_t ctrl, kbnode_t keyblock, u32 *keyid, int *non_self)
   int rc;
   kbnode_t n;
 
+  check_self_sigs_parallel (ctrl, keyblock);
+
   for (n=keyblock; (n = find_next_kbnode (n, 0)); )
     {
       if (n->pkt->pkttype == PKT_PUBLIC_SUBKEY)
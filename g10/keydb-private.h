@@ -101,6 +101,14 @@ struct keydb_handle_s
   int last_uid_no;
   int last_pk_no;
 
+  /* If the search is served from keyblocks fetched by keydb_prefetch
+   * this holds a reference to them, the index of the next item to
+   * look at and a copy of the search descriptions.  */
+  struct prefetch_cache_s *prefetch;
+  size_t prefetch_idx;
+  KEYDB_SEARCH_DESC *prefetch_desc;
+  size_t prefetch_ndesc;
+
   /* END USE_KEYBOXD */
 
   /* BEGIN !USE_KEYBOXD */
@@ -56,6 +56,16 @@ static void *primary_keydb;
 /* Whether we have successfully registered any resource.  */
 static int any_registered;
 
+/* The state of the key resources when the first handle was created;
+ * see keydb_get_resource_state.  */
+static byte initial_resource_state[32];
+static int initial_resource_state_saved;
+
+/* The state of the key resources after our last change and a flag
+ * telling whether we noticed a change by another process.  */
+static byte own_resource_state[32];
+static int resource_changed_by_others;
+
 /* Looking up keys is expensive.  To hide the cost, we cache whether
    keys exist in the key database.  Then, if we know a key does not
    exist, we don't have to spend time looking it up.  This
@@ -822,6 +832,162 @@ keydb_dump_stats (void)
 }
 
 
+/* Hash the size, inode and the modification and change times of the
+ * file FNAME into MD.  A missing file is also hashed.  Files may be
+ * rewritten in place within a second; thus the nanoseconds of the
+ * times are also hashed if available.  */
+void
+keydb_hash_file_state (gcry_md_hd_t md, const char *fname)
+{
+  struct stat st;
+  unsigned long long val[6];
+
+  if (gnupg_stat (fname, &st))
+    {
+      gcry_md_putc (md, 0);
+      return;
+    }
+  memset (val, 0, sizeof val);
+  val[0] = st.st_size;
+  val[1] = st.st_mtime;
+  val[2] = st.st_ino;
+  val[3] = st.st_ctime;
+#ifdef HAVE_STRUCT_STAT_ST_MTIM_TV_NSEC
+  val[4] = st.st_mtim.tv_nsec;
+  val[5] = st.st_ctim.tv_nsec;
+#endif
+  gcry_md_putc (md, 1);
+  gcry_md_write (md, val, sizeof val);
+}
+
+
+/* Store a SHA-256 hash over the state of all key resources at
+ * R_STATE.  */
+static void
+hash_resource_state (byte *r_state)
+{
+  gcry_md_hd_t md;
+  char *fname;
+  int idx;
+
+  if (gcry_md_open (&md, GCRY_MD_SHA256, 0))
+    log_fatal ("can't open hash context\n");
+
+  if (opt.use_keyboxd)
+    {
+      /* The database is used in WAL mode; thus we need to look at
+       * both files.  */
+      fname = make_filename (gnupg_homedir (), GNUPG_PUBLIC_KEYS_DIR,
+                             "pubring.db", NULL);
+      keydb_hash_file_state (md, fname);
+      xfree (fname);
+      fname = make_filename (gnupg_homedir (), GNUPG_PUBLIC_KEYS_DIR,
+                             "pubring.db-wal", NULL);
+      keydb_hash_file_state (md, fname);
+      xfree (fname);
+    }
+
+  for (idx=0; idx < used_resources; idx++)
+    {
+      const char *s = NULL;
+      KEYRING_HANDLE kr = NULL;
+      KEYBOX_HANDLE kb = NULL;
+
+      switch (all_resources[idx].type)
+        {
+        case KEYDB_RESOURCE_TYPE_NONE:
+          break;
+        case KEYDB_RESOURCE_TYPE_KEYRING:
+          kr = keyring_new (all_resources[idx].token);
+          s = kr? keyring_get_resource_name (kr) : NULL;
+          break;
+        case KEYDB_RESOURCE_TYPE_KEYBOX:
+          kb = keybox_new_openpgp (all_resources[idx].token, 0);
+          s = kb? keybox_get_resource_name (kb) : NULL;
+          break;
+        }
+      if (s)
+        keydb_hash_file_state (md, s);
+      keyring_release (kr);
+      keybox_release (kb);
+    }
+
+  memcpy (r_state, gcry_md_read (md, GCRY_MD_SHA256), 32);
+  gcry_md_close (md);
+}
+
+
+/* Remember the state of the key resources before the first change
+ * made by this process.  This is called when a handle is created.  */
+void
+keydb_save_resource_state (void)
+{
+  if (!initial_resource_state_saved)
+    {
+      hash_resource_state (initial_resource_state);
+      memcpy (own_resource_state, initial_resource_state, 32);
+      initial_resource_state_saved = 1;
+    }
+}
+
+
+/* Check that the key resources are still in the state we left them.
+ * This is called before we change the key database.  */
+void
+keydb_begin_resource_change (void)
+{
+  byte state[32];
+
+  keydb_save_resource_state ();
+  hash_resource_state (state);
+  if (memcmp (state, own_resource_state, 32))
+    resource_changed_by_others = 1;
+}
+
+
+/* Remember the state of the key resources after our own change.
+ * This is called after we changed the key database.  */
+void
+keydb_end_resource_change (void)
+{
+  keydb_save_resource_state ();
+  hash_resource_state (own_resource_state);
+}
+
+
+/* Return true if another process changed the key resources since
+ * this process created its first handle.  */
+int
+keydb_resource_changed_by_others (void)
+{
+  byte state[32];
+
+  if (resource_changed_by_others)
+    return 1;
+  keydb_save_resource_state ();
+  hash_resource_state (state);
+  return !!memcmp (state, own_resource_state, 32);
+}
+
+
+/* Store a hash over the size and modification time of all key
+ * resources at R_STATE, which must have space for 32 bytes.  If
+ * INITIAL is set, the state saved by keydb_save_resource_state is
+ * returned instead of the current state.  This is used to detect
+ * changes of the key database made by other processes.  */
+void
+keydb_get_resource_state (byte *r_state, int initial)
+{
+  if (initial)
+    {
+      keydb_save_resource_state ();
+      memcpy (r_state, initial_resource_state, 32);
+    }
+  else
+    hash_resource_state (r_state);
+}
+
+
 /* keydb_new diverts to here in non-keyboxd mode.  HD is just the
  * calloced structure with the handle type initialized.  */
 gpg_error_t
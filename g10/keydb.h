@@ -204,6 +204,13 @@ gpg_error_t keydb_search_reset (KEYDB_HANDLE hd);
 gpg_error_t keydb_search (KEYDB_HANDLE hd, KEYDB_SEARCH_DESC *desc,
                           size_t ndesc, size_t *descindex);
 
+/* Fetch the keyblocks for several search descriptions at once.  */
+gpg_error_t keydb_prefetch (ctrl_t ctrl, KEYDB_SEARCH_DESC *desc,
+                            size_t ndesc);
+
+/* Forget the keyblocks fetched by keydb_prefetch.  */
+void keydb_prefetch_done (void);
+
 
 
 /*-- keydb.c --*/
@@ -237,6 +244,22 @@ void keydb_pop_found_state (KEYDB_HANDLE hd);
 /* Return the file name of the resource.  */
 const char *keydb_get_resource_name (KEYDB_HANDLE hd);
 
+/* Hash the size, inode and times of FNAME into MD.  */
+void keydb_hash_file_state (gcry_md_hd_t md, const char *fname);
+
+/* Remember the state of the key resources.  */
+void keydb_save_resource_state (void);
+
+/* Return a hash over the state of the key resources.  */
+void keydb_get_resource_state (byte *r_state, int initial);
+
+/* Track our own changes of the key resources.  */
+void keydb_begin_resource_change (void);
+void keydb_end_resource_change (void);
+
+/* Return true if another process changed the key resources.  */
+int keydb_resource_changed_by_others (void);
+
 /* Find the first writable resource.  */
 gpg_error_t keydb_locate_writable (KEYDB_HANDLE hd);
 
@@ -335,6 +358,9 @@ gpg_error_t get_pubkey_for_sig (ctrl_t ctrl,
                                 PKT_public_key *forced_pk,
                                 kbnode_t *r_keyblock);
 
+/* Prefetch the keys used to issue the signatures in KEYBLOCK.  */
+void prefetch_sig_issuers (ctrl_t ctrl, kbnode_t keyblock);
+
 /* Return the public key with the key id KEYID and store it at PK.
  * Optionally return the entire keyblock.  */
 gpg_error_t get_pubkey_bykid (ctrl_t ctrl, PKT_public_key *pk,
@@ -2497,9 +2497,11 @@ keyedit_menu (ctrl_t ctrl, const char *username, strlist_t locusr,
 
 	  if (update_trust)
 	    {
-	      revalidation_mark (ctrl);
+	      revalidation_mark_key (ctrl, keyblock->pkt->pkt.public_key);
 	      update_trust = 0;
 	    }
+	  else if (modified)
+	    revalidation_note_key (ctrl, keyblock->pkt->pkt.public_key);
 	  goto leave;
 
 	case cmdINVCMD:
@@ -2691,7 +2693,7 @@ keyedit_quick_adduid (ctrl_t ctrl, const char *username, const char *newuid)
         }
       maybe_upload_key (ctrl, keyblock);
       if (update_trust)
-        revalidation_mark (ctrl);
+        revalidation_mark_key (ctrl, keyblock->pkt->pkt.public_key);
     }
 
  leave:
@@ -2825,7 +2827,7 @@ keyedit_quick_revuid (ctrl_t ctrl, const char *username, const char *uidtorev)
           goto leave;
         }
       maybe_upload_key (ctrl, keyblock);
-      revalidation_mark (ctrl);
+      revalidation_mark_key (ctrl, keyblock->pkt->pkt.public_key);
       goto leave;
     }
   err = gpg_error (GPG_ERR_NO_USER_ID);
@@ -2891,7 +2893,7 @@ keyedit_quick_set_primary (ctrl_t ctrl, const char *username,
           goto leave;
         }
       maybe_upload_key (ctrl, keyblock);
-      revalidation_mark (ctrl);
+      revalidation_mark_key (ctrl, keyblock->pkt->pkt.public_key);
     }
   else
     err = gpg_error (GPG_ERR_GENERAL);
@@ -3259,7 +3261,7 @@ keyedit_quick_sign (ctrl_t ctrl, const char *fpr, strlist_t uids,
     log_info (_("Key not changed so no update needed.\n"));
 
   if (update_trust)
-    revalidation_mark (ctrl);
+    revalidation_mark_key (ctrl, keyblock->pkt->pkt.public_key);
 
  leave:
   if (err)
@@ -3489,7 +3491,7 @@ keyedit_quick_revsig (ctrl_t ctrl, const char *username, const char *sigtorev,
       goto leave;
     }
   maybe_upload_key (ctrl, keyblock);
-  revalidation_mark (ctrl);
+  revalidation_mark_key (ctrl, keyblock->pkt->pkt.public_key);
 
  leave:
   if (err)
@@ -3789,7 +3791,7 @@ keyedit_quick_set_expire (ctrl_t ctrl, const char *fpr, const char *expirestr,
         }
       maybe_upload_key (ctrl, keyblock);
       if (update_trust)
-        revalidation_mark (ctrl);
+        revalidation_mark_key (ctrl, keyblock->pkt->pkt.public_key);
     }
   else
     log_info (_("Key not changed so no update needed.\n"));
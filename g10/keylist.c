@@ -977,6 +977,11 @@ list_one (ctrl_t ctrl, strlist_t names, int secret, int mark_secret)
       release_kbnode (keyblock);
     }
   while (!listerr && !getkey_next (ctrl, ctx, NULL, &keyblock));
+  if (keydb_get_skipped_counter (get_ctx_handle (ctx)))
+    log_info (ngettext("Warning: %lu key skipped due to its large size\n",
+                       "Warning: %lu keys skipped due to their large sizes\n",
+                       keydb_get_skipped_counter (get_ctx_handle (ctx))),
+              keydb_get_skipped_counter (get_ctx_handle (ctx)));
   getkey_end (ctrl, ctx);
 
   if (opt.check_sigs && !opt.with_colons)
@@ -2581,6 +2586,9 @@ list_keyblock (ctrl_t ctrl,
         return 0;  /* Skip this one.  */
     }
 
+  if (opt.check_sigs)
+    prefetch_sig_issuers (ctrl, keyblock);
+
   if (opt.with_colons)
     list_keyblock_colon (ctrl, keyblock, secret, has_secret);
   else if ((opt.list_options & LIST_SHOW_ONLY_FPR_MBOX))
@@ -2592,6 +2600,9 @@ list_keyblock (ctrl_t ctrl,
   else
     list_keyblock_print (ctrl, keyblock, secret, fpr, listctx);
 
+  if (opt.check_sigs)
+    keydb_prefetch_done ();
+
   if (es_ferror (es_stdout))
     err = gpg_error_from_syserror ();
 
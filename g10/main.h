@@ -303,6 +303,18 @@ gpg_error_t check_signature_over_key_or_uid (ctrl_t ctrl,
                                              int *is_selfsig,
                                              PKT_public_key *ret_pk);
 
+/* Verify the self-signatures of KEYBLOCKS and the key signatures
+   selected by FILTER using several threads and cache the results in
+   the signatures.  */
+void check_key_sigs_parallel (ctrl_t ctrl, kbnode_t *keyblocks,
+                              int nkeyblocks,
+                              int (*filter) (void *opaque,
+                                             PKT_signature *sig),
+                              void *opaque);
+/* Verify the self-signatures of KEYBLOCK using several threads and
+   cache the results in the signatures.  */
+void check_self_sigs_parallel (ctrl_t ctrl, kbnode_t keyblock);
+
 
 /*-- delkey.c --*/
 gpg_error_t delete_keys (ctrl_t ctrl,
@@ -519,9 +531,10 @@ gpg_error_t decrypt_message_fd (ctrl_t ctrl, gnupg_fd_t input_fd,
 void decrypt_messages (ctrl_t ctrl, int nfiles, char *files[]);
 
 /*-- plaintext.c --*/
-int hash_datafiles( gcry_md_hd_t md, gcry_md_hd_t md2,
+int hash_datafiles( gcry_md_hd_t md, gcry_md_hd_t md2, gcry_md_hd_t *algo_md,
 		    strlist_t files, const char *sigfilename, int textmode);
 int hash_datafile_by_fd (gcry_md_hd_t md, gcry_md_hd_t md2,
+                         gcry_md_hd_t *algo_md,
                          gnupg_fd_t data_fd, int textmode);
 PKT_plaintext *setup_plaintext_name(const char *filename,IOBUF iobuf);
 
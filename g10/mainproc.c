@@ -1225,7 +1225,8 @@ do_check_sig (CTX c, kbnode_t node, const void *extrahash, size_t extrahashlen,
     {
       if (c->mfx.md)
         {
-          if (gcry_md_copy (&md, c->mfx.md ))
+          if (gcry_md_copy (&md, md_thd_select_md (c->mfx.md,
+                                                   c->mfx.algo_md, algo)))
             BUG ();
         }
       else /* detached signature */
@@ -1241,7 +1242,8 @@ do_check_sig (CTX c, kbnode_t node, const void *extrahash, size_t extrahashlen,
          in canonical mode ??? (calculating both modes???) */
       if (c->mfx.md)
         {
-          if (gcry_md_copy (&md, c->mfx.md ))
+          if (gcry_md_copy (&md, md_thd_select_md (c->mfx.md,
+                                                   c->mfx.algo_md, algo)))
             BUG ();
           if (c->mfx.md2 && gcry_md_copy (&md2, c->mfx.md2))
             BUG ();
@@ -2742,11 +2744,11 @@ proc_tree (CTX c, kbnode_t node)
             {
               if (c->signed_data.used
                   && c->signed_data.data_fd != GNUPG_INVALID_FD)
-                rc = hash_datafile_by_fd (c->mfx.md, NULL,
+                rc = hash_datafile_by_fd (c->mfx.md, NULL, c->mfx.algo_md,
                                           c->signed_data.data_fd,
                                           use_textmode);
               else
-                rc = hash_datafiles (c->mfx.md, NULL,
+                rc = hash_datafiles (c->mfx.md, NULL, c->mfx.algo_md,
                                      c->signed_data.data_names,
                                      c->sigfilename,
                                      use_textmode);
@@ -2754,6 +2756,7 @@ proc_tree (CTX c, kbnode_t node)
           else
             {
               rc = ask_for_detached_datafile (c->mfx.md, NULL,
+                                              c->mfx.algo_md,
                                               iobuf_get_real_fname (c->iobuf),
                                               use_textmode);
 	    }
@@ -2890,10 +2893,12 @@ proc_tree (CTX c, kbnode_t node)
               if (c->signed_data.used
                   && c->signed_data.data_fd != GNUPG_INVALID_FD)
                 rc = hash_datafile_by_fd (c->mfx.md, c->mfx.md2,
+                                          c->mfx.algo_md,
                                           c->signed_data.data_fd,
                                           (sig->sig_class == 0x01));
               else
                 rc = hash_datafiles (c->mfx.md, c->mfx.md2,
+                                     c->mfx.algo_md,
                                      c->signed_data.data_names,
                                      c->sigfilename,
                                      (sig->sig_class == 0x01));
@@ -2901,6 +2906,7 @@ proc_tree (CTX c, kbnode_t node)
           else
             {
               rc = ask_for_detached_datafile (c->mfx.md, c->mfx.md2,
+                                              c->mfx.algo_md,
                                               iobuf_get_real_fname(c->iobuf),
                                               (sig->sig_class == 0x01));
 	    }
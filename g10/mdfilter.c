@@ -28,6 +28,8 @@
 #include "../common/status.h"
 #include "../common/iobuf.h"
 #include "../common/util.h"
+#include "../common/openpgpdefs.h"
+#include "options.h"
 #include "filter.h"
 
 
@@ -68,6 +70,7 @@ free_md_filter_context( md_filter_context_t *mfx )
 {
     gcry_md_close(mfx->md);
     gcry_md_close(mfx->md2);
+    md_thd_close_algo_md (mfx->algo_md);
     mfx->md = NULL;
     mfx->md2 = NULL;
     mfx->maxbuf_size = 0;
@@ -76,19 +79,34 @@ free_md_filter_context( md_filter_context_t *mfx )
 
 /****************
  * Threaded implementation for hashing.
+ *
+ * The data is passed in two alternating buffers to one or more hash
+ * threads.  Each thread has its own hash context; thus several
+ * digest algorithms can be computed on separate cores (see
+ * md_thd_filter_add_md).  A buffer is filled again only after all
+ * threads are done with it.
  */
 
-struct md_thd_filter_context {
+/* The maximum number of hash threads per filter.  */
+#define MD_THD_MAX_WORKERS MD_THD_MAX_ALGOS
+
+struct md_thd_worker_s {
+  struct md_thd_filter_context *mfx;
   gcry_md_hd_t md;
   npth_t thd;
-  /**/
+  unsigned long next_seq;  /* Sequence number of the next buffer.  */
+};
+
+struct md_thd_filter_context {
   npth_mutex_t mutex;
   npth_cond_t  cond;
   size_t bufsize;
-  unsigned int produce : 1;
-  unsigned int consume : 1;
-  ssize_t written0;
-  ssize_t written1;
+  unsigned int eof : 1;    /* The threads have been told to terminate.  */
+  unsigned long seq;       /* Number of buffers sent so far.  */
+  ssize_t written[2];      /* Length of the data in each buffer.  */
+  int pending[2];          /* Number of threads still hashing a buffer.  */
+  int nworkers;
+  struct md_thd_worker_s workers[MD_THD_MAX_WORKERS];
   unsigned char buf[1];
 };
 
@@ -113,15 +131,16 @@ unlock_md (struct md_thd_filter_context * mfx)
 }
 
 static int
-get_buffer_to_hash (struct md_thd_filter_context *mfx,
+get_buffer_to_hash (struct md_thd_worker_s *w,
                     unsigned char **r_buf, size_t *r_len)
 {
+  struct md_thd_filter_context *mfx = w->mfx;
+  int slot = (w->next_seq & 1);
   int rc = 0;
 
   lock_md (mfx);
 
-  if ((mfx->consume == 0 && mfx->written0 < 0)
-      || (mfx->consume != 0 && mfx->written1 < 0))
+  while (mfx->seq <= w->next_seq)
     {
       rc = npth_cond_wait (&mfx->cond, &mfx->mutex);
       if (rc)
@@ -131,16 +150,8 @@ get_buffer_to_hash (struct md_thd_filter_context *mfx,
         }
     }
 
-  if (mfx->consume == 0)
-    {
-      *r_buf = mfx->buf;
-      *r_len = mfx->written0;
-    }
-  else
-    {
-      *r_buf = mfx->buf + mfx->bufsize;
-      *r_len = mfx->written1;
-    }
+  *r_buf = mfx->buf + slot * mfx->bufsize;
+  *r_len = mfx->written[slot];
 
   unlock_md (mfx);
 
@@ -148,27 +159,22 @@ get_buffer_to_hash (struct md_thd_filter_context *mfx,
 }
 
 static int
-put_buffer_to_recv (struct md_thd_filter_context *mfx)
+put_buffer_to_recv (struct md_thd_worker_s *w)
 {
+  struct md_thd_filter_context *mfx = w->mfx;
+  int slot = (w->next_seq & 1);
   int rc = 0;
 
   lock_md (mfx);
-  if (mfx->consume == 0)
-    {
-      mfx->written0 = -1;
-      mfx->consume = 1;
-    }
-  else
-    {
-      mfx->written1 = -1;
-      mfx->consume = 0;
-    }
-
-  rc = npth_cond_signal (&mfx->cond);
-  if (rc)
+  w->next_seq++;
+  if (!--mfx->pending[slot])
     {
-      unlock_md (mfx);
-      return -1;
+      rc = npth_cond_broadcast (&mfx->cond);
+      if (rc)
+        {
+          unlock_md (mfx);
+          return -1;
+        }
     }
 
   unlock_md (mfx);
@@ -179,6 +185,8 @@ static int
 get_buffer_to_fill (struct md_thd_filter_context *mfx,
                     unsigned char **r_buf, size_t len)
 {
+  int slot;
+
   lock_md (mfx);
 
   if (len > mfx->bufsize)
@@ -187,8 +195,8 @@ get_buffer_to_fill (struct md_thd_filter_context *mfx,
       return GPG_ERR_BUFFER_TOO_SHORT;
     }
 
-  if ((mfx->produce == 0 && mfx->written0 >= 0)
-      || (mfx->produce != 0 && mfx->written1 >= 0))
+  slot = (mfx->seq & 1);
+  while (mfx->pending[slot])
     {
       int rc = npth_cond_wait (&mfx->cond, &mfx->mutex);
       if (rc)
@@ -198,10 +206,7 @@ get_buffer_to_fill (struct md_thd_filter_context *mfx,
         }
     }
 
-  if (mfx->produce == 0)
-    *r_buf = mfx->buf;
-  else
-    *r_buf = mfx->buf + mfx->bufsize;
+  *r_buf = mfx->buf + slot * mfx->bufsize;
   unlock_md (mfx);
   return 0;
 }
@@ -209,21 +214,16 @@ get_buffer_to_fill (struct md_thd_filter_context *mfx,
 static int
 put_buffer_to_send (struct md_thd_filter_context *mfx, size_t len)
 {
+  int slot;
   int rc;
 
   lock_md (mfx);
-  if (mfx->produce == 0)
-    {
-      mfx->written0 = len;
-      mfx->produce = 1;
-    }
-  else
-    {
-      mfx->written1 = len;
-      mfx->produce = 0;
-    }
+  slot = (mfx->seq & 1);
+  mfx->written[slot] = len;
+  mfx->pending[slot] = mfx->nworkers;
+  mfx->seq++;
 
-  rc = npth_cond_signal (&mfx->cond);
+  rc = npth_cond_broadcast (&mfx->cond);
   if (rc)
     {
       unlock_md (mfx);
@@ -241,25 +241,28 @@ put_buffer_to_send (struct md_thd_filter_context *mfx, size_t len)
 static void *
 md_thread (void *arg)
 {
-  struct md_thd_filter_context *mfx = arg;
+  struct md_thd_worker_s *w = arg;
 
   while (1)
     {
       unsigned char *buf;
       size_t len;
 
-      if (get_buffer_to_hash (mfx, &buf, &len) < 0)
+      if (get_buffer_to_hash (w, &buf, &len) < 0)
         /* Error  */
         return NULL;
 
       if (len == 0)
         break;
 
-      npth_unprotect ();
-      gcry_md_write (mfx->md, buf, len);
-      npth_protect ();
+      if (w->md)
+        {
+          npth_unprotect ();
+          gcry_md_write (w->md, buf, len);
+          npth_protect ();
+        }
 
-      if (put_buffer_to_recv (mfx) < 0)
+      if (put_buffer_to_recv (w) < 0)
         /* Error  */
         return NULL;
     }
@@ -267,6 +270,112 @@ md_thread (void *arg)
   return NULL;
 }
 
+
+/* Start another hash thread for MFX which hashes into MD.  */
+static gpg_error_t
+start_md_worker (struct md_thd_filter_context *mfx, gcry_md_hd_t md)
+{
+  struct md_thd_worker_s *w;
+  npth_attr_t tattr;
+  int rc;
+
+  if (mfx->nworkers >= MD_THD_MAX_WORKERS)
+    return gpg_error (GPG_ERR_TOO_MANY);
+
+  w = mfx->workers + mfx->nworkers;
+  w->mfx = mfx;
+  w->md = md;
+  w->next_seq = mfx->seq;
+
+  rc = npth_attr_init (&tattr);
+  if (rc)
+    return gpg_error_from_errno (rc);
+  npth_attr_setdetachstate (&tattr, NPTH_CREATE_JOINABLE);
+  rc = npth_create (&w->thd, &tattr, md_thread, w);
+  npth_attr_destroy (&tattr);
+  if (rc)
+    return gpg_error_from_errno (rc);
+
+  lock_md (mfx);
+  mfx->nworkers++;
+  unlock_md (mfx);
+  return 0;
+}
+
+
+/* Tell the threads of MFX to terminate and wait for them.  */
+static void
+join_md_threads (struct md_thd_filter_context *mfx)
+{
+  int i;
+
+  mfx->eof = 1;
+  for (i = 0; i < mfx->nworkers; i++)
+    npth_join (mfx->workers[i].thd, NULL);
+}
+
+
+/* Create a hashing context and start its first thread.  */
+static gpg_error_t
+start_md_thread (struct md_thd_filter_context **r_mfx)
+{
+  struct md_thd_filter_context *mfx;
+  gpg_error_t err;
+  size_t n;
+  int rc;
+
+  *r_mfx = NULL;
+  n = 2 * iobuf_set_buffer_size (0) * 1024;
+  mfx = xtrycalloc (1, n + offsetof (struct md_thd_filter_context, buf));
+  if (!mfx)
+    return gpg_error_from_syserror ();
+  mfx->bufsize = n / 2;
+
+  rc = npth_mutex_init (&mfx->mutex, NULL);
+  if (rc)
+    {
+      xfree (mfx);
+      return gpg_error_from_errno (rc);
+    }
+  rc = npth_cond_init (&mfx->cond, NULL);
+  if (rc)
+    {
+      npth_mutex_destroy (&mfx->mutex);
+      xfree (mfx);
+      return gpg_error_from_errno (rc);
+    }
+  err = start_md_worker (mfx, NULL);
+  if (err)
+    {
+      npth_cond_destroy (&mfx->cond);
+      npth_mutex_destroy (&mfx->mutex);
+      xfree (mfx);
+      return err;
+    }
+
+  *r_mfx = mfx;
+  return 0;
+}
+
+
+/* Wait until all data has been hashed and release MFX.  */
+static void
+stop_md_thread (struct md_thd_filter_context *mfx)
+{
+  unsigned char *md_buf;
+
+  if (!mfx)
+    return;
+
+  if (!mfx->eof && !get_buffer_to_fill (mfx, &md_buf, 0)
+      && !put_buffer_to_send (mfx, 0))
+    join_md_threads (mfx);
+  npth_cond_destroy (&mfx->cond);
+  npth_mutex_destroy (&mfx->mutex);
+  xfree (mfx);
+}
+
+
 int
 md_thd_filter (void *opaque, int control,
                IOBUF a, byte *buf, size_t *ret_len)
@@ -278,53 +387,52 @@ md_thd_filter (void *opaque, int control,
 
   if (control == IOBUFCTRL_INIT)
     {
-      npth_attr_t tattr;
-      size_t n;
-
-      n = 2 * iobuf_set_buffer_size (0) * 1024;
-      mfx = xtrymalloc (n + offsetof (struct md_thd_filter_context, buf));
-      if (!mfx)
-        return gpg_error_from_syserror ();
-      *r_mfx = mfx;
-      mfx->bufsize = n / 2;
-      mfx->consume = mfx->produce = 0;
-      mfx->written0 = -1;
-      mfx->written1 = -1;
-
-      rc = npth_mutex_init (&mfx->mutex, NULL);
-      if (rc)
-        {
-          return gpg_error_from_errno (rc);
-        }
-      rc = npth_cond_init (&mfx->cond, NULL);
+      rc = start_md_thread (r_mfx);
       if (rc)
-        {
-          npth_mutex_destroy (&mfx->mutex);
-          return gpg_error_from_errno (rc);
-        }
-      rc = npth_attr_init (&tattr);
+        return rc;
+
+      /* We can hand our buffers directly to the reader.  */
+      *ret_len = IOBUFCTRL_LEND;
+    }
+  else if (control == IOBUFCTRL_LEND)
+    {
+      int i;
+      unsigned char *md_buf = NULL;
+
+      /* Read into the buffer for the hash threads and lend that
+       * buffer to the reader.  The hash threads and the reader only
+       * read from it and the buffer is not filled again before the
+       * next but one call.  */
+      rc = get_buffer_to_fill (mfx, &md_buf, 0);
       if (rc)
-        {
-          npth_cond_destroy (&mfx->cond);
-          npth_mutex_destroy (&mfx->mutex);
-          return gpg_error_from_errno (rc);
-        }
-      npth_attr_setdetachstate (&tattr, NPTH_CREATE_JOINABLE);
-      rc = npth_create (&mfx->thd, &tattr, md_thread, mfx);
+        return rc;
+
+      if (size > mfx->bufsize)
+        size = mfx->bufsize;
+      i = iobuf_read (a, md_buf, size);
+      if (i == -1)
+        i = 0;
+
+      rc = put_buffer_to_send (mfx, i);
       if (rc)
+        return rc;
+
+      if (i == 0)
         {
-          npth_cond_destroy (&mfx->cond);
-          npth_mutex_destroy (&mfx->mutex);
-          npth_attr_destroy (&tattr);
-          return gpg_error_from_errno (rc);
+          join_md_threads (mfx);
+          rc = -1; /* eof */
         }
-      npth_attr_destroy (&tattr);
+
+      *(unsigned char **)buf = md_buf;
+      *ret_len = i;
     }
   else if (control == IOBUFCTRL_UNDERFLOW)
     {
       int i;
       unsigned char *md_buf = NULL;
 
+      if (size > mfx->bufsize)
+        size = mfx->bufsize;
       i = iobuf_read (a, buf, size);
       if (i == -1)
         i = 0;
@@ -342,7 +450,7 @@ md_thd_filter (void *opaque, int control,
 
       if (i == 0)
         {
-          npth_join (mfx->thd, NULL);
+          join_md_threads (mfx);
           rc = -1; /* eof */
         }
 
@@ -350,9 +458,7 @@ md_thd_filter (void *opaque, int control,
     }
   else if (control == IOBUFCTRL_FREE)
     {
-      npth_cond_destroy (&mfx->cond);
-      npth_mutex_destroy (&mfx->mutex);
-      xfree (mfx);
+      stop_md_thread (mfx);
       *r_mfx = NULL;
     }
   else if (control == IOBUFCTRL_DESC)
@@ -364,5 +470,158 @@ md_thd_filter (void *opaque, int control,
 void
 md_thd_filter_set_md (struct md_thd_filter_context *mfx, gcry_md_hd_t md)
 {
-  mfx->md = md;
+  mfx->workers[0].md = md;
+}
+
+
+/* Let the threads of MFX hash into MD or, if ALGO_MD is not NULL
+ * and not empty, into each context of ALGO_MD using a separate
+ * thread.  Must be called before any data is read.  */
+gpg_error_t
+md_thd_filter_use_md (md_thd_filter_context_t mfx, gcry_md_hd_t md,
+                      gcry_md_hd_t *algo_md)
+{
+  gpg_error_t err;
+  int i;
+
+  if (!algo_md || !algo_md[0])
+    {
+      md_thd_filter_set_md (mfx, md);
+      return 0;
+    }
+
+  md_thd_filter_set_md (mfx, algo_md[0]);
+  for (i = 1; algo_md[i]; i++)
+    {
+      err = start_md_worker (mfx, algo_md[i]);
+      if (err)
+        return err;
+    }
+  return 0;
+}
+
+
+/* Open a hash context for each digest algorithm enabled in MD and
+ * store them in the NULL terminated array ALGO_MD of size
+ * MD_THD_MAX_ALGOS+1.  Hashing into these contexts in separate
+ * threads computes several digest algorithms in parallel.  Nothing
+ * is done if ALGO_MD has already been set or if MD has only one
+ * algorithm enabled.  MD must not yet have been used because the
+ * data is from then on hashed only into ALGO_MD.  */
+void
+md_thd_split_md (gcry_md_hd_t md, gcry_md_hd_t *algo_md)
+{
+  static const int algos[] = {
+    DIGEST_ALGO_SHA256, DIGEST_ALGO_SHA384, DIGEST_ALGO_SHA512,
+    DIGEST_ALGO_SHA224, DIGEST_ALGO_SHA1, DIGEST_ALGO_RMD160,
+    DIGEST_ALGO_MD5
+  };
+  int i, n;
+
+  if (!md || algo_md[0])
+    return;
+
+  for (n = i = 0; i < DIM (algos); i++)
+    if (gcry_md_is_enabled (md, algos[i]))
+      n++;
+  if (n < 2 || n > MD_THD_MAX_ALGOS)
+    return;
+
+  for (n = i = 0; i < DIM (algos); i++)
+    if (gcry_md_is_enabled (md, algos[i]))
+      {
+        if (gcry_md_open (&algo_md[n], algos[i], 0))
+          BUG ();
+        if (DBG_HASHING)
+          gcry_md_debug (algo_md[n], "algo");
+        algo_md[++n] = NULL;
+      }
+}
+
+
+/* Release the hash contexts in ALGO_MD.  */
+void
+md_thd_close_algo_md (gcry_md_hd_t *algo_md)
+{
+  int i;
+
+  for (i = 0; algo_md[i]; i++)
+    {
+      gcry_md_close (algo_md[i]);
+      algo_md[i] = NULL;
+    }
+}
+
+
+/* Return the context holding the digest for ALGO.  This is the
+ * matching context from ALGO_MD or MD.  */
+gcry_md_hd_t
+md_thd_select_md (gcry_md_hd_t md, gcry_md_hd_t *algo_md, int algo)
+{
+  int i;
+
+  for (i = 0; algo_md && algo_md[i]; i++)
+    if (gcry_md_is_enabled (algo_md[i], algo))
+      return algo_md[i];
+  return md;
+}
+
+
+/* Start a thread to compute the hash MD over the data passed to
+ * md_thd_write.  This is the same as md_thd_filter but for callers
+ * which read the data themselves.  ALGO_MD is used as with
+ * md_thd_filter_use_md.  On success the new context is stored at
+ * R_MFX.  */
+gpg_error_t
+md_thd_open (md_thd_filter_context_t *r_mfx, gcry_md_hd_t md,
+             gcry_md_hd_t *algo_md)
+{
+  gpg_error_t err;
+
+  err = start_md_thread (r_mfx);
+  if (err)
+    return err;
+  err = md_thd_filter_use_md (*r_mfx, md, algo_md);
+  if (err)
+    {
+      stop_md_thread (*r_mfx);
+      *r_mfx = NULL;
+    }
+  return err;
+}
+
+
+/* Queue BUF of length LEN to be hashed by the threads of MFX.  The
+ * data is copied; thus the caller may re-use BUF right away.  */
+gpg_error_t
+md_thd_write (md_thd_filter_context_t mfx, const void *buf, size_t len)
+{
+  const unsigned char *p = buf;
+  unsigned char *md_buf;
+  size_t n;
+  int rc;
+
+  while (len)
+    {
+      n = len > mfx->bufsize? mfx->bufsize : len;
+      rc = get_buffer_to_fill (mfx, &md_buf, n);
+      if (rc)
+        return rc;
+      memcpy (md_buf, p, n);
+      rc = put_buffer_to_send (mfx, n);
+      if (rc)
+        return rc;
+      p += n;
+      len -= n;
+    }
+  return 0;
+}
+
+
+/* Wait until all data passed to md_thd_write has been hashed and
+ * release MFX.  Passing NULL is allowed.  */
+void
+md_thd_close (md_thd_filter_context_t mfx)
+{
+  stop_md_thread (mfx);
 }
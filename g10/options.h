@@ -82,6 +82,18 @@ struct
   /* The AEAD chunk size expressed as a power of 2.  */
   int chunk_size;
 
+  /* The number of threads used to encrypt or decrypt AEAD chunks.
+   * A value below 2 processes the chunks in the main thread.  */
+  int aead_threads;
+
+  /* The number of threads used to search a mapped keybox for user
+   * ids.  A value below 2 searches in the main thread.  */
+  int search_threads;
+
+  /* The number of threads used to verify the self-signatures of a
+   * key.  A value below 2 verifies them in the main thread.  */
+  int verify_threads;
+
   int dry_run;
   int autostart;
   int list_only;
@@ -123,6 +135,9 @@ struct
   int compress_level;
   int bz2_compress_level;
   int bz2_decompress_lowmem;
+  /* The number of threads used to deflate ZIP and ZLIB packets.  A
+   * value below 2 compresses in the main thread.  */
+  int compress_threads;
   strlist_t def_secret_key;
   char *def_recipient;
   int def_recipient_self;
@@ -200,6 +215,7 @@ struct
   int exec_disable;
   int exec_path_set;
   unsigned int import_options;
+  unsigned int import_batch_size;  /* Used with IMPORT_BULK.  */
   unsigned int export_options;
   unsigned int list_options;
   unsigned int verify_options;
@@ -282,6 +298,8 @@ struct
     unsigned int allow_old_cipher_algos:1;
     unsigned int allow_weak_digest_algos:1;
     unsigned int allow_weak_key_signatures:1;
+    /* Store good key signatures in a cache file.  */
+    unsigned int persistent_sig_cache:1;
     unsigned int large_rsa:1;
     unsigned int disable_signer_uid:1;
     unsigned int include_key_block:1;
@@ -418,6 +436,10 @@ EXTERN_UNLESS_MAIN_MODULE int memory_stat_debug_mode;
 #define PGP8    (opt.compliance==CO_PGP8)
 #define PGPX    (PGP7 || PGP8)
 
+/* The default number of keyblocks committed at once by keyboxd in
+ * bulk import mode (see IMPORT_BULK).  */
+#define DEFAULT_IMPORT_BATCH_SIZE 10000
+
 /* Various option flags.  Note that there should be no common string
    names between the IMPORT_ and EXPORT_ flags as they can be mixed in
    the keyserver-options option. */
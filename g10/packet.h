@@ -1001,6 +1001,7 @@ gpg_error_t get_output_file (const byte *embedded_name, int embedded_namelen,
 int handle_plaintext( PKT_plaintext *pt, md_filter_context_t *mfx,
 					int nooutput, int clearsig );
 int ask_for_detached_datafile( gcry_md_hd_t md, gcry_md_hd_t md2,
+                               gcry_md_hd_t *algo_md,
 			       const char *inname, int textmode );
 
 /*-- sign.c --*/
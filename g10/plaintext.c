@@ -189,6 +189,7 @@ handle_plaintext (PKT_plaintext * pt, md_filter_context_t * mfx,
   int err = 0;
   int c;
   int convert;
+  md_thd_filter_context_t mdthd = NULL;
 #ifdef __riscos__
   int filetype = 0xfff;
 #endif
@@ -294,6 +295,14 @@ handle_plaintext (PKT_plaintext * pt, md_filter_context_t * mfx,
 	      es_setbuf (fp, NULL);
 	    }
 
+	  if (mfx->md && (opt.compat_flags & COMPAT_PARALLELIZED))
+	    {
+	      md_thd_split_md (mfx->md, mfx->algo_md);
+	      err = md_thd_open (&mdthd, mfx->md, mfx->algo_md);
+	      if (err)
+		goto leave;
+	    }
+
 	  buffer = xmalloc (temp_size);
           if (!buffer)
             {
@@ -313,7 +322,16 @@ handle_plaintext (PKT_plaintext * pt, md_filter_context_t * mfx,
 		  xfree (buffer);
 		  goto leave;
 		}
-	      if (mfx->md)
+	      if (mdthd)
+		{
+		  err = md_thd_write (mdthd, buffer, len);
+		  if (err)
+		    {
+		      xfree (buffer);
+		      goto leave;
+		    }
+		}
+	      else if (mfx->md)
 		gcry_md_write (mfx->md, buffer, len);
 	      if (fp)
 		{
@@ -386,6 +404,14 @@ handle_plaintext (PKT_plaintext * pt, md_filter_context_t * mfx,
 	      es_setbuf (fp, NULL);
 	    }
 
+	  if (mfx->md && (opt.compat_flags & COMPAT_PARALLELIZED))
+	    {
+	      md_thd_split_md (mfx->md, mfx->algo_md);
+	      err = md_thd_open (&mdthd, mfx->md, mfx->algo_md);
+	      if (err)
+		goto leave;
+	    }
+
           buffer = xtrymalloc (temp_size);
           if (!buffer)
             {
@@ -406,7 +432,16 @@ handle_plaintext (PKT_plaintext * pt, md_filter_context_t * mfx,
 		break;
 	      if (len < temp_size)
 		eof_seen = 1;
-	      if (mfx->md)
+	      if (mdthd)
+		{
+		  err = md_thd_write (mdthd, buffer, len);
+		  if (err)
+		    {
+		      xfree (buffer);
+		      goto leave;
+		    }
+		}
+	      else if (mfx->md)
 		gcry_md_write (mfx->md, buffer, len);
 	      if (fp)
 		{
@@ -502,6 +537,9 @@ handle_plaintext (PKT_plaintext * pt, md_filter_context_t * mfx,
   fp = NULL;
 
  leave:
+  /* Wait for the hash thread to finish.  */
+  md_thd_close (mdthd);
+
   /* Make sure that stdout gets flushed after the plaintext has been
      handled.  This is for extra security as we do a flush anyway
      before checking the signature.  */
@@ -523,8 +561,13 @@ handle_plaintext (PKT_plaintext * pt, md_filter_context_t * mfx,
 }
 
 
+/* Hash the data from FP into MD and MD2.  With threaded hashing and
+ * if ALGO_MD is not NULL, the data may instead be hashed into one
+ * context per digest algorithm stored at ALGO_MD (see
+ * md_thd_split_md).  */
 static void
-do_hash (gcry_md_hd_t md, gcry_md_hd_t md2, IOBUF fp, int textmode)
+do_hash (gcry_md_hd_t md, gcry_md_hd_t md2, gcry_md_hd_t *algo_md,
+         IOBUF fp, int textmode)
 {
   text_filter_context_t tfx;
   int c;
@@ -560,6 +603,26 @@ do_hash (gcry_md_hd_t md, gcry_md_hd_t md2, IOBUF fp, int textmode)
 	  lc = c;
 	}
     }
+  else if (md && (opt.compat_flags & COMPAT_PARALLELIZED))
+    {
+      size_t temp_size = iobuf_set_buffer_size(0) * 1024;
+      md_thd_filter_context_t mfx = NULL;
+      gpg_error_t err;
+
+      /* Hash in a second thread while reading.  The filter lends
+       * its buffers to FP and thus we only need to skip the data.  */
+      if (algo_md)
+        md_thd_split_md (md, algo_md);
+      iobuf_push_filter (fp, md_thd_filter, &mfx);
+      err = md_thd_filter_use_md (mfx, md, algo_md);
+      if (err)
+        log_fatal ("error starting hash thread: %s\n", gpg_strerror (err));
+      while (iobuf_read (fp, NULL, temp_size) != -1)
+	;
+      /* The filter has been popped on EOF but not on a read error.  */
+      if (mfx)
+	iobuf_pop_filter (fp, md_thd_filter, &mfx);
+    }
   else
     {
       size_t temp_size = iobuf_set_buffer_size(0) * 1024;
@@ -583,6 +646,7 @@ do_hash (gcry_md_hd_t md, gcry_md_hd_t md2, IOBUF fp, int textmode)
  */
 int
 ask_for_detached_datafile (gcry_md_hd_t md, gcry_md_hd_t md2,
+                           gcry_md_hd_t *algo_md,
 			   const char *inname, int textmode)
 {
   progress_filter_context_t *pfx;
@@ -645,7 +709,7 @@ ask_for_detached_datafile (gcry_md_hd_t md, gcry_md_hd_t md2,
       fp = iobuf_open (NULL);
       log_assert (fp);
     }
-  do_hash (md, md2, fp, textmode);
+  do_hash (md, md2, algo_md, fp, textmode);
   iobuf_close (fp);
 
 leave:
@@ -657,10 +721,12 @@ leave:
 
 
 /* Hash the given files and append the hash to hash contexts MD and
- * MD2.  If FILES is NULL, stdin is hashed.  */
+ * MD2.  If FILES is NULL, stdin is hashed.  ALGO_MD is either NULL
+ * or receives the per-algorithm contexts used instead of MD (see
+ * do_hash).  */
 int
-hash_datafiles (gcry_md_hd_t md, gcry_md_hd_t md2, strlist_t files,
-		const char *sigfilename, int textmode)
+hash_datafiles (gcry_md_hd_t md, gcry_md_hd_t md2, gcry_md_hd_t *algo_md,
+                strlist_t files, const char *sigfilename, int textmode)
 {
   progress_filter_context_t *pfx;
   IOBUF fp;
@@ -680,7 +746,7 @@ hash_datafiles (gcry_md_hd_t md, gcry_md_hd_t md2, strlist_t files,
           fp = open_sigfile (sigfilename, pfx);
           if (fp)
             {
-              do_hash (md, md2, fp, textmode);
+              do_hash (md, md2, algo_md, fp, textmode);
               iobuf_close (fp);
               release_progress_context (pfx);
               return 0;
@@ -710,7 +776,7 @@ hash_datafiles (gcry_md_hd_t md, gcry_md_hd_t md2, strlist_t files,
 	  return rc;
 	}
       handle_progress (pfx, fp, sl->d);
-      do_hash (md, md2, fp, textmode);
+      do_hash (md, md2, algo_md, fp, textmode);
       iobuf_close (fp);
     }
 
@@ -720,9 +786,9 @@ hash_datafiles (gcry_md_hd_t md, gcry_md_hd_t md2, strlist_t files,
 
 
 /* Hash the data from file descriptor DATA_FD and append the hash to hash
-   contexts MD and MD2.  */
+   contexts MD and MD2.  ALGO_MD is used as with hash_datafiles.  */
 int
-hash_datafile_by_fd (gcry_md_hd_t md, gcry_md_hd_t md2,
+hash_datafile_by_fd (gcry_md_hd_t md, gcry_md_hd_t md2, gcry_md_hd_t *algo_md,
                      gnupg_fd_t data_fd, int textmode)
 {
   progress_filter_context_t *pfx = new_progress_context ();
@@ -747,7 +813,7 @@ hash_datafile_by_fd (gcry_md_hd_t md, gcry_md_hd_t md2,
 
   handle_progress (pfx, fp, NULL);
 
-  do_hash (md, md2, fp, textmode);
+  do_hash (md, md2, algo_md, fp, textmode);
 
   iobuf_close (fp);
 
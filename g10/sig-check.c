@@ -23,6 +23,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <npth.h>
 
 #include "gpg.h"
 #include "../common/util.h"
@@ -34,6 +35,7 @@
 #include "options.h"
 #include "pkglue.h"
 #include "../common/compliance.h"
+#include "sigcache.h"
 
 static int check_signature_end (PKT_public_key *pk, PKT_signature *sig,
 				gcry_md_hd_t digest,
@@ -67,6 +69,65 @@ sig_check_dump_stats (void)
 }
 
 
+/* A public key operation deferred by check_key_sigs_parallel.  */
+struct sig_batch_job_s
+{
+  PKT_public_key *pk;  /* A copy of the signer's key.  */
+  PKT_signature *sig;
+  gcry_mpi_t result;   /* The encoded digest.  */
+  int use_sigcache;
+  byte cachekey[SIGCACHE_KEYLEN];
+  int rc;              /* The result of pk_verify.  */
+};
+
+/* The public key operations collected for the worker threads.  */
+struct sig_batch_s
+{
+  int njobs;
+  int size;
+  struct sig_batch_job_s *jobs;
+  int next;  /* The next job to take.  This is only accessed while
+              * holding the global npth lock.  */
+};
+
+/* If set, check_signature_end_simple does not call pk_verify but
+ * adds the job to this batch.  */
+static struct sig_batch_s *sig_batch;
+
+
+/* Add a job to verify RESULT for SIG made by PK to BATCH.  The
+ * batch takes ownership of RESULT on success.  CACHEKEY is NULL or
+ * the key for the persistent cache.  */
+static gpg_error_t
+add_batch_job (struct sig_batch_s *batch, PKT_public_key *pk,
+               PKT_signature *sig, gcry_mpi_t result, const byte *cachekey)
+{
+  struct sig_batch_job_s *job;
+
+  if (batch->njobs == batch->size)
+    {
+      int newsize = batch->size? 2 * batch->size : 32;
+
+      job = xtryrealloc (batch->jobs, newsize * sizeof *batch->jobs);
+      if (!job)
+        return gpg_error_from_syserror ();
+      batch->jobs = job;
+      batch->size = newsize;
+    }
+  job = batch->jobs + batch->njobs++;
+  memset (job, 0, sizeof *job);
+  job->pk = copy_public_key_basics (NULL, pk);
+  job->sig = sig;
+  job->result = result;
+  if (cachekey)
+    {
+      job->use_sigcache = 1;
+      memcpy (job->cachekey, cachekey, SIGCACHE_KEYLEN);
+    }
+  return 0;
+}
+
+
 static gpg_error_t
 check_key_verify_compliance (PKT_public_key *pk)
 {
@@ -498,6 +559,8 @@ check_signature_end_simple (PKT_public_key *pk, PKT_signature *sig,
 {
   gcry_mpi_t result = NULL;
   int rc = 0;
+  int use_sigcache;
+  byte cachekey[SIGCACHE_KEYLEN];
 
   if (!opt.flags.allow_weak_digest_algos)
     {
@@ -618,18 +681,36 @@ check_signature_end_simple (PKT_public_key *pk, PKT_signature *sig,
     }
     gcry_md_final( digest );
 
-    /* Convert the digest to an MPI.  */
-    result = encode_md_value (pk, digest, sig->digest_algo );
-    if (!result)
+  /* Key signatures are verified again by each invocation of gpg; the
+   * persistent cache remembers the good ones.  */
+  use_sigcache = (sigcache_enabled ()
+                  && sig->sig_class >= 0x10 && sig->sig_class <= 0x30
+                  && !sigcache_make_key (pk, sig, digest, cachekey));
+  if (use_sigcache && sigcache_lookup (cachekey))
+    rc = 0;
+  else
+    {
+      /* Convert the digest to an MPI.  */
+      result = encode_md_value (pk, digest, sig->digest_algo );
+      if (!result)
         return GPG_ERR_GENERAL;
 
-    /* Verify the signature.  */
-    if (DBG_CLOCK && sig->sig_class <= 0x01)
-      log_clock ("enter pk_verify");
-    rc = pk_verify( pk->pubkey_algo, result, sig->data, pk->pkey );
-    if (DBG_CLOCK && sig->sig_class <= 0x01)
-      log_clock ("leave pk_verify");
-    gcry_mpi_release (result);
+      /* Let check_key_sigs_parallel run pk_verify later.  */
+      if (sig_batch
+          && !add_batch_job (sig_batch, pk, sig, result,
+                             use_sigcache? cachekey : NULL))
+        return gpg_error (GPG_ERR_TRUE);
+
+      /* Verify the signature.  */
+      if (DBG_CLOCK && sig->sig_class <= 0x01)
+        log_clock ("enter pk_verify");
+      rc = pk_verify( pk->pubkey_algo, result, sig->data, pk->pkey );
+      if (DBG_CLOCK && sig->sig_class <= 0x01)
+        log_clock ("leave pk_verify");
+      gcry_mpi_release (result);
+      if (!rc && use_sigcache)
+        sigcache_put (cachekey);
+    }
 
   if (!rc && sig->flags.unknown_critical)
     {
@@ -906,6 +987,7 @@ check_signature_over_key_or_uid (ctrl_t ctrl, PKT_public_key *signer,
   gcry_md_hd_t md;
   int signer_alloced = 0;
   int stub_is_selfsig;
+  struct sig_batch_s *batch;
 
   if (!is_selfsig)
     is_selfsig = &stub_is_selfsig;
@@ -1006,7 +1088,12 @@ check_signature_over_key_or_uid (ctrl_t ctrl, PKT_public_key *signer,
               if (IS_CERT (sig))
                 signer->req_usage = PUBKEY_USAGE_CERT;
 
+              /* The lookup may need to verify the signer's own key
+               * signatures right away.  */
+              batch = sig_batch;
+              sig_batch = NULL;
               rc = get_pubkey_for_sig (ctrl, signer, sig, NULL, NULL);
+              sig_batch = batch;
               if (rc)
                 {
                   if (signer_alloced != 1)
@@ -1286,3 +1373,174 @@ check_key_signature2 (ctrl_t ctrl,
 
   return rc;
 }
+
+
+/* The worker thread for check_key_sigs_parallel.  */
+static void *
+sig_batch_worker (void *arg)
+{
+  struct sig_batch_s *batch = arg;
+  struct sig_batch_job_s *job;
+
+  while (batch->next < batch->njobs)
+    {
+      job = batch->jobs + batch->next++;
+      npth_unprotect ();
+      job->rc = pk_verify (job->pk->pubkey_algo, job->result,
+                           job->sig->data, job->pk->pkey);
+      npth_protect ();
+    }
+  return NULL;
+}
+
+
+/* Collect the public key operations for the self-signatures of
+ * KEYBLOCK and those key signatures for which FILTER returns true
+ * into SIG_BATCH.  Signatures not needing a public key operation get
+ * their result cached right away.  */
+static void
+collect_key_sigs (ctrl_t ctrl, kbnode_t keyblock,
+                  int (*filter) (void *opaque, PKT_signature *sig),
+                  void *opaque)
+{
+  PKT_public_key *pk;
+  PKT_signature *sig;
+  kbnode_t node;
+  kbnode_t unode = NULL;
+  kbnode_t snode = NULL;
+  int rc;
+
+  if (keyblock->pkt->pkttype != PKT_PUBLIC_KEY)
+    return;
+  pk = keyblock->pkt->pkt.public_key;
+
+  for (node = keyblock->next; node; node = node->next)
+    {
+      if (node->pkt->pkttype == PKT_USER_ID)
+        unode = node;
+      else if (node->pkt->pkttype == PKT_PUBLIC_SUBKEY)
+        snode = node;
+      if (node->pkt->pkttype != PKT_SIGNATURE || is_deleted_kbnode (node))
+        continue;
+      sig = node->pkt->pkt.signature;
+      if (sig->flags.checked)
+        continue;
+
+      if (keyid_cmp (pk_keyid (pk), sig->keyid))
+        {
+          /* Only certifications are checked for other keys; the
+           * signer is looked up by check_signature_over_key_or_uid.  */
+          if ((IS_UID_SIG (sig) || IS_UID_REV (sig)) && unode
+              && filter && filter (opaque, sig))
+            rc = check_signature_over_key_or_uid (ctrl, NULL, sig, keyblock,
+                                                  unode->pkt, NULL, NULL);
+          else
+            continue;
+        }
+      else if (IS_KEY_SIG (sig) || IS_KEY_REV (sig))
+        rc = check_signature_over_key_or_uid (ctrl, pk, sig, keyblock,
+                                              keyblock->pkt, NULL, NULL);
+      else if ((IS_SUBKEY_SIG (sig) || IS_SUBKEY_REV (sig)) && snode)
+        rc = check_signature_over_key_or_uid (ctrl, pk, sig, keyblock,
+                                              snode->pkt, NULL, NULL);
+      else if ((IS_UID_SIG (sig) || IS_UID_REV (sig)) && unode)
+        rc = check_signature_over_key_or_uid (ctrl, pk, sig, keyblock,
+                                              unode->pkt, NULL, NULL);
+      else
+        continue;
+      if (gpg_err_code (rc) != GPG_ERR_TRUE)
+        cache_sig_result (sig, rc);
+    }
+}
+
+
+/* Verify the self-signatures of the NKEYBLOCKS keyblocks at
+ * KEYBLOCKS and those key signatures for which FILTER returns true
+ * using opt.verify_threads worker threads.  The results are stored
+ * in the signature cache flags.  The caller then walks the keyblocks
+ * as usual and check_key_signature takes the results from the cache.
+ * Only the public key operation runs in the workers; the hashing,
+ * the lookup of the signers and all other checks are done in the
+ * main thread.  */
+void
+check_key_sigs_parallel (ctrl_t ctrl, kbnode_t *keyblocks, int nkeyblocks,
+                         int (*filter) (void *opaque, PKT_signature *sig),
+                         void *opaque)
+{
+  struct sig_batch_s batch;
+  struct sig_batch_s *saved_batch;
+  npth_attr_t tattr;
+  npth_t *thds = NULL;
+  int nthreads = 0;
+  int i, rc;
+
+  if (opt.no_sig_cache || opt.verify_threads < 2)
+    return;
+
+  /* Hash the data of all signatures which are not yet in the cache
+   * and collect the public key operations.  */
+  memset (&batch, 0, sizeof batch);
+  saved_batch = sig_batch;
+  sig_batch = &batch;
+  for (i=0; i < nkeyblocks; i++)
+    collect_key_sigs (ctrl, keyblocks[i], filter, opaque);
+  sig_batch = saved_batch;
+
+  /* The main thread works as well.  */
+  if (batch.njobs > 1)
+    {
+      nthreads = opt.verify_threads < batch.njobs? opt.verify_threads - 1
+        /**/                                      : batch.njobs - 1;
+      thds = xtrycalloc (nthreads, sizeof *thds);
+      if (!thds || npth_attr_init (&tattr))
+        nthreads = 0;
+      else
+        {
+          npth_attr_setdetachstate (&tattr, NPTH_CREATE_JOINABLE);
+          for (i=0; i < nthreads; i++)
+            if (npth_create (&thds[i], &tattr, sig_batch_worker, &batch))
+              break;
+          nthreads = i;
+          npth_attr_destroy (&tattr);
+        }
+      if (DBG_LOOKUP)
+        log_debug ("verifying %d key signatures using %d threads\n",
+                   batch.njobs, nthreads + 1);
+    }
+
+  /* Take jobs in the main thread too and wait for the workers.  */
+  sig_batch_worker (&batch);
+  for (i=0; i < nthreads; i++)
+    npth_join (thds[i], NULL);
+  xfree (thds);
+
+  /* Finish the jobs like check_signature_end_simple.  */
+  for (i=0; i < batch.njobs; i++)
+    {
+      struct sig_batch_job_s *job = batch.jobs + i;
+
+      gcry_mpi_release (job->result);
+      rc = job->rc;
+      if (!rc && job->use_sigcache)
+        sigcache_put (job->cachekey);
+      if (!rc && job->sig->flags.unknown_critical)
+        {
+          log_info(_("assuming bad signature from key %s"
+                     " due to an unknown critical bit\n"),
+                   keystr_from_pk (job->pk));
+          rc = GPG_ERR_BAD_SIGNATURE;
+        }
+      cache_sig_result (job->sig, rc);
+      free_public_key (job->pk);
+    }
+  xfree (batch.jobs);
+}
+
+
+/* Verify the self-signatures of KEYBLOCK using several threads.  See
+ * check_key_sigs_parallel.  */
+void
+check_self_sigs_parallel (ctrl_t ctrl, kbnode_t keyblock)
+{
+  check_key_sigs_parallel (ctrl, &keyblock, 1, NULL, NULL);
+}
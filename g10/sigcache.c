@@ -0,0 +1,592 @@
+/* sigcache.c - Persistent cache of verified key signatures
+ * Copyright (C) 2026 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* The in-memory flags of a signature (sig->flags.checked and .valid)
+ * are lost at the end of a process and thus each invocation of gpg
+ * needs to verify all key signatures again.  This module keeps a file
+ * with the good key signatures in the home directory.
+ *
+ * An entry is the SHA-256 hash over everything which goes into the
+ * public key operation: The fingerprint of the signer, the algorithms,
+ * the final digest over the signed key, user id and signature data,
+ * and the signature values.  Thus an entry is only found for exactly
+ * the same signature over exactly the same data; a changed keyblock
+ * results in a different entry and no explicit invalidation is
+ * needed.  Checks which do not depend on the public key operation,
+ * like expiration and revocation, are done as usual.
+ *
+ * The file is written by replacing it with a new file while holding
+ * a lock.  Entries added meanwhile by other processes are merged.
+ * The file ends with an HMAC over its content.  The key for the HMAC
+ * is a random value stored in a second file which is created with
+ * mode 0600 and ignored if others may access it.  Thus a cache file
+ * can't be forged without access to that key; a corrupted or
+ * truncated file is also detected.
+ *
+ * File format:
+ *   8 bytes magic "GPGsigc" followed by the version 0x02
+ *   4 bytes number of entries N (big endian)
+ *   N * 32 bytes entries
+ *   32 bytes HMAC-SHA256 over all preceding bytes
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "gpg.h"
+#include "../common/util.h"
+#include "../common/host2net.h"
+#include "packet.h"
+#include "main.h"
+#include "keydb.h"
+#include "options.h"
+#include "sigcache.h"
+
+
+#define SIGCACHE_FILENAME "sigcache.bin"
+#define SIGCACHE_KEYFILENAME "sigcache.key"
+#define SIGCACHE_MAGIC "GPGsigc\x02"
+#define SIGCACHE_MAGICLEN 8
+#define SIGCACHE_HDRLEN (SIGCACHE_MAGICLEN + 4)
+#define SIGCACHE_MACLEN 32
+
+/* The maximum number of entries written to the file.  If there are
+ * more entries, those not used by this process are dropped.  */
+#define SIGCACHE_MAX_ITEMS 500000
+
+/* The states of a slot in the hash table.  */
+#define SLOT_EMPTY 0
+#define SLOT_OLD   1  /* Read from the file but not yet used.  */
+#define SLOT_USED  2  /* Used or added by this process.  */
+
+typedef struct
+{
+  byte key[SIGCACHE_KEYLEN];
+  byte state;
+} sigcache_item_t;
+
+/* The hash table with the entries using open addressing.
+ * TABLE_SIZE is a power of 2.  */
+static sigcache_item_t *table;
+static size_t table_size;
+static size_t table_count;
+
+/* True if the file has been read.  */
+static int cache_loaded;
+
+/* The key for the HMAC of the file; only valid if MAC_KEY_VALID is
+ * set.  */
+static byte mac_key[SIGCACHE_MACLEN];
+static int mac_key_valid;
+
+/* Number of entries added since the file has been read.  */
+static unsigned int cache_added;
+
+/* Statistics.  */
+static struct
+{
+  unsigned int hits;
+  unsigned int misses;
+  unsigned int added;
+} cache_stats;
+
+
+/* Return true if the persistent cache shall be used.  */
+int
+sigcache_enabled (void)
+{
+  return opt.flags.persistent_sig_cache && !opt.no_sig_cache;
+}
+
+
+/* Hash the MPI A into MD.  */
+static void
+hash_mpi (gcry_md_hd_t md, gcry_mpi_t a)
+{
+  byte lenbuf[4];
+  unsigned int nbits;
+  const void *p;
+  unsigned char *buf = NULL;
+  size_t n = 0;
+
+  if (!a)
+    p = NULL;
+  else if (gcry_mpi_get_flag (a, GCRYMPI_FLAG_OPAQUE))
+    {
+      p = gcry_mpi_get_opaque (a, &nbits);
+      n = (nbits + 7) / 8;
+    }
+  else if (!gcry_mpi_aprint (GCRYMPI_FMT_USG, &buf, &n, a))
+    p = buf;
+  else
+    p = NULL;
+  if (!p)
+    n = 0;
+
+  lenbuf[0] = n >> 24;
+  lenbuf[1] = n >> 16;
+  lenbuf[2] = n >> 8;
+  lenbuf[3] = n;
+  gcry_md_write (md, lenbuf, 4);
+  if (n)
+    gcry_md_write (md, p, n);
+  gcry_free (buf);
+}
+
+
+/* Compute the cache key for the signature SIG made by PK and store
+ * it at R_KEY which must have room for SIGCACHE_KEYLEN bytes.  DIGEST
+ * is the finalized hash context over the signed data.  Returns 0 on
+ * success.  */
+gpg_error_t
+sigcache_make_key (PKT_public_key *pk, PKT_signature *sig,
+                   gcry_md_hd_t digest, byte *r_key)
+{
+  gpg_error_t err;
+  gcry_md_hd_t md;
+  byte fpr[MAX_FINGERPRINT_LEN];
+  size_t fprlen;
+  const byte *dig;
+  byte buf[4];
+  int i, nsig;
+
+  dig = gcry_md_read (digest, sig->digest_algo);
+  nsig = pubkey_get_nsig (sig->pubkey_algo);
+  if (!dig || !nsig || pk->version < 4)
+    return gpg_error (GPG_ERR_NOT_SUPPORTED);
+  fingerprint_from_pk (pk, fpr, &fprlen);
+
+  err = gcry_md_open (&md, GCRY_MD_SHA256, 0);
+  if (err)
+    return err;
+  gcry_md_write (md, "GnuPG sigcache 1", 16);
+  buf[0] = fprlen;
+  gcry_md_write (md, buf, 1);
+  gcry_md_write (md, fpr, fprlen);
+  buf[0] = sig->pubkey_algo;
+  buf[1] = sig->digest_algo;
+  buf[2] = sig->sig_class;
+  buf[3] = gcry_md_get_algo_dlen (sig->digest_algo);
+  gcry_md_write (md, buf, 4);
+  gcry_md_write (md, dig, buf[3]);
+  for (i=0; i < nsig; i++)
+    hash_mpi (md, sig->data[i]);
+  memcpy (r_key, gcry_md_read (md, GCRY_MD_SHA256), SIGCACHE_KEYLEN);
+  gcry_md_close (md);
+  return 0;
+}
+
+
+/* Return the slot for KEY; this is either the slot with KEY or the
+ * empty slot where KEY would be inserted.  */
+static sigcache_item_t *
+find_slot (const byte *key)
+{
+  size_t idx, mask = table_size - 1;
+
+  /* The keys are hash values and thus we can use their first bytes
+   * as index.  */
+  for (idx = buf32_to_ulong (key) & mask;
+       table[idx].state != SLOT_EMPTY;
+       idx = (idx + 1) & mask)
+    if (!memcmp (table[idx].key, key, SIGCACHE_KEYLEN))
+      break;
+  return table + idx;
+}
+
+
+/* Insert KEY with STATE into the table unless it already exists.
+ * Returns true if KEY has been inserted.  */
+static int
+insert_item (const byte *key, byte state)
+{
+  sigcache_item_t *item;
+
+  if ((table_count + 1) * 2 > table_size)
+    {
+      sigcache_item_t *oldtable = table;
+      size_t oldsize = table_size;
+      size_t n;
+
+      table_size = oldsize? oldsize * 2 : 1024;
+      table = xtrycalloc (table_size, sizeof *table);
+      if (!table)
+        {
+          table = oldtable;
+          table_size = oldsize;
+          return 0;
+        }
+      for (n=0; n < oldsize; n++)
+        if (oldtable[n].state != SLOT_EMPTY)
+          *find_slot (oldtable[n].key) = oldtable[n];
+      xfree (oldtable);
+    }
+
+  item = find_slot (key);
+  if (item->state != SLOT_EMPTY)
+    return 0;
+  memcpy (item->key, key, SIGCACHE_KEYLEN);
+  item->state = state;
+  table_count++;
+  return 1;
+}
+
+
+/* Return true if the file FP named FNAME is owned by us and can't be
+ * accessed by others.  */
+static int
+private_file_p (estream_t fp, const char *fname)
+{
+#ifndef HAVE_W32_SYSTEM
+  struct stat st;
+
+  if (fstat (es_fileno (fp), &st))
+    {
+      log_info ("can't stat '%s': %s\n",
+                fname, gpg_strerror (gpg_error_from_syserror ()));
+      return 0;
+    }
+  if (st.st_uid != getuid () || (st.st_mode & (S_IRWXG|S_IRWXO)))
+    {
+      log_info ("WARNING: unsafe permissions on '%s' - ignored\n", fname);
+      return 0;
+    }
+#else
+  (void)fp;
+  (void)fname;
+#endif
+  return 1;
+}
+
+
+/* Load the HMAC key into MAC_KEY.  If it does not exist and CREATE is
+ * set a new key is created; this must only be done while holding the
+ * lock for the cache file.  Returns true if the key is available.  */
+static int
+load_mac_key (int create)
+{
+  gpg_error_t err;
+  char *fname, *tmpfname = NULL;
+  estream_t fp;
+
+  if (mac_key_valid)
+    return 1;
+
+  fname = make_filename (gnupg_homedir (), SIGCACHE_KEYFILENAME, NULL);
+  fp = es_fopen (fname, "rb");
+  if (fp)
+    {
+      if (private_file_p (fp, fname)
+          && es_fread (mac_key, sizeof mac_key, 1, fp) == 1
+          && es_getc (fp) == EOF)
+        mac_key_valid = 1;
+      es_fclose (fp);
+    }
+  else if (errno != ENOENT)
+    log_info ("can't open '%s': %s\n",
+              fname, gpg_strerror (gpg_error_from_syserror ()));
+  else if (create)
+    {
+      gcry_randomize (mac_key, sizeof mac_key, GCRY_STRONG_RANDOM);
+      tmpfname = xstrconcat (fname, ".tmp", NULL);
+      fp = es_fopen (tmpfname, "wb,mode=-rw");
+      if (!fp)
+        {
+          err = gpg_error_from_syserror ();
+          log_info ("can't create '%s': %s\n", tmpfname, gpg_strerror (err));
+        }
+      else if (es_fwrite (mac_key, sizeof mac_key, 1, fp) != 1
+               || es_fclose (fp))
+        {
+          err = gpg_error_from_syserror ();
+          log_info ("error writing '%s': %s\n", tmpfname, gpg_strerror (err));
+          es_fclose (fp);
+          gnupg_remove (tmpfname);
+        }
+      else if ((err = gnupg_rename_file (tmpfname, fname, NULL)))
+        log_info ("renaming '%s' failed: %s\n", tmpfname, gpg_strerror (err));
+      else
+        mac_key_valid = 1;
+    }
+
+  xfree (tmpfname);
+  xfree (fname);
+  return mac_key_valid;
+}
+
+
+/* Return a new HMAC context keyed with MAC_KEY at R_MD.  */
+static gpg_error_t
+open_mac (gcry_md_hd_t *r_md)
+{
+  gpg_error_t err;
+
+  err = gcry_md_open (r_md, GCRY_MD_SHA256, GCRY_MD_FLAG_HMAC);
+  if (!err)
+    {
+      err = gcry_md_setkey (*r_md, mac_key, sizeof mac_key);
+      if (err)
+        {
+          gcry_md_close (*r_md);
+          *r_md = NULL;
+        }
+    }
+  return err;
+}
+
+
+/* Read the entries from the cache file FNAME into the table.  */
+static void
+read_cache_file (const char *fname)
+{
+  estream_t fp;
+  gcry_md_hd_t md;
+  byte *buffer = NULL;
+  byte hdr[SIGCACHE_HDRLEN];
+  size_t count, n;
+  int okay;
+
+  if (!load_mac_key (0))
+    return;  /* Without the key there can't be a valid file.  */
+
+  fp = es_fopen (fname, "rb");
+  if (!fp)
+    {
+      if (errno != ENOENT)
+        log_info ("can't open '%s': %s\n",
+                  fname, gpg_strerror (gpg_error_from_syserror ()));
+      return;
+    }
+
+  if (es_fread (hdr, sizeof hdr, 1, fp) != 1
+      || memcmp (hdr, SIGCACHE_MAGIC, SIGCACHE_MAGICLEN))
+    goto invalid;
+  count = buf32_to_ulong (hdr + SIGCACHE_MAGICLEN);
+  if (count > SIGCACHE_MAX_ITEMS)
+    goto invalid;
+  n = SIGCACHE_HDRLEN + count * SIGCACHE_KEYLEN;
+  buffer = xtrymalloc (n + SIGCACHE_MACLEN);
+  if (!buffer)
+    {
+      log_error ("error reading '%s': %s\n",
+                 fname, gpg_strerror (gpg_error_from_syserror ()));
+      goto leave;
+    }
+  memcpy (buffer, hdr, sizeof hdr);
+  if (es_fread (buffer + sizeof hdr, n - sizeof hdr + SIGCACHE_MACLEN,
+                1, fp) != 1
+      || es_getc (fp) != EOF)
+    goto invalid;
+  if (open_mac (&md))
+    goto invalid;
+  gcry_md_write (md, buffer, n);
+  okay = !memcmp (gcry_md_read (md, GCRY_MD_SHA256), buffer + n,
+                  SIGCACHE_MACLEN);
+  gcry_md_close (md);
+  if (!okay)
+    goto invalid;
+
+  for (n=0; n < count; n++)
+    insert_item (buffer + SIGCACHE_HDRLEN + n * SIGCACHE_KEYLEN, SLOT_OLD);
+  if (opt.verbose > 1)
+    log_info ("read %zu entries from '%s'\n", count, fname);
+  goto leave;
+
+ invalid:
+  log_info ("signature cache '%s' is invalid - ignored\n", fname);
+ leave:
+  xfree (buffer);
+  es_fclose (fp);
+}
+
+
+static void
+load_cache (void)
+{
+  char *fname;
+
+  if (cache_loaded)
+    return;
+  cache_loaded = 1;
+  fname = make_filename (gnupg_homedir (), SIGCACHE_FILENAME, NULL);
+  read_cache_file (fname);
+  xfree (fname);
+}
+
+
+/* Return true if KEY is in the cache.  */
+int
+sigcache_lookup (const byte *key)
+{
+  sigcache_item_t *item;
+
+  load_cache ();
+  if (table_size && (item = find_slot (key))->state != SLOT_EMPTY)
+    {
+      item->state = SLOT_USED;
+      cache_stats.hits++;
+      return 1;
+    }
+  cache_stats.misses++;
+  return 0;
+}
+
+
+/* Store KEY of a good signature in the cache.  */
+void
+sigcache_put (const byte *key)
+{
+  load_cache ();
+  if (table_count >= 2 * SIGCACHE_MAX_ITEMS)
+    return;
+  if (insert_item (key, SLOT_USED))
+    {
+      cache_added++;
+      cache_stats.added++;
+    }
+}
+
+
+/* Write the items with STATE to FP and update MD.  Stop after
+ * *R_LEFT items and decrement *R_LEFT.  */
+static int
+write_items (estream_t fp, gcry_md_hd_t md, byte state, size_t *r_left)
+{
+  size_t n;
+
+  for (n=0; n < table_size && *r_left; n++)
+    if (table[n].state == state)
+      {
+        if (es_fwrite (table[n].key, SIGCACHE_KEYLEN, 1, fp) != 1)
+          return -1;
+        gcry_md_write (md, table[n].key, SIGCACHE_KEYLEN);
+        --*r_left;
+      }
+  return 0;
+}
+
+
+/* Write the cache file if entries have been added.  This is called
+ * at the end of the process.  */
+void
+sigcache_flush (void)
+{
+  gpg_error_t err;
+  char *fname;
+  char *tmpfname = NULL;
+  dotlock_t lockhd = NULL;
+  estream_t fp = NULL;
+  gcry_md_hd_t md = NULL;
+  byte hdr[SIGCACHE_HDRLEN];
+  size_t count, left;
+
+  if (!cache_added || opt.dry_run)
+    return;
+  cache_added = 0;
+
+  fname = make_filename (gnupg_homedir (), SIGCACHE_FILENAME, NULL);
+  lockhd = dotlock_create (fname, 0);
+  if (!lockhd || dotlock_take (lockhd, -1))
+    {
+      err = gpg_error_from_syserror ();
+      log_info ("can't lock '%s': %s\n", fname, gpg_strerror (err));
+      goto leave;
+    }
+
+  if (!load_mac_key (1))
+    goto leave;
+
+  /* Merge the entries written by other processes meanwhile.  */
+  read_cache_file (fname);
+
+  count = table_count < SIGCACHE_MAX_ITEMS? table_count : SIGCACHE_MAX_ITEMS;
+  tmpfname = xstrconcat (fname, ".tmp", NULL);
+  fp = es_fopen (tmpfname, "wb,mode=-rw");
+  if (!fp)
+    {
+      err = gpg_error_from_syserror ();
+      log_info ("can't create '%s': %s\n", tmpfname, gpg_strerror (err));
+      goto leave;
+    }
+  err = open_mac (&md);
+  if (err)
+    goto leave;
+  memcpy (hdr, SIGCACHE_MAGIC, SIGCACHE_MAGICLEN);
+  hdr[SIGCACHE_MAGICLEN]   = count >> 24;
+  hdr[SIGCACHE_MAGICLEN+1] = count >> 16;
+  hdr[SIGCACHE_MAGICLEN+2] = count >> 8;
+  hdr[SIGCACHE_MAGICLEN+3] = count;
+  gcry_md_write (md, hdr, sizeof hdr);
+  left = count;
+  if (es_fwrite (hdr, sizeof hdr, 1, fp) != 1
+      || write_items (fp, md, SLOT_USED, &left)
+      || write_items (fp, md, SLOT_OLD, &left)
+      || es_fwrite (gcry_md_read (md, GCRY_MD_SHA256),
+                    SIGCACHE_MACLEN, 1, fp) != 1)
+    {
+      err = gpg_error_from_syserror ();
+      log_info ("error writing '%s': %s\n", tmpfname, gpg_strerror (err));
+      goto leave;
+    }
+  if (es_fclose (fp))
+    {
+      fp = NULL;
+      err = gpg_error_from_syserror ();
+      log_info ("error writing '%s': %s\n", tmpfname, gpg_strerror (err));
+      goto leave;
+    }
+  fp = NULL;
+  err = gnupg_rename_file (tmpfname, fname, NULL);
+  if (err)
+    log_info ("renaming '%s' failed: %s\n", tmpfname, gpg_strerror (err));
+  else if (opt.verbose > 1)
+    log_info ("wrote %zu entries to '%s'\n", count, fname);
+
+ leave:
+  if (fp)
+    {
+      es_fclose (fp);
+      gnupg_remove (tmpfname);
+    }
+  gcry_md_close (md);
+  if (lockhd)
+    {
+      dotlock_release (lockhd);
+      dotlock_destroy (lockhd);
+    }
+  xfree (tmpfname);
+  xfree (fname);
+}
+
+
+void
+sigcache_dump_stats (void)
+{
+  if (sigcache_enabled ())
+    log_info ("sigcache: entries=%zu hits=%u misses=%u added=%u\n",
+              table_count, cache_stats.hits, cache_stats.misses,
+              cache_stats.added);
+}
@@ -936,14 +936,33 @@ write_plaintext_packet (iobuf_t out, iobuf_t inp,
 }
 
 
+/* Push the hash thread filter onto INP.  The data is hashed into MD
+ * or, if ALGO_MD is not empty, into each context of ALGO_MD using a
+ * separate thread.  */
+static void
+push_md_thd_filter (iobuf_t inp, md_thd_filter_context_t *r_mfx,
+                    gcry_md_hd_t md, gcry_md_hd_t *algo_md)
+{
+  gpg_error_t err;
+
+  iobuf_push_filter (inp, md_thd_filter, r_mfx);
+  err = md_thd_filter_use_md (*r_mfx, md, algo_md);
+  if (err)
+    log_fatal ("error starting hash thread: %s\n", gpg_strerror (err));
+}
+
+
 /*
  * Write the signatures from the SK_LIST to OUT. HASH must be a
- * non-finalized hash which will not be changes here.  EXTRAHASH is
- * either NULL or the extra data to be hashed into v5 signatures.
+ * non-finalized hash which will not be changes here.  If ALGO_MD is
+ * not NULL and not empty, the contexts from ALGO_MD (see
+ * md_thd_split_md) are used instead of HASH.  EXTRAHASH is either NULL
+ * or the extra data to be hashed into v5 signatures.
  */
 static int
 write_signature_packets (ctrl_t ctrl,
                          SK_LIST sk_list, IOBUF out, gcry_md_hd_t hash,
+                         gcry_md_hd_t *algo_md,
                          pt_extra_hash_data_t extrahash,
                          int sigclass, u32 timestamp, u32 duration,
 			 int status_letter, const char *cache_nonce)
@@ -982,7 +1001,8 @@ write_signature_packets (ctrl_t ctrl,
         sig->expiredate = sig->timestamp + duration;
       sig->sig_class = sigclass;
 
-      if (gcry_md_copy (&md, hash))
+      if (gcry_md_copy (&md, md_thd_select_md (hash, algo_md,
+                                               sig->digest_algo)))
         BUG ();
 
       build_sig_subpkt_from_sig (sig, pk, 0);
@@ -1054,6 +1074,7 @@ sign_file (ctrl_t ctrl, strlist_t filenames, int detached, strlist_t locusr,
   armor_filter_context_t *afx;
   compress_filter_context_t zfx;
   gcry_md_hd_t md = NULL;
+  gcry_md_hd_t algo_md[MD_THD_MAX_ALGOS+1] = { NULL };
   md_filter_context_t mfx;
   md_thd_filter_context_t mfx2 = NULL;
   text_filter_context_t tfx;
@@ -1262,14 +1283,13 @@ sign_file (ctrl_t ctrl, strlist_t filenames, int detached, strlist_t locusr,
 
   for (sk_rover = sk_list; sk_rover; sk_rover = sk_rover->next)
     gcry_md_enable (md, hash_for (sk_rover->pk));
+  if (opt.compat_flags & COMPAT_PARALLELIZED)
+    md_thd_split_md (md, algo_md);
 
   if (!multifile)
     {
-      if (encryptflag && (opt.compat_flags & COMPAT_PARALLELIZED))
-        {
-          iobuf_push_filter (inp, md_thd_filter, &mfx2);
-          md_thd_filter_set_md (mfx2, md);
-        }
+      if (opt.compat_flags & COMPAT_PARALLELIZED)
+        push_md_thd_filter (inp, &mfx2, md, algo_md);
       else
         {
           iobuf_push_filter (inp, md_filter, &mfx);
@@ -1378,11 +1398,8 @@ sign_file (ctrl_t ctrl, strlist_t filenames, int detached, strlist_t locusr,
                   memset (&tfx, 0, sizeof tfx);
                   iobuf_push_filter (inp, text_filter, &tfx);
                 }
-              if (encryptflag && (opt.compat_flags & COMPAT_PARALLELIZED))
-                {
-                  iobuf_push_filter (inp, md_thd_filter, &mfx2);
-                  md_thd_filter_set_md (mfx2, md);
-                }
+              if (opt.compat_flags & COMPAT_PARALLELIZED)
+                push_md_thd_filter (inp, &mfx2, md, algo_md);
               else
                 {
                   iobuf_push_filter (inp, md_filter, &mfx);
@@ -1416,7 +1433,7 @@ sign_file (ctrl_t ctrl, strlist_t filenames, int detached, strlist_t locusr,
     goto leave;
 
   /* Write the signatures. */
-  rc = write_signature_packets (ctrl, sk_list, out, md, extrahash,
+  rc = write_signature_packets (ctrl, sk_list, out, md, algo_md, extrahash,
                                 opt.textmode && !outfile? 0x01 : 0x00,
                                 0, duration, detached ? 'D':'S', NULL);
   if (rc)
@@ -1434,6 +1451,7 @@ sign_file (ctrl_t ctrl, strlist_t filenames, int detached, strlist_t locusr,
     }
   iobuf_close (inp);
   gcry_md_close (md);
+  md_thd_close_algo_md (algo_md);
   release_sk_list (sk_list);
   release_pk_list (pk_list);
   recipient_digest_algo = 0;
@@ -1585,7 +1603,7 @@ clearsign_file (ctrl_t ctrl,
     }
 
   /* Write the signatures.  */
-  rc = write_signature_packets (ctrl, sk_list, out, textmd, extrahash,
+  rc = write_signature_packets (ctrl, sk_list, out, textmd, NULL, extrahash,
                                 0x01, 0, duration, 'C', NULL);
   if (rc)
     goto leave;
@@ -1618,6 +1636,7 @@ sign_symencrypt_file (ctrl_t ctrl, const char *fname, strlist_t locusr)
   md_filter_context_t mfx;
   md_thd_filter_context_t mfx2 = NULL;
   gcry_md_hd_t md = NULL;
+  gcry_md_hd_t algo_md[MD_THD_MAX_ALGOS+1] = { NULL };
   text_filter_context_t tfx;
   cipher_filter_context_t cfx;
   iobuf_t inp = NULL;
@@ -1711,8 +1730,8 @@ sign_symencrypt_file (ctrl_t ctrl, const char *fname, strlist_t locusr)
 
   if ((opt.compat_flags & COMPAT_PARALLELIZED))
     {
-      iobuf_push_filter (inp, md_thd_filter, &mfx2);
-      md_thd_filter_set_md (mfx2, md);
+      md_thd_split_md (md, algo_md);
+      push_md_thd_filter (inp, &mfx2, md, algo_md);
     }
   else
     {
@@ -1784,7 +1803,7 @@ sign_symencrypt_file (ctrl_t ctrl, const char *fname, strlist_t locusr)
 
   /* Write the signatures.  */
   /* (current filters: zip - encrypt - armor) */
-  rc = write_signature_packets (ctrl, sk_list, out, md, extrahash,
+  rc = write_signature_packets (ctrl, sk_list, out, md, algo_md, extrahash,
                                 opt.textmode? 0x01 : 0x00,
                                 0, duration, 'S', NULL);
   if (rc)
@@ -1802,6 +1821,7 @@ sign_symencrypt_file (ctrl_t ctrl, const char *fname, strlist_t locusr)
   iobuf_close (inp);
   release_sk_list (sk_list);
   gcry_md_close (md);
+  md_thd_close_algo_md (algo_md);
   xfree (cfx.dek);
   xfree (s2k);
   release_progress_context (pfx);
@@ -0,0 +1,331 @@
+/* t-tdbio.c - Tests for the record cache of tdbio.c.
+ * Copyright (C) 2026 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "test.c"
+
+/* The cache functions are static; thus we include the module.  */
+#include "tdbio.c"
+
+#define DBNAME "t-tdbio.db"
+
+/* Number of records in the test file.  This is more than fits into
+ * the cache so that records are evicted.  */
+#define NRECORDS (2 * MAX_CACHE_ENTRIES)
+
+/* A copy of what the file should contain.  */
+static char (*shadow)[TRUST_RECORD_LEN];
+
+
+/* Stubs for functions of trustdb.c and tdbdump.c.  */
+void
+how_to_fix_the_trustdb (void)
+{
+}
+
+void
+list_trustdb (ctrl_t ctrl, estream_t fp, const char *username)
+{
+  (void)ctrl;
+  (void)fp;
+  (void)username;
+}
+
+
+/* Create the test file with NRECORDS zeroed records and open it.  */
+static void
+create_db (void)
+{
+  char buf[TRUST_RECORD_LEN];
+  FILE *fp;
+  int i;
+
+  fp = fopen (DBNAME, "wb");
+  if (!fp)
+    ABORT ("can't create " DBNAME);
+  memset (buf, 0, sizeof buf);
+  for (i = 0; i < NRECORDS; i++)
+    if (fwrite (buf, sizeof buf, 1, fp) != 1)
+      ABORT ("error writing " DBNAME);
+  if (fclose (fp))
+    ABORT ("error writing " DBNAME);
+
+  db_name = xstrdup (DBNAME);
+  db_fd = open (DBNAME, O_RDWR | MY_O_BINARY);
+  if (db_fd == -1)
+    ABORT ("can't open " DBNAME);
+  /* The dotlock stubs don't need a real handle.  */
+  lockhandle = (dotlock_t)&lockhandle;
+  save_db_file_state ();
+}
+
+
+/* Close the test file and reset the cache.  */
+static void
+close_db (void)
+{
+  CACHE_CTRL r;
+
+  while ((r = cache_newest))
+    remove_cache_item (r);
+#ifdef USE_MMAP
+  if (db_map)
+    munmap (db_map, db_map_len);
+#endif
+  db_map = NULL;
+  db_map_len = 0;
+  close (db_fd);
+  db_fd = -1;
+  xfree (db_name);
+  db_name = NULL;
+  db_file_state.valid = 0;
+  remove (DBNAME);
+}
+
+
+/* Read the record RECNO into BUF the same way tdbio_read_record
+ * does.  */
+static int
+read_raw_record (ulong recno, char *buf)
+{
+  const char *p;
+
+  p = get_record_from_cache (recno);
+  if (!p && (p = get_record_from_map (recno)))
+    {
+      if (put_record_into_cache (recno, p, 0))
+        return -1;
+    }
+  else if (!p)
+    {
+      if (lseek (db_fd, recno * TRUST_RECORD_LEN, SEEK_SET) == -1
+          || read (db_fd, buf, TRUST_RECORD_LEN) != TRUST_RECORD_LEN)
+        return -1;
+      return put_record_into_cache (recno, buf, 0)? -1 : 0;
+    }
+  memcpy (buf, p, TRUST_RECORD_LEN);
+  return 0;
+}
+
+
+/* Write BUF to the file at record RECNO as another process would
+ * do.  If APPEND is set also append a record so that the size of the
+ * file changes.  */
+static void
+write_behind_cache (ulong recno, const char *buf, int append)
+{
+  char tmp[TRUST_RECORD_LEN];
+
+  memset (tmp, 0, sizeof tmp);
+  if (lseek (db_fd, recno * TRUST_RECORD_LEN, SEEK_SET) == -1
+      || write (db_fd, buf, TRUST_RECORD_LEN) != TRUST_RECORD_LEN)
+    ABORT ("error writing " DBNAME);
+  if (append
+      && (lseek (db_fd, 0, SEEK_END) == -1
+          || write (db_fd, tmp, TRUST_RECORD_LEN) != TRUST_RECORD_LEN))
+    ABORT ("error writing " DBNAME);
+}
+
+
+/* Do random reads and writes and compare the records with a shadow
+ * copy.  */
+static void
+test_random_access (int use_mmap)
+{
+  char buf[TRUST_RECORD_LEN];
+  ulong recno;
+  int i, bad;
+
+  create_db ();
+  tdbio_use_mmap = use_mmap;
+  memset (shadow, 0, NRECORDS * sizeof *shadow);
+
+  srand (1);
+  bad = 0;
+  for (i = 0; i < 2 * NRECORDS; i++)
+    {
+      recno = rand () % NRECORDS;
+      if (!(rand () % 3))
+        {
+          memset (shadow[recno], rand () & 0xff, TRUST_RECORD_LEN);
+          if (put_record_into_cache (recno, shadow[recno], 1))
+            ABORT ("error writing record");
+        }
+      else if (read_raw_record (recno, buf))
+        ABORT ("error reading record");
+      else if (memcmp (buf, shadow[recno], TRUST_RECORD_LEN))
+        bad++;
+    }
+  TEST ("cached records", bad, 0);
+  TEST_P ("evictions", cache_stats.evictions > 0);
+
+  TEST ("sync", tdbio_sync (), 0);
+  TEST ("dirty records after sync", cache_dirty_entries, 0);
+  bad = 0;
+  for (recno = 0; recno < NRECORDS; recno++)
+    if (lseek (db_fd, recno * TRUST_RECORD_LEN, SEEK_SET) == -1
+        || read (db_fd, buf, TRUST_RECORD_LEN) != TRUST_RECORD_LEN
+        || memcmp (buf, shadow[recno], TRUST_RECORD_LEN))
+      bad++;
+  TEST ("records in the file", bad, 0);
+
+  close_db ();
+  tdbio_use_mmap = 0;
+}
+
+
+/* Check that records changed by another process are not taken from
+ * the cache once we take the lock.  */
+static void
+test_lock_invalidates (void)
+{
+  char buf[TRUST_RECORD_LEN], newbuf[TRUST_RECORD_LEN];
+
+  create_db ();
+
+  if (read_raw_record (5, buf))
+    ABORT ("error reading record");
+  memset (newbuf, 0x42, sizeof newbuf);
+  write_behind_cache (5, newbuf, 1);
+
+  take_write_lock ();
+  release_write_lock ();
+  if (read_raw_record (5, buf))
+    ABORT ("error reading record");
+  TEST ("record changed by another process",
+        memcmp (buf, newbuf, TRUST_RECORD_LEN), 0);
+
+  close_db ();
+}
+
+
+#ifdef HAVE_STRUCT_STAT_ST_MTIM_TV_NSEC
+/* Check that a record rewritten in place within the same second is
+ * not taken from the cache.  */
+static void
+test_rewrite_in_place (void)
+{
+  char buf[TRUST_RECORD_LEN], newbuf[TRUST_RECORD_LEN];
+
+  create_db ();
+
+  if (read_raw_record (7, buf))
+    ABORT ("error reading record");
+  /* Wait for the next clock tick of the file system.  */
+  gnupg_usleep (20000);
+  memset (newbuf, 0x43, sizeof newbuf);
+  write_behind_cache (7, newbuf, 0);
+
+  take_write_lock ();
+  release_write_lock ();
+  if (read_raw_record (7, buf))
+    ABORT ("error reading record");
+  TEST ("record rewritten in place",
+        memcmp (buf, newbuf, TRUST_RECORD_LEN), 0);
+
+  close_db ();
+}
+#endif /*HAVE_STRUCT_STAT_ST_MTIM_TV_NSEC*/
+
+
+/* Check that the version record is read again if another process
+ * changed the file.  */
+static void
+test_version_record (void)
+{
+  TRUSTREC rec;
+  char buf[TRUST_RECORD_LEN];
+
+  create_db ();
+
+  memset (&rec, 0, sizeof rec);
+  rec.rectype = RECTYPE_VER;
+  rec.recnum = 0;
+  rec.r.ver.version = 3;
+  rec.r.ver.nextcheck = 1;
+  if (tdbio_write_record (NULL, &rec) || tdbio_sync ())
+    ABORT ("error writing version record");
+  TEST ("nextcheck", tdbio_read_nextcheck (), 1);
+
+  if (lseek (db_fd, 0, SEEK_SET) == -1
+      || read (db_fd, buf, TRUST_RECORD_LEN) != TRUST_RECORD_LEN)
+    ABORT ("error reading version record");
+  ulongtobuf (buf + 16, 4711);
+  write_behind_cache (0, buf, 1);
+  TEST ("nextcheck changed by another process",
+        tdbio_read_nextcheck (), 4711);
+
+  close_db ();
+}
+
+
+/* Check that appending records does not drop the cache.  */
+static void
+test_append (void)
+{
+  TRUSTREC rec;
+  unsigned int invalidations;
+  ulong recnum;
+  int i;
+
+  create_db ();
+
+  memset (&rec, 0, sizeof rec);
+  rec.rectype = RECTYPE_VER;
+  rec.recnum = 0;
+  rec.r.ver.version = 3;
+  if (tdbio_write_record (NULL, &rec) || tdbio_sync ())
+    ABORT ("error writing version record");
+
+  invalidations = cache_stats.invalidations;
+  for (i = 0; i < 10; i++)
+    {
+      recnum = tdbio_new_recnum (NULL);
+      TEST ("appended record", recnum, NRECORDS + i);
+    }
+  TEST ("invalidations while appending",
+        cache_stats.invalidations - invalidations, 0);
+
+  close_db ();
+}
+
+
+static void
+do_test (int argc, char *argv[])
+{
+  (void)argc;
+  (void)argv;
+
+  shadow = xcalloc (NRECORDS, sizeof *shadow);
+
+  TEST_GROUP ("random access");
+  test_random_access (0);
+  TEST_GROUP ("random access with mapping");
+  test_random_access (1);
+  TEST_GROUP ("changes by other processes");
+  test_lock_invalidates ();
+#ifdef HAVE_STRUCT_STAT_ST_MTIM_TV_NSEC
+  test_rewrite_in_place ();
+#endif
+  test_version_record ();
+  TEST_GROUP ("appending records");
+  test_append ();
+
+  xfree (shadow);
+}
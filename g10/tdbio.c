@@ -27,6 +27,10 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#if defined(HAVE_MMAP) && !defined(HAVE_W32_SYSTEM)
+# include <sys/mman.h>
+# define USE_MMAP 1
+#endif
 
 #include "gpg.h"
 #include "../common/status.h"
@@ -50,33 +54,67 @@
 
 
 /*
- * Yes, this is a very simple implementation. We should really
- * use a page aligned buffer and read complete pages.
- * To implement a simple trannsaction system, this is sufficient.
+ * The record cache.  Cached records are found by a hash table over
+ * the record number and are kept in a list ordered by their last
+ * use, so that the least recently used record is evicted if the
+ * cache is full.  Modified records are written back in batches,
+ * either when a modified record is evicted or by tdbio_sync.  The
+ * records read from the file are dropped if another process changed
+ * the file; this is checked when we take the lock and when the
+ * version record is read.
  */
 typedef struct cache_ctrl_struct *CACHE_CTRL;
 struct cache_ctrl_struct
 {
-  CACHE_CTRL next;
+  CACHE_CTRL next;   /* Next item in the same hash bucket.  */
+  CACHE_CTRL newer;  /* Next more recently used item.  */
+  CACHE_CTRL older;  /* Next less recently used item.  */
   struct {
-    unsigned used:1;
     unsigned dirty:1;
   } flags;
   ulong recno;
   char data[TRUST_RECORD_LEN];
 };
 
-/* Size of the cache.  The SOFT value is the general one.  While in a
-   transaction this may not be sufficient and thus we may increase it
-   then up to the HARD limit.  */
-#define MAX_CACHE_ENTRIES_SOFT	200
-#define MAX_CACHE_ENTRIES_HARD	10000
+/* The memory used for cached records is limited to this number of
+   bytes.  While in a transaction this may not be sufficient and thus
+   we may then use up to twice the memory.  */
+#define CACHE_MEMORY_LIMIT (4*1024*1024)
+#define MAX_CACHE_ENTRIES \
+  (CACHE_MEMORY_LIMIT / sizeof (struct cache_ctrl_struct))
+
+/* The number of hash buckets; this must be a power of 2.  Records are
+   mostly allocated in sequence and thus the low bits of the record
+   number are used as hash value.  */
+#define CACHE_HASH_SIZE 8192
+
+/* The maximum number of records written back at once if a modified
+   record needs to be evicted.  */
+#define CACHE_WRITEBACK_BATCH 64
 
 
 /* The cache is controlled by these variables.  */
-static CACHE_CTRL cache_list;
-static int cache_entries;
-static int cache_is_dirty;
+static CACHE_CTRL *cache_table;  /* The hash buckets.  */
+static CACHE_CTRL cache_newest;  /* The most recently used item.  */
+static CACHE_CTRL cache_oldest;  /* The least recently used item.  */
+static CACHE_CTRL cache_unused;  /* List of items for reuse.  */
+static unsigned int cache_entries;
+static unsigned int cache_dirty_entries;
+
+/* Statistics for the record cache.  */
+static struct
+{
+  unsigned int hits;
+  unsigned int misses;
+  unsigned int mapped_reads;
+  unsigned int evictions;
+  unsigned int invalidations;
+  unsigned int writebacks;
+  unsigned int syncs;
+  unsigned int written_records;
+  unsigned int write_calls;
+  unsigned int peak;
+} cache_stats;
 
 
 /* An object to pass information to cmp_krec_fpr. */
@@ -107,6 +145,30 @@ static unsigned int is_locked;
 /* The file descriptor of the trustdb.  */
 static int  db_fd = -1;
 
+/* Whether the trustdb may be mapped into memory and the current
+ * mapping of the trustdb.  */
+static int tdbio_use_mmap;
+static char *db_map;
+static size_t db_map_len;
+
+/* The size, inode and times of the trustdb file as last seen by this
+ * process.  Records are rewritten in place; thus the times are also
+ * compared with sub-second resolution if available.  */
+static struct
+{
+  int valid;
+  off_t size;
+  ino_t ino;
+  time_t mtime;
+  time_t ctime;
+  long mtime_nsec;
+  long ctime_nsec;
+} db_file_state;
+
+/* Set if we noticed a change of the trustdb file by another
+ * process.  */
+static int db_changed_by_others;
+
 /* A flag indicating that a transaction is active.  */
 /* static int in_transaction;   Not yet used. */
 
@@ -114,6 +176,7 @@ static int  db_fd = -1;
 
 static void open_db (void);
 static void create_hashtable (ctrl_t ctrl, TRUSTREC *vr, int type);
+static void check_db_file_state (void);
 
 
 
@@ -140,6 +203,7 @@ take_write_lock (void)
     {
       if (dotlock_take (lockhandle, -1) )
         log_fatal ( _("can't lock '%s'\n"), db_name );
+      check_db_file_state ();
       rc = 0;
     }
   else
@@ -181,6 +245,75 @@ release_write_lock (void)
  ************* record cache **********
  *************************************/
 
+/*
+ * Return the cache item for RECNO or NULL if it is not cached.
+ */
+static CACHE_CTRL
+lookup_cache_item (ulong recno)
+{
+  CACHE_CTRL r;
+
+  if (!cache_table)
+    return NULL;
+  for (r = cache_table[recno & (CACHE_HASH_SIZE - 1)]; r; r = r->next)
+    if (r->recno == recno)
+      return r;
+  return NULL;
+}
+
+
+/* Remove R from the LRU list.  */
+static void
+unlink_cache_item (CACHE_CTRL r)
+{
+  if (r->newer)
+    r->newer->older = r->older;
+  else
+    cache_newest = r->older;
+  if (r->older)
+    r->older->newer = r->newer;
+  else
+    cache_oldest = r->newer;
+  r->newer = r->older = NULL;
+}
+
+
+/* Mark R as the most recently used item.  */
+static void
+touch_cache_item (CACHE_CTRL r)
+{
+  if (r == cache_newest)
+    return;
+  if (r->newer || r->older || cache_oldest == r)
+    unlink_cache_item (r);
+  r->older = cache_newest;
+  if (cache_newest)
+    cache_newest->newer = r;
+  else
+    cache_oldest = r;
+  cache_newest = r;
+}
+
+
+/* Remove R from the cache and keep it for reuse.  */
+static void
+remove_cache_item (CACHE_CTRL r)
+{
+  CACHE_CTRL *rp;
+
+  for (rp = &cache_table[r->recno & (CACHE_HASH_SIZE - 1)];
+       *rp != r; rp = &(*rp)->next)
+    ;
+  *rp = r->next;
+  unlink_cache_item (r);
+  if (r->flags.dirty)
+    cache_dirty_entries--;
+  r->next = cache_unused;
+  cache_unused = r;
+  cache_entries--;
+}
+
+
 /*
  * Get the data from the record cache and return a pointer into that
  * cache.  Caller should copy the returned data.  NULL is returned on
@@ -191,225 +324,346 @@ get_record_from_cache (ulong recno)
 {
   CACHE_CTRL r;
 
-  for (r = cache_list; r; r = r->next)
+  r = lookup_cache_item (recno);
+  if (!r)
     {
-      if (r->flags.used && r->recno == recno)
-        return r->data;
+      cache_stats.misses++;
+      return NULL;
     }
-  return NULL;
+  cache_stats.hits++;
+  touch_cache_item (r);
+  return r->data;
 }
 
 
-/*
- * Write a cached item back to the trustdb file.
- *
- * Returns: 0 on success or an error code.
- */
+/* Return true if ST matches the saved state of the trustdb file.  */
 static int
-write_cache_item (CACHE_CTRL r)
+db_file_state_equal_p (const struct stat *st)
 {
-  gpg_error_t err;
-  int n;
+  if (!db_file_state.valid
+      || st->st_size != db_file_state.size
+      || st->st_ino != db_file_state.ino
+      || st->st_mtime != db_file_state.mtime
+      || st->st_ctime != db_file_state.ctime)
+    return 0;
+#ifdef HAVE_STRUCT_STAT_ST_MTIM_TV_NSEC
+  if (st->st_mtim.tv_nsec != db_file_state.mtime_nsec
+      || st->st_ctim.tv_nsec != db_file_state.ctime_nsec)
+    return 0;
+#endif
+  return 1;
+}
 
-  if (lseek (db_fd, r->recno * TRUST_RECORD_LEN, SEEK_SET) == -1)
+
+/* Remember the size, inode and times of the trustdb file.  This is
+ * called after we wrote to the file.  */
+static void
+save_db_file_state (void)
+{
+  struct stat st;
+
+  if (db_fd == -1 || fstat (db_fd, &st))
     {
-      err = gpg_error_from_syserror ();
-      log_error (_("trustdb rec %lu: lseek failed: %s\n"),
-                 r->recno, strerror (errno));
-      return err;
+      db_file_state.valid = 0;
+      return;
     }
-  n = write (db_fd, r->data, TRUST_RECORD_LEN);
-  if (n != TRUST_RECORD_LEN)
+  db_file_state.valid = 1;
+  db_file_state.size = st.st_size;
+  db_file_state.ino = st.st_ino;
+  db_file_state.mtime = st.st_mtime;
+  db_file_state.ctime = st.st_ctime;
+#ifdef HAVE_STRUCT_STAT_ST_MTIM_TV_NSEC
+  db_file_state.mtime_nsec = st.st_mtim.tv_nsec;
+  db_file_state.ctime_nsec = st.st_ctim.tv_nsec;
+#endif
+}
+
+
+/*
+ * Drop all records read from the file from the cache if the trustdb
+ * file has been changed by another process since we last looked at
+ * it.  Modified records are kept.
+ */
+static void
+check_db_file_state (void)
+{
+  struct stat st;
+  CACHE_CTRL r, r2;
+
+  if (db_fd == -1)
+    return;
+  if (!fstat (db_fd, &st) && db_file_state_equal_p (&st))
+    return;
+  if (db_file_state.valid)
+    db_changed_by_others = 1;
+
+  if (cache_entries > cache_dirty_entries)
     {
-      err = gpg_error_from_syserror ();
-      log_error (_("trustdb rec %lu: write failed (n=%d): %s\n"),
-                 r->recno, n, strerror (errno) );
-      return err;
+      for (r = cache_newest; r; r = r2)
+        {
+          r2 = r->older;
+          if (!r->flags.dirty)
+            remove_cache_item (r);
+        }
+      cache_stats.invalidations++;
     }
-  r->flags.dirty = 0;
+  save_db_file_state ();
+}
+
+
+/*
+ * Return true if another process changed the trustdb file since we
+ * opened it.  Our own changes need to be synced before calling this.
+ */
+int
+tdbio_changed_by_others (void)
+{
+  struct stat st;
+
+  if (db_changed_by_others)
+    return 1;
+  if (db_fd == -1)
+    return 0;
+  if (fstat (db_fd, &st) || !db_file_state_equal_p (&st))
+    return 1;
   return 0;
 }
 
 
+/* Allow or disallow mapping the trustdb into memory.  */
+void
+tdbio_enable_mmap (int enable)
+{
+  tdbio_use_mmap = !!enable;
+}
+
+
+/*
+ * Return a pointer to the record RECNO in the mapping of the trustdb.
+ * NULL is returned if mapping is not enabled or the record is not
+ * covered by the mapping.  The file is mapped again only if it has
+ * grown considerably; records appended in the meantime are read as
+ * usual.
+ */
+static const char *
+get_record_from_map (ulong recno)
+{
+#ifdef USE_MMAP
+  struct stat st;
+  size_t off = (size_t)recno * TRUST_RECORD_LEN;
+  void *p;
+
+  if (!tdbio_use_mmap)
+    return NULL;
+
+  if (off + TRUST_RECORD_LEN > db_map_len)
+    {
+      if (fstat (db_fd, &st)
+          || !S_ISREG (st.st_mode)
+          || (uint64_t)st.st_size > (size_t)(-1)
+          || (size_t)st.st_size < off + TRUST_RECORD_LEN
+          || (size_t)st.st_size < db_map_len + db_map_len / 8)
+        return NULL;
+
+      p = mmap (NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, db_fd, 0);
+      if (p == MAP_FAILED)
+        return NULL;
+      if (db_map)
+        munmap (db_map, db_map_len);
+      db_map = p;
+      db_map_len = (size_t)st.st_size;
+    }
+
+  cache_stats.mapped_reads++;
+  return db_map + off;
+#else
+  (void)recno;
+  return NULL;
+#endif
+}
+
+
+/* Helper for write_cache_items to sort items by record number.  */
+static int
+cmp_cache_items (const void *a, const void *b)
+{
+  ulong ra = (*(const CACHE_CTRL *)a)->recno;
+  ulong rb = (*(const CACHE_CTRL *)b)->recno;
+
+  return ra < rb? -1 : ra > rb;
+}
+
+
 /*
- * Put data into the cache.  This function may flush
- * some cache entries if the cache is filled up.
+ * Write the N dirty cache items ITEMS back to the trustdb file.  The
+ * items are sorted by record number so that consecutive records are
+ * written with one system call.
  *
  * Returns: 0 on success or an error code.
  */
 static int
-put_record_into_cache (ulong recno, const char *data)
+write_cache_items (CACHE_CTRL *items, size_t n)
 {
-  CACHE_CTRL r, unused;
-  int dirty_count = 0;
-  int clean_count = 0;
+  char buffer[CACHE_WRITEBACK_BATCH * TRUST_RECORD_LEN];
+  gpg_error_t err;
+  size_t i, j, k;
+  int nbytes;
 
-  /* See whether we already cached this one.  */
-  for (unused = NULL, r = cache_list; r; r = r->next)
+  qsort (items, n, sizeof *items, cmp_cache_items);
+  for (i = 0; i < n; i = j)
     {
-      if (!r->flags.used)
+      for (j = i + 1; (j < n && j - i < CACHE_WRITEBACK_BATCH
+                       && items[j]->recno == items[j-1]->recno + 1); j++)
+        ;
+      for (k = i; k < j; k++)
+        memcpy (buffer + (k - i) * TRUST_RECORD_LEN,
+                items[k]->data, TRUST_RECORD_LEN);
+
+      if (lseek (db_fd, items[i]->recno * TRUST_RECORD_LEN, SEEK_SET) == -1)
         {
-          if (!unused)
-            unused = r;
-	}
-      else if (r->recno == recno)
+          err = gpg_error_from_syserror ();
+          log_error (_("trustdb rec %lu: lseek failed: %s\n"),
+                     items[i]->recno, strerror (errno));
+          return err;
+        }
+      nbytes = write (db_fd, buffer, (j - i) * TRUST_RECORD_LEN);
+      if (nbytes != (int)((j - i) * TRUST_RECORD_LEN))
         {
-          if (!r->flags.dirty)
-            {
-              /* Hmmm: should we use a copy and compare? */
-              if (memcmp (r->data, data, TRUST_RECORD_LEN))
-                {
-                  r->flags.dirty = 1;
-                  cache_is_dirty = 1;
-		}
-	    }
-          memcpy (r->data, data, TRUST_RECORD_LEN);
-          return 0;
-	}
-      if (r->flags.used)
+          err = gpg_error_from_syserror ();
+          log_error (_("trustdb rec %lu: write failed (n=%d): %s\n"),
+                     items[i]->recno, nbytes, strerror (errno) );
+          return err;
+        }
+      cache_stats.write_calls++;
+      cache_stats.written_records += j - i;
+
+      for (k = i; k < j; k++)
         {
-          if (r->flags.dirty)
-            dirty_count++;
-          else
-            clean_count++;
-	}
+          items[k]->flags.dirty = 0;
+          cache_dirty_entries--;
+        }
     }
+  save_db_file_state ();
+  return 0;
+}
 
-  /* Not in the cache: add a new entry. */
-  if (unused)
-    {
-      /* Reuse this entry. */
-      r = unused;
-      r->flags.used = 1;
-      r->recno = recno;
-      memcpy (r->data, data, TRUST_RECORD_LEN);
-      r->flags.dirty = 1;
-      cache_is_dirty = 1;
-      cache_entries++;
-      return 0;
-    }
 
-  /* See whether we reached the limit. */
-  if (cache_entries < MAX_CACHE_ENTRIES_SOFT)
+/*
+ * Evict the least recently used item from the cache.  If that item
+ * is dirty, it is written back together with other old dirty items.
+ *
+ * Returns: 0 on success or an error code.
+ */
+static int
+evict_cache_item (void)
+{
+  CACHE_CTRL items[CACHE_WRITEBACK_BATCH];
+  CACHE_CTRL r;
+  size_t n;
+  int i, rc;
+
+  log_assert (cache_oldest);
+  if (cache_oldest->flags.dirty)
     {
-      /* No: Put into cache.  */
-      r = xmalloc (sizeof *r);
-      r->flags.used = 1;
-      r->recno = recno;
-      memcpy (r->data, data, TRUST_RECORD_LEN);
-      r->flags.dirty = 1;
-      r->next = cache_list;
-      cache_list = r;
-      cache_is_dirty = 1;
-      cache_entries++;
-      return 0;
+      /* Don't walk the entire list if there are only a few dirty
+       * items.  */
+      n = 0;
+      for (r = cache_oldest, i = 0;
+           r && n < CACHE_WRITEBACK_BATCH && i < 8 * CACHE_WRITEBACK_BATCH;
+           r = r->newer, i++)
+        if (r->flags.dirty)
+          items[n++] = r;
+
+      take_write_lock ();
+      rc = write_cache_items (items, n);
+      release_write_lock ();
+      if (rc)
+        return rc;
+      cache_stats.writebacks++;
     }
 
-  /* Cache is full: discard some clean entries.  */
-  if (clean_count)
-    {
-      int n;
+  remove_cache_item (cache_oldest);
+  cache_stats.evictions++;
+  return 0;
+}
 
-      /* We discard a third of the clean entries.  */
-      n = clean_count / 3;
-      if (!n)
-        n = 1;
 
-      for (unused = NULL, r = cache_list; r; r = r->next)
-        {
-          if (r->flags.used && !r->flags.dirty)
-            {
-              if (!unused)
-                unused = r;
-              r->flags.used = 0;
-              cache_entries--;
-              if (!--n)
-                break;
-	    }
-	}
+/*
+ * Put data into the cache.  DIRTY is set if the data has been
+ * modified and is not yet in the trustdb file.  This function may
+ * evict some cache entries if the cache is filled up.
+ *
+ * Returns: 0 on success or an error code.
+ */
+static int
+put_record_into_cache (ulong recno, const char *data, int dirty)
+{
+  CACHE_CTRL r;
+  int rc;
 
-      /* Now put into the cache.  */
-      log_assert (unused);
-      r = unused;
-      r->flags.used = 1;
-      r->recno = recno;
+  /* See whether we already cached this one.  */
+  r = lookup_cache_item (recno);
+  if (r)
+    {
+      if (dirty && !r->flags.dirty
+          && memcmp (r->data, data, TRUST_RECORD_LEN))
+        {
+          r->flags.dirty = 1;
+          cache_dirty_entries++;
+        }
       memcpy (r->data, data, TRUST_RECORD_LEN);
-      r->flags.dirty = 1;
-      cache_is_dirty = 1;
-      cache_entries++;
+      touch_cache_item (r);
       return 0;
     }
 
-  /* No clean entries: We have to flush some dirty entries.  */
+  /* Not in the cache: See whether we reached the limit.  */
 #if 0 /* Transactions are not yet used.  */
   if (in_transaction)
     {
-      /* But we can't do this while in a transaction.  Thus we
-       * increase the cache size instead.  */
-      if (cache_entries < MAX_CACHE_ENTRIES_HARD)
+      /* We can't flush dirty entries while in a transaction.  Thus
+       * we increase the cache size instead.  */
+      if (cache_entries >= 2 * MAX_CACHE_ENTRIES)
         {
-          if (opt.debug && !(cache_entries % 100))
-            log_debug ("increasing tdbio cache size\n");
-          r = xmalloc (sizeof *r);
-          r->flags.used = 1;
-          r->recno = recno;
-          memcpy (r->data, data, TRUST_RECORD_LEN);
-          r->flags.dirty = 1;
-          r->next = cache_list;
-          cache_list = r;
-          cache_is_dirty = 1;
-          cache_entries++;
-          return 0;
-	}
-      /* Hard limit for the cache size reached.  */
-      log_info (_("trustdb transaction too large\n"));
-      return GPG_ERR_RESOURCE_LIMIT;
+          /* Hard limit for the cache size reached.  */
+          log_info (_("trustdb transaction too large\n"));
+          return GPG_ERR_RESOURCE_LIMIT;
+        }
+      if (cache_entries >= MAX_CACHE_ENTRIES
+          && cache_oldest && !cache_oldest->flags.dirty)
+        remove_cache_item (cache_oldest);
     }
+  else
 #endif
-
-  if (dirty_count)
+  if (cache_entries >= MAX_CACHE_ENTRIES)
     {
-      int n;
-
-      /* Discard some dirty entries. */
-      n = dirty_count / 5;
-      if (!n)
-        n = 1;
-
-      take_write_lock ();
-      for (unused = NULL, r = cache_list; r; r = r->next)
-        {
-          if (r->flags.used && r->flags.dirty)
-            {
-              int rc;
-
-              rc = write_cache_item (r);
-              if (rc)
-                return rc;
-              if (!unused)
-                unused = r;
-              r->flags.used = 0;
-              cache_entries--;
-              if (!--n)
-                break;
-	    }
-	}
-      release_write_lock ();
-
-      /* Now put into the cache.  */
-      log_assert (unused);
-      r = unused;
-      r->flags.used = 1;
-      r->recno = recno;
-      memcpy (r->data, data, TRUST_RECORD_LEN);
-      r->flags.dirty = 1;
-      cache_is_dirty = 1;
-      cache_entries++;
-      return 0;
+      rc = evict_cache_item ();
+      if (rc)
+        return rc;
     }
 
-  /* We should never reach this.  */
-  BUG();
+  if (!cache_table)
+    cache_table = xcalloc (CACHE_HASH_SIZE, sizeof *cache_table);
+  if (cache_unused)
+    {
+      /* Reuse this entry.  */
+      r = cache_unused;
+      cache_unused = r->next;
+    }
+  else
+    r = xmalloc (sizeof *r);
+  r->recno = recno;
+  memcpy (r->data, data, TRUST_RECORD_LEN);
+  r->flags.dirty = !!dirty;
+  if (dirty)
+    cache_dirty_entries++;
+  r->next = cache_table[recno & (CACHE_HASH_SIZE - 1)];
+  cache_table[recno & (CACHE_HASH_SIZE - 1)] = r;
+  r->newer = r->older = NULL;
+  touch_cache_item (r);
+  cache_entries++;
+  if (cache_entries > cache_stats.peak)
+    cache_stats.peak = cache_entries;
+  return 0;
 }
 
 
@@ -417,7 +671,7 @@ put_record_into_cache (ulong recno, const char *data)
 int
 tdbio_is_dirty (void)
 {
-  return cache_is_dirty;
+  return !!cache_dirty_entries;
 }
 
 
@@ -427,34 +681,63 @@ tdbio_is_dirty (void)
 int
 tdbio_sync (void)
 {
-    CACHE_CTRL r;
-    int did_lock = 0;
+  CACHE_CTRL *items, r;
+  size_t n;
+  int did_lock = 0;
+  int rc;
 
-    if( db_fd == -1 )
-	open_db();
+  if (db_fd == -1)
+    open_db ();
 #if 0 /* Transactions are not yet used.  */
-    if( in_transaction )
-	log_bug("tdbio: syncing while in transaction\n");
+  if (in_transaction)
+    log_bug ("tdbio: syncing while in transaction\n");
 #endif
 
-    if( !cache_is_dirty )
-	return 0;
+  if (!cache_dirty_entries)
+    return 0;
 
-    if (!take_write_lock ())
-        did_lock = 1;
+  items = xtrymalloc (cache_dirty_entries * sizeof *items);
+  if (!items)
+    return gpg_error_from_syserror ();
+  for (n = 0, r = cache_newest; r; r = r->older)
+    if (r->flags.dirty)
+      items[n++] = r;
+  log_assert (n == cache_dirty_entries);
+
+  if (!take_write_lock ())
+    did_lock = 1;
+  rc = write_cache_items (items, n);
+  if (did_lock)
+    release_write_lock ();
+  xfree (items);
+  if (!rc)
+    cache_stats.syncs++;
 
-    for( r = cache_list; r; r = r->next ) {
-	if( r->flags.used && r->flags.dirty ) {
-	    int rc = write_cache_item( r );
-	    if( rc )
-		return rc;
-	}
-    }
-    cache_is_dirty = 0;
-    if (did_lock)
-        release_write_lock ();
+  return rc;
+}
 
-    return 0;
+
+/* Print statistics for the record cache.  */
+void
+tdbio_dump_stats (void)
+{
+  if (!cache_stats.hits && !cache_stats.misses)
+    return;
+
+  log_info ("tdbio: cache hits=%u misses=%u mapped=%u entries=%u peak=%u\n",
+            cache_stats.hits,
+            cache_stats.misses,
+            cache_stats.mapped_reads,
+            cache_entries,
+            cache_stats.peak);
+  log_info ("       evictions=%u invalidations=%u writebacks=%u syncs=%u"
+            " written=%u writes=%u\n",
+            cache_stats.evictions,
+            cache_stats.invalidations,
+            cache_stats.writebacks,
+            cache_stats.syncs,
+            cache_stats.written_records,
+            cache_stats.write_calls);
 }
 
 
@@ -501,24 +784,18 @@ tdbio_end_transaction ()  /* Not yet used.  */
 int
 tdbio_cancel_transaction () /* Not yet used.  */
 {
-  CACHE_CTRL r;
+  CACHE_CTRL r, r2;
 
   if (!in_transaction)
     log_bug ("tdbio: no active transaction\n");
 
   /* Remove all dirty marked entries, so that the original ones are
    * read back the next time.  */
-  if (cache_is_dirty)
+  for (r = cache_newest; r && cache_dirty_entries; r = r2)
     {
-      for (r = cache_list; r; r = r->next)
-        {
-          if (r->flags.used && r->flags.dirty)
-            {
-              r->flags.used = 0;
-              cache_entries--;
-	    }
-	}
-      cache_is_dirty = 0;
+      r2 = r->older;
+      if (r->flags.dirty)
+        remove_cache_item (r);
     }
 
   in_transaction = 0;
@@ -1496,8 +1773,19 @@ tdbio_read_record (ulong recnum, TRUSTREC *rec, int expected)
   if (db_fd == -1)
     open_db ();
 
+  /* The version record is the one most likely updated by other
+   * processes.  */
+  if (!recnum)
+    check_db_file_state ();
+
   buf = get_record_from_cache( recnum );
-  if (!buf)
+  if (!buf && (buf = get_record_from_map (recnum)))
+    {
+      err = put_record_into_cache (recnum, buf, 0);
+      if (err)
+        return err;
+    }
+  else if (!buf)
     {
       if (lseek (db_fd, recnum * TRUST_RECORD_LEN, SEEK_SET) == -1)
         {
@@ -1518,6 +1806,9 @@ tdbio_read_record (ulong recnum, TRUSTREC *rec, int expected)
           return err;
 	}
       buf = readbuf;
+      err = put_record_into_cache (recnum, buf, 0);
+      if (err)
+        return err;
     }
   rec->recnum = recnum;
   rec->dirty = 0;
@@ -1715,7 +2006,7 @@ tdbio_write_record (ctrl_t ctrl, TRUSTREC *rec)
       BUG();
     }
 
-  rc = put_record_into_cache (recnum, buf);
+  rc = put_record_into_cache (recnum, buf, 1);
   if (rc)
     ;
   else if (rec->rectype == RECTYPE_TRUST)
@@ -1841,6 +2132,8 @@ tdbio_new_recnum (ctrl_t ctrl)
       if (rc)
         log_fatal (_("%s: failed to append a record: %s\n"),
                    db_name, gpg_strerror (rc));
+      /* Don't take our own append for a change by another process.  */
+      save_db_file_state ();
     }
 
   return recnum ;
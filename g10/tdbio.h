@@ -106,6 +106,9 @@ ulong tdbio_read_nextcheck (void);
 int tdbio_write_nextcheck (ctrl_t ctrl, ulong stamp);
 int tdbio_is_dirty(void);
 int tdbio_sync(void);
+int tdbio_changed_by_others (void);
+void tdbio_enable_mmap (int enable);
+void tdbio_dump_stats (void);
 int tdbio_begin_transaction(void);
 int tdbio_end_transaction(void);
 int tdbio_cancel_transaction(void);
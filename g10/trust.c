@@ -297,6 +297,28 @@ revalidation_mark (ctrl_t ctrl)
 }
 
 
+void
+revalidation_mark_key (ctrl_t ctrl, PKT_public_key *pk)
+{
+#ifndef NO_TRUST_MODELS
+  tdb_revalidation_mark_key (ctrl, pk);
+#else
+  (void)pk;
+#endif
+}
+
+
+void
+revalidation_note_key (ctrl_t ctrl, PKT_public_key *pk)
+{
+#ifndef NO_TRUST_MODELS
+  tdb_revalidation_note_key (ctrl, pk);
+#else
+  (void)pk;
+#endif
+}
+
+
 void
 check_trustdb_stale (ctrl_t ctrl)
 {
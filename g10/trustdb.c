@@ -22,9 +22,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 
 #include "gpg.h"
 #include "../common/status.h"
+#include "../common/host2net.h"
 #include "../common/iobuf.h"
 #include "../regexp/jimregexp.h"
 #include "keydb.h"
@@ -43,6 +45,10 @@
 
 typedef struct key_item **KeyHashTable; /* see new_key_hash_table() */
 
+/* The number of keyblocks read by validate_key_list before their
+ * signatures are verified in parallel.  */
+#define VALIDATE_BATCH_SIZE 64
+
 /*
  * Structure to keep track of keys, this is used as an array where the
  * item right after the last one has a keyblock set to NULL.  Maybe we
@@ -75,11 +81,18 @@ static int any_trusted_key_seen;
 /* Flag whether a trustdb check is pending.  */
 static int pending_check_trustdb;
 
+/* A hash over the state of the trustdb file when it was opened.  */
+static byte initial_trustdb_state[32];
+
 
 
 static void write_record (ctrl_t ctrl, TRUSTREC *rec);
 static void do_sync (void);
 static int validate_keys (ctrl_t ctrl, int interactive);
+static void remove_wot_state (void);
+static void clear_wot_pending (void);
+static void add_wot_pending (u32 *kid);
+static void hash_trustdb_state (byte *r_state);
 
 
 /**********************************************
@@ -633,6 +646,7 @@ init_trustdb (ctrl_t ctrl, int no_create)
         }
       if (rc)
 	log_fatal("can't init trustdb: %s\n", gpg_strerror (rc) );
+      hash_trustdb_state (initial_trustdb_state);
     }
   else
     BUG();
@@ -752,6 +766,43 @@ tdb_revalidation_mark (ctrl_t ctrl)
   if (tdbio_write_nextcheck (ctrl, 1))
     do_sync ();
   pending_check_trustdb = 1;
+  remove_wot_state ();
+  clear_wot_pending ();
+}
+
+/* Same as tdb_revalidation_mark but only the primary key PK has been
+ * changed.  The next check may then revalidate just the changed
+ * keys.  */
+void
+tdb_revalidation_mark_key (ctrl_t ctrl, PKT_public_key *pk)
+{
+  u32 kid[2];
+
+  init_trustdb (ctrl, 0);
+  if (trustdb_args.no_trustdb && opt.trust_model == TM_ALWAYS)
+    return;
+
+  if (tdbio_write_nextcheck (ctrl, 1))
+    do_sync ();
+  pending_check_trustdb = 1;
+  keyid_from_pk (pk, kid);
+  add_wot_pending (kid);
+}
+
+/* Record that the primary key PK has been changed or deleted in a
+ * way which does not require a check of the trustdb.  The next
+ * check will nevertheless revalidate it.  */
+void
+tdb_revalidation_note_key (ctrl_t ctrl, PKT_public_key *pk)
+{
+  u32 kid[2];
+
+  init_trustdb (ctrl, 0);
+  if (trustdb_args.no_trustdb)
+    return;
+
+  keyid_from_pk (pk, kid);
+  add_wot_pending (kid);
 }
 
 int
@@ -1996,6 +2047,89 @@ search_skipfnc (void *opaque, u32 *kid, int dummy_uid_no)
 }
 
 
+/* Filter for check_key_sigs_parallel to select the certifications
+ * which mark_usable_uid_certs will check.  OPAQUE is the klist.  */
+static int
+klist_sig_filter (void *opaque, PKT_signature *sig)
+{
+  struct key_item *klist = opaque;
+
+  if (sig->sig_class >= 0x11 && sig->sig_class <= 0x13
+      && sig->sig_class - 0x10 < opt.min_cert_level)
+    return 0;
+  return !!is_in_klist (klist, sig);
+}
+
+
+/* Run steps 5 to 7 as described for validate_keys on the NBATCH
+ * keyblocks at BATCH and add the suitable ones to the key_array at
+ * R_KEYS.  The keyblocks are released or owned by R_KEYS on return.
+ * The signatures of the keyblocks are first verified by several
+ * threads if enabled.  */
+static void
+validate_key_batch (ctrl_t ctrl, kbnode_t *batch, int nbatch,
+                    KeyHashTable full_trust, struct key_item *klist,
+                    u32 curtime, u32 *next_expire,
+                    struct key_array **r_keys, size_t *r_nkeys,
+                    size_t *r_maxkeys)
+{
+  kbnode_t keyblock;
+  int i;
+
+  check_key_sigs_parallel (ctrl, batch, nbatch, klist_sig_filter, klist);
+
+  for (i=0; i < nbatch; i++)
+    {
+      PKT_public_key *pk;
+
+      keyblock = batch[i];
+      batch[i] = NULL;
+
+      /* prepare the keyblock for further processing */
+      merge_keys_and_selfsig (ctrl, keyblock);
+      clear_kbnode_flags (keyblock);
+      pk = keyblock->pkt->pkt.public_key;
+      if (pk->has_expired || pk->flags.revoked)
+        {
+          /* Step 5: Mark revoked and expired keys.
+           * (it does not make sense to look further at those keys.) */
+          mark_keyblock_seen (full_trust, keyblock);
+        }
+      else if (validate_one_keyblock (ctrl, keyblock, klist,
+                                      curtime, next_expire))
+        {
+          /* Step 6 has been done by validate_one_keyblock.  This here
+           * is step 7.  */
+	  kbnode_t node;
+
+          if (pk->expiredate && pk->expiredate >= curtime
+              && pk->expiredate < *next_expire)
+            *next_expire = pk->expiredate;
+
+          if (*r_nkeys == *r_maxkeys) {
+            *r_maxkeys += 1000;
+            *r_keys = xrealloc (*r_keys, (*r_maxkeys+1) * sizeof **r_keys);
+          }
+          (*r_keys)[(*r_nkeys)++].keyblock = keyblock;
+
+	  /* Optimization - if all uids are fully trusted, then we
+	     never need to consider this key as a candidate again. */
+
+	  for (node=keyblock; node; node = node->next)
+	    if (node->pkt->pkttype == PKT_USER_ID && !(node->flag & 4))
+	      break;
+
+	  if(node==NULL)
+	    mark_keyblock_seen (full_trust, keyblock);
+
+          keyblock = NULL;
+        }
+
+      release_kbnode (keyblock);
+    }
+}
+
+
 /* This implements steps 4 to 7 as described for validate_keys.
  *
  * Scan all keys and return a key_array of all suitable keys from
@@ -2013,6 +2147,9 @@ validate_key_list (ctrl_t ctrl, KEYDB_HANDLE hd, KeyHashTable full_trust,
   size_t nkeys, maxkeys;
   int rc;
   KEYDB_SEARCH_DESC desc;
+  kbnode_t batch[VALIDATE_BATCH_SIZE];
+  int nbatch = 0;
+  int batchsize;
 
   maxkeys = 1000;  /* Initially allocate space for 1000 keys.  */
   keys = xmalloc ((maxkeys+1) * sizeof *keys);
@@ -2042,11 +2179,13 @@ validate_key_list (ctrl_t ctrl, KEYDB_HANDLE hd, KeyHashTable full_trust,
       goto die;
     }
 
+  /* With verify threads we read several keyblocks so that their
+   * signatures can be verified in parallel.  */
+  batchsize = opt.verify_threads > 1? VALIDATE_BATCH_SIZE : 1;
+
   desc.mode = KEYDB_SEARCH_MODE_NEXT; /* change mode */
   do
     {
-      PKT_public_key *pk;
-
       rc = keydb_get_keyblock (hd, &keyblock);
       if (rc)
         {
@@ -2063,66 +2202,842 @@ validate_key_list (ctrl_t ctrl, KEYDB_HANDLE hd, KeyHashTable full_trust,
           continue;
         }
 
-      /* prepare the keyblock for further processing */
+      batch[nbatch++] = keyblock;
+      keyblock = NULL;
+      if (nbatch == batchsize)
+        {
+          validate_key_batch (ctrl, batch, nbatch, full_trust, klist,
+                              curtime, next_expire, &keys, &nkeys, &maxkeys);
+          nbatch = 0;
+        }
+    }
+  while (!(rc = keydb_search (hd, &desc, 1, NULL)));
+
+  if (rc && gpg_err_code (rc) != GPG_ERR_NOT_FOUND)
+    {
+      log_error ("keydb_search_next failed: %s\n", gpg_strerror (rc));
+      goto die;
+    }
+
+  validate_key_batch (ctrl, batch, nbatch, full_trust, klist,
+                      curtime, next_expire, &keys, &nkeys, &maxkeys);
+
+  keys[nkeys].keyblock = NULL;
+  return keys;
+
+ die:
+  while (nbatch)
+    release_kbnode (batch[--nbatch]);
+  keys[nkeys].keyblock = NULL;
+  release_key_array (keys);
+  return NULL;
+}
+
+/*
+ * The validation state file.
+ *
+ * A full run of validate_keys records the keys used as introducers
+ * at each depth (the klists) in the file "trustdb.gpg.wot".  Keys
+ * changed afterwards are added to a list of pending keys in this
+ * file.  The next check then only revalidates the pending keys
+ * against the recorded klists.  This gives the same result as a full
+ * run as long as no pending key enters, leaves or moves within the
+ * klists because the validity of a key depends only on the keys in
+ * the klists.  Otherwise, and whenever the trust parameters, the
+ * ultimately trusted keys or an ownertrust changed, a full run is
+ * done.
+ *
+ * The keys changed by a process are collected in memory and added
+ * to the file at exit or at the next check.  To detect changes not
+ * recorded this way, for example by an older gpg version or by a
+ * process which crashed, the file also stores a hash over the size
+ * and modification time of the key resources and the trustdb.  A
+ * process only adds its keys if that hash still matches the state
+ * it found at startup; the next check is a full run if the hash
+ * does not match the current state.
+ *
+ * File format (all numbers are big endian):
+ *   8 bytes magic "GPGwot" followed by 0x00 0x02
+ *   4 bytes trust model
+ *   4 bytes marginals needed
+ *   4 bytes completes needed
+ *   4 bytes max cert depth
+ *   4 bytes min cert level
+ *   4 bytes time of the next scheduled check or 0
+ *   32 bytes SHA-256 over the state of the key resources and trustdb
+ *   4 bytes number of klist items N
+ *   N * 12 bytes items: keyid (8), depth, ownertrust, flags, reserved
+ *   4 bytes number of pending keys M
+ *   M * 8 bytes keyids
+ */
+#define WOT_MAGIC "GPGwot\x00\x02"
+#define WOT_MAGICLEN 8
+#define WOT_NPARMS 6
+#define WOT_MARKERLEN 32
+
+/* Do not keep more pending keys; a full run is then done anyway.  */
+#define WOT_MAX_PENDING 20000
+
+/* The item has trust signature information.  */
+#define WOT_FLAG_TRUSTSIG 1
+
+struct wot_item
+{
+  u32 kid[2];
+  byte depth;
+  byte ownertrust;
+  byte flags;
+};
+
+struct wot_state
+{
+  u32 parms[WOT_NPARMS];
+  byte marker[WOT_MARKERLEN];
+  unsigned int nitems;
+  unsigned int maxitems;
+  struct wot_item *items;
+  /* Hash table over ITEMS; see wot_state_find_item.  */
+  unsigned int nbuckets;
+  unsigned int *buckets;
+  unsigned int *chain;
+  unsigned int npending;
+  u32 (*pending)[2];
+};
+
+
+/* The keys changed by this process which have not yet been added to
+ * the state file.  */
+static KeyHashTable wot_pending_table;
+static u32 (*wot_pending)[2];
+static unsigned int wot_npending;
+static unsigned int wot_maxpending;
+
+/* The marker expected in the state file; see wot_state_marker.  */
+static byte wot_expected_marker[WOT_MARKERLEN];
+static int wot_expected_marker_valid;
+
+
+static char *
+wot_state_fname (void)
+{
+  return xstrconcat (tdbio_get_dbname (), ".wot", NULL);
+}
+
+
+/* Store a hash over the state of the trustdb file at R_STATE.  */
+static void
+hash_trustdb_state (byte *r_state)
+{
+  gcry_md_hd_t md;
+
+  if (gcry_md_open (&md, GCRY_MD_SHA256, 0))
+    log_fatal ("can't open hash context\n");
+  keydb_hash_file_state (md, tdbio_get_dbname ());
+  memcpy (r_state, gcry_md_read (md, GCRY_MD_SHA256), WOT_MARKERLEN);
+  gcry_md_close (md);
+}
+
+
+/* Store the marker for the state of the key resources and the
+ * trustdb at R_MARKER.  If INITIAL is set the marker for the state
+ * before this process made any changes is returned.  */
+static void
+wot_state_marker (byte *r_marker, int initial)
+{
+  byte buf[2*WOT_MARKERLEN];
+
+  keydb_get_resource_state (buf, initial);
+  if (initial)
+    memcpy (buf + WOT_MARKERLEN, initial_trustdb_state, WOT_MARKERLEN);
+  else
+    hash_trustdb_state (buf + WOT_MARKERLEN);
+  gcry_md_hash_buffer (GCRY_MD_SHA256, r_marker, buf, sizeof buf);
+}
+
+
+/* Set the marker of ST to the current state and remember it as the
+ * state expected by this process.  This must be called after all
+ * changes to the trustdb have been synced.  Returns -1 if another
+ * process changed the key resources or the trustdb since this process
+ * started; the state file must then be removed because these changes
+ * are not recorded.  */
+static int
+wot_state_update_marker (struct wot_state *st)
+{
+  if (keydb_resource_changed_by_others () || tdbio_changed_by_others ())
+    {
+      if (DBG_TRUST)
+        log_debug ("key database changed by another process\n");
+      return -1;
+    }
+  wot_state_marker (st->marker, 0);
+  memcpy (wot_expected_marker, st->marker, WOT_MARKERLEN);
+  wot_expected_marker_valid = 1;
+  return 0;
+}
+
+
+/* Drop the list of changed keys of this process.  */
+static void
+clear_wot_pending (void)
+{
+  release_key_hash_table (wot_pending_table);
+  wot_pending_table = NULL;
+  xfree (wot_pending);
+  wot_pending = NULL;
+  wot_npending = wot_maxpending = 0;
+}
+
+
+/* Store the current trust parameters in ST.  */
+static void
+wot_state_set_parms (struct wot_state *st, u32 next_check)
+{
+  st->parms[0] = opt.trust_model;
+  st->parms[1] = opt.marginals_needed;
+  st->parms[2] = opt.completes_needed;
+  st->parms[3] = opt.max_cert_depth;
+  st->parms[4] = opt.min_cert_level;
+  st->parms[5] = next_check;
+}
+
+
+static void
+release_wot_state (struct wot_state *st)
+{
+  if (!st)
+    return;
+  xfree (st->items);
+  xfree (st->buckets);
+  xfree (st->chain);
+  xfree (st->pending);
+  xfree (st);
+}
+
+
+/* Append an item for K at DEPTH to ST.  */
+static void
+wot_state_add_item (struct wot_state *st, struct key_item *k, int depth)
+{
+  struct wot_item *item;
+
+  if (st->nitems == st->maxitems)
+    {
+      st->maxitems += 1000;
+      st->items = xrealloc (st->items, st->maxitems * sizeof *st->items);
+    }
+  log_assert (!st->buckets);
+  item = st->items + st->nitems++;
+  item->kid[0] = k->kid[0];
+  item->kid[1] = k->kid[1];
+  item->depth = depth;
+  item->ownertrust = k->ownertrust;
+  item->flags = 0;
+  if (k->trust_depth || k->trust_value || k->trust_regexp)
+    item->flags |= WOT_FLAG_TRUSTSIG;
+}
+
+
+/* Return the item for KID or NULL.  The items are hashed by the low
+ * bits of the keyid like in a KeyHashTable, but the table grows with
+ * the number of items.  BUCKETS holds the index of the first item
+ * plus one and CHAIN the index of the next item plus one.  The table
+ * is built on the first call; items may not be added after that.  */
+static struct wot_item *
+wot_state_find_item (struct wot_state *st, u32 *kid)
+{
+  unsigned int n, i;
+
+  if (!st->buckets)
+    {
+      st->nbuckets = KEY_HASH_TABLE_SIZE;
+      while (st->nbuckets < st->nitems)
+        st->nbuckets *= 2;
+      st->buckets = xcalloc (st->nbuckets, sizeof *st->buckets);
+      st->chain = xcalloc (st->nitems + 1, sizeof *st->chain);
+      for (n=0; n < st->nitems; n++)
+        {
+          i = st->items[n].kid[1] & (st->nbuckets - 1);
+          st->chain[n] = st->buckets[i];
+          st->buckets[i] = n + 1;
+        }
+    }
+
+  for (n = st->buckets[kid[1] & (st->nbuckets - 1)]; n; n = st->chain[n-1])
+    if (st->items[n-1].kid[0] == kid[0] && st->items[n-1].kid[1] == kid[1])
+      return st->items + n - 1;
+  return NULL;
+}
+
+
+/* Read the state file FNAME.  Returns NULL if it does not exist or
+ * is not valid.  */
+static struct wot_state *
+read_wot_state (const char *fname)
+{
+  estream_t fp;
+  struct wot_state *st;
+  byte buf[12];
+  unsigned int n;
+  int i;
+
+  fp = es_fopen (fname, "rb");
+  if (!fp)
+    return NULL;
+  st = xcalloc (1, sizeof *st);
+
+  if (es_fread (buf, WOT_MAGICLEN, 1, fp) != 1
+      || memcmp (buf, WOT_MAGIC, WOT_MAGICLEN))
+    goto invalid;
+  for (i=0; i < WOT_NPARMS; i++)
+    {
+      if (es_fread (buf, 4, 1, fp) != 1)
+        goto invalid;
+      st->parms[i] = buf32_to_u32 (buf);
+    }
+  if (es_fread (st->marker, WOT_MARKERLEN, 1, fp) != 1)
+    goto invalid;
+
+  if (es_fread (buf, 4, 1, fp) != 1)
+    goto invalid;
+  st->nitems = st->maxitems = buf32_to_uint (buf);
+  if (st->nitems > 0x1000000)
+    goto invalid;
+  st->items = xcalloc (st->maxitems + 1, sizeof *st->items);
+  for (n=0; n < st->nitems; n++)
+    {
+      if (es_fread (buf, 12, 1, fp) != 1)
+        goto invalid;
+      st->items[n].kid[0] = buf32_to_u32 (buf);
+      st->items[n].kid[1] = buf32_to_u32 (buf+4);
+      st->items[n].depth = buf[8];
+      st->items[n].ownertrust = buf[9];
+      st->items[n].flags = buf[10];
+    }
+
+  if (es_fread (buf, 4, 1, fp) != 1)
+    goto invalid;
+  st->npending = buf32_to_uint (buf);
+  if (st->npending > WOT_MAX_PENDING)
+    goto invalid;
+  st->pending = xcalloc (st->npending + 1, sizeof *st->pending);
+  for (n=0; n < st->npending; n++)
+    {
+      if (es_fread (buf, 8, 1, fp) != 1)
+        goto invalid;
+      st->pending[n][0] = buf32_to_u32 (buf);
+      st->pending[n][1] = buf32_to_u32 (buf+4);
+    }
+  if (es_getc (fp) != EOF)
+    goto invalid;
+
+  es_fclose (fp);
+  return st;
+
+ invalid:
+  log_info ("validation state '%s' is invalid - ignored\n", fname);
+  es_fclose (fp);
+  release_wot_state (st);
+  return NULL;
+}
+
+
+static int
+write_u32 (estream_t fp, u32 val)
+{
+  byte buf[4];
+
+  buf[0] = val >> 24;
+  buf[1] = val >> 16;
+  buf[2] = val >>  8;
+  buf[3] = val;
+  return es_fwrite (buf, 4, 1, fp) != 1;
+}
+
+
+/* Write ST to the state file FNAME.  */
+static gpg_error_t
+write_wot_state (const char *fname, struct wot_state *st)
+{
+  gpg_error_t err = 0;
+  char *tmpfname;
+  estream_t fp;
+  unsigned int n;
+  byte buf[4];
+  int i, failed;
+
+  tmpfname = xstrconcat (fname, ".tmp", NULL);
+  fp = es_fopen (tmpfname, "wb");
+  if (!fp)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  failed = es_fwrite (WOT_MAGIC, WOT_MAGICLEN, 1, fp) != 1;
+  for (i=0; i < WOT_NPARMS; i++)
+    failed |= write_u32 (fp, st->parms[i]);
+  failed |= es_fwrite (st->marker, WOT_MARKERLEN, 1, fp) != 1;
+  failed |= write_u32 (fp, st->nitems);
+  for (n=0; n < st->nitems && !failed; n++)
+    {
+      failed |= write_u32 (fp, st->items[n].kid[0]);
+      failed |= write_u32 (fp, st->items[n].kid[1]);
+      buf[0] = st->items[n].depth;
+      buf[1] = st->items[n].ownertrust;
+      buf[2] = st->items[n].flags;
+      buf[3] = 0;
+      failed |= es_fwrite (buf, 4, 1, fp) != 1;
+    }
+  failed |= write_u32 (fp, st->npending);
+  for (n=0; n < st->npending && !failed; n++)
+    {
+      failed |= write_u32 (fp, st->pending[n][0]);
+      failed |= write_u32 (fp, st->pending[n][1]);
+    }
+  if (failed)
+    {
+      err = gpg_error_from_syserror ();
+      es_fclose (fp);
+      gnupg_remove (tmpfname);
+      goto leave;
+    }
+  if (es_fclose (fp))
+    {
+      err = gpg_error_from_syserror ();
+      gnupg_remove (tmpfname);
+      goto leave;
+    }
+  err = gnupg_rename_file (tmpfname, fname, NULL);
+
+ leave:
+  if (err)
+    log_error (_("error writing '%s': %s\n"), fname, gpg_strerror (err));
+  xfree (tmpfname);
+  return err;
+}
+
+
+/* Lock the state file FNAME.  Returns NULL on error.  */
+static dotlock_t
+lock_wot_state (const char *fname)
+{
+  dotlock_t lockhd;
+
+  lockhd = dotlock_create (fname, 0);
+  if (lockhd && dotlock_take (lockhd, -1))
+    {
+      dotlock_destroy (lockhd);
+      lockhd = NULL;
+    }
+  if (!lockhd)
+    log_info ("can't lock '%s': %s\n",
+              fname, gpg_strerror (gpg_error_from_syserror ()));
+  return lockhd;
+}
+
+
+static void
+unlock_wot_state (dotlock_t lockhd)
+{
+  if (lockhd)
+    {
+      dotlock_release (lockhd);
+      dotlock_destroy (lockhd);
+    }
+}
+
+
+/* Remove the state file so that the next check is a full run.  */
+static void
+remove_wot_state (void)
+{
+  char *fname = wot_state_fname ();
+
+  if (gnupg_remove (fname) && errno != ENOENT)
+    log_info ("error removing '%s': %s\n",
+              fname, gpg_strerror (gpg_error_from_syserror ()));
+  xfree (fname);
+}
+
+
+/* Record that the key KID has been changed by this process.  */
+static void
+add_wot_pending (u32 *kid)
+{
+  if (!wot_pending_table)
+    wot_pending_table = new_key_hash_table ();
+  if (test_key_hash_table (wot_pending_table, kid))
+    return;
+  add_key_hash_table (wot_pending_table, kid);
+
+  if (wot_npending == wot_maxpending)
+    {
+      wot_maxpending += 256;
+      wot_pending = xrealloc (wot_pending,
+                              wot_maxpending * sizeof *wot_pending);
+    }
+  wot_pending[wot_npending][0] = kid[0];
+  wot_pending[wot_npending][1] = kid[1];
+  wot_npending++;
+}
+
+
+/* Move the keys changed by this process to the pending keys of ST.
+ * Returns -1 if the state file does not describe the state found by
+ * this process or there are too many pending keys; a full run is
+ * then required.  */
+static int
+merge_wot_pending (struct wot_state *st)
+{
+  KeyHashTable tbl;
+  unsigned int n;
+  int rc = 0;
+
+  if (!wot_expected_marker_valid)
+    {
+      wot_state_marker (wot_expected_marker, 1);
+      wot_expected_marker_valid = 1;
+    }
+  if (memcmp (st->marker, wot_expected_marker, WOT_MARKERLEN))
+    {
+      if (DBG_TRUST)
+        log_debug ("key database changed by another process\n");
+      rc = -1;
+      goto leave;
+    }
+
+  if (!wot_npending)
+    goto leave;
+  if (st->npending + wot_npending > WOT_MAX_PENDING)
+    {
+      rc = -1;
+      goto leave;
+    }
+
+  tbl = new_key_hash_table ();
+  for (n=0; n < st->npending; n++)
+    add_key_hash_table (tbl, st->pending[n]);
+  st->pending = xrealloc (st->pending, ((st->npending + wot_npending)
+                                        * sizeof *st->pending));
+  for (n=0; n < wot_npending; n++)
+    if (!test_key_hash_table (tbl, wot_pending[n]))
+      {
+        st->pending[st->npending][0] = wot_pending[n][0];
+        st->pending[st->npending][1] = wot_pending[n][1];
+        st->npending++;
+      }
+  release_key_hash_table (tbl);
+
+ leave:
+  clear_wot_pending ();
+  return rc;
+}
+
+
+/* Add the keys changed by this process to the state file.  This is
+ * called at exit so that the file is written only once.  */
+void
+tdb_flush_wot_pending (void)
+{
+  char *fname;
+  dotlock_t lockhd;
+  struct wot_state *st = NULL;
+
+  if (!wot_npending)
+    return;
+
+  fname = wot_state_fname ();
+  lockhd = lock_wot_state (fname);
+  if (!lockhd)
+    {
+      remove_wot_state ();
+      goto leave;
+    }
+  st = read_wot_state (fname);
+  if (!st)
+    goto leave;  /* The next check will be a full run anyway.  */
+
+  if (merge_wot_pending (st) || wot_state_update_marker (st)
+      || write_wot_state (fname, st))
+    remove_wot_state ();
+
+ leave:
+  clear_wot_pending ();
+  unlock_wot_state (lockhd);
+  release_wot_state (st);
+  xfree (fname);
+}
+
+
+/* Read the keyblock of the primary key KID using HD into R_KEYBLOCK.
+ * Returns GPG_ERR_NOT_FOUND if there is no such key and
+ * GPG_ERR_AMBIGUOUS_NAME if the key ID is not unique.  */
+static gpg_error_t
+get_wot_keyblock (KEYDB_HANDLE hd, u32 *kid, kbnode_t *r_keyblock)
+{
+  gpg_error_t err;
+  kbnode_t keyblock;
+
+  *r_keyblock = NULL;
+  err = keydb_search_reset (hd);
+  if (!err)
+    err = keydb_search_kid (hd, kid);
+  if (err)
+    return err;
+  err = keydb_get_keyblock (hd, &keyblock);
+  if (err)
+    return err;
+  if (keyblock->pkt->pkttype != PKT_PUBLIC_KEY
+      || keyid_cmp (pk_keyid (keyblock->pkt->pkt.public_key), kid)
+      || gpg_err_code (keydb_search_kid (hd, kid)) != GPG_ERR_NOT_FOUND)
+    {
+      release_kbnode (keyblock);
+      return gpg_error (GPG_ERR_AMBIGUOUS_NAME);
+    }
+  *r_keyblock = keyblock;
+  return 0;
+}
+
+
+/* Clear the computed validity of the key PK like reset_trust_records
+ * does for all keys.  Caller must sync.  */
+static void
+reset_key_trust_records (ctrl_t ctrl, PKT_public_key *pk)
+{
+  TRUSTREC trec, vrec;
+  ulong recno;
+
+  if (read_trust_record (ctrl, pk, &trec))
+    return;
+  if (trec.r.trust.min_ownertrust)
+    {
+      trec.r.trust.min_ownertrust = 0;
+      write_record (ctrl, &trec);
+    }
+  for (recno = trec.r.trust.validlist; recno; recno = vrec.r.valid.next)
+    {
+      read_record (recno, &vrec, RECTYPE_VALID);
+      if ((vrec.r.valid.validity & TRUST_MASK)
+          || vrec.r.valid.marginal_count || vrec.r.valid.full_count)
+        {
+          vrec.r.valid.validity &= ~TRUST_MASK;
+          vrec.r.valid.marginal_count = vrec.r.valid.full_count = 0;
+          write_record (ctrl, &vrec);
+        }
+    }
+}
+
+
+/* Revalidate the key KID against the klists of ST the same way the
+ * full run of validate_keys does.  KLISTS has an entry for each
+ * depth.  Returns 0 on success or -1 if a full run is required.  */
+static int
+revalidate_one_key (ctrl_t ctrl, KEYDB_HANDLE hd, struct wot_state *st,
+                    struct key_item **klists, u32 *kid,
+                    u32 curtime, u32 *next_expire)
+{
+  gpg_error_t err;
+  struct wot_item *item;
+  kbnode_t keyblock, node;
+  PKT_public_key *pk;
+  int depth, newdepth, olddepth;
+
+  item = wot_state_find_item (st, kid);
+  olddepth = item? item->depth : -1;
+
+  err = get_wot_keyblock (hd, kid, &keyblock);
+  if (gpg_err_code (err) == GPG_ERR_NOT_FOUND)
+    return olddepth == -1? 0 : -1;  /* Deleted.  */
+  if (err)
+    return -1;
+
+  /* Trust signatures on this key would need to be tracked.  */
+  for (node = keyblock; node; node = node->next)
+    if (node->pkt->pkttype == PKT_SIGNATURE
+        && node->pkt->pkt.signature->trust_depth)
+      {
+        release_kbnode (keyblock);
+        return -1;
+      }
+
+  reset_key_trust_records (ctrl, keyblock->pkt->pkt.public_key);
+
+  /* Steps 4 to 8 for this key.  As in validate_key_list the keyblock
+   * is read again for each depth.  */
+  newdepth = -1;
+  for (depth=0; depth < opt.max_cert_depth && klists[depth]; depth++)
+    {
+      if (!keyblock && get_wot_keyblock (hd, kid, &keyblock))
+        return -1;
+
       merge_keys_and_selfsig (ctrl, keyblock);
       clear_kbnode_flags (keyblock);
       pk = keyblock->pkt->pkt.public_key;
       if (pk->has_expired || pk->flags.revoked)
+        break;
+      if (validate_one_keyblock (ctrl, keyblock, klists[depth],
+                                 curtime, next_expire))
         {
-          /* Step 5: Mark revoked and expired keys.
-           * (it does not make sense to look further at those keys.) */
-          mark_keyblock_seen (full_trust, keyblock);
-        }
-      else if (validate_one_keyblock (ctrl, keyblock, klist,
-                                      curtime, next_expire))
-        {
-          /* Step 6 has been done by validate_one_keyblock.  This here
-           * is step 7.  */
-	  kbnode_t node;
-
           if (pk->expiredate && pk->expiredate >= curtime
               && pk->expiredate < *next_expire)
             *next_expire = pk->expiredate;
+          store_validation_status (ctrl, depth, keyblock);
+
+          for (node=keyblock; node; node = node->next)
+            if (node->pkt->pkttype == PKT_USER_ID && (node->flag & 4))
+              break;
+          if (node && newdepth == -1)
+            newdepth = depth + 1;
+
+          for (node=keyblock; node; node = node->next)
+            if (node->pkt->pkttype == PKT_USER_ID && !(node->flag & 4))
+              break;
+          if (!node)
+            break;  /* All user ids are fully valid.  */
+        }
+      release_kbnode (keyblock);
+      keyblock = NULL;
+    }
+  release_kbnode (keyblock);
 
-          if (nkeys == maxkeys) {
-            maxkeys += 1000;
-            keys = xrealloc (keys, (maxkeys+1) * sizeof *keys);
-          }
-          keys[nkeys++].keyblock = keyblock;
+  if (newdepth >= opt.max_cert_depth)
+    newdepth = -1;
+  if (newdepth != olddepth)
+    {
+      if (DBG_TRUST)
+        log_debug ("key %s moved from depth %d to %d\n",
+                   keystr (kid), olddepth, newdepth);
+      return -1;
+    }
+  return 0;
+}
 
-	  /* Optimization - if all uids are fully trusted, then we
-	     never need to consider this key as a candidate again. */
 
-	  for (node=keyblock; node; node = node->next)
-	    if (node->pkt->pkttype == PKT_USER_ID && !(node->flag & 4))
-	      break;
+/* Revalidate only the pending keys of the state file.  Returns 0 on
+ * success or -1 if a full run of validate_keys is required.  */
+static int
+validate_keys_incremental (ctrl_t ctrl)
+{
+  int rc = -1;
+  char *fname;
+  dotlock_t lockhd;
+  struct wot_state *st = NULL;
+  struct wot_state cur;
+  struct key_item **klists = NULL;
+  struct key_item *k;
+  KEYDB_HANDLE kdb = NULL;
+  unsigned int n, nutks;
+  u32 start_time, next_expire;
 
-	  if(node==NULL)
-	    mark_keyblock_seen (full_trust, keyblock);
+  if (opt.trust_model != TM_PGP && opt.trust_model != TM_CLASSIC)
+    return -1;
 
-          keyblock = NULL;
-        }
+  fname = wot_state_fname ();
+  lockhd = lock_wot_state (fname);
+  if (!lockhd)
+    goto leave;
+  st = read_wot_state (fname);
+  if (!st || merge_wot_pending (st) || !st->npending)
+    goto leave;
+
+  /* The trust parameters must not have changed and no time based
+   * check may be due.  */
+  start_time = make_timestamp ();
+  wot_state_set_parms (&cur, st->parms[5]);
+  if (memcmp (cur.parms, st->parms, sizeof cur.parms)
+      || (st->parms[5] && st->parms[5] <= start_time))
+    goto leave;
+  next_expire = st->parms[5]? st->parms[5] : 0xffffffff;
+
+  /* Build the klists.  */
+  klists = xcalloc (opt.max_cert_depth + 1, sizeof *klists);
+  for (n=0; n < st->nitems; n++)
+    {
+      if (st->items[n].flags || st->items[n].depth >= opt.max_cert_depth)
+        goto leave;
+      k = new_key_item ();
+      k->kid[0] = st->items[n].kid[0];
+      k->kid[1] = st->items[n].kid[1];
+      k->ownertrust = st->items[n].ownertrust;
+      k->next = klists[st->items[n].depth];
+      klists[st->items[n].depth] = k;
+    }
+
+  /* The usable ultimately trusted keys must be the first klist.  */
+  nutks = 0;
+  for (k=utk_list; k; k = k->next)
+    {
+      kbnode_t keyblock = get_pubkeyblock (ctrl, k->kid);
 
+      if (!keyblock)
+        continue;
+      if (!keyblock->pkt->pkt.public_key->has_expired)
+        {
+          struct wot_item *item = wot_state_find_item (st, k->kid);
+
+          if (!item || item->depth)
+            {
+              release_kbnode (keyblock);
+              goto leave;
+            }
+          nutks++;
+        }
       release_kbnode (keyblock);
-      keyblock = NULL;
     }
-  while (!(rc = keydb_search (hd, &desc, 1, NULL)));
+  for (n=0, k=klists[0]; k; k = k->next)
+    n++;
+  if (n != nutks)
+    goto leave;
 
-  if (rc && gpg_err_code (rc) != GPG_ERR_NOT_FOUND)
+  kdb = keydb_new (ctrl);
+  if (!kdb)
+    goto leave;
+
+  for (n=0; n < st->npending; n++)
     {
-      log_error ("keydb_search_next failed: %s\n", gpg_strerror (rc));
-      goto die;
+      for (k=utk_list; k; k = k->next)
+        if (k->kid[0] == st->pending[n][0] && k->kid[1] == st->pending[n][1])
+          goto leave;
+      if (revalidate_one_key (ctrl, kdb, st, klists, st->pending[n],
+                              start_time, &next_expire))
+        goto leave;
     }
+  do_sync ();
 
-  keys[nkeys].keyblock = NULL;
-  return keys;
+  if (next_expire == 0xffffffff || next_expire < start_time)
+    next_expire = 0;
+  tdbio_write_nextcheck (ctrl, next_expire);
+  if (next_expire && !opt.quiet)
+    log_info (_("next trustdb check due at %s\n"),
+              strtimestamp (next_expire));
+  do_sync ();
 
- die:
-  keys[nkeys].keyblock = NULL;
-  release_key_array (keys);
-  return NULL;
+  if (!opt.quiet)
+    log_info ("revalidated %u changed keys\n", st->npending);
+  st->parms[5] = next_expire;
+  st->npending = 0;
+  if (wot_state_update_marker (st) || write_wot_state (fname, st))
+    remove_wot_state ();
+  pending_check_trustdb = 0;
+  rc = 0;
+
+ leave:
+  if (rc && st && st->npending && DBG_TRUST)
+    log_debug ("incremental trustdb check not possible\n");
+  keydb_release (kdb);
+  if (klists)
+    {
+      for (n=0; n <= opt.max_cert_depth; n++)
+        release_key_items (klists[n]);
+      xfree (klists);
+    }
+  unlock_wot_state (lockhd);
+  release_wot_state (st);
+  xfree (fname);
+  return rc;
 }
 
+
 /* Caller must sync */
 static void
 reset_trust_records (ctrl_t ctrl)
@@ -2207,6 +3122,15 @@ validate_keys (ctrl_t ctrl, int interactive)
   int ot_unknown, ot_undefined, ot_never, ot_marginal, ot_full, ot_ultimate;
   KeyHashTable used, full_trust;
   u32 start_time, next_expire;
+  struct wot_state *wot = NULL;
+
+  /* Try to revalidate only the keys changed since the last run.  */
+  if (!interactive && !validate_keys_incremental (ctrl))
+    return 0;
+
+  /* The state file is written again at the end of a successful run.  */
+  remove_wot_state ();
+  clear_wot_pending ();
 
   /* Make sure we have all sigs cached.  TODO: This is going to
      require some architectural re-thinking, as it is agonizingly slow.
@@ -2219,6 +3143,9 @@ validate_keys (ctrl_t ctrl, int interactive)
   if (!kdb)
     return gpg_error_from_syserror ();
 
+  if (opt.trust_model == TM_PGP || opt.trust_model == TM_CLASSIC)
+    wot = xcalloc (1, sizeof *wot);
+
   start_time = make_timestamp ();
   next_expire = 0xffffffff; /* set next expire to the year 2106 */
   used = new_key_hash_table ();
@@ -2344,6 +3271,9 @@ validate_keys (ctrl_t ctrl, int interactive)
 	      k->ownertrust=min;
 	    }
 
+	  if (wot)
+	    wot_state_add_item (wot, k, depth);
+
 	  if (k->ownertrust == TRUST_UNKNOWN)
             ot_unknown++;
           else if (k->ownertrust == TRUST_UNDEFINED)
@@ -2450,14 +3380,11 @@ validate_keys (ctrl_t ctrl, int interactive)
       int rc2;
 
       if (next_expire == 0xffffffff || next_expire < start_time )
-        tdbio_write_nextcheck (ctrl, 0);
-      else
-        {
-          tdbio_write_nextcheck (ctrl, next_expire);
-          if (!opt.quiet)
-            log_info (_("next trustdb check due at %s\n"),
-                      strtimestamp (next_expire));
-        }
+        next_expire = 0;
+      tdbio_write_nextcheck (ctrl, next_expire);
+      if (next_expire && !opt.quiet)
+        log_info (_("next trustdb check due at %s\n"),
+                  strtimestamp (next_expire));
 
       rc2 = tdbio_update_version_record (ctrl);
       if (rc2)
@@ -2469,7 +3396,22 @@ validate_keys (ctrl_t ctrl, int interactive)
 
       do_sync ();
       pending_check_trustdb = 0;
+
+      /* Record the klists for the next incremental check.  */
+      if (wot)
+        {
+          char *fname = wot_state_fname ();
+          dotlock_t lockhd = lock_wot_state (fname);
+
+          wot_state_set_parms (wot, next_expire);
+          if (lockhd && (wot_state_update_marker (wot)
+                         || write_wot_state (fname, wot)))
+            remove_wot_state ();
+          unlock_wot_state (lockhd);
+          xfree (fname);
+        }
     }
+  release_wot_state (wot);
 
   return rc;
 }
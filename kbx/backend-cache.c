@@ -38,12 +38,16 @@
 #include "keybox-defs.h"
 
 
-/* Standard values for the number of buckets and the threshold we use
- * to flush items.  */
-#define NO_OF_KEY_ITEM_BUCKETS          383
-#define KEY_ITEMS_PER_BUCKET_THRESHOLD  40
-#define NO_OF_BLOB_BUCKETS              383
-#define BLOBS_PER_BUCKET_THRESHOLD      20
+/* The initial number of buckets of the hash tables.  The tables are
+ * grown when the average chain length exceeds MAX_CHAIN_LENGTH.  The
+ * sizes need to be a power of two.  */
+#define INITIAL_NO_OF_KEY_ITEM_BUCKETS  1024
+#define INITIAL_NO_OF_BLOB_BUCKETS      1024
+#define MAX_NO_OF_BUCKETS               (1 << 22)
+#define MAX_CHAIN_LENGTH                2
+
+/* The default memory budget of the cache in bytes.  */
+#define DEFAULT_CACHE_LIMIT  (DEFAULT_CACHE_SIZE * 1024 * 1024)
 
 
 /* Our definition of the backend handle.  */
@@ -58,9 +62,11 @@ struct backend_handle_s
 typedef struct blob_s
 {
   struct blob_s *next;
+  struct blob_s *lru_prev;    /* Links for the LRU list.  */
+  struct blob_s *lru_next;
+  unsigned long lastuse;      /* Value of LRU_CLOCK at the last use.  */
   enum pubkey_types pktype;
   unsigned int refcount;
-  unsigned int usecount;
   unsigned int datalen;
   unsigned char *data;        /* The actual data of length DATALEN.  */
   unsigned char ubid[UBID_LEN];
@@ -69,10 +75,9 @@ typedef struct blob_s
 
 static blob_t *blob_table;                /* Hash table with the blobs.   */
 static size_t blob_table_size;            /* Number of allocated buckets. */
-static unsigned int blob_table_threshold; /* Max. # of items per bucket.  */
-static unsigned int blob_table_added;     /* Number of items added.       */
-static unsigned int blob_table_dropped;   /* Number of items dropped.     */
 static blob_t blob_attic;                 /* List of freed blobs.         */
+static blob_t blob_lru_head;              /* Most recently used blob.     */
+static blob_t blob_lru_tail;              /* Least recently used blob.    */
 
 
 /* A list item to blob data.  This is so that a next operation on a
@@ -106,8 +111,10 @@ static bloblist_t bloblist_attic;  /* List of freed items.  */
 typedef struct key_item_s
 {
   struct key_item_s *next;
+  struct key_item_s *lru_prev; /* Links for the LRU list.  */
+  struct key_item_s *lru_next;
+  unsigned long lastuse;   /* Value of LRU_CLOCK at the last use.  */
   bloblist_t  blist;       /* List of blobs or NULL for not-found.  */
-  unsigned int usecount;
   unsigned int refcount;   /* Reference counter for this item.  */
   u32 kid_h;               /* Upper 4 bytes of the keyid.  */
   u32 kid_l;               /* Lower 4 bytes of the keyid.  */
@@ -115,38 +122,98 @@ typedef struct key_item_s
 
 static key_item_t *key_table;            /* Hash table with the keys.    */
 static size_t key_table_size;            /* Number of allocated buckets. */
-static unsigned int key_table_threshold; /* Max. # of items per bucket.  */
-static unsigned int key_table_added;     /* Number of items added.       */
-static unsigned int key_table_dropped;   /* Number of items dropped.     */
 static key_item_t key_item_attic;        /* List of freed items.         */
+static key_item_t key_lru_head;          /* Most recently used item.     */
+static key_item_t key_lru_tail;          /* Least recently used item.    */
 
 
+/* The clock used to decide which of the two LRU lists holds the
+ * least recently used item.  */
+static unsigned long lru_clock;
 
-
-/* The hash function we use for the key_table.  Must not call a system
- * function.  */
+/* The memory budget and the statistics of the cache.  */
+static struct
+{
+  size_t limit;                 /* Max. memory used for cached items. */
+  size_t used;                  /* Memory used for cached items.      */
+  unsigned int nblobs;          /* Number of cached blobs.            */
+  unsigned int nkeys;           /* Number of cached key items.        */
+  unsigned long blob_hits;
+  unsigned long blob_misses;
+  unsigned long key_hits;       /* Including not-found marks.         */
+  unsigned long key_misses;
+  unsigned long blobs_added;
+  unsigned long keys_added;
+  unsigned long blobs_evicted;
+  unsigned long keys_evicted;
+} cache_stats = { DEFAULT_CACHE_LIMIT };
+
+
+static void evict_items (void);
+
+
+
+/* The hash function we use for the blob_table.  Must not call a
+ * system function.  */
 static inline unsigned int
 blob_table_hasher (const unsigned char *ubid)
 {
-  return (ubid[0] << 16 | ubid[1]) % blob_table_size;
+  return buf32_to_u32 (ubid) & (blob_table_size - 1);
 }
 
 
-/* Runtime allocation of the key table.  This allows us to eventually
- * add an option to control the size.  */
+/* Runtime allocation of the blob table.  */
 static gpg_error_t
 blob_table_init (void)
 {
   if (blob_table)
     return 0;
-  blob_table_size = NO_OF_BLOB_BUCKETS;
-  blob_table_threshold  = BLOBS_PER_BUCKET_THRESHOLD;
+  blob_table_size = INITIAL_NO_OF_BLOB_BUCKETS;
   blob_table = xtrycalloc (blob_table_size, sizeof *blob_table);
   if (!blob_table)
     return gpg_error_from_syserror ();
   return 0;
 }
 
+
+/* Double the size of the blob table if the chains get too long.  On
+ * malloc failure we keep on using the current table.  */
+static void
+maybe_grow_blob_table (void)
+{
+  blob_t *newtable, *oldtable, b, b_next;
+  size_t oldsize, newsize, idx;
+
+  oldsize = blob_table_size;
+  if (cache_stats.nblobs <= oldsize * MAX_CHAIN_LENGTH
+      || oldsize >= MAX_NO_OF_BUCKETS)
+    return;
+  newsize = oldsize * 2;
+  newtable = xtrycalloc (newsize, sizeof *newtable);
+  if (!newtable)
+    return;
+  if (blob_table_size != oldsize)
+    {
+      /* Another thread was faster.  */
+      xfree (newtable);
+      return;
+    }
+
+  /* Rehash.  Note that we may not use any system call here.  */
+  oldtable = blob_table;
+  blob_table = newtable;
+  blob_table_size = newsize;
+  for (idx=0; idx < oldsize; idx++)
+    for (b = oldtable[idx]; b; b = b_next)
+      {
+        b_next = b->next;
+        b->next = blob_table[blob_table_hasher (b->ubid)];
+        blob_table[blob_table_hasher (b->ubid)] = b;
+      }
+  xfree (oldtable);
+}
+
+
 /* Free a blob.  This is done by moving it to the attic list.  */
 static void
 blob_unref (blob_t blob)
@@ -167,43 +234,74 @@ blob_unref (blob_t blob)
 }
 
 
+/* Mark BLOB as the most recently used blob.  */
+static void
+blob_touch (blob_t blob)
+{
+  blob->lastuse = ++lru_clock;
+  if (blob == blob_lru_head)
+    return;
+
+  /* Unlink.  */
+  blob->lru_prev->lru_next = blob->lru_next;
+  if (blob->lru_next)
+    blob->lru_next->lru_prev = blob->lru_prev;
+  else
+    blob_lru_tail = blob->lru_prev;
+
+  /* And put it to the front.  */
+  blob->lru_prev = NULL;
+  blob->lru_next = blob_lru_head;
+  blob_lru_head->lru_prev = blob;
+  blob_lru_head = blob;
+}
+
+
+/* Remove BLOB from the hash table and the LRU list and drop the
+ * reference held by the table.  */
+static void
+blob_table_remove (blob_t blob)
+{
+  blob_t *bp;
+
+  for (bp = &blob_table[blob_table_hasher (blob->ubid)]; *bp;
+       bp = &(*bp)->next)
+    if (*bp == blob)
+      {
+        *bp = blob->next;
+        break;
+      }
+
+  if (blob->lru_prev)
+    blob->lru_prev->lru_next = blob->lru_next;
+  else
+    blob_lru_head = blob->lru_next;
+  if (blob->lru_next)
+    blob->lru_next->lru_prev = blob->lru_prev;
+  else
+    blob_lru_tail = blob->lru_prev;
+  blob->lru_prev = blob->lru_next = NULL;
+
+  cache_stats.used -= sizeof *blob + blob->datalen;
+  cache_stats.nblobs--;
+  blob_unref (blob);
+}
+
+
 /* Given the hash value and the ubid, find the blob in the bucket.
- * Returns NULL if not found or the blob item if found.  Always
- * returns the the number of items searched, which is in the case of a
- * not-found the length of the chain.  */
+ * Returns NULL if not found or the blob item if found.  */
 static blob_t
-find_blob (unsigned int hash, const unsigned char *ubid,
-           unsigned int *r_count)
+find_blob (unsigned int hash, const unsigned char *ubid)
 {
   blob_t b;
-  unsigned int count = 0;
 
-  for (b = blob_table[hash]; b; b = b->next, count++)
+  for (b = blob_table[hash]; b; b = b->next)
     if (!memcmp (b->ubid, ubid, UBID_LEN))
       break;
-  if (r_count)
-    *r_count = count;
   return b;
 }
 
 
-/* Helper for the qsort in key_table_put.  */
-static int
-compare_blobs (const void *arg_a, const void *arg_b)
-{
-  const blob_t a = *(const blob_t *)arg_a;
-  const blob_t b = *(const blob_t *)arg_b;
-
-  /* Reverse sort on the usecount.  */
-  if (a->usecount > b->usecount)
-    return -1;
-  else if (a->usecount == b->usecount)
-    return 0;
-  else
-    return 1;
-}
-
-
 /* Put the blob (BLOBDATA, BLOBDATALEN) into the cache using UBID as
  * the index.  If it is already in the cache nothing happens.  */
 static void
@@ -212,12 +310,15 @@ blob_table_put (const unsigned char *ubid, enum pubkey_types pktype,
 {
   unsigned int hash;
   blob_t b;
-  unsigned int count, n;
+  unsigned int n;
   void *blobdatacopy = NULL;
 
-  hash = blob_table_hasher (ubid);
+  if (sizeof *b + blobdatalen > cache_stats.limit)
+    return;  /* Too large or caching disabled.  */
+
  find_again:
-  b = find_blob (hash, ubid, &count);
+  hash = blob_table_hasher (ubid);
+  b = find_blob (hash, ubid);
   if (b)
     {
       xfree (blobdatacopy);
@@ -235,72 +336,7 @@ blob_table_put (const unsigned char *ubid, enum pubkey_types pktype,
           return;  /* Out of core - ignore.  */
         }
       memcpy (blobdatacopy, blobdata, blobdatalen);
-    }
-
-  /* If the bucket is full remove a couple of items. */
-  if (count >= blob_table_threshold)
-    {
-      blob_t list_head, *list_tailp, b_next;
-      blob_t *array;
-      int narray, idx;
-
-      /* Unlink from the global list so that other threads don't
-       * disturb us.  If another thread adds or removes something only
-       * one will be the winner.  Bad luck for the dropped cache items
-       * but after all it is just a cache.  */
-      list_head = blob_table[hash];
-      blob_table[hash] = NULL;
-
-      /* Put all items into an array for sorting.  */
-      array = xtrycalloc (count, sizeof *array);
-      if (!array)
-        {
-          /* That's bad; give up all  items of the bucket.  */
-          log_info ("Note: malloc failed while purging blobs from the "
-                    "cache: %s\n", gpg_strerror (gpg_error_from_syserror ()));
-          goto leave_drop;
-        }
-      narray = 0;
-      for (b = list_head; b; b = b_next)
-        {
-          b_next = b->next;
-          array[narray++] = b;
-          b->next = NULL;
-        }
-      log_assert (narray == count);
-
-      /* Sort the array and put half of it onto a new list.  */
-      qsort (array, narray, sizeof *array, compare_blobs);
-      list_head = NULL;
-      list_tailp = &list_head;
-      for (idx=0; idx < narray/2; idx++)
-        {
-          *list_tailp = array[idx];
-          list_tailp = &array[idx]->next;
-        }
-
-      /* Put the new list into the bucket.  */
-      b = blob_table[hash];
-      blob_table[hash] = list_head;
-      list_head = b;
-
-      /* Free the remaining items and the array.  */
-      for (; idx < narray; idx++)
-        {
-          blob_unref (array[idx]);
-          blob_table_dropped++;
-        }
-      xfree (array);
-
-    leave_drop:
-      /* Free any items added in the meantime by other threads.  This
-       * is also used in case of a malloc problem (which won't update
-       * the counters, though). */
-      for ( ; list_head; list_head = b_next)
-        {
-          b_next = list_head->next;
-          blob_unref (list_head);
-        }
+      goto find_again;  /* Another thread may have added it.  */
     }
 
   /* Add an item to the bucket.  We allocate a whole block of items
@@ -339,11 +375,23 @@ blob_table_put (const unsigned char *ubid, enum pubkey_types pktype,
   b->data = blobdatacopy;
   b->datalen = blobdatalen;
   memcpy (b->ubid, ubid, UBID_LEN);
-  b->usecount = 1;
   b->refcount = 1;
   b->next = blob_table[hash];
   blob_table[hash] = b;
-  blob_table_added++;
+  b->lastuse = ++lru_clock;
+  b->lru_prev = NULL;
+  b->lru_next = blob_lru_head;
+  if (blob_lru_head)
+    blob_lru_head->lru_prev = b;
+  else
+    blob_lru_tail = b;
+  blob_lru_head = b;
+  cache_stats.used += sizeof *b + blobdatalen;
+  cache_stats.nblobs++;
+  cache_stats.blobs_added++;
+
+  evict_items ();
+  maybe_grow_blob_table ();
 }
 
 
@@ -356,43 +404,82 @@ blob_table_get (const unsigned char *ubid)
   blob_t b;
 
   hash = blob_table_hasher (ubid);
-  b = find_blob (hash, ubid, NULL);
+  b = find_blob (hash, ubid);
   if (b)
     {
-      b->usecount++;
+      blob_touch (b);
       b->refcount++;
+      cache_stats.blob_hits++;
       return b;  /* Found  */
     }
 
+  cache_stats.blob_misses++;
   return NULL;
 }
 
 
-
+
 /* The hash function we use for the key_table.  Must not call a system
  * function.  */
 static inline unsigned int
 key_table_hasher (u32 kid_l)
 {
-  return kid_l % key_table_size;
+  return kid_l & (key_table_size - 1);
 }
 
 
-/* Runtime allocation of the key table.  This allows us to eventually
- * add an option to control the size.  */
+/* Runtime allocation of the key table.  */
 static gpg_error_t
 key_table_init (void)
 {
   if (key_table)
     return 0;
-  key_table_size = NO_OF_KEY_ITEM_BUCKETS;
-  key_table_threshold  = KEY_ITEMS_PER_BUCKET_THRESHOLD;
+  key_table_size = INITIAL_NO_OF_KEY_ITEM_BUCKETS;
   key_table = xtrycalloc (key_table_size, sizeof *key_table);
   if (!key_table)
     return gpg_error_from_syserror ();
   return 0;
 }
 
+
+/* Double the size of the key table if the chains get too long.  On
+ * malloc failure we keep on using the current table.  */
+static void
+maybe_grow_key_table (void)
+{
+  key_item_t *newtable, *oldtable, ki, ki_next;
+  size_t oldsize, newsize, idx;
+
+  oldsize = key_table_size;
+  if (cache_stats.nkeys <= oldsize * MAX_CHAIN_LENGTH
+      || oldsize >= MAX_NO_OF_BUCKETS)
+    return;
+  newsize = oldsize * 2;
+  newtable = xtrycalloc (newsize, sizeof *newtable);
+  if (!newtable)
+    return;
+  if (key_table_size != oldsize)
+    {
+      /* Another thread was faster.  */
+      xfree (newtable);
+      return;
+    }
+
+  /* Rehash.  Note that we may not use any system call here.  */
+  oldtable = key_table;
+  key_table = newtable;
+  key_table_size = newsize;
+  for (idx=0; idx < oldsize; idx++)
+    for (ki = oldtable[idx]; ki; ki = ki_next)
+      {
+        ki_next = ki->next;
+        ki->next = key_table[key_table_hasher (ki->kid_l)];
+        key_table[key_table_hasher (ki->kid_l)] = ki;
+      }
+  xfree (oldtable);
+}
+
+
 /* Free a key_item.  This is done by moving it to the attic list.  */
 static void
 key_item_unref (key_item_t ki)
@@ -420,41 +507,109 @@ key_item_unref (key_item_t ki)
 }
 
 
-/* Given the hash value and the search info, find the key item in the
- * bucket.  Return NULL if not found or the key item if found.  Always
- * returns the the number of items searched, which is in the case of a
- * not-found the length of the chain.  Note that FPR may only be NULL
- * if FPRLEN is 0. */
-static key_item_t
-find_in_chain (unsigned int hash, u32 kid_h, u32 kid_l,
-               unsigned int *r_count)
+/* Mark the key item KI as the most recently used one.  */
+static void
+key_item_touch (key_item_t ki)
 {
-  key_item_t ki = key_table[hash];
-  unsigned int count = 0;
+  ki->lastuse = ++lru_clock;
+  if (ki == key_lru_head)
+    return;
 
-  for (; ki; ki = ki->next, count++)
-    if (ki->kid_h == kid_h && ki->kid_l == kid_l)
-      break;
-  if (r_count)
-    *r_count = count;
-  return ki;
+  /* Unlink.  */
+  ki->lru_prev->lru_next = ki->lru_next;
+  if (ki->lru_next)
+    ki->lru_next->lru_prev = ki->lru_prev;
+  else
+    key_lru_tail = ki->lru_prev;
+
+  /* And put it to the front.  */
+  ki->lru_prev = NULL;
+  ki->lru_next = key_lru_head;
+  key_lru_head->lru_prev = ki;
+  key_lru_head = ki;
 }
 
 
-/* Helper for the qsort in key_table_put.  */
-static int
-compare_key_items (const void *arg_a, const void *arg_b)
+/* Return the memory used by the key item KI.  */
+static size_t
+key_item_size (key_item_t ki)
 {
-  const key_item_t a = *(const key_item_t *)arg_a;
-  const key_item_t b = *(const key_item_t *)arg_b;
+  size_t n = sizeof *ki;
+  bloblist_t bl;
 
-  /* Reverse sort on the usecount.  */
-  if (a->usecount > b->usecount)
-    return -1;
-  else if (a->usecount == b->usecount)
-    return 0;
+  for (bl = ki->blist; bl; bl = bl->next)
+    n += sizeof *bl;
+  return n;
+}
+
+
+/* Remove KI from the hash table and the LRU list and drop the
+ * reference held by the table.  */
+static void
+key_table_remove (key_item_t ki)
+{
+  key_item_t *kp;
+
+  for (kp = &key_table[key_table_hasher (ki->kid_l)]; *kp;
+       kp = &(*kp)->next)
+    if (*kp == ki)
+      {
+        *kp = ki->next;
+        break;
+      }
+
+  if (ki->lru_prev)
+    ki->lru_prev->lru_next = ki->lru_next;
+  else
+    key_lru_head = ki->lru_next;
+  if (ki->lru_next)
+    ki->lru_next->lru_prev = ki->lru_prev;
   else
-    return 1;
+    key_lru_tail = ki->lru_prev;
+  ki->lru_prev = ki->lru_next = NULL;
+
+  cache_stats.used -= key_item_size (ki);
+  cache_stats.nkeys--;
+  key_item_unref (ki);
+}
+
+
+/* Remove the least recently used blobs and key items until the
+ * memory budget is met.  Both kinds of items are evicted in the
+ * order of their last use.  Note that we may not use any system call
+ * here.  */
+static void
+evict_items (void)
+{
+  while (cache_stats.used > cache_stats.limit
+         && (blob_lru_tail || key_lru_tail))
+    {
+      if (blob_lru_tail
+          && (!key_lru_tail || blob_lru_tail->lastuse <= key_lru_tail->lastuse))
+        {
+          blob_table_remove (blob_lru_tail);
+          cache_stats.blobs_evicted++;
+        }
+      else
+        {
+          key_table_remove (key_lru_tail);
+          cache_stats.keys_evicted++;
+        }
+    }
+}
+
+
+/* Given the hash value and the search info, find the key item in the
+ * bucket.  Return NULL if not found or the key item if found.  */
+static key_item_t
+find_in_chain (unsigned int hash, u32 kid_h, u32 kid_l)
+{
+  key_item_t ki = key_table[hash];
+
+  for (; ki; ki = ki->next)
+    if (ki->kid_h == kid_h && ki->kid_l == kid_l)
+      break;
+  return ki;
 }
 
 
@@ -545,85 +700,6 @@ new_bloblist_item (const unsigned char *fpr, unsigned int fprlen,
 }
 
 
-/* If the list of key item in the bucken HASH is full remove a couple
- * of them.  On error a diagnostic is printed and an error code
- * return.  Note that the error code GPG_ERR_TRUE is returned if any
- * flush and thus system calls were done.
- */
-static gpg_error_t
-maybe_flush_some_key_buckets (unsigned int hash, unsigned int count)
-{
-  gpg_error_t err;
-  key_item_t ki, list_head, *list_tailp, ki_next;
-  key_item_t *array;
-  int narray, idx;
-
-  if (count < key_table_threshold)
-    return 0;  /* Nothing to do.  */
-
-  /* Unlink from the global list so that other threads don't disturb
-   * us.  If another thread adds or removes something only one will be
-   * the winner.  Bad luck for the dropped cache items but after all
-   * it is just a cache.  */
-  list_head = key_table[hash];
-  key_table[hash] = NULL;
-
-  /* Put all items into an array for sorting.  */
-  array = xtrycalloc (count, sizeof *array);
-  if (!array)
-    {
-      /* That's bad; give up all items of the bucket.  */
-      err = gpg_error_from_syserror ();
-      log_info ("Note: malloc failed while purging from the cache: %s\n",
-                gpg_strerror (err));
-      goto leave;
-    }
-  narray = 0;
-  for (ki = list_head; ki; ki = ki_next)
-    {
-      ki_next = ki->next;
-      array[narray++] = ki;
-      ki->next = NULL;
-    }
-  log_assert (narray == count);
-
-  /* Sort the array and put half of it onto a new list.  */
-  qsort (array, narray, sizeof *array, compare_key_items);
-  list_head = NULL;
-  list_tailp = &list_head;
-  for (idx=0; idx < narray/2; idx++)
-    {
-      *list_tailp = array[idx];
-      list_tailp = &array[idx]->next;
-    }
-
-  /* Put the new list into the bucket.  */
-  ki = key_table[hash];
-  key_table[hash] = list_head;
-  list_head = ki;
-
-  /* Free the remaining items and the array.  */
-  for (; idx < narray; idx++)
-    {
-      key_item_unref (array[idx]);
-      key_table_dropped++;
-    }
-  xfree (array);
-  err = gpg_error (GPG_ERR_TRUE);
-
- leave:
-  /* Free any items added in the meantime by other threads.  This is
-   * also used in case of a malloc problem (which won't update the
-   * counters, though). */
-  for ( ; list_head; list_head = ki_next)
-    {
-      ki_next = list_head->next;
-      key_item_unref (list_head);
-    }
-  return err;
-}
-
-
 /* This is the core of
  *   key_table_put,
  *   key_table_put_no_fpr,
@@ -637,14 +713,16 @@ do_key_table_put (u32 kid_h, u32 kid_l,
   unsigned int hash;
   key_item_t ki;
   bloblist_t bl, bl_tail;
-  unsigned int count;
   int do_find_again;
   int mark_not_found = !fpr;
 
-  hash = key_table_hasher (kid_l);
+  if (!cache_stats.limit)
+    return;  /* Caching disabled.  */
+
  find_again:
   do_find_again = 0;
-  ki = find_in_chain (hash, kid_h, kid_l, &count);
+  hash = key_table_hasher (kid_l);
+  ki = find_in_chain (hash, kid_h, kid_l);
   if (ki)
     {
       if (mark_not_found)
@@ -673,18 +751,13 @@ do_key_table_put (u32 kid_h, u32 kid_l,
         bl_tail->next = bl;
       else
         ki->blist = bl;
+      key_item_touch (ki);
+      cache_stats.used += sizeof *bl;
+      evict_items ();
 
       return;
     }
 
-  /* If the bucket is full remove a couple of items. */
-  if (maybe_flush_some_key_buckets (hash, count))
-    {
-      /* During the function call another thread might have changed
-       * the bucket.  Thus we need to start over.  */
-      do_find_again = 1;
-    }
-
   if (!key_item_attic)
     {
       if (alloc_more_key_items ())
@@ -715,12 +788,24 @@ do_key_table_put (u32 kid_h, u32 kid_l,
 
   ki->kid_h = kid_h;
   ki->kid_l = kid_l;
-  ki->usecount = 1;
   ki->refcount = 1;
 
   ki->next = key_table[hash];
   key_table[hash] = ki;
-  key_table_added++;
+  ki->lastuse = ++lru_clock;
+  ki->lru_prev = NULL;
+  ki->lru_next = key_lru_head;
+  if (key_lru_head)
+    key_lru_head->lru_prev = ki;
+  else
+    key_lru_tail = ki;
+  key_lru_head = ki;
+  cache_stats.used += key_item_size (ki);
+  cache_stats.nkeys++;
+  cache_stats.keys_added++;
+
+  evict_items ();
+  maybe_grow_key_table ();
 }
 
 
@@ -793,10 +878,10 @@ key_table_get (u32 kid_h, u32 kid_l)
   key_item_t ki;
 
   hash = key_table_hasher (kid_l);
-  ki = find_in_chain (hash, kid_h, kid_l, NULL);
+  ki = find_in_chain (hash, kid_h, kid_l);
   if (ki)
     {
-      ki->usecount++;
+      key_item_touch (ki);
       ki->refcount++;
       return ki;  /* Found  */
     }
@@ -859,6 +944,54 @@ be_cache_initialize (void)
 }
 
 
+/* Set the memory budget of the cache to MBYTES MiB.  A value of 0
+ * disables the cache.  Items are evicted as needed.  */
+void
+be_cache_set_limit (unsigned int mbytes)
+{
+  cache_stats.limit = (size_t)mbytes * 1024 * 1024;
+  evict_items ();
+}
+
+
+/* Append the statistics of the cache as lines of the form
+ * "NAME VALUE" to MB.  */
+void
+be_cache_get_stats (membuf_t *mb)
+{
+  char line[100];
+
+  snprintf (line, sizeof line,
+            "limit %zu\n"
+            "used %zu\n", cache_stats.limit, cache_stats.used);
+  put_membuf_str (mb, line);
+  snprintf (line, sizeof line,
+            "blobs %u\n"
+            "keys %u\n", cache_stats.nblobs, cache_stats.nkeys);
+  put_membuf_str (mb, line);
+  snprintf (line, sizeof line,
+            "blob_hits %lu\n"
+            "blob_misses %lu\n",
+            cache_stats.blob_hits, cache_stats.blob_misses);
+  put_membuf_str (mb, line);
+  snprintf (line, sizeof line,
+            "key_hits %lu\n"
+            "key_misses %lu\n",
+            cache_stats.key_hits, cache_stats.key_misses);
+  put_membuf_str (mb, line);
+  snprintf (line, sizeof line,
+            "blobs_added %lu\n"
+            "keys_added %lu\n",
+            cache_stats.blobs_added, cache_stats.keys_added);
+  put_membuf_str (mb, line);
+  snprintf (line, sizeof line,
+            "blobs_evicted %lu\n"
+            "keys_evicted %lu\n",
+            cache_stats.blobs_evicted, cache_stats.keys_evicted);
+  put_membuf_str (mb, line);
+}
+
+
 /* Install a new resource and return a handle for that backend.  */
 gpg_error_t
 be_cache_add_resource (ctrl_t ctrl, backend_handle_t *r_hd)
@@ -908,7 +1041,10 @@ be_cache_release_resource (ctrl_t ctrl, backend_handle_t hd)
 
 
 /* Search for the keys described by (DESC,NDESC) and return them to
- * the caller.  BACKEND_HD is the handle for this backend and REQUEST
+ * the caller.  Note that kbxd_search does not yet call this function
+ * because the cache is never configured as the database; the cache
+ * is only filled by the other backends.  BACKEND_HD is the handle for
+ * this backend and REQUEST
  * is the current database request object.  On a cache hit either 0 or
  * GPG_ERR_NOT_FOUND is returned.  The former returns the item; the
  * latter indicates that the cache has known that the item won't be
@@ -955,6 +1091,10 @@ be_cache_search (ctrl_t ctrl, backend_handle_t backend_hd, db_request_t request,
         {
         case KEYDB_SEARCH_MODE_LONG_KID:
           ki = query_by_kid (desc[n].u.kid[0], desc[n].u.kid[1]);
+          if (ki)
+            cache_stats.key_hits++;
+          else
+            cache_stats.key_misses++;
           if (ki && ki->blist)
             {
               not_found = 0;
@@ -979,6 +1119,10 @@ be_cache_search (ctrl_t ctrl, backend_handle_t backend_hd, db_request_t request,
 
         case KEYDB_SEARCH_MODE_FPR:
           ki = query_by_fpr (desc[n].u.fpr, desc[n].fprlen);
+          if (ki)
+            cache_stats.key_hits++;
+          else
+            cache_stats.key_misses++;
           if (ki && ki->blist)
             {
               not_found = 0;
@@ -45,12 +45,45 @@ struct backend_handle_s
 };
 
 
+/* A cache of prepared statements for one connection.  The statements
+ * are kept until the connection is closed and are handed out again if
+ * the same SQL is requested.  */
+struct stmt_cache_s
+{
+  struct stmt_cache_s *next;
+  sqlite3_stmt *stmt;
+  char sql[1];
+};
+typedef struct stmt_cache_s *stmt_cache_t;
+
+
+/* A read-only connection to the database.  These connections are
+ * used for searches so that they can run in parallel with searches
+ * on other connections and - thanks to the WAL mode - without
+ * blocking the writer.  A reader connection is used only by one
+ * request at a time.  */
+struct reader_conn_s
+{
+  struct reader_conn_s *next;  /* Link for the list of idle readers.  */
+  sqlite3 *hd;                 /* The database handle.  */
+  stmt_cache_t stmts;          /* Prepared statements for HD.  */
+};
+typedef struct reader_conn_s *reader_conn_t;
+
+
 /* Definition of local request data.  */
 struct be_sqlite_local_s
 {
+  /* The reader connection used by this request or NULL to use the
+   * main database handle.  */
+  reader_conn_t conn;
+
   /* The statement object of the current select command.  */
   sqlite3_stmt *select_stmt;
 
+  /* The SELECT_STMT is owned by the statement cache of CONN.  */
+  unsigned int select_cached : 1;
+
   /* The column numbers for UIDNO and SUBKEY or 0.  */
   int select_col_uidno;
   int select_col_subkey;
@@ -65,6 +98,9 @@ struct be_sqlite_local_s
   /* Flag indicating that LASTUBID has a value.  */
   unsigned int lastubid_valid : 1;
 
+  /* The select needs to continue after LASTUBID.  */
+  unsigned int resume : 1;
+
   /* The current description index.  */
   unsigned int descidx;
 
@@ -88,17 +124,52 @@ static npth_mutex_t database_mutex = NPTH_MUTEX_INITIALIZER;
 static sqlite3 *database_hd;
 /* A lockfile used make sure only we are accessing the database.  */
 static dotlock_t database_lock;
+/* True if the full text search table for user ids is available.  */
+static int database_fts;
+/* Prepared statements for DATABASE_HD.  */
+static stmt_cache_t database_stmts;
+/* True if the database is in WAL mode and we may thus use reader
+ * connections.  */
+static int database_wal_mode;
+
+/* The end of most selects.  The select statement is reset after each
+ * returned blob so that neither a reader connection nor a read
+ * transaction is kept while the client processes the blob; the next
+ * search then runs the select again with ?9 bound to the last
+ * returned UBID.  */
+#define AFTER_LASTUBID " AND p.ubid > ?9 ORDER BY p.ubid"
+
+/* The maximum number of read-only connections we open in addition to
+ * the main database handle.  If all are in use further requests use
+ * the main database handle.  */
+#define MAX_READER_CONNS 8
+
+/* The list of currently unused reader connections and the total
+ * number of opened reader connections.  Both are protected by
+ * DATABASE_MUTEX.  */
+static reader_conn_t idle_readers;
+static unsigned int n_readers;
+
+/* State of a global transaction in bulk mode: Whether the search
+ * indices have been dropped, the number of keyblocks stored in the
+ * current batch and in total, and the start time of the batch.  All
+ * are protected by DATABASE_MUTEX.  */
+static int bulk_indices_dropped;
+static unsigned int batch_count;
+static unsigned long bulk_total;
+static struct timespec batch_start;
 
 /* The version of our current database schema and the maximum version
  * supported without migration.  */
-#define DATABASE_VERSION 2
-#define DATABASE_VERSION_MAX 2
+#define DATABASE_VERSION 3
+#define DATABASE_VERSION_MAX 3
 
 /* Table definitions for the database.  */
 static struct
 {
   const char *sql;
   const char *name;
+  const char *drop;  /* Used to drop an index only used for searching.  */
 } table_definitions[] =
   {
    { "PRAGMA foreign_keys = ON" },
@@ -158,6 +229,8 @@ static struct
 
    /* Table to allow fast access via user ids or mail addresses.  */
    { "CREATE TABLE IF NOT EXISTS userid ("
+     /* The row id; used to link the full text search table.  */
+     "id INTEGER PRIMARY KEY,"
      /* The full user id - for X.509 the Subject or altSubject.  */
      "uid  TEXT NOT NULL,"
      /* The mail address if available or NULL.  */
@@ -170,13 +243,21 @@ static struct
       * with 1 for the first user id in the keyblock.  */
      "uidno INTEGER NOT NULL,"
      /* The Unique Blob ID (possibly truncated fingerprint).  */
-     "ubid BLOB NOT NULL REFERENCES pubkey"
-     ")"  },
+     "ubid BLOB NOT NULL REFERENCES pubkey,"
+     /* The lowercased domain part of the mail address or NULL.  */
+     "domain TEXT"
+     ")", "userid" },
 
    /* Indices for the userid table.  */
-   { "CREATE INDEX IF NOT EXISTS userididx0 on userid (ubid)"     },
-   { "CREATE INDEX IF NOT EXISTS userididx1 on userid (uid)"      },
-   { "CREATE INDEX IF NOT EXISTS userididx3 on userid (addrspec)" },
+   { "CREATE INDEX IF NOT EXISTS userididx0 on userid (ubid)",
+     "uid-index" },
+   { "CREATE INDEX IF NOT EXISTS userididx1 on userid (uid)",
+     "uid-index", "DROP INDEX IF EXISTS userididx1" },
+   { "CREATE INDEX IF NOT EXISTS userididx3 on userid (addrspec)",
+     "uid-index", "DROP INDEX IF EXISTS userididx3" },
+   /* This index requires database version 3.  */
+   { "CREATE INDEX IF NOT EXISTS userididx4 on userid (domain)",
+     "uid-index-v3", "DROP INDEX IF EXISTS userididx4" },
 
    /* Table to allow fast access via s/n + issuer DN  (X.509 only).  */
    { "CREATE TABLE IF NOT EXISTS issuer ("
@@ -351,6 +432,71 @@ run_sql_prepare (const char *sqlstr, const char *extra, const char *extra2,
 }
 
 
+/* This is similar to run_sql_prepare but the statement is prepared
+ * for the database handle DB and taken from or stored in the
+ * statement cache CACHE.  The returned statement is reset and has no
+ * bindings; the caller may not finalize it but should reset it after
+ * use.  */
+static gpg_error_t
+run_sql_prepare_cached (sqlite3 *db, stmt_cache_t *cache,
+                        const char *sqlstr,
+                        const char *extra, const char *extra2,
+                        sqlite3_stmt **r_stmt)
+{
+  gpg_error_t err;
+  int res;
+  stmt_cache_t item;
+  char *buffer = NULL;
+
+  *r_stmt = NULL;
+  if (extra || extra2)
+    {
+      buffer = strconcat (sqlstr, extra?extra:"", extra2, NULL);
+      if (!buffer)
+        return gpg_error_from_syserror ();
+      sqlstr = buffer;
+    }
+
+  for (item = *cache; item; item = item->next)
+    if (!strcmp (item->sql, sqlstr))
+      break;
+  if (item)
+    {
+      sqlite3_reset (item->stmt);
+      sqlite3_clear_bindings (item->stmt);
+      *r_stmt = item->stmt;
+      xfree (buffer);
+      return 0;
+    }
+
+  item = xtrymalloc (sizeof *item + strlen (sqlstr));
+  if (!item)
+    {
+      err = gpg_error_from_syserror ();
+      xfree (buffer);
+      return err;
+    }
+  strcpy (item->sql, sqlstr);
+  res = sqlite3_prepare_v3 (db, sqlstr, -1, SQLITE_PREPARE_PERSISTENT,
+                            &item->stmt, NULL);
+  if (res)
+    {
+      err = diag_prepare_err (res, sqlstr);
+      xfree (item);
+    }
+  else
+    {
+      item->next = *cache;
+      *cache = item;
+      *r_stmt = item->stmt;
+      err = 0;
+    }
+  xfree (buffer);
+  return err;
+}
+
+
+
 /* Helper to bind a BLOB parameter to a statement.  */
 static gpg_error_t
 run_sql_bind_blob (sqlite3_stmt *stmt, int no,
@@ -446,6 +592,28 @@ run_sql_bind_text_like (sqlite3_stmt *stmt, int no, const char *value)
 }
 
 
+/* Return a malloced copy of STRING with the characters special to
+ * LIKE escaped by a backslash.  The pattern must be used with
+ * ESCAPE '\'.  Returns NULL and sets ERRNO on error.  */
+static char *
+escape_like (const char *string)
+{
+  char *buffer, *p;
+
+  buffer = p = xtrymalloc (2 * strlen (string) + 1);
+  if (!buffer)
+    return NULL;
+  for (; *string; string++)
+    {
+      if (*string == '%' || *string == '_' || *string == '\\')
+        *p++ = '\\';
+      *p++ = *string;
+    }
+  *p = 0;
+  return buffer;
+}
+
+
 /* Wrapper around sqlite3_step for use with simple functions.  */
 static gpg_error_t
 run_sql_step (sqlite3_stmt *stmt)
@@ -472,7 +640,20 @@ run_sql_step_for_select (sqlite3_stmt *stmt)
   gpg_error_t err;
   int res;
 
-  res = sqlite3_step (stmt);
+  if (sqlite3_db_handle (stmt) != database_hd)
+    {
+      /* A statement of a reader connection.  That connection is only
+       * used by the current request and thus we can run the step
+       * without holding our mutex or the npth lock.  This is what
+       * allows searches to use several cores.  */
+      release_mutex ();
+      npth_unprotect ();
+      res = sqlite3_step (stmt);
+      npth_protect ();
+      acquire_mutex ();
+    }
+  else
+    res = sqlite3_step (stmt);
   if (res == SQLITE_DONE || res == SQLITE_ROW)
     err = gpg_error (gpg_err_code_from_sqlite (res));
   else
@@ -620,7 +801,7 @@ migrate_from_v1_to_v2 (void)
         if (err)
           goto leave;
       }
-  err = set_config_value ("dbversion", STR2(DATABASE_VERSION));
+  err = set_config_value ("dbversion", "2");
   if (err)
     goto leave;
   err = run_sql_statement ("commit");
@@ -638,6 +819,221 @@ migrate_from_v1_to_v2 (void)
 }
 
 
+/* Migrate from database version 2 to 3.  This adds the column ID as
+ * an explicit row id and the column DOMAIN to the userid table.  An
+ * explicit row id is required because we use it to link the full
+ * text search table and a VACUUM may change implicit row ids.  As
+ * with the migration to version 2 the table needs to be rebuilt.  */
+static gpg_error_t
+migrate_from_v2_to_v3 (void)
+{
+  gpg_error_t err;
+  int idx;
+  const char *origsql = NULL;
+  char *sql = NULL;
+  int intransaction = 0;
+
+  log_info ("migrating database from version 2 to version 3\n");
+  for (idx=0; idx < DIM(table_definitions); idx++)
+    if (table_definitions[idx].name
+        && !strcmp (table_definitions[idx].name, "userid"))
+      {
+        origsql = table_definitions[idx].sql;
+        break;
+      }
+  log_assert (origsql);
+  sql = replace_substr (origsql, " userid ", " userid_new ");
+  if (!sql)
+    return gpg_error_from_syserror ();
+
+  err = run_sql_statement ("begin transaction");
+  if (err)
+    goto leave;
+  intransaction = 1;
+  err = run_sql_statement (sql);
+  if (err)
+    goto leave;
+  err = run_sql_statement ("INSERT"
+                           " INTO userid_new(uid,addrspec,type,uidno,ubid,"
+                           "                 domain)"
+                           " SELECT uid, addrspec, type, uidno, ubid,"
+                           "  CASE WHEN instr(addrspec,'@') > 0"
+                           "   THEN lower(substr(addrspec,"
+                           "                     instr(addrspec,'@')+1))"
+                           "  END"
+                           " FROM userid");
+  if (err)
+    goto leave;
+  err = run_sql_statement ("DROP TABLE userid");
+  if (err)
+    goto leave;
+  err = run_sql_statement ("ALTER TABLE userid_new RENAME TO userid");
+  if (err)
+    goto leave;
+  for (idx=0; idx < DIM(table_definitions); idx++)
+    if (table_definitions[idx].name
+        && (!strcmp (table_definitions[idx].name, "uid-index")
+            || !strcmp (table_definitions[idx].name, "uid-index-v3")))
+      {
+        err = run_sql_statement (table_definitions[idx].sql);
+        if (err)
+          goto leave;
+      }
+  /* The full text search table needs to be rebuilt.  */
+  err = set_config_value ("userid_fts", "stale");
+  if (err)
+    goto leave;
+  err = set_config_value ("dbversion", "3");
+  if (err)
+    goto leave;
+  err = run_sql_statement ("commit");
+  if (err)
+    goto leave;
+  intransaction = 0;
+  log_info ("database migration succeeded\n");
+
+ leave:
+  if (intransaction && run_sql_statement ("rollback"))
+    log_error ("Warning: database rollback failed - should not happen!\n");
+  xfree (sql);
+  return err;
+}
+
+
+/* Create the full text search table for the user ids if the SQLite
+ * library supports it.  The table uses the trigram tokenizer so that
+ * LIKE patterns as used for substring searches can use the index.
+ * The table is maintained by our store and delete functions; if it
+ * has not been maintained, for example because the database was
+ * used with an SQLite without FTS5 support, it is rebuilt.  Failure
+ * to create the table is not fatal; we then fall back to plain LIKE
+ * on the userid table.  */
+static gpg_error_t
+setup_fts (void)
+{
+  gpg_error_t err;
+  char *value = NULL;
+
+  database_fts = 0;
+  if (!sqlite3_compileoption_used ("ENABLE_FTS5")
+      || sqlite3_libversion_number () < 3034000)
+    {
+      /* No FTS5 or no trigram tokenizer.  Changes to the userid
+       * table won't be reflected in an existing table.  */
+      log_info ("note: SQLite has no trigram full text search"
+                " - substring searches will be slow\n");
+      return set_config_value ("userid_fts", "stale");
+    }
+
+  err = run_sql_statement ("CREATE VIRTUAL TABLE IF NOT EXISTS userid_fts"
+                           " USING fts5(uid, addrspec,"
+                           "  content='userid', content_rowid='id',"
+                           "  tokenize='trigram')");
+  if (err)
+    return set_config_value ("userid_fts", "stale");
+
+  err = get_config_value ("userid_fts", &value);
+  if (!err && !strcmp (value, "ok"))
+    ;
+  else if (err && gpg_err_code (err) != GPG_ERR_NOT_FOUND)
+    goto leave;
+  else
+    {
+      if (!opt.quiet)
+        log_info ("building the full text search table\n");
+      err = run_sql_statement ("INSERT INTO userid_fts(userid_fts)"
+                               " VALUES('rebuild')");
+      if (!err)
+        err = set_config_value ("userid_fts", "ok");
+      if (err)
+        goto leave;
+    }
+
+  database_fts = 1;
+
+ leave:
+  xfree (value);
+  return err;
+}
+
+
+/* Switch the database to WAL mode.  In this mode readers and the
+ * writer don't block each other and we can use reader connections.
+ * Failure to do so is not fatal; we then stick to the main database
+ * handle.  */
+static void
+enable_wal_mode (void)
+{
+  gpg_error_t err;
+  sqlite3_stmt *stmt;
+  const char *s;
+
+  database_wal_mode = 0;
+  err = run_sql_prepare ("PRAGMA journal_mode = WAL", NULL, NULL, &stmt);
+  if (err)
+    return;
+  err = run_sql_step_for_select (stmt);
+  if (gpg_err_code (err) == GPG_ERR_SQL_ROW)
+    {
+      s = sqlite3_column_text (stmt, 0);
+      if (s && !ascii_strcasecmp (s, "wal"))
+        database_wal_mode = 1;
+    }
+  sqlite3_finalize (stmt);
+
+  if (!database_wal_mode)
+    log_info ("database not in WAL mode - searches will be serialized\n");
+  else if (opt.verbose)
+    log_info ("database is in WAL mode\n");
+}
+
+
+/* Return a reader connection for the database FILENAME or NULL if
+ * none is available.  The caller must hold the mutex.  */
+static reader_conn_t
+get_reader_conn (const char *filename)
+{
+  reader_conn_t conn;
+  int res;
+
+  if (!database_wal_mode)
+    return NULL;
+
+  if (idle_readers)
+    {
+      conn = idle_readers;
+      idle_readers = conn->next;
+      conn->next = NULL;
+      return conn;
+    }
+
+  if (n_readers >= MAX_READER_CONNS)
+    return NULL;
+
+  conn = xtrycalloc (1, sizeof *conn);
+  if (!conn)
+    return NULL;
+  res = sqlite3_open_v2 (filename, &conn->hd,
+                         SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, NULL);
+  if (res)
+    {
+      log_info ("error opening reader connection for '%s': %s\n",
+                filename, sqlite3_errstr (res));
+      sqlite3_close (conn->hd);
+      xfree (conn);
+      return NULL;
+    }
+  sqlite3_extended_result_codes (conn->hd, 1);
+  /* A checkpoint by the writer may shortly lock out readers.  */
+  sqlite3_busy_timeout (conn->hd, 1000);
+  n_readers++;
+  if (opt.verbose)
+    log_info ("opened reader connection %u\n", n_readers);
+  return conn;
+}
+
+
+
 
 /* Create and initialize a new SQL database file if it does not
  * exists; else open it and check that all required objects are
@@ -715,10 +1111,15 @@ create_or_open_database (ctrl_t ctrl, const char *filename)
   /* Enable extended error codes.  */
   sqlite3_extended_result_codes (database_hd, 1);
 
+  enable_wal_mode ();
+
   /* Create the tables if needed.  */
   dbversion = 0; /* unknown.  */
   for (idx=0; idx < DIM(table_definitions); idx++)
     {
+      if (dbversion && dbversion < 3 && table_definitions[idx].name
+          && !strcmp (table_definitions[idx].name, "uid-index-v3"))
+        continue;  /* Will be created by the migration.  */
       err = run_sql_statement (table_definitions[idx].sql);
       if (err)
         goto leave;
@@ -739,7 +1140,7 @@ create_or_open_database (ctrl_t ctrl, const char *filename)
               err = 0;
               dbversion = 0;
             }
-          else if ((dbversion = atoi (value)) < DATABASE_VERSION
+          else if ((dbversion = atoi (value)) < 1
                    || dbversion > DATABASE_VERSION_MAX)
             {
               log_error ("database version %d is not valid\n", dbversion);
@@ -775,16 +1176,26 @@ create_or_open_database (ctrl_t ctrl, const char *filename)
       if (!err)
         err = set_config_value ("created", isotimestamp (gnupg_get_time ()));
     }
-  else if (dbversion == 1 && DATABASE_VERSION == 2)
-    err = migrate_from_v1_to_v2 ();
   else if (baddbversion)
     {
       log_info ("no migration procedure for this database version available\n");
       err = gpg_error (GPG_ERR_NOT_SUPPORTED);
     }
   else
-    err = 0;
+    {
+      err = 0;
+      if (dbversion == 1)
+        {
+          err = migrate_from_v1_to_v2 ();
+          dbversion = 2;
+        }
+      if (!err && dbversion == 2)
+        err = migrate_from_v2_to_v3 ();
+    }
+  if (err)
+    goto leave;
 
+  err = setup_fts ();
   if (err)
     goto leave;
 
@@ -853,49 +1264,234 @@ be_sqlite_init_local (backend_handle_t backend_hd, db_request_part_t part)
 }
 
 
+/* Release the select statement of CTX.  */
+static void
+release_select_stmt (be_sqlite_local_t ctx)
+{
+  if (!ctx->select_stmt)
+    return;
+  if (ctx->select_cached)
+    sqlite3_reset (ctx->select_stmt);
+  else
+    sqlite3_finalize (ctx->select_stmt);
+  ctx->select_stmt = NULL;
+  ctx->select_cached = 0;
+}
+
+
+/* Put the reader connection of CTX back into the list of idle
+ * connections.  A select statement of that connection is released
+ * first because it may not be used by another request.  The caller
+ * must hold the mutex.  */
+static void
+put_reader_conn (be_sqlite_local_t ctx)
+{
+  if (!ctx->conn)
+    return;
+
+  if (ctx->select_cached)
+    release_select_stmt (ctx);
+  ctx->conn->next = idle_readers;
+  idle_readers = ctx->conn;
+  ctx->conn = NULL;
+}
+
+
 /* Release local data of a sqlite request part.  */
 void
 be_sqlite_release_local (be_sqlite_local_t ctx)
 {
-  if (ctx->select_stmt)
-    sqlite3_finalize (ctx->select_stmt);
+  release_select_stmt (ctx);
+  acquire_mutex ();
+  put_reader_conn (ctx);
+  release_mutex ();
   xfree (ctx);
 }
 
 
+/* Prepare the select statement SQLSTR with the optional EXTRA and
+ * EXTRA2 parts for CTX.  Outside of a global transaction the reader
+ * connection of CTX is used if there is one.  Within a transaction
+ * we need to use the main database handle so that the search sees
+ * the changes done so far.  */
+static gpg_error_t
+prepare_select (be_sqlite_local_t ctx, const char *sqlstr,
+                const char *extra, const char *extra2)
+{
+  gpg_error_t err;
+
+  log_assert (!ctx->select_stmt);
+  if (ctx->conn && !opt.active_transaction)
+    {
+      err = run_sql_prepare_cached (ctx->conn->hd, &ctx->conn->stmts,
+                                    sqlstr, extra, extra2, &ctx->select_stmt);
+      if (!err)
+        ctx->select_cached = 1;
+    }
+  else
+    err = run_sql_prepare (sqlstr, extra, extra2, &ctx->select_stmt);
+  return err;
+}
+
+
+/* Start the SQL transaction for a requested global transaction.  In
+ * bulk mode the indices which are only used for searching and the
+ * full text search table are not maintained; they are rebuilt once
+ * by finish_bulk_mode.  */
+static gpg_error_t
+begin_global_transaction (void)
+{
+  gpg_error_t err;
+  int idx;
+
+  err = run_sql_statement ("begin transaction");
+  if (err)
+    return err;
+  opt.active_transaction = 1;
+  batch_count = 0;
+  npth_clock_gettime (&batch_start);
+
+  if (opt.bulk_mode && !bulk_indices_dropped)
+    {
+      for (idx=0; idx < DIM(table_definitions); idx++)
+        if (table_definitions[idx].drop)
+          {
+            err = run_sql_statement (table_definitions[idx].drop);
+            if (err)
+              return err;
+          }
+      if (database_fts)
+        {
+          /* Marking the table as stale makes sure that it will be
+           * rebuilt even if we are terminated in bulk mode.  */
+          err = set_config_value ("userid_fts", "stale");
+          if (err)
+            return err;
+          database_fts = 0;
+        }
+      bulk_indices_dropped = 1;
+      if (opt.verbose)
+        log_info ("bulk mode: search indices dropped\n");
+    }
+
+  return 0;
+}
+
+
+/* Called after each store in a global transaction.  If a batch size
+ * has been set and that many keyblocks have been stored, the
+ * transaction is committed; the next store starts a new one.  The
+ * throughput of the batch is reported to the client.  */
+static gpg_error_t
+maybe_commit_batch (ctrl_t ctrl)
+{
+  gpg_error_t err;
+  struct timespec now;
+  unsigned long msecs;
+
+  batch_count++;
+  bulk_total++;
+  if (!opt.transaction_batch_size || batch_count < opt.transaction_batch_size)
+    return 0;
+
+  err = run_sql_statement ("commit");
+  if (err)
+    return err;
+  opt.active_transaction = 0;
+
+  npth_clock_gettime (&now);
+  msecs = ((now.tv_sec - batch_start.tv_sec) * 1000
+           + (now.tv_nsec - batch_start.tv_nsec) / 1000000);
+  if (opt.verbose)
+    log_info ("bulk mode: committed %u keyblocks in %lu ms"
+              " (%lu total, %lu keyblocks/s)\n",
+              batch_count, msecs, bulk_total,
+              msecs? (unsigned long)batch_count * 1000 / msecs : 0);
+  /* A failure to send the status line is not a reason to fail the
+   * store operation.  */
+  kbxd_status_printf (ctrl, "BATCH_COMMITTED", "%u %lu %lu",
+                      batch_count, bulk_total, msecs);
+  batch_count = 0;
+  return 0;
+}
+
+
+/* Leave the bulk mode at the end of a global transaction and rebuild
+ * the indices dropped by begin_global_transaction.  */
+static gpg_error_t
+finish_bulk_mode (void)
+{
+  gpg_error_t err = 0;
+  int idx;
+
+  opt.bulk_mode = 0;
+  opt.transaction_batch_size = 0;
+  bulk_total = 0;
+  if (!bulk_indices_dropped)
+    return 0;
+  bulk_indices_dropped = 0;
+
+  if (!opt.quiet)
+    log_info ("bulk mode: re-creating the search indices\n");
+  for (idx=0; !err && idx < DIM(table_definitions); idx++)
+    if (table_definitions[idx].drop)
+      err = run_sql_statement (table_definitions[idx].sql);
+  if (!err)
+    err = setup_fts ();
+  if (err)
+    log_error ("error re-creating the search indices: %s\n",
+               gpg_strerror (err));
+  return err;
+}
+
+
 gpg_error_t
 be_sqlite_rollback (void)
 {
-  opt.in_transaction = 0;
-  if (!opt.active_transaction)
-    return 0;  /* Nothing to do.  */
+  gpg_error_t err = 0;
 
-  if (!database_hd)
+  opt.in_transaction = 0;
+  if (opt.active_transaction)
     {
-      log_error ("Warning: No database handle for global rollback\n");
-      return gpg_error (GPG_ERR_INTERNAL);
+      if (!database_hd)
+        {
+          log_error ("Warning: No database handle for global rollback\n");
+          return gpg_error (GPG_ERR_INTERNAL);
+        }
+
+      opt.active_transaction = 0;
+      err = run_sql_statement ("rollback");
     }
 
-  opt.active_transaction = 0;
-  return run_sql_statement ("rollback");
+  /* Batches already committed are not rolled back and thus we need
+   * to rebuild the indices in any case.  */
+  if (!err)
+    err = finish_bulk_mode ();
+  return err;
 }
 
 
 gpg_error_t
 be_sqlite_commit (void)
 {
-  opt.in_transaction = 0;
-  if (!opt.active_transaction)
-    return 0;  /* Nothing to do.  */
+  gpg_error_t err = 0;
 
-  if (!database_hd)
+  opt.in_transaction = 0;
+  if (opt.active_transaction)
     {
-      log_error ("Warning: No database handle for global commit\n");
-      return gpg_error (GPG_ERR_INTERNAL);
+      if (!database_hd)
+        {
+          log_error ("Warning: No database handle for global commit\n");
+          return gpg_error (GPG_ERR_INTERNAL);
+        }
+
+      opt.active_transaction = 0;
+      err = run_sql_statement ("commit");
     }
 
-  opt.active_transaction = 0;
-  return run_sql_statement ("commit");
+  if (!err)
+    err = finish_bulk_mode ();
+  return err;
 }
 
 
@@ -974,6 +1570,7 @@ run_select_statement (ctrl_t ctrl, be_sqlite_local_t ctx,
 {
   gpg_error_t err = 0;
   unsigned int descidx;
+  KeydbSearchMode mode;
   const char *extra = NULL;
   unsigned char kidbuf[8];
   const char *s;
@@ -987,23 +1584,30 @@ run_select_statement (ctrl_t ctrl, be_sqlite_local_t ctx,
       goto leave;
     }
 
+  /* A search continued after FIRST runs the FIRST select again.  */
+  mode = desc[descidx].mode;
+  if (mode == KEYDB_SEARCH_MODE_NEXT && ctx->resume)
+    mode = KEYDB_SEARCH_MODE_FIRST;
+
   /* Check whether we can reuse the current select statement.  */
   if (!ctx->select_stmt)
     ;
-  else if (ctx->select_mode != desc[descidx].mode)
-    {
-      sqlite3_finalize (ctx->select_stmt);
-      ctx->select_stmt = NULL;
-    }
+  else if (ctx->select_mode != mode)
+    release_select_stmt (ctx);
   else if (ctx->filter_opgp != ctrl->filter_opgp
            || ctx->filter_x509 != ctrl->filter_x509)
     {
       /* The filter flags changed, thus we can't reuse the statement.  */
-      sqlite3_finalize (ctx->select_stmt);
-      ctx->select_stmt = NULL;
+      release_select_stmt (ctx);
+    }
+  else if ((ctx->conn && !opt.active_transaction) != ctx->select_cached)
+    {
+      /* A transaction started or ended; we need to switch between the
+       * reader connection and the main database handle.  */
+      release_select_stmt (ctx);
     }
 
-  ctx->select_mode = desc[descidx].mode;
+  ctx->select_mode = mode;
   ctx->filter_opgp = ctrl->filter_opgp;
   ctx->filter_x509 = ctrl->filter_x509;
 
@@ -1028,7 +1632,7 @@ run_select_statement (ctrl_t ctrl, be_sqlite_local_t ctx,
 
 
   ctx->select_col_uidno = ctx->select_col_subkey = 0;
-  switch (desc[descidx].mode)
+  switch (mode)
     {
     case KEYDB_SEARCH_MODE_NONE:
       never_reached ();
@@ -1038,25 +1642,27 @@ run_select_statement (ctrl_t ctrl, be_sqlite_local_t ctx,
     case KEYDB_SEARCH_MODE_EXACT:
       ctx->select_col_uidno = 5;
       if (!ctx->select_stmt)
-        err = run_sql_prepare ("SELECT p.ubid, p.type, p.ephemeral, p.revoked,"
-                               " p.keyblob, u.uidno"
-                               " FROM pubkey as p, userid as u"
-                               " WHERE p.ubid = u.ubid AND u.uid = ?1",
-                               extra, " ORDER BY p.ubid", &ctx->select_stmt);
+        err = prepare_select (ctx,
+                              "SELECT p.ubid, p.type, p.ephemeral, p.revoked,"
+                              " p.keyblob, u.uidno"
+                              " FROM pubkey as p, userid as u"
+                              " WHERE p.ubid = u.ubid AND u.uid = ?1",
+                              extra, AFTER_LASTUBID);
       if (!err)
         err = run_sql_bind_text (ctx->select_stmt, 1, desc[descidx].u.name);
       break;
     case KEYDB_SEARCH_MODE_MAIL:
       ctx->select_col_uidno = 5;
       if (!ctx->select_stmt)
-        err = run_sql_prepare ("SELECT p.ubid, p.type, p.ephemeral, p.revoked,"
-                               " p.keyblob, u.uidno"
-                               " FROM pubkey as p, userid as u"
-                               " WHERE p.ubid = u.ubid AND u.addrspec = ?1",
-                               extra, " ORDER BY p.ubid", &ctx->select_stmt);
+        err = prepare_select (ctx,
+                              "SELECT p.ubid, p.type, p.ephemeral, p.revoked,"
+                              " p.keyblob, u.uidno"
+                              " FROM pubkey as p, userid as u"
+                              " WHERE p.ubid = u.ubid AND u.addrspec = ?1",
+                              extra, AFTER_LASTUBID);
       if (!err)
         {
-          if (desc[descidx].mode == KEYDB_SEARCH_MODE_MAIL)
+          if (mode == KEYDB_SEARCH_MODE_MAIL)
             {
               char *mail = xtrystrdup (desc[descidx].u.name);
 
@@ -1091,12 +1697,22 @@ run_select_statement (ctrl_t ctrl, be_sqlite_local_t ctx,
 
     case KEYDB_SEARCH_MODE_MAILSUB:
       ctx->select_col_uidno = 5;
-      if (!ctx->select_stmt)
-        err = run_sql_prepare ("SELECT p.ubid, p.type, p.ephemeral, p.revoked,"
-                               " p.keyblob, u.uidno"
-                               " FROM pubkey as p, userid as u"
-                               " WHERE p.ubid = u.ubid AND u.addrspec LIKE ?1",
-                               extra, " ORDER BY p.ubid", &ctx->select_stmt);
+      if (!ctx->select_stmt && database_fts)
+        err = prepare_select (ctx,
+                              "SELECT p.ubid, p.type, p.ephemeral, p.revoked,"
+                              " p.keyblob, u.uidno"
+                              " FROM pubkey as p, userid as u"
+                              " WHERE p.ubid = u.ubid AND u.id IN"
+                              " (SELECT rowid FROM userid_fts"
+                              "  WHERE addrspec LIKE ?1)",
+                              extra, AFTER_LASTUBID);
+      else if (!ctx->select_stmt)
+        err = prepare_select (ctx,
+                              "SELECT p.ubid, p.type, p.ephemeral, p.revoked,"
+                              " p.keyblob, u.uidno"
+                              " FROM pubkey as p, userid as u"
+                              " WHERE p.ubid = u.ubid AND u.addrspec LIKE ?1",
+                              extra, AFTER_LASTUBID);
       if (!err)
         err = run_sql_bind_text_like (ctx->select_stmt, 1,
                                       desc[descidx].u.name);
@@ -1104,30 +1720,94 @@ run_select_statement (ctrl_t ctrl, be_sqlite_local_t ctx,
 
     case KEYDB_SEARCH_MODE_SUBSTR:
       ctx->select_col_uidno = 5;
-      if (!ctx->select_stmt)
-        err = run_sql_prepare ("SELECT p.ubid, p.type, p.ephemeral, p.revoked,"
-                               " p.keyblob, u.uidno"
-                               " FROM pubkey as p, userid as u"
-                               " WHERE p.ubid = u.ubid AND u.uid LIKE ?1",
-                               extra, " ORDER BY p.ubid", &ctx->select_stmt);
+      if (!ctx->select_stmt && database_fts)
+        err = prepare_select (ctx,
+                              "SELECT p.ubid, p.type, p.ephemeral, p.revoked,"
+                              " p.keyblob, u.uidno"
+                              " FROM pubkey as p, userid as u"
+                              " WHERE p.ubid = u.ubid AND u.id IN"
+                              " (SELECT rowid FROM userid_fts"
+                              "  WHERE uid LIKE ?1)",
+                              extra, AFTER_LASTUBID);
+      else if (!ctx->select_stmt)
+        err = prepare_select (ctx,
+                              "SELECT p.ubid, p.type, p.ephemeral, p.revoked,"
+                              " p.keyblob, u.uidno"
+                              " FROM pubkey as p, userid as u"
+                              " WHERE p.ubid = u.ubid AND u.uid LIKE ?1",
+                              extra, AFTER_LASTUBID);
       if (!err)
         err = run_sql_bind_text_like (ctx->select_stmt, 1,
                                       desc[descidx].u.name);
       break;
 
     case KEYDB_SEARCH_MODE_MAILEND:
+      /* Match all mail addresses in the given domain and its
+       * subdomains.  The full text search table can't be used with
+       * an ESCAPE clause and is thus only used if the domain has no
+       * characters special to LIKE.  */
+      ctx->select_col_uidno = 5;
+      if (strpbrk (desc[descidx].u.name, "%_\\"))
+        release_select_stmt (ctx);
+      if (!ctx->select_stmt && database_fts
+          && !strpbrk (desc[descidx].u.name, "%_\\"))
+        err = prepare_select (ctx,
+                              "SELECT p.ubid, p.type, p.ephemeral, p.revoked,"
+                              " p.keyblob, u.uidno"
+                              " FROM pubkey as p, userid as u"
+                              " WHERE p.ubid = u.ubid"
+                              " AND (u.domain = ?1 OR u.id IN"
+                              "  (SELECT rowid FROM userid_fts"
+                              "   WHERE addrspec LIKE '%.' || ?1))",
+                              extra, AFTER_LASTUBID);
+      else if (!ctx->select_stmt)
+        err = prepare_select (ctx,
+                              "SELECT p.ubid, p.type, p.ephemeral, p.revoked,"
+                              " p.keyblob, u.uidno"
+                              " FROM pubkey as p, userid as u"
+                              " WHERE p.ubid = u.ubid"
+                              " AND (u.domain = ?1"
+                              "      OR u.domain LIKE '%.' || ?2"
+                              "         ESCAPE '\\')",
+                              extra, AFTER_LASTUBID);
+      if (!err)
+        {
+          char *domain = xtrystrdup (desc[descidx].u.name);
+          char *pattern = NULL;
+
+          if (!domain)
+            err = gpg_error_from_syserror ();
+          else
+            {
+              ascii_strlwr (domain);
+              err = run_sql_bind_text (ctx->select_stmt, 1, domain);
+              if (!err && sqlite3_bind_parameter_name (ctx->select_stmt, 2))
+                {
+                  pattern = escape_like (domain);
+                  if (!pattern)
+                    err = gpg_error_from_syserror ();
+                  else
+                    err = run_sql_bind_text (ctx->select_stmt, 2, pattern);
+                }
+              xfree (pattern);
+              xfree (domain);
+            }
+        }
+      break;
+
     case KEYDB_SEARCH_MODE_WORDS:
       err = gpg_error (GPG_ERR_NOT_IMPLEMENTED);
       break;
 
     case KEYDB_SEARCH_MODE_ISSUER:
       if (!ctx->select_stmt)
-        err = run_sql_prepare ("SELECT p.ubid, p.type, p.ephemeral, p.revoked,"
-                               " p.keyblob"
-                               " FROM pubkey as p, issuer as i"
-                               " WHERE p.ubid = i.ubid"
-                               " AND i.dn = $1",
-                               extra, " ORDER BY p.ubid", &ctx->select_stmt);
+        err = prepare_select (ctx,
+                              "SELECT p.ubid, p.type, p.ephemeral, p.revoked,"
+                              " p.keyblob"
+                              " FROM pubkey as p, issuer as i"
+                              " WHERE p.ubid = i.ubid"
+                              " AND i.dn = $1",
+                              extra, AFTER_LASTUBID);
       if (!err)
         err = run_sql_bind_text (ctx->select_stmt, 1,
                                  desc[descidx].u.name);
@@ -1143,13 +1823,13 @@ run_select_statement (ctrl_t ctrl, be_sqlite_local_t ctx,
       else
         {
           if (!ctx->select_stmt)
-            err = run_sql_prepare ("SELECT p.ubid, p.type, p.ephemeral,"
-                                   " p.revoked, p.keyblob"
-                                   " FROM pubkey as p, issuer as i"
-                                   " WHERE p.ubid = i.ubid"
-                                   " AND i.sn = $1 AND i.dn = $2",
-                                   extra, " ORDER BY p.ubid",
-                                   &ctx->select_stmt);
+            err = prepare_select (ctx,
+                                  "SELECT p.ubid, p.type, p.ephemeral,"
+                                  " p.revoked, p.keyblob"
+                                  " FROM pubkey as p, issuer as i"
+                                  " WHERE p.ubid = i.ubid"
+                                  " AND i.sn = $1 AND i.dn = $2",
+                                  extra, AFTER_LASTUBID);
           if (!err)
             err = run_sql_bind_ntext (ctx->select_stmt, 1,
                                       desc[descidx].sn, desc[descidx].snlen);
@@ -1169,12 +1849,13 @@ run_select_statement (ctrl_t ctrl, be_sqlite_local_t ctx,
     case KEYDB_SEARCH_MODE_SUBJECT:
       ctx->select_col_uidno = 5;
       if (!ctx->select_stmt)
-        err = run_sql_prepare ("SELECT p.ubid, p.type, p.ephemeral, p.revoked,"
-                               " p.keyblob, u.uidno"
-                               " FROM pubkey as p, userid as u"
-                               " WHERE p.ubid = u.ubid"
-                               " AND u.uid = $1",
-                               extra, " ORDER BY p.ubid", &ctx->select_stmt);
+        err = prepare_select (ctx,
+                              "SELECT p.ubid, p.type, p.ephemeral, p.revoked,"
+                              " p.keyblob, u.uidno"
+                              " FROM pubkey as p, userid as u"
+                              " WHERE p.ubid = u.ubid"
+                              " AND u.uid = $1",
+                              extra, AFTER_LASTUBID);
       if (!err)
         err = run_sql_bind_text (ctx->select_stmt, 1,
                                  desc[descidx].u.name);
@@ -1183,12 +1864,13 @@ run_select_statement (ctrl_t ctrl, be_sqlite_local_t ctx,
     case KEYDB_SEARCH_MODE_SHORT_KID:
       ctx->select_col_subkey = 5;
       if (!ctx->select_stmt)
-        err = run_sql_prepare ("SELECT p.ubid, p.type, p.ephemeral,"
-                               " p.revoked, p.keyblob, f.subkey"
-                               " FROM pubkey as p, fingerprint as f"
-                               " WHERE p.ubid = f.ubid AND"
-                               " substr(f.kid,5) = ?1",
-                               extra, " ORDER BY p.ubid", &ctx->select_stmt);
+        err = prepare_select (ctx,
+                              "SELECT p.ubid, p.type, p.ephemeral,"
+                              " p.revoked, p.keyblob, f.subkey"
+                              " FROM pubkey as p, fingerprint as f"
+                              " WHERE p.ubid = f.ubid AND"
+                              " substr(f.kid,5) = ?1",
+                              extra, AFTER_LASTUBID);
       if (!err)
         err = run_sql_bind_blob (ctx->select_stmt, 1,
                                  kid_from_u32 (desc[descidx].u.kid, kidbuf)+4,
@@ -1198,11 +1880,12 @@ run_select_statement (ctrl_t ctrl, be_sqlite_local_t ctx,
     case KEYDB_SEARCH_MODE_LONG_KID:
       ctx->select_col_subkey = 5;
       if (!ctx->select_stmt)
-        err = run_sql_prepare ("SELECT p.ubid, p.type, p.ephemeral,"
-                               " p.revoked, p.keyblob, f.subkey"
-                               " FROM pubkey as p, fingerprint as f"
-                               " WHERE p.ubid = f.ubid AND f.kid = ?1",
-                               extra, " ORDER BY p.ubid", &ctx->select_stmt);
+        err = prepare_select (ctx,
+                              "SELECT p.ubid, p.type, p.ephemeral,"
+                              " p.revoked, p.keyblob, f.subkey"
+                              " FROM pubkey as p, fingerprint as f"
+                              " WHERE p.ubid = f.ubid AND f.kid = ?1",
+                              extra, AFTER_LASTUBID);
       if (!err)
         err = run_sql_bind_blob (ctx->select_stmt, 1,
                                  kid_from_u32 (desc[descidx].u.kid, kidbuf),
@@ -1212,11 +1895,12 @@ run_select_statement (ctrl_t ctrl, be_sqlite_local_t ctx,
     case KEYDB_SEARCH_MODE_FPR:
       ctx->select_col_subkey = 5;
       if (!ctx->select_stmt)
-        err = run_sql_prepare ("SELECT p.ubid, p.type, p.ephemeral,"
-                               " p.revoked, p.keyblob, f.subkey"
-                               " FROM pubkey as p, fingerprint as f"
-                               " WHERE p.ubid = f.ubid AND f.fpr = ?1",
-                               extra, " ORDER BY p.ubid", &ctx->select_stmt);
+        err = prepare_select (ctx,
+                              "SELECT p.ubid, p.type, p.ephemeral,"
+                              " p.revoked, p.keyblob, f.subkey"
+                              " FROM pubkey as p, fingerprint as f"
+                              " WHERE p.ubid = f.ubid AND f.fpr = ?1",
+                              extra, AFTER_LASTUBID);
       if (!err)
         err = run_sql_bind_blob (ctx->select_stmt, 1,
                                  desc[descidx].u.fpr, desc[descidx].fprlen);
@@ -1225,11 +1909,12 @@ run_select_statement (ctrl_t ctrl, be_sqlite_local_t ctx,
     case KEYDB_SEARCH_MODE_KEYGRIP:
       ctx->select_col_subkey = 5;
       if (!ctx->select_stmt)
-        err = run_sql_prepare ("SELECT p.ubid, p.type, p.ephemeral, p.revoked,"
-                               " p.keyblob, f.subkey"
-                               " FROM pubkey as p, fingerprint as f"
-                               " WHERE p.ubid = f.ubid AND f.keygrip = ?1",
-                               extra, " ORDER BY p.ubid", &ctx->select_stmt);
+        err = prepare_select (ctx,
+                              "SELECT p.ubid, p.type, p.ephemeral, p.revoked,"
+                              " p.keyblob, f.subkey"
+                              " FROM pubkey as p, fingerprint as f"
+                              " WHERE p.ubid = f.ubid AND f.keygrip = ?1",
+                              extra, AFTER_LASTUBID);
       if (!err)
         err = run_sql_bind_blob (ctx->select_stmt, 1,
                                  desc[descidx].u.grip, KEYGRIP_LEN);
@@ -1237,10 +1922,11 @@ run_select_statement (ctrl_t ctrl, be_sqlite_local_t ctx,
 
     case KEYDB_SEARCH_MODE_UBID:
       if (!ctx->select_stmt)
-        err = run_sql_prepare ("SELECT ubid, type, ephemeral, revoked, keyblob"
-                               " FROM pubkey as p"
-                               " WHERE ubid = ?1",
-                               extra, NULL, &ctx->select_stmt);
+        err = prepare_select (ctx,
+                              "SELECT ubid, type, ephemeral, revoked, keyblob"
+                              " FROM pubkey as p"
+                              " WHERE ubid = ?1",
+                              extra, NULL);
       if (!err)
         err = run_sql_bind_blob (ctx->select_stmt, 1,
                                  desc[descidx].u.ubid, UBID_LEN);
@@ -1248,21 +1934,11 @@ run_select_statement (ctrl_t ctrl, be_sqlite_local_t ctx,
 
     case KEYDB_SEARCH_MODE_FIRST:
       if (!ctx->select_stmt)
-        {
-          if (ctx->filter_opgp && ctx->filter_x509)
-            extra = " WHERE ( p.type = 1 OR p.type = 2 ) ORDER by ubid";
-          else if (ctx->filter_opgp && !ctx->filter_x509)
-            extra = " WHERE p.type = 1 ORDER by ubid";
-          else if (!ctx->filter_opgp && ctx->filter_x509)
-            extra = " WHERE p.type = 2 ORDER by ubid";
-          else
-            extra = " ORDER by ubid";
-
-          err = run_sql_prepare ("SELECT ubid, type, ephemeral, revoked,"
-                                 " keyblob"
-                                 " FROM pubkey as p",
-                                 extra, NULL, &ctx->select_stmt);
-        }
+        err = prepare_select (ctx,
+                              "SELECT ubid, type, ephemeral, revoked, keyblob"
+                              " FROM pubkey as p"
+                              " WHERE p.ubid > ?9",
+                              extra, " ORDER BY p.ubid");
       break;
 
     case KEYDB_SEARCH_MODE_NEXT:
@@ -1274,6 +1950,16 @@ run_select_statement (ctrl_t ctrl, be_sqlite_local_t ctx,
       break;
     }
 
+  /* Continue after the last returned blob or start with the first.
+   * All UBIDs are larger than the empty blob.  */
+  if (!err && sqlite3_bind_parameter_index (ctx->select_stmt, "?9"))
+    {
+      if (ctx->resume)
+        err = run_sql_bind_blob (ctx->select_stmt, 9, ctx->lastubid, UBID_LEN);
+      else
+        err = run_sql_bind_blob (ctx->select_stmt, 9, "", 0);
+    }
+
  leave:
   return err;
 }
@@ -1290,6 +1976,7 @@ be_sqlite_search (ctrl_t ctrl,
   gpg_error_t err;
   db_request_part_t part;
   be_sqlite_local_t ctx;
+  sqlite3 *db;
 
   log_assert (backend_hd && backend_hd->db_type == DB_TYPE_SQLITE);
   log_assert (request);
@@ -1313,6 +2000,8 @@ be_sqlite_search (ctrl_t ctrl,
       ctx->select_eof = 0;
       ctx->descidx = 0;
       ctx->lastubid_valid = 0;
+      ctx->resume = 0;
+      put_reader_conn (ctx);
       err = 0;
       goto leave;
     }
@@ -1327,12 +2016,17 @@ be_sqlite_search (ctrl_t ctrl,
   /* Start a global transaction if needed.  */
   if (!opt.active_transaction && opt.in_transaction)
     {
-      err = run_sql_statement ("begin transaction");
+      err = begin_global_transaction ();
       if (err)
         goto leave;
-      opt.active_transaction = 1;
     }
 
+  /* Get a reader connection for this request.  It is given back
+   * after each returned blob so that a client keeping its connection
+   * open does not block a reader connection or a checkpoint.  */
+  if (!ctx->conn)
+    ctx->conn = get_reader_conn (backend_hd->filename);
+
 
  again:
   if (!ctx->select_done)
@@ -1345,6 +2039,7 @@ be_sqlite_search (ctrl_t ctrl,
     }
 
   show_sqlstmt (ctx->select_stmt);
+  db = sqlite3_db_handle (ctx->select_stmt);
 
   /* SQL select succeeded - get the first or next row. */
   err = run_sql_step_for_select (ctx->select_stmt);
@@ -1361,7 +2056,7 @@ be_sqlite_search (ctrl_t ctrl,
       n = sqlite3_column_bytes (ctx->select_stmt, 0);
       if (!ubid || n < 0)
         {
-          if (!ubid && sqlite3_errcode (database_hd) == SQLITE_NOMEM)
+          if (!ubid && sqlite3_errcode (db) == SQLITE_NOMEM)
             err = gpg_error (gpg_err_code_from_sqlite (SQLITE_NOMEM));
           else
             err = gpg_error (GPG_ERR_DB_CORRUPTED);
@@ -1394,7 +2089,7 @@ be_sqlite_search (ctrl_t ctrl,
       ctx->lastubid_valid = 1;
 
       n = sqlite3_column_int (ctx->select_stmt, 1);
-      if (!n && sqlite3_errcode (database_hd) == SQLITE_NOMEM)
+      if (!n && sqlite3_errcode (db) == SQLITE_NOMEM)
         {
           err = gpg_error (gpg_err_code_from_sqlite (SQLITE_NOMEM));
           show_sqlstmt (ctx->select_stmt);
@@ -1405,7 +2100,7 @@ be_sqlite_search (ctrl_t ctrl,
       pubkey_type = n;
 
       n = sqlite3_column_int (ctx->select_stmt, 2);
-      if (!n && sqlite3_errcode (database_hd) == SQLITE_NOMEM)
+      if (!n && sqlite3_errcode (db) == SQLITE_NOMEM)
         {
           err = gpg_error (gpg_err_code_from_sqlite (SQLITE_NOMEM));
           show_sqlstmt (ctx->select_stmt);
@@ -1416,7 +2111,7 @@ be_sqlite_search (ctrl_t ctrl,
       is_ephemeral = !!n;
 
       n = sqlite3_column_int (ctx->select_stmt, 3);
-      if (!n && sqlite3_errcode (database_hd) == SQLITE_NOMEM)
+      if (!n && sqlite3_errcode (db) == SQLITE_NOMEM)
         {
           err = gpg_error (gpg_err_code_from_sqlite (SQLITE_NOMEM));
           show_sqlstmt (ctx->select_stmt);
@@ -1430,7 +2125,7 @@ be_sqlite_search (ctrl_t ctrl,
       n = sqlite3_column_bytes (ctx->select_stmt, 4);
       if (!keyblob || n < 0)
         {
-          if (!keyblob && sqlite3_errcode (database_hd) == SQLITE_NOMEM)
+          if (!keyblob && sqlite3_errcode (db) == SQLITE_NOMEM)
             err = gpg_error (gpg_err_code_from_sqlite (SQLITE_NOMEM));
           else
             err = gpg_error (GPG_ERR_DB_CORRUPTED);
@@ -1444,7 +2139,7 @@ be_sqlite_search (ctrl_t ctrl,
       if (ctx->select_col_uidno)
         {
           n = sqlite3_column_int (ctx->select_stmt, ctx->select_col_uidno);
-          if (!n && sqlite3_errcode (database_hd) == SQLITE_NOMEM)
+          if (!n && sqlite3_errcode (db) == SQLITE_NOMEM)
             {
               err = gpg_error (gpg_err_code_from_sqlite (SQLITE_NOMEM));
               show_sqlstmt (ctx->select_stmt);
@@ -1463,7 +2158,7 @@ be_sqlite_search (ctrl_t ctrl,
       if (ctx->select_col_subkey)
         {
           n = sqlite3_column_int (ctx->select_stmt, ctx->select_col_subkey);
-          if (!n && sqlite3_errcode (database_hd) == SQLITE_NOMEM)
+          if (!n && sqlite3_errcode (db) == SQLITE_NOMEM)
             {
               err = gpg_error (gpg_err_code_from_sqlite (SQLITE_NOMEM));
               show_sqlstmt (ctx->select_stmt);
@@ -1483,16 +2178,25 @@ be_sqlite_search (ctrl_t ctrl,
                               ubid, is_ephemeral, is_revoked, uid_no, pk_no);
       if (!err)
         be_cache_pubkey (ctrl, ubid, keyblob, keybloblen, pubkey_type);
+
+      /* End the read transaction; a NEXT search runs the select
+       * again starting after LASTUBID.  */
+      ctx->resume = 1;
+      ctx->select_done = 0;
+      sqlite3_reset (ctx->select_stmt);
+      put_reader_conn (ctx);
     }
   else if (gpg_err_code (err) == GPG_ERR_SQL_DONE)
     {
       if (++ctx->descidx < ndesc)
         {
           ctx->select_done = 0;
+          ctx->resume = 0;
           goto again;
         }
       err = gpg_error (GPG_ERR_EOF);
       ctx->select_eof = 1;
+      put_reader_conn (ctx);
     }
   else
     {
@@ -1524,7 +2228,8 @@ store_into_pubkey (enum kbxd_store_modes mode,
   else /* Auto */
     sqlstr = ("INSERT OR REPLACE INTO pubkey(ubid,type,keyblob)"
               " VALUES(?1,?2,?3)");
-  err = run_sql_prepare (sqlstr, NULL, NULL, &stmt);
+  err = run_sql_prepare_cached (database_hd, &database_stmts,
+                                sqlstr, NULL, NULL, &stmt);
   if (err)
     goto leave;
   err = run_sql_bind_blob (stmt, 1, ubid, UBID_LEN);
@@ -1541,7 +2246,7 @@ store_into_pubkey (enum kbxd_store_modes mode,
 
  leave:
   if (stmt)
-    sqlite3_finalize (stmt);
+    sqlite3_reset (stmt);
   return err;
 }
 
@@ -1560,7 +2265,8 @@ store_into_fingerprint (const unsigned char *ubid, int subkey,
 
   sqlstr = ("INSERT OR REPLACE INTO fingerprint(fpr,kid,keygrip,subkey,ubid)"
             " VALUES(?1,?2,?3,?4,?5)");
-  err = run_sql_prepare (sqlstr, NULL, NULL, &stmt);
+  err = run_sql_prepare_cached (database_hd, &database_stmts,
+                                sqlstr, NULL, NULL, &stmt);
   if (err)
     goto leave;
   err = run_sql_bind_blob (stmt, 1, fpr, fprlen);
@@ -1583,7 +2289,7 @@ store_into_fingerprint (const unsigned char *ubid, int subkey,
 
  leave:
   if (stmt)
-    sqlite3_finalize (stmt);
+    sqlite3_reset (stmt);
   return err;
 }
 
@@ -1599,10 +2305,14 @@ store_into_userid (const unsigned char *ubid, enum pubkey_types pktype,
   const char *sqlstr;
   sqlite3_stmt *stmt = NULL;
   char *addrspec = NULL;
-
-  sqlstr = ("INSERT OR REPLACE INTO userid(uid,addrspec,type,ubid,uidno)"
-            " VALUES(?1,?2,?3,?4,?5)");
-  err = run_sql_prepare (sqlstr, NULL, NULL, &stmt);
+  const char *mbox;
+  char *domain = NULL;
+
+  sqlstr = ("INSERT OR REPLACE INTO userid(uid,addrspec,type,ubid,uidno,"
+            "                            domain)"
+            " VALUES(?1,?2,?3,?4,?5,?6)");
+  err = run_sql_prepare_cached (database_hd, &database_stmts,
+                                sqlstr, NULL, NULL, &stmt);
   if (err)
     goto leave;
 
@@ -1611,12 +2321,10 @@ store_into_userid (const unsigned char *ubid, enum pubkey_types pktype,
     goto leave;
 
   if (override_mbox)
-    err = run_sql_bind_text (stmt, 2, override_mbox);
+    mbox = override_mbox;
   else
-    {
-      addrspec = mailbox_from_userid (uid, 0);
-      err = run_sql_bind_text (stmt, 2, addrspec);
-    }
+    mbox = addrspec = mailbox_from_userid (uid, 0);
+  err = run_sql_bind_text (stmt, 2, mbox);
   if (err)
     goto leave;
 
@@ -1630,16 +2338,82 @@ store_into_userid (const unsigned char *ubid, enum pubkey_types pktype,
   if (err)
     goto leave;
 
+  if (mbox && strchr (mbox, '@'))
+    {
+      domain = xtrystrdup (strchr (mbox, '@') + 1);
+      if (!domain)
+        {
+          err = gpg_error_from_syserror ();
+          goto leave;
+        }
+      ascii_strlwr (domain);
+    }
+  err = run_sql_bind_text (stmt, 6, domain);
+  if (err)
+    goto leave;
+
   err = run_sql_step (stmt);
+  if (err)
+    goto leave;
+
+  if (database_fts)
+    {
+      sqlite3_int64 rowid = sqlite3_last_insert_rowid (database_hd);
+
+      sqlite3_reset (stmt);
+      err = run_sql_prepare_cached
+        (database_hd, &database_stmts,
+         "INSERT INTO userid_fts(rowid,uid,addrspec) VALUES(?1,?2,?3)",
+         NULL, NULL, &stmt);
+      if (err)
+        goto leave;
+      if (sqlite3_bind_int64 (stmt, 1, rowid))
+        {
+          err = diag_bind_err (sqlite3_errcode (database_hd), stmt);
+          goto leave;
+        }
+      err = run_sql_bind_text (stmt, 2, uid);
+      if (err)
+        goto leave;
+      err = run_sql_bind_text (stmt, 3, mbox);
+      if (err)
+        goto leave;
+      err = run_sql_step (stmt);
+    }
 
  leave:
   if (stmt)
-    sqlite3_finalize (stmt);
+    sqlite3_reset (stmt);
   xfree (addrspec);
+  xfree (domain);
   return err;
 }
 
 
+/* Delete all rows of the userid table for UBID.  The entries of the
+ * full text search table are deleted as well.  */
+static gpg_error_t
+delete_userids (const unsigned char *ubid)
+{
+  gpg_error_t err;
+
+  if (database_fts)
+    {
+      /* The table has an external content table; thus we need to
+       * pass the old values for the delete.  */
+      err = run_sql_statement_bind_ubid
+        ("INSERT INTO userid_fts(userid_fts,rowid,uid,addrspec)"
+         " SELECT 'delete', id, uid, addrspec FROM userid WHERE ubid = ?1",
+         ubid);
+      if (err)
+        return err;
+    }
+
+  return run_sql_statement_bind_ubid
+    ("DELETE FROM userid WHERE ubid = ?1", ubid);
+}
+
+
 /* Helper for be_sqlite_store to update or insert a row in the
  * issuer table.  */
 static gpg_error_t
@@ -1653,7 +2427,8 @@ store_into_issuer (const unsigned char *ubid,
 
   sqlstr = ("INSERT OR REPLACE INTO issuer(sn,dn,ubid)"
             " VALUES(?1,?2,?3)");
-  err = run_sql_prepare (sqlstr, NULL, NULL, &stmt);
+  err = run_sql_prepare_cached (database_hd, &database_stmts,
+                                sqlstr, NULL, NULL, &stmt);
   if (err)
     goto leave;
 
@@ -1671,7 +2446,7 @@ store_into_issuer (const unsigned char *ubid,
 
  leave:
   if (stmt)
-    sqlite3_finalize (stmt);
+    sqlite3_reset (stmt);
   xfree (addrspec);
   return err;
 }
@@ -1747,11 +2522,12 @@ be_sqlite_store (ctrl_t ctrl, backend_handle_t backend_hd,
 
   if (!opt.active_transaction)
     {
-      err = run_sql_statement ("begin transaction");
+      if (opt.in_transaction)
+        err = begin_global_transaction ();
+      else
+        err = run_sql_statement ("begin transaction");
       if (err)
         goto leave;
-      if (opt.in_transaction)
-        opt.active_transaction = 1;
     }
   in_transaction = 1;
 
@@ -1765,8 +2541,7 @@ be_sqlite_store (ctrl_t ctrl, backend_handle_t backend_hd,
     ("DELETE FROM fingerprint WHERE ubid = ?1", ubid);
   if (err)
     goto leave;
-  err = run_sql_statement_bind_ubid
-    ("DELETE FROM userid WHERE ubid = ?1", ubid);
+  err = delete_userids (ubid);
   if (err)
     goto leave;
   if (cert)
@@ -1898,7 +2673,7 @@ be_sqlite_store (ctrl_t ctrl, backend_handle_t backend_hd,
   if (in_transaction && !err)
     {
       if (opt.active_transaction)
-        ; /* We are in a global transaction.  */
+        err = maybe_commit_batch (ctrl);
       else
         err = run_sql_statement ("commit");
     }
@@ -1950,16 +2725,16 @@ be_sqlite_delete (ctrl_t ctrl, backend_handle_t backend_hd,
 
   if (!opt.active_transaction)
     {
-      err = run_sql_statement ("begin transaction");
+      if (opt.in_transaction)
+        err = begin_global_transaction ();
+      else
+        err = run_sql_statement ("begin transaction");
       if (err)
         goto leave;
-      if (opt.in_transaction)
-        opt.active_transaction = 1;
     }
   in_transaction = 1;
 
-  err = run_sql_statement_bind_ubid
-    ("DELETE from userid WHERE ubid = ?1", ubid);
+  err = delete_userids (ubid);
   if (!err)
     err = run_sql_statement_bind_ubid
       ("DELETE from fingerprint WHERE ubid = ?1", ubid);
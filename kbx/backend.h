@@ -122,6 +122,8 @@ gpg_error_t be_get_x509_keygrip (ksba_cert_t cert, unsigned char *keygrip);
 
 /*-- backend-cache.c --*/
 gpg_error_t be_cache_initialize (void);
+void be_cache_set_limit (unsigned int mbytes);
+void be_cache_get_stats (membuf_t *mb);
 gpg_error_t be_cache_add_resource (ctrl_t ctrl, backend_handle_t *r_hd);
 void be_cache_release_resource (ctrl_t ctrl, backend_handle_t hd);
 gpg_error_t be_cache_search (ctrl_t ctrl, backend_handle_t backend_hd,
@@ -23,6 +23,7 @@
 #include <stdlib.h>
 #include <stddef.h>
 #include <string.h>
+#include <npth.h>
 
 #include "keyboxd.h"
 #include <assuan.h>
@@ -41,12 +42,86 @@ struct
 
 
 
+/* The lock protecting the databases.  Any number of readers may
+ * hold the lock at the same time but a writer needs exclusive
+ * access.  Requests are served strictly in the order they arrived:
+ * Each request draws a ticket and is admitted only when its ticket
+ * is the next one to serve.  Thus a stream of searches can't starve
+ * an update and a writer can't starve the searches queued up behind
+ * it.  A run of consecutive readers is admitted as a whole.  */
+static struct
+{
+  npth_mutex_t mutex;
+  npth_cond_t cond;
+  unsigned int next_ticket; /* Ticket to hand out next.  */
+  unsigned int serving;     /* Ticket to be admitted next.  */
+  unsigned int readers;     /* Number of active readers.  */
+  int writer;               /* True if a writer is active.  */
+} db_lock = { NPTH_MUTEX_INITIALIZER, NPTH_COND_INITIALIZER };
+
+
+static void
+acquire_db_lock_mutex (void)
+{
+  int res;
+
+  res = npth_mutex_lock (&db_lock.mutex);
+  if (res)
+    log_fatal ("failed to acquire database lock mutex: %s\n",
+               gpg_strerror (gpg_error_from_errno (res)));
+}
+
+
+static void
+release_db_lock_mutex (void)
+{
+  int res;
+
+  res = npth_mutex_unlock (&db_lock.mutex);
+  if (res)
+    log_fatal ("failed to release database lock mutex: %s\n",
+               gpg_strerror (gpg_error_from_errno (res)));
+}
+
+
+/* Wait until the caller's TICKET is the next to serve and, for a
+ * writer, all active readers are gone.  Must be called with the
+ * mutex held.  */
+static void
+wait_for_db_lock (unsigned int ticket, int for_write)
+{
+  int res;
+
+  while (ticket != db_lock.serving
+         || db_lock.writer
+         || (for_write && db_lock.readers))
+    {
+      res = npth_cond_wait (&db_lock.cond, &db_lock.mutex);
+      if (res)
+        log_fatal ("failed to wait for the database lock: %s\n",
+                   gpg_strerror (gpg_error_from_errno (res)));
+    }
+}
+
+
 /* Take a lock for reading the databases.  */
 static void
 take_read_lock (ctrl_t ctrl)
 {
-  /* FIXME */
-  (void)ctrl;
+  unsigned int ticket;
+
+  log_assert (!ctrl->db_lock_mode);
+
+  acquire_db_lock_mutex ();
+  ticket = db_lock.next_ticket++;
+  wait_for_db_lock (ticket, 0);
+  db_lock.serving++;
+  db_lock.readers++;
+  /* Let a reader queued up right behind us in.  */
+  npth_cond_broadcast (&db_lock.cond);
+  release_db_lock_mutex ();
+
+  ctrl->db_lock_mode = 1;
 }
 
 
@@ -54,8 +129,18 @@ take_read_lock (ctrl_t ctrl)
 static void
 take_read_write_lock (ctrl_t ctrl)
 {
-  /* FIXME */
-  (void)ctrl;
+  unsigned int ticket;
+
+  log_assert (!ctrl->db_lock_mode);
+
+  acquire_db_lock_mutex ();
+  ticket = db_lock.next_ticket++;
+  wait_for_db_lock (ticket, 1);
+  db_lock.serving++;
+  db_lock.writer = 1;
+  release_db_lock_mutex ();
+
+  ctrl->db_lock_mode = 2;
 }
 
 
@@ -64,8 +149,22 @@ take_read_write_lock (ctrl_t ctrl)
 static void
 release_lock (ctrl_t ctrl)
 {
-  /* FIXME */
-  (void)ctrl;
+  if (!ctrl->db_lock_mode)
+    return;
+
+  acquire_db_lock_mutex ();
+  if (ctrl->db_lock_mode == 2)
+    db_lock.writer = 0;
+  else
+    {
+      log_assert (db_lock.readers);
+      db_lock.readers--;
+    }
+  if (!db_lock.writer && !db_lock.readers)
+    npth_cond_broadcast (&db_lock.cond);
+  release_db_lock_mutex ();
+
+  ctrl->db_lock_mode = 0;
 }
 
 
@@ -172,6 +271,22 @@ kbxd_release_session_info (ctrl_t ctrl)
 }
 
 
+/* Set the memory budget of the cache to MBYTES MiB.  */
+void
+kbxd_set_cache_size (unsigned int mbytes)
+{
+  be_cache_set_limit (mbytes);
+}
+
+
+/* Append the cache statistics to MB.  */
+void
+kbxd_get_cache_stats (membuf_t *mb)
+{
+  be_cache_get_stats (mb);
+}
+
+
 
 gpg_error_t
 kbxd_rollback (void)
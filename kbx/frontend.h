@@ -27,6 +27,8 @@ gpg_error_t kbxd_set_database (ctrl_t ctrl,
                                const char *filename_arg, int readonly);
 
 void kbxd_release_session_info (ctrl_t ctrl);
+void kbxd_set_cache_size (unsigned int mbytes);
+void kbxd_get_cache_stats (membuf_t *mb);
 
 gpg_error_t kbxd_rollback (void);
 gpg_error_t kbxd_commit (void);
@@ -43,6 +43,16 @@
 static volatile int debug_client;
 
 
+/* An item of the queue of data received from the keyboxd.  */
+struct datablob_s
+{
+  struct datablob_s *next;
+  char *data;         /* The data or NULL on error.  */
+  size_t datalen;
+  gpg_error_t err;    /* The error code if DATA is NULL.  */
+};
+
+
 /* This object is used to implement a client to the keyboxd.  */
 struct kbx_client_data_s
 {
@@ -58,12 +68,11 @@ struct kbx_client_data_s
   npth_cond_t  cond;
   npth_t thd;
 
-  /* The data received from the keyboxd and an error code if there was
-   * a problem (in which case DATA is also set to NULL.  This is only
-   * used if FP is not NULL.  */
-  char *data;
-  size_t datalen;
-  gpg_error_t dataerr;
+  /* The data received from the keyboxd in the order of arrival.  A
+   * SEARCH with --all returns several items.  This is only used if
+   * FP is not NULL.  */
+  struct datablob_s *dataq;
+  struct datablob_s **dataq_tail;
 
   /* Helper variables in case D-lines are used (FP is NULL)  */
   char *dlinedata;
@@ -110,9 +119,8 @@ prepare_data_pipe (kbx_client_data_t kcd)
   npth_attr_t tattr;
 
   kcd->fp = NULL;
-  kcd->data = NULL;
-  kcd->datalen = 0;
-  kcd->dataerr = 0;
+  kcd->dataq = NULL;
+  kcd->dataq_tail = &kcd->dataq;
 
   err = gnupg_create_inbound_pipe (&inpipe, &infp, 0);
   if (err)
@@ -194,7 +202,7 @@ datastream_thread (void *arg)
   unsigned char lenbuf[4];
   size_t nread, datalen;
   char *data = NULL;
-  char *tmpdata;
+  struct datablob_s *item;
 
   if (debug_client)
     log_debug ("%s: started\n", __func__);
@@ -258,16 +266,27 @@ datastream_thread (void *arg)
             log_debug ("%s: parsing datastream succeeded\n", __func__);
         }
 
-      /* Thread-safe assignment to the result var:  */
-      tmpdata = kcd->data;
-      kcd->data = data;
-      kcd->datalen = datalen;
-      kcd->dataerr = err;
-      xfree (tmpdata);
+      item = xtrycalloc (1, sizeof *item);
+      if (!item)
+        {
+          /* We can't do much in this case but the caller must not
+           * wait forever.  */
+          log_error ("error queuing data from keyboxd: %s\n",
+                     gpg_strerror (gpg_error_from_syserror ()));
+          xfree (data);
+          data = NULL;
+          gnupg_sleep (1);
+          continue;
+        }
+      item->data = data;
+      item->datalen = datalen;
+      item->err = err;
       data = NULL;
 
-      /* Tell the main thread.  */
+      /* Append to the queue and tell the main thread.  */
       lock_datastream (kcd);
+      *kcd->dataq_tail = item;
+      kcd->dataq_tail = &item->next;
       rc = npth_cond_signal (&kcd->cond);
       if (rc)
         {
@@ -340,6 +359,7 @@ void
 kbx_client_data_release (kbx_client_data_t kcd)
 {
   estream_t fp;
+  struct datablob_s *item;
 
   if (!kcd)
     return;
@@ -357,6 +377,13 @@ kbx_client_data_release (kbx_client_data_t kcd)
   kcd->fp = NULL;
   es_fclose (fp);
 
+  while ((item = kcd->dataq))
+    {
+      kcd->dataq = item->next;
+      xfree (item->data);
+      xfree (item);
+    }
+
   npth_cond_destroy (&kcd->cond);
   npth_mutex_destroy (&kcd->mutex);
   xfree (kcd);
@@ -374,6 +401,16 @@ kbx_client_data_simple (kbx_client_data_t kcd, const char *command)
 }
 
 
+/* Return true if the data is received via a separate data stream.
+ * Only in this case commands returning several data items can be
+ * used.  */
+int
+kbx_client_data_use_stream (kbx_client_data_t kcd)
+{
+  return !!kcd->fp;
+}
+
+
 /* Send the COMMAND down to the keyboxd associated with KCD.
  * STATUS_CB and STATUS_CB_VALUE are the usual status callback as used
  * by assuan_transact.  After this function has returned success
@@ -383,6 +420,22 @@ gpg_error_t
 kbx_client_data_cmd (kbx_client_data_t kcd, const char *command,
                      gpg_error_t (*status_cb)(void *opaque, const char *line),
                      void *status_cb_value)
+{
+  return kbx_client_data_cmd_inq (kcd, command, NULL, NULL,
+                                  status_cb, status_cb_value);
+}
+
+
+/* Same as kbx_client_data_cmd but with an additional inquire callback
+ * INQUIRE_CB and its argument INQUIRE_CB_VALUE.  */
+gpg_error_t
+kbx_client_data_cmd_inq (kbx_client_data_t kcd, const char *command,
+                         gpg_error_t (*inquire_cb)(void *opaque,
+                                                   const char *line),
+                         void *inquire_cb_value,
+                         gpg_error_t (*status_cb)(void *opaque,
+                                                  const char *line),
+                         void *status_cb_value)
 {
   gpg_error_t err;
 
@@ -397,7 +450,7 @@ kbx_client_data_cmd (kbx_client_data_t kcd, const char *command,
         log_debug ("%s: sending command '%s'\n", __func__, command);
       err = assuan_transact (kcd->ctx, command,
                              NULL, NULL,
-                             NULL, NULL,
+                             inquire_cb, inquire_cb_value,
                              status_cb, status_cb_value);
       if (err)
         {
@@ -422,7 +475,7 @@ kbx_client_data_cmd (kbx_client_data_t kcd, const char *command,
       init_membuf (&mb, 8192);
       err = assuan_transact (kcd->ctx, command,
                              put_membuf_cb, &mb,
-                             NULL, NULL,
+                             inquire_cb, inquire_cb_value,
                              status_cb, status_cb_value);
       if (err)
         {
@@ -451,19 +504,21 @@ kbx_client_data_cmd (kbx_client_data_t kcd, const char *command,
 
 
 /* Wait for the data from the server and on success return it at
- * (R_DATA, R_DATALEN). */
+ * (R_DATA, R_DATALEN).  If a command returned several data items
+ * this needs to be called for each item.  */
 gpg_error_t
 kbx_client_data_wait (kbx_client_data_t kcd, char **r_data, size_t *r_datalen)
 {
   gpg_error_t err = 0;
   int rc;
+  struct datablob_s *item;
 
   *r_data = NULL;
   *r_datalen = 0;
   if (kcd->fp)
     {
       lock_datastream (kcd);
-      if (!kcd->data && !kcd->dataerr)
+      while (!kcd->dataq)
         {
           if (debug_client)
             log_debug ("%s: waiting on datastream_cond ...\n", __func__);
@@ -473,14 +528,22 @@ kbx_client_data_wait (kbx_client_data_t kcd, char **r_data, size_t *r_datalen)
               err = gpg_error_from_errno (rc);
               log_error ("%s: waiting on condition failed: %s\n",
                          __func__, gpg_strerror (err));
+              break;
             }
           else if (debug_client)
             log_debug ("%s: waiting on datastream.cond done\n", __func__);
         }
-      *r_data = kcd->data;
-      kcd->data = NULL;
-      *r_datalen = kcd->datalen;
-      err = err? err : kcd->dataerr;
+      if (!err)
+        {
+          item = kcd->dataq;
+          kcd->dataq = item->next;
+          if (!kcd->dataq)
+            kcd->dataq_tail = &kcd->dataq;
+          *r_data = item->data;
+          *r_datalen = item->datalen;
+          err = item->err;
+          xfree (item);
+        }
 
       unlock_datastream (kcd);
     }
@@ -29,10 +29,19 @@ gpg_error_t kbx_client_data_new (kbx_client_data_t *r_kcd,
                                  assuan_context_t ctx, int dlines);
 void kbx_client_data_release (kbx_client_data_t kcd);
 gpg_error_t kbx_client_data_simple (kbx_client_data_t kcd, const char *command);
+int kbx_client_data_use_stream (kbx_client_data_t kcd);
 gpg_error_t kbx_client_data_cmd (kbx_client_data_t kcd, const char *command,
                                  gpg_error_t (*status_cb)(void *opaque,
                                                           const char *line),
                                  void *status_cb_value);
+gpg_error_t kbx_client_data_cmd_inq (kbx_client_data_t kcd,
+                                     const char *command,
+                                     gpg_error_t (*inquire_cb)(void *opaque,
+                                                               const char *l),
+                                     void *inquire_cb_value,
+                                     gpg_error_t (*status_cb)(void *opaque,
+                                                              const char *l),
+                                     void *status_cb_value);
 gpg_error_t kbx_client_data_wait (kbx_client_data_t kcd,
                                   char **r_data, size_t *r_datalen);
 
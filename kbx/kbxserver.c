@@ -320,161 +320,247 @@ option_handler (assuan_context_t ctx, const char *key, const char *value)
 
 
 
+/* Append the current search description of CTRL to the list of
+ * descriptions used for a multi pattern search.  */
+static gpg_error_t
+append_multi_search_desc (ctrl_t ctrl)
+{
+  gpg_error_t err;
+  unsigned int n, k;
+  KEYBOX_SEARCH_DESC *desc;
+  struct search_backing_store_s *store;
+
+  if (!ctrl->server_local->multi_search_desc_size)
+    {
+      n = 10;
+      ctrl->server_local->multi_search_desc
+        = xtrycalloc (n, sizeof *ctrl->server_local->multi_search_desc);
+      if (!ctrl->server_local->multi_search_desc)
+        return gpg_error_from_syserror ();
+      ctrl->server_local->multi_search_store
+        = xtrycalloc (n, sizeof *ctrl->server_local->multi_search_store);
+      if (!ctrl->server_local->multi_search_store)
+        {
+          err = gpg_error_from_syserror ();
+          xfree (ctrl->server_local->multi_search_desc);
+          ctrl->server_local->multi_search_desc = NULL;
+          return err;
+        }
+      ctrl->server_local->multi_search_desc_size = n;
+    }
+
+  if (ctrl->server_local->multi_search_desc_len
+      == ctrl->server_local->multi_search_desc_size)
+    {
+      n = ctrl->server_local->multi_search_desc_size + 10;
+      desc = xtrycalloc (n, sizeof *desc);
+      if (!desc)
+        return gpg_error_from_syserror ();
+      store = xtrycalloc (n, sizeof *store);
+      if (!store)
+        {
+          err = gpg_error_from_syserror ();
+          xfree (desc);
+          return err;
+        }
+      for (k=0; k < ctrl->server_local->multi_search_desc_size; k++)
+        {
+          desc[k] = ctrl->server_local->multi_search_desc[k];
+          store[k] = ctrl->server_local->multi_search_store[k];
+        }
+      xfree (ctrl->server_local->multi_search_desc);
+      xfree (ctrl->server_local->multi_search_store);
+      ctrl->server_local->multi_search_desc = desc;
+      ctrl->server_local->multi_search_store = store;
+      ctrl->server_local->multi_search_desc_size = n;
+    }
+  /* Actually store. We need to fix up the const pointers by
+   * copies from our backing store.  */
+  desc = &(ctrl->server_local->multi_search_desc
+           [ctrl->server_local->multi_search_desc_len]);
+  store = &(ctrl->server_local->multi_search_store
+            [ctrl->server_local->multi_search_desc_len]);
+  *desc = ctrl->server_local->search_desc;
+  if (ctrl->server_local->search_desc.sn)
+    {
+      xfree (store->sn);
+      store->sn = xtrymalloc (ctrl->server_local->search_desc.snlen);
+      if (!store->sn)
+        return gpg_error_from_syserror ();
+      memcpy (store->sn, ctrl->server_local->search_desc.sn,
+              ctrl->server_local->search_desc.snlen);
+      desc->sn = store->sn;
+    }
+  if (ctrl->server_local->search_desc.name_used)
+    {
+      xfree (store->name);
+      store->name = xtrystrdup (ctrl->server_local->search_desc.u.name);
+      if (!store->name)
+        {
+          err = gpg_error_from_syserror ();
+          xfree (store->sn);
+          store->sn = NULL;
+          return err;
+        }
+      desc->u.name = store->name;
+    }
+  ctrl->server_local->multi_search_desc_len++;
+  return 0;
+}
+
+
+/* Read the patterns for SEARCH --inquire and append them to the list
+ * of descriptions used for a multi pattern search.  */
+static gpg_error_t
+inquire_search_patterns (ctrl_t ctrl)
+{
+  assuan_context_t ctx = get_assuan_ctx_from_ctrl (ctrl);
+  gpg_error_t err;
+  unsigned char *value = NULL;
+  size_t valuelen;
+  char *p, *pend;
+
+  err = assuan_inquire (ctx, "PATTERNS", &value, &valuelen, 0);
+  if (err)
+    {
+      log_error (_("assuan_inquire failed: %s\n"), gpg_strerror (err));
+      return err;
+    }
+
+  /* One pattern per line; empty lines are ignored.  */
+  for (p = (char *)value; p < (char *)value + valuelen; p = pend + 1)
+    {
+      pend = memchr (p, '\n', (char *)value + valuelen - p);
+      if (!pend)
+        pend = (char *)value + valuelen;
+      *pend = 0;
+      if (pend > p && pend[-1] == '\r')
+        pend[-1] = 0;
+      if (!*p)
+        continue;
+      err = classify_user_id (p, &ctrl->server_local->search_desc, 1);
+      if (!err)
+        err = append_multi_search_desc (ctrl);
+      if (err)
+        break;
+    }
+  if (!err && !ctrl->server_local->multi_search_desc_len)
+    err = set_error (GPG_ERR_INV_ARG, "no pattern inquired");
+
+  xfree (value);
+  return err;
+}
+
+
 static const char hlp_search[] =
-  "SEARCH [--no-data] [--openpgp|--x509] [[--more] PATTERN]\n"
+  "SEARCH [--no-data] [--openpgp|--x509] [--all] [[--more] PATTERN]\n"
+  "SEARCH [--no-data] [--openpgp|--x509] [--all] --inquire\n"
   "\n"
   "Search for the keys identified by PATTERN.  With --more more\n"
   "patterns to be used for the search are expected with the next\n"
-  "command.  With --no-data only the search status is returned but\n"
-  "not the actual data.  With --openpgp or --x509 only the respective\n"
-  "keys are returned.  See also \"NEXT\".";
+  "command.  With --inquire the patterns are requested using\n"
+  "  INQUIRE PATTERNS\n"
+  "and are expected one per line.  With --no-data only the search\n"
+  "status is returned but not the actual data.  With --openpgp or\n"
+  "--x509 only the respective keys are returned.  With --all all\n"
+  "matching keys are returned at once; this requires that the\n"
+  "OUTPUT command has been used.  See also \"NEXT\".";
 static gpg_error_t
 cmd_search (assuan_context_t ctx, char *line)
 {
   ctrl_t ctrl = assuan_get_pointer (ctx);
-  int opt_more, opt_no_data, opt_openpgp, opt_x509;
+  int opt_more, opt_no_data, opt_openpgp, opt_x509, opt_all, opt_inquire;
   gpg_error_t err;
-  unsigned int n, k;
+  KEYBOX_SEARCH_DESC *desc;
+  unsigned int ndesc, n;
 
   opt_no_data = has_option (line, "--no-data");
   opt_more = has_option (line, "--more");
   opt_openpgp = has_option (line, "--openpgp");
   opt_x509 = has_option (line, "--x509");
+  opt_all = has_option (line, "--all");
+  opt_inquire = has_option (line, "--inquire");
   line = skip_options (line);
 
   ctrl->server_local->search_any_found = 0;
 
-  if (!*line)
+  if (opt_inquire)
     {
-      if (opt_more)
+      if (*line || opt_more)
         {
-          err = set_error (GPG_ERR_INV_ARG, "--more but no pattern");
+          err = set_error (GPG_ERR_INV_ARG, "pattern given with --inquire");
           goto leave;
         }
-      else if (!*line && ctrl->server_local->search_expecting_more)
-        {
-          /* It would be too surprising to first set a pattern but
-           * finally add no pattern to search the entire DB.  */
-          err = set_error (GPG_ERR_INV_ARG, "--more pending but no pattern");
-          goto leave;
-        }
-      else /* No pattern - return the first item.  */
-        {
-          memset (&ctrl->server_local->search_desc, 0,
-                  sizeof ctrl->server_local->search_desc);
-          ctrl->server_local->search_desc.mode = KEYDB_SEARCH_MODE_FIRST;
-        }
-    }
-  else
-    {
-      err = classify_user_id (line, &ctrl->server_local->search_desc, 1);
+      /* Patterns given with --more are used as well.  */
+      if (!ctrl->server_local->search_expecting_more)
+        ctrl->server_local->multi_search_desc_len = 0;
+      ctrl->server_local->search_expecting_more = 0;
+      err = inquire_search_patterns (ctrl);
       if (err)
         goto leave;
     }
-
-  if (opt_more || ctrl->server_local->search_expecting_more)
+  else
     {
-      /* More pattern are expected - store the current one and return
-       * success.  */
-      KEYBOX_SEARCH_DESC *desc;
-      struct search_backing_store_s *store;
-
-      if (!ctrl->server_local->multi_search_desc_size)
-        {
-          n = 10;
-          ctrl->server_local->multi_search_desc
-            = xtrycalloc (n, sizeof *ctrl->server_local->multi_search_desc);
-          if (!ctrl->server_local->multi_search_desc)
-            {
-              err = gpg_error_from_syserror ();
-              goto leave;
-            }
-          ctrl->server_local->multi_search_store
-            = xtrycalloc (n, sizeof *ctrl->server_local->multi_search_store);
-          if (!ctrl->server_local->multi_search_store)
-            {
-              err = gpg_error_from_syserror ();
-              xfree (ctrl->server_local->multi_search_desc);
-              ctrl->server_local->multi_search_desc = NULL;
-              goto leave;
-            }
-          ctrl->server_local->multi_search_desc_size = n;
-        }
-
-      if (ctrl->server_local->multi_search_desc_len
-          == ctrl->server_local->multi_search_desc_size)
+      if (!*line)
         {
-          n = ctrl->server_local->multi_search_desc_size + 10;
-          desc = xtrycalloc (n, sizeof *desc);
-          if (!desc)
+          if (opt_more)
             {
-              err = gpg_error_from_syserror ();
+              err = set_error (GPG_ERR_INV_ARG, "--more but no pattern");
               goto leave;
             }
-          store = xtrycalloc (n, sizeof *store);
-          if (!store)
+          else if (!*line && ctrl->server_local->search_expecting_more)
             {
-              err = gpg_error_from_syserror ();
-              xfree (desc);
+              /* It would be too surprising to first set a pattern but
+               * finally add no pattern to search the entire DB.  */
+              err = set_error (GPG_ERR_INV_ARG,
+                               "--more pending but no pattern");
               goto leave;
             }
-          for (k=0; k < ctrl->server_local->multi_search_desc_size; k++)
+          else /* No pattern - return the first item.  */
             {
-              desc[k] = ctrl->server_local->multi_search_desc[k];
-              store[k] = ctrl->server_local->multi_search_store[k];
+              memset (&ctrl->server_local->search_desc, 0,
+                      sizeof ctrl->server_local->search_desc);
+              ctrl->server_local->search_desc.mode = KEYDB_SEARCH_MODE_FIRST;
             }
-          xfree (ctrl->server_local->multi_search_desc);
-          xfree (ctrl->server_local->multi_search_store);
-          ctrl->server_local->multi_search_desc = desc;
-          ctrl->server_local->multi_search_store = store;
-          ctrl->server_local->multi_search_desc_size = n;
         }
-      /* Actually store. We need to fix up the const pointers by
-       * copies from our backing store.  */
-      desc = &(ctrl->server_local->multi_search_desc
-               [ctrl->server_local->multi_search_desc_len]);
-      store = &(ctrl->server_local->multi_search_store
-                [ctrl->server_local->multi_search_desc_len]);
-      *desc = ctrl->server_local->search_desc;
-      if (ctrl->server_local->search_desc.sn)
+      else
         {
-          xfree (store->sn);
-          store->sn = xtrymalloc (ctrl->server_local->search_desc.snlen);
-          if (!store->sn)
-            {
-              err = gpg_error_from_syserror ();
-              goto leave;
-            }
-          memcpy (store->sn, ctrl->server_local->search_desc.sn,
-                  ctrl->server_local->search_desc.snlen);
-          desc->sn = store->sn;
+          err = classify_user_id (line, &ctrl->server_local->search_desc, 1);
+          if (err)
+            goto leave;
         }
-      if (ctrl->server_local->search_desc.name_used)
+
+      if (opt_more || ctrl->server_local->search_expecting_more)
         {
-          xfree (store->name);
-          store->name = xtrystrdup (ctrl->server_local->search_desc.u.name);
-          if (!store->name)
+          /* More pattern are expected - store the current one and
+           * return success.  */
+          err = append_multi_search_desc (ctrl);
+          if (err)
+            goto leave;
+
+          if (opt_more)
             {
-              err = gpg_error_from_syserror ();
-              xfree (store->sn);
-              store->sn = NULL;
+              /* We need to be called again with more pattern.  */
+              ctrl->server_local->search_expecting_more = 1;
               goto leave;
             }
-          desc->u.name = store->name;
+          ctrl->server_local->search_expecting_more = 0;
+          /* Continue with the actual search.  */
         }
-      ctrl->server_local->multi_search_desc_len++;
+      else
+        ctrl->server_local->multi_search_desc_len = 0;
+    }
 
-      if (opt_more)
-        {
-          /* We need to be called again with more pattern.  */
-          ctrl->server_local->search_expecting_more = 1;
-          goto leave;
-        }
-      ctrl->server_local->search_expecting_more = 0;
-      /* Continue with the actual search.  */
+  if (ctrl->server_local->multi_search_desc_len)
+    {
+      desc = ctrl->server_local->multi_search_desc;
+      ndesc = ctrl->server_local->multi_search_desc_len;
     }
   else
-    ctrl->server_local->multi_search_desc_len = 0;
+    {
+      desc = &ctrl->server_local->search_desc;
+      ndesc = 1;
+    }
 
   ctrl->server_local->inhibit_data_logging = 1;
   ctrl->server_local->inhibit_data_logging_now = 0;
@@ -484,12 +570,30 @@ cmd_search (assuan_context_t ctx, char *line)
   ctrl->filter_x509 = opt_x509;
   err = prepare_outstream (ctrl);
   if (err)
-    ;
-  else if (ctrl->server_local->multi_search_desc_len)
-    err = kbxd_search (ctrl, ctrl->server_local->multi_search_desc,
-                       ctrl->server_local->multi_search_desc_len, 1);
-  else
-    err = kbxd_search (ctrl, &ctrl->server_local->search_desc, 1, 1);
+    goto leave;
+  if (opt_all && !ctrl->server_local->outstream && !opt_no_data)
+    {
+      /* With D-lines the client would not be able to tell the
+       * returned keys apart.  */
+      err = set_error (GPG_ERR_NOT_SUPPORTED, "--all requires OUTPUT");
+      goto leave;
+    }
+
+  err = kbxd_search (ctrl, desc, ndesc, 1);
+  if (opt_all)
+    {
+      /* Return all further matches.  The client sees one PUBKEY_INFO
+       * status line for each key and the keys on the output stream
+       * in the same order.  */
+      for (n = 0; !err; n++)
+        {
+          if (desc[0].mode == KEYDB_SEARCH_MODE_FIRST)
+            desc[0].mode = KEYDB_SEARCH_MODE_NEXT;
+          err = kbxd_search (ctrl, desc, ndesc, 0);
+        }
+      if (n && gpg_err_code (err) == GPG_ERR_NOT_FOUND)
+        err = 0;
+    }
   if (err)
     goto leave;
 
@@ -667,18 +771,31 @@ cmd_delete (assuan_context_t ctx, char *line)
 
 
 static const char hlp_transaction[] =
-  "TRANSACTION [begin|commit|rollback]\n"
+  "TRANSACTION [--bulk] [--batch-size=N] [begin|commit|rollback]\n"
   "\n"
   "For bulk import of data it is often useful to run everything\n"
   "in one transaction.  This can be achieved with this command.\n"
   "If the last connection of client is closed before a commit\n"
   "or rollback an implicit rollback is done.  With no argument\n"
-  "the status of the current transaction is returned.";
+  "the status of the current transaction is returned.\n"
+  "\n"
+  "With option --bulk given to \"begin\" the indices used only for\n"
+  "searching are not maintained during the transaction but rebuilt\n"
+  "at its end.  With --batch-size the transaction is committed\n"
+  "after every N stored keyblocks and a status line\n"
+  "  BATCH_COMMITTED <n> <total> <msecs>\n"
+  "is emitted; a rollback then only affects the current batch.";
 static gpg_error_t
 cmd_transaction (assuan_context_t ctx, char *line)
 {
   gpg_error_t err = 0;
+  int opt_bulk;
+  unsigned int opt_batch_size = 0;
+  const char *s;
 
+  opt_bulk = has_option (line, "--bulk");
+  if ((s = option_value (line, "--batch-size")))
+    opt_batch_size = strtoul (s, NULL, 10);
   line = skip_options (line);
 
   if (!strcmp (line, "begin"))
@@ -691,6 +808,8 @@ cmd_transaction (assuan_context_t ctx, char *line)
         {
           opt.in_transaction = 1;
           opt.transaction_pid = assuan_get_pid (ctx);
+          opt.bulk_mode = !!opt_bulk;
+          opt.transaction_batch_size = opt_batch_size;
         }
     }
   else if (!strcmp (line, "commit"))
@@ -735,6 +854,22 @@ cmd_transaction (assuan_context_t ctx, char *line)
 
 
 
+/* Return true if the command CMD implements the option CMDOPT.  */
+static int
+command_has_option (const char *cmd, const char *cmdopt)
+{
+  if (!strcmp (cmd, "SEARCH"))
+    {
+      if (!strcmp (cmdopt, "all"))
+        return 1;
+      if (!strcmp (cmdopt, "inquire"))
+        return 1;
+    }
+
+  return 0;
+}
+
+
 static const char hlp_getinfo[] =
   "GETINFO <what>\n"
   "\n"
@@ -746,7 +881,10 @@ static const char hlp_getinfo[] =
   "socket_name - Return the name of the socket.\n"
   "session_id  - Return the current session_id.\n"
   "connections - Return number of active connections.\n"
-  "getenv NAME - Return value of envvar NAME\n";
+  "cache_stats - Return the statistics of the cache.\n"
+  "getenv NAME - Return value of envvar NAME\n"
+  "cmd_has_option CMD OPT\n"
+  "            - Returns OK if command CMD has option OPT.\n";
 static gpg_error_t
 cmd_getinfo (assuan_context_t ctx, char *line)
 {
@@ -799,6 +937,46 @@ cmd_getinfo (assuan_context_t ctx, char *line)
                 get_kbxd_active_connection_count ());
       err = assuan_send_data (ctx, numbuf, strlen (numbuf));
     }
+  else if (!strcmp (line, "cache_stats"))
+    {
+      membuf_t mb;
+      char *p;
+      size_t n;
+
+      init_membuf (&mb, 512);
+      kbxd_get_cache_stats (&mb);
+      p = get_membuf (&mb, &n);
+      if (!p)
+        err = gpg_error_from_syserror ();
+      else
+        {
+          err = assuan_send_data (ctx, p, n);
+          xfree (p);
+        }
+    }
+  else if (!strncmp (line, "cmd_has_option", 14)
+           && (line[14] == ' ' || line[14] == '\t' || !line[14]))
+    {
+      char *cmd, *cmdopt;
+
+      line += 14;
+      while (*line == ' ' || *line == '\t')
+        line++;
+      cmd = line;
+      while (*line && *line != ' ' && *line != '\t')
+        line++;
+      if (*line)
+        *line++ = 0;
+      while (*line == ' ' || *line == '\t')
+        line++;
+      cmdopt = line;
+      if (!*cmd || !*cmdopt)
+        err = gpg_error (GPG_ERR_MISSING_VALUE);
+      else if (!command_has_option (cmd, cmdopt))
+        err = gpg_error (GPG_ERR_FALSE);
+      else
+        err = 0;
+    }
   else
     err = set_error (GPG_ERR_ASS_PARAMETER, "unknown value for WHAT");
 
@@ -55,6 +55,7 @@ enum cmd_and_opt_values {
   aImportOpenPGP,
   aFindDups,
   aCut,
+  aCreateIndex,
 
   oDebug,
   oDebugAll,
@@ -77,6 +78,7 @@ static gpgrt_opt_t opts[] = {
   { aImportOpenPGP, "import-openpgp", 0, "import OpenPGP keyblocks"},
   { aFindDups,    "find-dups",   0, "find duplicates" },
   { aCut,         "cut",         0, "export records" },
+  { aCreateIndex, "create-index", 0, "create or rebuild the search index" },
 
   { 301, NULL, 0, N_("@\nOptions:\n ") },
 
@@ -490,6 +492,7 @@ main (int argc, char **argv)
         case aImportOpenPGP:
         case aFindDups:
         case aCut:
+        case aCreateIndex:
           cmd = pargs.r_opt;
           break;
 
@@ -552,6 +555,17 @@ main (int argc, char **argv)
             _keybox_dump_cut_records (*argv, from, to, stdout);
         }
     }
+  else if (cmd == aCreateIndex)
+    {
+      gpg_error_t err;
+
+      if (!argc)
+        log_error ("usage: kbxutil --create-index KEYBOXFILE\n");
+      for (; argc; argc--, argv++)
+        if ((err = _keybox_index_create (*argv)))
+          log_error ("error creating index for '%s': %s\n",
+                     *argv, gpg_strerror (err));
+    }
   else if (cmd == aImportOpenPGP)
     {
       if (!argc)
@@ -227,6 +227,8 @@ struct keyboxblob {
   byte *blob;
   size_t bloblen;
   off_t fileoffset;
+  keybox_map_t map;  /* If set BLOB points into this mapping.  */
+  int is_view;       /* BLOB is owned by someone else.  */
 
   /* stuff used only by keybox_create_blob */
   unsigned char *serialbuf;
@@ -1063,6 +1065,62 @@ _keybox_new_blob (KEYBOXBLOB *r_blob,
 }
 
 
+/* Create a blob for the image at offset OFF of the file mapping MAP.
+ * The image is not copied; the blob keeps a reference to MAP
+ * instead.  */
+gpg_error_t
+_keybox_new_mapped_blob (KEYBOXBLOB *r_blob, keybox_map_t map,
+                         off_t off, size_t imagelen)
+{
+  KEYBOXBLOB blob;
+
+  *r_blob = NULL;
+  blob = xtrycalloc (1, sizeof *blob);
+  if (!blob)
+    return gpg_error_from_syserror ();
+
+  /* The mapping is read-only; the cast is fine because we never
+   * modify an image read from a file.  */
+  blob->blob = (byte *)_keybox_ref_map (map, off);
+  blob->map = map;
+  blob->bloblen = imagelen;
+  blob->fileoffset = off;
+  *r_blob = blob;
+  return 0;
+}
+
+
+/* Create a blob which does not own its image.  The image is set with
+ * _keybox_set_view_blob.  This allows to evaluate many images, for
+ * example from a file mapping, without allocating a blob for each.  */
+gpg_error_t
+_keybox_new_view_blob (KEYBOXBLOB *r_blob)
+{
+  KEYBOXBLOB blob;
+
+  *r_blob = NULL;
+  blob = xtrycalloc (1, sizeof *blob);
+  if (!blob)
+    return gpg_error_from_syserror ();
+  blob->is_view = 1;
+  *r_blob = blob;
+  return 0;
+}
+
+
+/* Let the view blob BLOB describe the image {IMAGE,IMAGELEN} read
+ * from file offset OFF.  */
+void
+_keybox_set_view_blob (KEYBOXBLOB blob, const unsigned char *image,
+                       size_t imagelen, off_t off)
+{
+  log_assert (blob->is_view);
+  blob->blob = (byte *)image;
+  blob->bloblen = imagelen;
+  blob->fileoffset = off;
+}
+
+
 void
 _keybox_release_blob (KEYBOXBLOB blob)
 {
@@ -1080,7 +1138,10 @@ _keybox_release_blob (KEYBOXBLOB blob)
     xfree (blob->uids[i].name);
   xfree (blob->uids );
   xfree (blob->sigs );
-  xfree (blob->blob );
+  if (blob->map)
+    _keybox_unref_map (blob->map);
+  else if (!blob->is_view)
+    xfree (blob->blob );
   xfree (blob );
 }
 
@@ -34,6 +34,8 @@
 
 
 typedef struct keyboxblob *KEYBOXBLOB;
+typedef struct keybox_index_s *keybox_index_t;
+typedef struct keybox_map_s *keybox_map_t;
 
 
 typedef struct keybox_name *KB_NAME;
@@ -61,11 +63,31 @@ struct keybox_name
   /* Not yet used.  */
   int did_full_scan;
 
+  /* The blobs of the file with the inode number VERIFIED_INO up to
+   * the offset VERIFIED_LEN are known to be complete; the last of
+   * them starts at VERIFIED_LAST.  This lets remove_torn_tail check
+   * only the blobs appended thereafter.  VERIFIED_LEN is 0 if
+   * nothing is known.  */
+  off_t verified_len;
+  off_t verified_last;
+  uint64_t verified_ino;
+
   /* The name of the resource file. */
   char fname[1];
 };
 
 
+/* A read-only mapping of a keybox file.  Blobs read from the mapping
+ * point into it and hold a reference so that the mapping stays valid
+ * even after the handle has switched to a new mapping.  */
+struct keybox_map_s
+{
+  unsigned int refcount;
+  unsigned char *data;
+  size_t len;
+};
+
+
 struct keybox_found_s
 {
   KEYBOXBLOB blob;
@@ -83,6 +105,11 @@ struct keybox_handle {
   int for_openpgp;        /* Used by gpg.  */
   struct keybox_found_s found;
   struct keybox_found_s saved_found;
+  /* If not NULL the file is mapped into memory and the blobs are
+   * read from the mapping.  MAPPOS is then used instead of the file
+   * position of FP.  */
+  keybox_map_t map;
+  off_t mappos;
   struct {
     char *name;
     char *pattern;
@@ -163,6 +190,11 @@ int _keybox_create_x509_blob (KEYBOXBLOB *r_blob, ksba_cert_t cert,
 int  _keybox_new_blob (KEYBOXBLOB *r_blob,
                        unsigned char *image, size_t imagelen,
                        off_t off);
+gpg_error_t _keybox_new_mapped_blob (KEYBOXBLOB *r_blob, keybox_map_t map,
+                                     off_t off, size_t imagelen);
+gpg_error_t _keybox_new_view_blob (KEYBOXBLOB *r_blob);
+void _keybox_set_view_blob (KEYBOXBLOB blob, const unsigned char *image,
+                            size_t imagelen, off_t off);
 void _keybox_release_blob (KEYBOXBLOB blob);
 const unsigned char *_keybox_get_blob_image (KEYBOXBLOB blob, size_t *n);
 off_t _keybox_get_blob_fileoffset (KEYBOXBLOB blob);
@@ -177,6 +209,15 @@ void _keybox_destroy_openpgp_info (keybox_openpgp_info_t info);
 
 /*-- keybox-file.c --*/
 int _keybox_read_blob (KEYBOXBLOB *r_blob, estream_t fp, int *skipped_deleted);
+int _keybox_read_mapped_blob (KEYBOXBLOB *r_blob, keybox_map_t map,
+                              off_t *r_pos, int *skipped_deleted);
+int _keybox_read_mapped_view (KEYBOXBLOB view, keybox_map_t map,
+                              off_t *r_pos);
+gpg_error_t _keybox_skip_blob (estream_t fp);
+void _keybox_update_map (KEYBOX_HANDLE hd);
+void _keybox_drop_map (KEYBOX_HANDLE hd);
+const unsigned char *_keybox_ref_map (keybox_map_t map, off_t off);
+void _keybox_unref_map (keybox_map_t map);
 int _keybox_write_blob (KEYBOXBLOB blob, estream_t fp, FILE *outfp);
 
 /*-- keybox-search.c --*/
@@ -199,6 +240,23 @@ blob_get_type (KEYBOXBLOB blob)
 }
 
 
+/*-- keybox-index.c --*/
+gpg_error_t _keybox_index_create (const char *fname);
+void _keybox_index_load (const char *fname, keybox_index_t *r_idx);
+void _keybox_index_release (keybox_index_t idx);
+void _keybox_index_reset (keybox_index_t idx);
+gpg_error_t _keybox_index_add (keybox_index_t idx, KEYBOXBLOB blob,
+                               off_t offset);
+void _keybox_index_drop (keybox_index_t idx, off_t offset, off_t len);
+int _keybox_index_valid_p (keybox_index_t idx);
+void _keybox_index_update (keybox_index_t idx, const char *fname,
+                           off_t offset, off_t oldlen, off_t newlen,
+                           KEYBOXBLOB blob);
+gpg_error_t _keybox_index_lookup (KEYBOX_HANDLE hd, KEYBOX_SEARCH_DESC *desc,
+                                  size_t ndesc, int want_blobtype,
+                                  off_t **r_offsets, size_t *r_noffsets);
+
+
 /*-- keybox-dump.c --*/
 int _keybox_dump_blob (KEYBOXBLOB blob, FILE *fp);
 int _keybox_dump_file (const char *filename, int stats_only, FILE *outfp);
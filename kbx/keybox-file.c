@@ -23,12 +23,21 @@
 #include <string.h>
 #include <errno.h>
 #include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#if defined(HAVE_MMAP) && !defined(HAVE_W32_SYSTEM)
+# include <sys/mman.h>
+# define USE_MMAP 1
+#endif
 
 #include "keybox-defs.h"
 
 
 #define IMAGELEN_LIMIT (5*1024*1024)
 
+/* Whether keybox_search may map the keybox file into memory.  */
+static int keybox_use_mmap;
+
 
 #if !defined(HAVE_FTELLO) && !defined(ftello)
 static off_t
@@ -46,7 +55,8 @@ ftello (FILE *stream)
 
 
 /* Read a block at the current position and return it in R_BLOB.
-   R_BLOB may be NULL to simply skip the current block.  */
+   R_BLOB may be NULL to simply skip the current block.  A block cut
+   short by the end of the file returns GPG_ERR_TRUNCATED.  */
 int
 _keybox_read_blob (KEYBOXBLOB *r_blob, estream_t fp, int *skipped_deleted)
 {
@@ -74,7 +84,7 @@ _keybox_read_blob (KEYBOXBLOB *r_blob, estream_t fp, int *skipped_deleted)
       if ( c1 == EOF && !es_ferror (fp) )
         return -1; /* eof */
       if (!es_ferror (fp))
-        return gpg_error (GPG_ERR_TOO_SHORT);
+        return gpg_error (GPG_ERR_TRUNCATED);
       return gpg_error_from_syserror ();
     }
 
@@ -116,7 +126,12 @@ _keybox_read_blob (KEYBOXBLOB *r_blob, estream_t fp, int *skipped_deleted)
   image[0] = c1; image[1] = c2; image[2] = c3; image[3] = c4; image[4] = type;
   if (es_fread (image+5, imagelen-5, 1, fp) != 1)
     {
-      gpg_error_t tmperr = gpg_error_from_syserror ();
+      gpg_error_t tmperr;
+
+      if (es_ferror (fp))
+        tmperr = gpg_error_from_syserror ();
+      else
+        tmperr = gpg_error (GPG_ERR_TRUNCATED);
       xfree (image);
       return tmperr;
     }
@@ -128,6 +143,237 @@ _keybox_read_blob (KEYBOXBLOB *r_blob, estream_t fp, int *skipped_deleted)
 }
 
 
+/* Locate the blob at *R_POS of the mapping MAP and store its offset
+ * and length at R_OFF and R_IMAGELEN.  Deleted blobs are skipped.  On
+ * return *R_POS is set to the offset of the next blob.  Note that
+ * this function may be called by worker threads.  */
+static int
+locate_mapped_blob (keybox_map_t map, off_t *r_pos, int *skipped_deleted,
+                    off_t *r_off, size_t *r_imagelen)
+{
+  const unsigned char *p;
+  size_t imagelen;
+  off_t off;
+  int type;
+
+  if (skipped_deleted)
+    *skipped_deleted = 0;
+ again:
+  off = *r_pos;
+  if (off < 0)
+    return gpg_error (GPG_ERR_INV_VALUE);
+  if ((uint64_t)off >= (uint64_t)map->len)
+    return -1; /* eof */
+  if (map->len - off < 5)
+    return gpg_error (GPG_ERR_TRUNCATED);
+
+  p = map->data + off;
+  imagelen = ((unsigned int)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+  type = p[4];
+  if (imagelen < 5)
+    return gpg_error (GPG_ERR_TOO_SHORT);
+  if (imagelen > map->len - off)
+    return gpg_error (GPG_ERR_TRUNCATED);
+  *r_pos = off + imagelen;
+
+  if (!type)
+    {
+      /* Special treatment for empty blobs. */
+      if (skipped_deleted)
+        *skipped_deleted = 1;
+      goto again;
+    }
+
+  if (imagelen > IMAGELEN_LIMIT) /* Sanity check. */
+    return gpg_error (GPG_ERR_TOO_LARGE);
+
+  *r_off = off;
+  *r_imagelen = imagelen;
+  return 0;
+}
+
+
+/* Read the blob at *R_POS of the mapping MAP and return it in R_BLOB.
+ * This is the same as _keybox_read_blob but the returned blob points
+ * into the mapping and thus no memory needs to be allocated for the
+ * image.  On return *R_POS is set to the offset of the next blob.  */
+int
+_keybox_read_mapped_blob (KEYBOXBLOB *r_blob, keybox_map_t map,
+                          off_t *r_pos, int *skipped_deleted)
+{
+  int rc;
+  off_t off;
+  size_t imagelen;
+
+  if (r_blob)
+    *r_blob = NULL;
+  rc = locate_mapped_blob (map, r_pos, skipped_deleted, &off, &imagelen);
+  if (rc || !r_blob)
+    return rc;
+
+  return _keybox_new_mapped_blob (r_blob, map, off, imagelen);
+}
+
+
+/* Same as _keybox_read_mapped_blob but the blob is stored in the view
+ * blob VIEW; this does not allocate any memory or change the
+ * reference count of MAP and may thus be used by worker threads.  */
+int
+_keybox_read_mapped_view (KEYBOXBLOB view, keybox_map_t map, off_t *r_pos)
+{
+  int rc;
+  off_t off;
+  size_t imagelen;
+
+  rc = locate_mapped_blob (map, r_pos, NULL, &off, &imagelen);
+  if (!rc)
+    _keybox_set_view_blob (view, map->data + off, imagelen, off);
+  return rc;
+}
+
+
+/* Skip the blob at the current position of FP.  In contrast to
+ * _keybox_read_blob a deleted blob is not handled specially and thus
+ * exactly one blob is skipped.  */
+gpg_error_t
+_keybox_skip_blob (estream_t fp)
+{
+  unsigned char buf[4];
+  size_t imagelen;
+
+  if (es_fread (buf, 4, 1, fp) != 1)
+    {
+      if (!es_ferror (fp))
+        return gpg_error (GPG_ERR_TOO_SHORT);
+      return gpg_error_from_syserror ();
+    }
+
+  imagelen = ((size_t)buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) | buf[3];
+  if (imagelen < 5)
+    return gpg_error (GPG_ERR_TOO_SHORT);
+  if (es_fseek (fp, imagelen-4, SEEK_CUR))
+    return gpg_error_from_syserror ();
+  return 0;
+}
+
+
+/* Allow keybox_search to map the keybox file into memory if ENABLE
+ * is true.  Full scans of the keybox then do not need to allocate
+ * and copy each blob.  Note that a keybox file which is truncated
+ * while it is mapped results in a SIGBUS.  */
+void
+keybox_enable_mmap (int enable)
+{
+  keybox_use_mmap = !!enable;
+}
+
+
+/* Return a pointer to offset OFF of MAP and take a reference on it.  */
+const unsigned char *
+_keybox_ref_map (keybox_map_t map, off_t off)
+{
+  map->refcount++;
+  return map->data + off;
+}
+
+
+/* Release a reference to MAP and unmap it when it is not anymore
+ * used.  */
+void
+_keybox_unref_map (keybox_map_t map)
+{
+  if (!map)
+    return;
+  if (--map->refcount)
+    return;
+#ifdef USE_MMAP
+  munmap (map->data, map->len);
+#endif
+  xfree (map);
+}
+
+
+/* Stop reading HD from a mapping.  If the file is still open, its
+ * position is set to the position in the mapping.  */
+void
+_keybox_drop_map (KEYBOX_HANDLE hd)
+{
+  if (!hd->map)
+    return;
+  if (hd->fp && es_fseeko (hd->fp, hd->mappos, SEEK_SET))
+    {
+      /* The next search will re-open the file.  */
+      _keybox_ll_close (hd->fp);
+      hd->fp = NULL;
+    }
+  _keybox_unref_map (hd->map);
+  hd->map = NULL;
+}
+
+
+/* Make sure that HD reads from a mapping of its open file which
+ * covers the entire file.  If the file has changed its size since it
+ * was mapped, a new mapping is created; blobs which still point into
+ * the old one keep it alive.  If mapping is not enabled or not
+ * possible, HD reads the file as usual.  */
+void
+_keybox_update_map (KEYBOX_HANDLE hd)
+{
+#ifdef USE_MMAP
+  struct stat st;
+  keybox_map_t map;
+  off_t pos;
+  void *p;
+
+  if (!keybox_use_mmap || !hd->fp)
+    {
+      _keybox_drop_map (hd);
+      return;
+    }
+
+  if (fstat (es_fileno (hd->fp), &st)
+      || !S_ISREG (st.st_mode)
+      || !st.st_size
+      || (uint64_t)st.st_size > (size_t)(-1))
+    {
+      _keybox_drop_map (hd);
+      return;
+    }
+  if (hd->map && hd->map->len == (size_t)st.st_size)
+    return;  /* Still up-to-date.  */
+
+  if (hd->map)
+    pos = hd->mappos;
+  else if ((pos = es_ftello (hd->fp)) == (off_t)-1)
+    return;
+
+  p = mmap (NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED,
+            es_fileno (hd->fp), 0);
+  if (p == MAP_FAILED)
+    {
+      _keybox_drop_map (hd);
+      return;
+    }
+  map = xtrymalloc (sizeof *map);
+  if (!map)
+    {
+      munmap (p, (size_t)st.st_size);
+      _keybox_drop_map (hd);
+      return;
+    }
+  map->refcount = 1;
+  map->data = p;
+  map->len = (size_t)st.st_size;
+
+  _keybox_unref_map (hd->map);
+  hd->map = map;
+  hd->mappos = pos;
+#else
+  (void)hd;
+#endif
+}
+
+
 /* Write the block to the current file position */
 int
 _keybox_write_blob (KEYBOXBLOB blob, estream_t fp, FILE *outfp)
@@ -0,0 +1,930 @@
+/* keybox-index.c - Sidecar index for keybox files
+ * Copyright (C) 2026 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* The index is an optional file stored next to the keybox with the
+ * suffix ".idx".  It maps the fingerprints, long keyids, keygrips,
+ * the UBID and the lowercased addrspecs of all OpenPGP blobs to the
+ * file offset of their blob.  The index is only used if it exists;
+ * it is created using "kbxutil --create-index" and from then on kept
+ * up-to-date by the update functions of keybox-update.c.
+ *
+ * The file format is (all integers are big endian):
+ *
+ *   byte[4]  magic "KBXi"
+ *   byte     version (1)
+ *   byte     flags; bit 0 is set if the keybox has only OpenPGP blobs.
+ *   byte[2]  reserved
+ *   u64      size of the keybox file
+ *   u64      mtime of the keybox file
+ *   u64      inode of the keybox file
+ *   u64      number of items
+ *
+ * followed by the items sorted by key and offset:
+ *
+ *   byte[8]  key
+ *   u64      offset of the blob
+ *
+ * The key is the leftmost 8 bytes of the SHA-1 hash over a type octet
+ * and the value.  Because the search function verifies each
+ * candidate blob with the regular matching code neither a hash
+ * collision nor a stale entry can lead to a wrong result.  The size,
+ * mtime and inode of the keybox are used to detect modifications by
+ * software not knowing about the index; in this case the index is
+ * ignored until it has been rebuilt.
+ */
+
+#include <config.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "keybox-defs.h"
+#include <gcrypt.h>
+#include "../common/sysutils.h"
+#include "../common/host2net.h"
+#include "../common/mbox-util.h"
+
+#define get32(a) buf32_to_ulong ((a))
+#define get16(a) buf16_to_ulong ((a))
+
+#define INDEX_SUFFIX     ".idx"
+#define INDEX_VERSION    1
+#define INDEX_HEADERLEN  40
+#define INDEX_ITEMLEN    16
+#define INDEX_KEYLEN      8
+
+#define INDEX_FLAG_PGP_ONLY 1
+
+/* The type octets prefixed to the hashed values.  */
+#define INDEX_TYPE_FPR    'F'
+#define INDEX_TYPE_KID    'K'
+#define INDEX_TYPE_GRIP   'G'
+#define INDEX_TYPE_UBID   'U'
+#define INDEX_TYPE_MAIL   'M'
+
+
+/* The state of the keybox file as recorded in the index.  */
+struct index_stamp_s
+{
+  uint64_t size;
+  uint64_t mtime;
+  uint64_t ino;
+};
+
+struct index_item_s
+{
+  unsigned char key[INDEX_KEYLEN];
+  uint64_t offset;
+};
+
+/* The in-memory version of the index as used by the update
+ * functions.  */
+struct keybox_index_s
+{
+  int stale;        /* The index needs to be rebuilt.  */
+  int pgp_only;     /* Only OpenPGP blobs are in the keybox.  */
+  size_t nitems;
+  size_t size;      /* Allocated number of items.  */
+  struct index_item_s *items;
+};
+
+
+
+static char *
+index_fname (const char *fname)
+{
+  return strconcat (fname, INDEX_SUFFIX, NULL);
+}
+
+
+static void
+stamp_from_stat (struct index_stamp_s *stamp, const struct stat *st)
+{
+  stamp->size = st->st_size;
+  stamp->mtime = st->st_mtime;
+  stamp->ino = st->st_ino;
+}
+
+
+static int
+stamp_equal_p (const struct index_stamp_s *a, const struct index_stamp_s *b)
+{
+  return (a->size == b->size && a->mtime == b->mtime && a->ino == b->ino);
+}
+
+
+static uint64_t
+get64 (const unsigned char *p)
+{
+  return (((uint64_t)buf32_to_u32 (p)) << 32) | buf32_to_u32 (p+4);
+}
+
+
+static void
+put64 (unsigned char *p, uint64_t a)
+{
+  int i;
+
+  for (i=7; i >= 0; i--, a >>= 8)
+    p[i] = a;
+}
+
+
+/* Compute the index key for VALUE of length VALUELEN with TYPE and
+ * store it at KEY.  */
+static void
+make_key (unsigned char *key, int type, const void *value, size_t valuelen)
+{
+  unsigned char digest[20];
+  gcry_buffer_t iov[2];
+  unsigned char t = type;
+
+  memset (iov, 0, sizeof iov);
+  iov[0].data = &t;
+  iov[0].len = 1;
+  iov[1].data = (void*)value;
+  iov[1].len = valuelen;
+  gcry_md_hash_buffers (GCRY_MD_SHA1, 0, digest, iov, 2);
+  memcpy (key, digest, INDEX_KEYLEN);
+}
+
+
+/* Same as make_key but lowercase the mail address NAME of length
+ * NAMELEN first.  */
+static void
+make_mail_key (unsigned char *key, const char *name, size_t namelen)
+{
+  char buffer[256];
+  char *tmp;
+  size_t n;
+
+  tmp = namelen < sizeof buffer? buffer : xtrymalloc (namelen);
+  if (!tmp)
+    {
+      /* Use an all zero key which will never match anything useful.
+       * The candidate is verified anyway.  */
+      memset (key, 0, INDEX_KEYLEN);
+      return;
+    }
+  for (n=0; n < namelen; n++)
+    tmp[n] = ascii_tolower (name[n]);
+  make_key (key, INDEX_TYPE_MAIL, tmp, namelen);
+  if (tmp != buffer)
+    xfree (tmp);
+}
+
+
+/* Read and check the header of the index file FP.  On success the
+ * stamp, the flags and the number of items are stored at the
+ * provided addresses.  */
+static gpg_error_t
+read_header (estream_t fp, struct index_stamp_s *stamp, int *r_flags,
+             uint64_t *r_nitems)
+{
+  unsigned char header[INDEX_HEADERLEN];
+
+  if (es_fread (header, INDEX_HEADERLEN, 1, fp) != 1)
+    return gpg_error (GPG_ERR_TOO_SHORT);
+  if (memcmp (header, "KBXi", 4) || header[4] != INDEX_VERSION)
+    return gpg_error (GPG_ERR_INV_OBJ);
+  *r_flags = header[5];
+  stamp->size  = get64 (header + 8);
+  stamp->mtime = get64 (header + 16);
+  stamp->ino   = get64 (header + 24);
+  *r_nitems    = get64 (header + 32);
+  return 0;
+}
+
+
+
+static void
+index_clear (keybox_index_t idx)
+{
+  idx->nitems = 0;
+  idx->pgp_only = 1;
+}
+
+
+static gpg_error_t
+index_add_item (keybox_index_t idx, const unsigned char *key, uint64_t offset)
+{
+  if (idx->nitems == idx->size)
+    {
+      struct index_item_s *tmp;
+      size_t newsize = idx->size? idx->size * 2 : 1024;
+
+      tmp = xtryrealloc (idx->items, newsize * sizeof *tmp);
+      if (!tmp)
+        return gpg_error_from_syserror ();
+      idx->items = tmp;
+      idx->size = newsize;
+    }
+  memcpy (idx->items[idx->nitems].key, key, INDEX_KEYLEN);
+  idx->items[idx->nitems].offset = offset;
+  idx->nitems++;
+  return 0;
+}
+
+
+static int
+compare_items (const void *arg_a, const void *arg_b)
+{
+  const struct index_item_s *a = arg_a;
+  const struct index_item_s *b = arg_b;
+  int cmp;
+
+  cmp = memcmp (a->key, b->key, INDEX_KEYLEN);
+  if (cmp)
+    return cmp;
+  return a->offset < b->offset? -1 : a->offset > b->offset;
+}
+
+
+/* Add the mail addresses of the OpenPGP blob BUFFER/LENGTH to IDX.
+ * This mirrors the parsing done by blob_cmp_mail in
+ * keybox-search.c.  */
+static gpg_error_t
+add_mail_items (keybox_index_t idx, const unsigned char *buffer,
+                size_t length, uint64_t offset)
+{
+  gpg_error_t err;
+  size_t pos, off, len, mypos;
+  size_t nkeys, keyinfolen;
+  size_t nuids, uidinfolen;
+  size_t nserial;
+  size_t idxno;
+  unsigned char key[INDEX_KEYLEN];
+
+  nkeys = get16 (buffer + 16);
+  keyinfolen = get16 (buffer + 18 );
+  if (keyinfolen < 28)
+    return 0;
+  pos = 20 + keyinfolen*nkeys;
+  if (pos+2 > length)
+    return 0;
+  nserial = get16 (buffer+pos);
+  pos += 2 + nserial;
+  if (pos+4 > length)
+    return 0;
+  nuids = get16 (buffer + pos);  pos += 2;
+  uidinfolen = get16 (buffer + pos);  pos += 2;
+  if (uidinfolen < 12)
+    return 0;
+  if (pos + uidinfolen*nuids > length)
+    return 0;
+
+  for (idxno=0; idxno < nuids; idxno++)
+    {
+      size_t mylen;
+
+      mypos = pos + idxno*uidinfolen;
+      off = get32 (buffer+mypos);
+      len = get32 (buffer+mypos+4);
+      if ((uint64_t)off+(uint64_t)len > (uint64_t)length)
+        return 0;
+
+      /* Forward to the mailbox part.  */
+      mypos = off;
+      mylen = len;
+      for ( ; len && buffer[off] != '<'; len--, off++)
+        ;
+      if (len < 2 || buffer[off] != '<')
+        {
+          /* No angle brackets; check whether the entire string is a
+           * mailbox.  */
+          off = mypos;
+          len = mylen;
+          if (!is_valid_mailbox_mem (buffer+off, len))
+            continue;
+        }
+      else
+        {
+          off++;
+          len--;
+          for (mypos=off; len && buffer[mypos] != '>'; len--, mypos++)
+            ;
+          if (!len || buffer[mypos] != '>' || off == mypos)
+            continue;
+          len = mypos - off;
+        }
+
+      make_mail_key (key, (const char*)buffer + off, len);
+      err = index_add_item (idx, key, offset);
+      if (err)
+        return err;
+    }
+  return 0;
+}
+
+
+/* Add the items for BLOB which is stored at OFFSET to IDX.  Only
+ * OpenPGP blobs are indexed.  */
+static gpg_error_t
+index_add_blob (keybox_index_t idx, KEYBOXBLOB blob, off_t offset)
+{
+  gpg_error_t err;
+  const unsigned char *buffer;
+  size_t length;
+  size_t pos, off, nkeys, keyinfolen;
+  size_t cert_off, cert_len;
+  int n, fpr32, fprlen;
+  unsigned char key[INDEX_KEYLEN];
+  struct _keybox_openpgp_info info;
+  struct _keybox_openpgp_key_info *k;
+
+  buffer = _keybox_get_blob_image (blob, &length);
+  if (length < 40)
+    return 0;
+  if (buffer[4] == KEYBOX_BLOBTYPE_HEADER)
+    return 0;
+  if (buffer[4] != KEYBOX_BLOBTYPE_PGP)
+    {
+      idx->pgp_only = 0;
+      return 0;
+    }
+  fpr32 = buffer[5] == 2;
+
+  nkeys = get16 (buffer + 16);
+  keyinfolen = get16 (buffer + 18);
+  if (!nkeys || keyinfolen < (fpr32?56:28))
+    return 0;
+  pos = 20;
+  if (pos + (uint64_t)keyinfolen*nkeys > (uint64_t)length)
+    return 0;
+
+  /* The UBID is the primary fingerprint.  */
+  make_key (key, INDEX_TYPE_UBID, buffer + pos, UBID_LEN);
+  err = index_add_item (idx, key, offset);
+  if (err)
+    return err;
+
+  for (n=0; n < nkeys; n++)
+    {
+      off = pos + n*keyinfolen;
+      if (fpr32 && (buffer[off + 32 + 1] & 0x80))
+        fprlen = 32;
+      else
+        fprlen = 20;
+      make_key (key, INDEX_TYPE_FPR, buffer + off, fprlen);
+      err = index_add_item (idx, key, offset);
+      if (err)
+        return err;
+      make_key (key, INDEX_TYPE_KID,
+                buffer + off + (fprlen == 32? 0 : 12), 8);
+      err = index_add_item (idx, key, offset);
+      if (err)
+        return err;
+    }
+
+  /* We don't have the keygrips as meta data and thus need to parse
+   * the keyblock.  */
+  cert_off = get32 (buffer+8);
+  cert_len = get32 (buffer+12);
+  if ((uint64_t)cert_off+(uint64_t)cert_len <= (uint64_t)length
+      && !_keybox_parse_openpgp (buffer + cert_off, cert_len, 0, NULL, &info))
+    {
+      make_key (key, INDEX_TYPE_GRIP, info.primary.grip, 20);
+      err = index_add_item (idx, key, offset);
+      for (k = info.nsubkeys? &info.subkeys : NULL; k && !err; k = k->next)
+        {
+          make_key (key, INDEX_TYPE_GRIP, k->grip, 20);
+          err = index_add_item (idx, key, offset);
+        }
+      _keybox_destroy_openpgp_info (&info);
+      if (err)
+        return err;
+    }
+
+  return add_mail_items (idx, buffer, length, offset);
+}
+
+
+/* Public version of index_add_blob.  On error IDX is marked for a
+ * rebuild.  */
+gpg_error_t
+_keybox_index_add (keybox_index_t idx, KEYBOXBLOB blob, off_t offset)
+{
+  gpg_error_t err;
+
+  if (!idx || idx->stale)
+    return 0;
+  err = index_add_blob (idx, blob, offset);
+  if (err)
+    idx->stale = 1;
+  return err;
+}
+
+
+/* Write IDX for the keybox FNAME.  The index is stamped with the
+ * current state of the keybox file.  */
+static gpg_error_t
+index_store (keybox_index_t idx, const char *fname,
+             const struct index_stamp_s *stamp)
+{
+  gpg_error_t err;
+  char *idxfname = NULL;
+  char *tmpfname = NULL;
+  estream_t fp = NULL;
+  unsigned char buffer[INDEX_HEADERLEN];
+  size_t n;
+
+  idxfname = index_fname (fname);
+  tmpfname = idxfname? strconcat (idxfname, ".tmp", NULL) : NULL;
+  if (!tmpfname)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+
+  qsort (idx->items, idx->nitems, sizeof *idx->items, compare_items);
+
+  fp = es_fopen (tmpfname, "wb,sysopen");
+  if (!fp)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+
+  memset (buffer, 0, sizeof buffer);
+  memcpy (buffer, "KBXi", 4);
+  buffer[4] = INDEX_VERSION;
+  buffer[5] = idx->pgp_only? INDEX_FLAG_PGP_ONLY : 0;
+  put64 (buffer + 8, stamp->size);
+  put64 (buffer + 16, stamp->mtime);
+  put64 (buffer + 24, stamp->ino);
+  put64 (buffer + 32, idx->nitems);
+  if (es_fwrite (buffer, INDEX_HEADERLEN, 1, fp) != 1)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+
+  for (n=0; n < idx->nitems; n++)
+    {
+      memcpy (buffer, idx->items[n].key, INDEX_KEYLEN);
+      put64 (buffer + INDEX_KEYLEN, idx->items[n].offset);
+      if (es_fwrite (buffer, INDEX_ITEMLEN, 1, fp) != 1)
+        {
+          err = gpg_error_from_syserror ();
+          goto leave;
+        }
+    }
+
+  if (es_fclose (fp))
+    {
+      fp = NULL;
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  fp = NULL;
+
+  err = gnupg_rename_file (tmpfname, idxfname, NULL);
+
+ leave:
+  if (fp)
+    es_fclose (fp);
+  if (err && tmpfname)
+    gnupg_remove (tmpfname);
+  xfree (tmpfname);
+  xfree (idxfname);
+  return err;
+}
+
+
+/* Create or rebuild the index for the keybox FNAME by scanning the
+ * entire keybox.  */
+gpg_error_t
+_keybox_index_create (const char *fname)
+{
+  gpg_error_t err;
+  struct keybox_index_s idxbuf;
+  struct index_stamp_s stamp;
+  struct stat st;
+  estream_t fp;
+  KEYBOXBLOB blob = NULL;
+
+  memset (&idxbuf, 0, sizeof idxbuf);
+  index_clear (&idxbuf);
+
+  err = _keybox_ll_open (&fp, fname, KEYBOX_LL_OPEN_READ);
+  if (err)
+    return err;
+  if (fstat (es_fileno (fp), &st))
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  stamp_from_stat (&stamp, &st);
+
+  while (!(err = _keybox_read_blob (&blob, fp, NULL)))
+    {
+      err = index_add_blob (&idxbuf, blob, _keybox_get_blob_fileoffset (blob));
+      _keybox_release_blob (blob);
+      blob = NULL;
+      if (err)
+        goto leave;
+    }
+  if (err == -1)
+    err = 0;
+  else
+    goto leave;
+
+  err = index_store (&idxbuf, fname, &stamp);
+
+ leave:
+  _keybox_ll_close (fp);
+  xfree (idxbuf.items);
+  return err;
+}
+
+
+/* Load the index for the keybox FNAME so that it can be updated
+ * after a change of the keybox.  This must be called with the keybox
+ * locked and before the keybox is modified.  If no index exists NULL
+ * is stored at R_IDX.  If the index does not match the keybox an
+ * index object marked for a rebuild is returned.  */
+void
+_keybox_index_load (const char *fname, keybox_index_t *r_idx)
+{
+  gpg_error_t err;
+  keybox_index_t idx;
+  char *idxfname;
+  estream_t fp = NULL;
+  struct index_stamp_s stamp, filestamp;
+  struct stat st;
+  int flags;
+  uint64_t nitems, n;
+  unsigned char buffer[INDEX_ITEMLEN];
+
+  *r_idx = NULL;
+
+  idxfname = index_fname (fname);
+  if (!idxfname)
+    return;
+  if (gnupg_access (idxfname, F_OK))
+    {
+      xfree (idxfname);
+      return;  /* No index - nothing to maintain.  */
+    }
+
+  idx = xtrycalloc (1, sizeof *idx);
+  if (!idx)
+    {
+      /* We can't mark the index as stale, thus we remove it.  */
+      gnupg_remove (idxfname);
+      xfree (idxfname);
+      return;
+    }
+  *r_idx = idx;
+  index_clear (idx);
+  idx->stale = 1;
+
+  fp = es_fopen (idxfname, "rb,sysopen");
+  if (!fp)
+    goto leave;
+  if (read_header (fp, &stamp, &flags, &nitems))
+    goto leave;
+  if (gnupg_stat (fname, &st))
+    goto leave;
+  stamp_from_stat (&filestamp, &st);
+  if (!stamp_equal_p (&stamp, &filestamp))
+    goto leave;
+
+  for (n=0; n < nitems; n++)
+    {
+      if (es_fread (buffer, INDEX_ITEMLEN, 1, fp) != 1)
+        goto leave;
+      err = index_add_item (idx, buffer, get64 (buffer + INDEX_KEYLEN));
+      if (err)
+        goto leave;
+    }
+  idx->pgp_only = !!(flags & INDEX_FLAG_PGP_ONLY);
+  idx->stale = 0;
+
+ leave:
+  if (idx->stale)
+    index_clear (idx);
+  es_fclose (fp);
+  xfree (idxfname);
+}
+
+
+/* Release an index object.  */
+void
+_keybox_index_release (keybox_index_t idx)
+{
+  if (!idx)
+    return;
+  xfree (idx->items);
+  xfree (idx);
+}
+
+
+/* Remove all items from IDX so that it can be refilled using
+ * _keybox_index_add.  This is used when the entire keybox is
+ * rewritten.  */
+void
+_keybox_index_reset (keybox_index_t idx)
+{
+  if (!idx)
+    return;
+  index_clear (idx);
+  idx->stale = 0;
+}
+
+
+/* Return true if IDX exists and matches its keybox.  Because the
+ * index is updated after each completed write, the keybox then ends
+ * with a complete blob.  */
+int
+_keybox_index_valid_p (keybox_index_t idx)
+{
+  return idx && !idx->stale;
+}
+
+
+/* Remove the items of the LEN bytes long blob at OFFSET from IDX.
+ * The index file is only written by the next _keybox_index_update;
+ * this is used if more than one blob has been changed.  */
+void
+_keybox_index_drop (keybox_index_t idx, off_t offset, off_t len)
+{
+  size_t n, i;
+
+  if (!idx || idx->stale)
+    return;
+
+  for (n=i=0; n < idx->nitems; n++)
+    if (idx->items[n].offset < (uint64_t)offset
+        || idx->items[n].offset >= (uint64_t)(offset + len))
+      idx->items[i++] = idx->items[n];
+  idx->nitems = i;
+}
+
+
+/* Update the index IDX of keybox FNAME after the keybox has been
+ * changed: The OLDLEN bytes at OFFSET have been replaced by NEWLEN
+ * bytes and BLOB, if not NULL, is the new blob at OFFSET.  An insert
+ * at the end of the file is thus described by OLDLEN 0 and a blob
+ * overwritten in place by OLDLEN == NEWLEN.  If IDX has been marked
+ * stale the index is rebuilt from the keybox.  Errors are only
+ * logged; a failed update removes the index.  */
+void
+_keybox_index_update (keybox_index_t idx, const char *fname, off_t offset,
+                      off_t oldlen, off_t newlen, KEYBOXBLOB blob)
+{
+  gpg_error_t err;
+  struct index_stamp_s stamp;
+  struct stat st;
+  size_t n, i;
+  char *idxfname;
+
+  if (!idx)
+    return;
+
+  if (idx->stale)
+    err = _keybox_index_create (fname);
+  else
+    {
+      for (n=i=0; n < idx->nitems; n++)
+        {
+          if (idx->items[n].offset >= (uint64_t)offset
+              && idx->items[n].offset < (uint64_t)(offset + oldlen))
+            continue;  /* Drop items of the old blob.  */
+          if (idx->items[n].offset >= (uint64_t)(offset + oldlen))
+            idx->items[n].offset += newlen - oldlen;
+          idx->items[i++] = idx->items[n];
+        }
+      idx->nitems = i;
+
+      err = blob? index_add_blob (idx, blob, offset) : 0;
+      if (!err && gnupg_stat (fname, &st))
+        err = gpg_error_from_syserror ();
+      if (!err)
+        {
+          stamp_from_stat (&stamp, &st);
+          err = index_store (idx, fname, &stamp);
+        }
+    }
+
+  if (err)
+    {
+      log_info ("keybox: error updating index for '%s': %s\n",
+                fname, gpg_strerror (err));
+      idxfname = index_fname (fname);
+      if (idxfname)
+        gnupg_remove (idxfname);
+      xfree (idxfname);
+    }
+}
+
+
+
+/* Binary search the index file FP with NITEMS items for KEY and
+ * append the offsets of all matching items to the array at
+ * R_OFFSETS/R_NOFFSETS/R_SIZE.  */
+static gpg_error_t
+lookup_key (estream_t fp, uint64_t nitems, const unsigned char *key,
+            off_t **r_offsets, size_t *r_noffsets, size_t *r_size)
+{
+  unsigned char buffer[INDEX_ITEMLEN];
+  uint64_t lo, hi, mid;
+
+  lo = 0;
+  hi = nitems;
+  while (lo < hi)
+    {
+      mid = lo + (hi - lo) / 2;
+      if (es_fseeko (fp, INDEX_HEADERLEN + mid * INDEX_ITEMLEN, SEEK_SET)
+          || es_fread (buffer, INDEX_ITEMLEN, 1, fp) != 1)
+        return gpg_error (GPG_ERR_TOO_SHORT);
+      if (memcmp (buffer, key, INDEX_KEYLEN) < 0)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+
+  if (es_fseeko (fp, INDEX_HEADERLEN + lo * INDEX_ITEMLEN, SEEK_SET))
+    return gpg_error_from_syserror ();
+  for (; lo < nitems; lo++)
+    {
+      if (es_fread (buffer, INDEX_ITEMLEN, 1, fp) != 1)
+        return gpg_error (GPG_ERR_TOO_SHORT);
+      if (memcmp (buffer, key, INDEX_KEYLEN))
+        break;
+      if (*r_noffsets == *r_size)
+        {
+          off_t *tmp;
+          size_t newsize = *r_size? *r_size * 2 : 16;
+
+          tmp = xtryrealloc (*r_offsets, newsize * sizeof *tmp);
+          if (!tmp)
+            return gpg_error_from_syserror ();
+          *r_offsets = tmp;
+          *r_size = newsize;
+        }
+      (*r_offsets)[(*r_noffsets)++] = get64 (buffer + INDEX_KEYLEN);
+    }
+  return 0;
+}
+
+
+static int
+compare_offsets (const void *arg_a, const void *arg_b)
+{
+  off_t a = *(const off_t *)arg_a;
+  off_t b = *(const off_t *)arg_b;
+
+  return a < b? -1 : a > b;
+}
+
+
+/* Return the offsets of the candidate blobs for the search
+ * DESC/NDESC on the keybox opened at HD.  On success an ascending
+ * array of offsets is stored at R_OFFSETS and its length at
+ * R_NOFFSETS; the caller must verify each candidate.
+ * GPG_ERR_NOT_SUPPORTED is returned if there is no valid index or
+ * a search mode can't be served from the index.  */
+gpg_error_t
+_keybox_index_lookup (KEYBOX_HANDLE hd, KEYBOX_SEARCH_DESC *desc,
+                      size_t ndesc, int want_blobtype,
+                      off_t **r_offsets, size_t *r_noffsets)
+{
+  gpg_error_t err;
+  unsigned char *keys;
+  unsigned char kidbuf[8];
+  const char *name;
+  size_t namelen, n, i, size;
+  char *idxfname = NULL;
+  estream_t fp = NULL;
+  struct index_stamp_s stamp, filestamp;
+  struct stat st;
+  int flags;
+  uint64_t nitems;
+
+  *r_offsets = NULL;
+  *r_noffsets = 0;
+
+  if (!ndesc || !hd->fp || !hd->kb)
+    return gpg_error (GPG_ERR_NOT_SUPPORTED);
+  if (want_blobtype && want_blobtype != KEYBOX_BLOBTYPE_PGP)
+    return gpg_error (GPG_ERR_NOT_SUPPORTED);
+
+  keys = xtrymalloc (ndesc * INDEX_KEYLEN);
+  if (!keys)
+    return gpg_error_from_syserror ();
+
+  for (n=0; n < ndesc; n++)
+    {
+      switch (desc[n].mode)
+        {
+        case KEYDB_SEARCH_MODE_FPR:
+          make_key (keys + n*INDEX_KEYLEN, INDEX_TYPE_FPR,
+                    desc[n].u.fpr, desc[n].fprlen);
+          break;
+        case KEYDB_SEARCH_MODE_LONG_KID:
+          kidbuf[0] = desc[n].u.kid[0] >> 24;
+          kidbuf[1] = desc[n].u.kid[0] >> 16;
+          kidbuf[2] = desc[n].u.kid[0] >> 8;
+          kidbuf[3] = desc[n].u.kid[0];
+          kidbuf[4] = desc[n].u.kid[1] >> 24;
+          kidbuf[5] = desc[n].u.kid[1] >> 16;
+          kidbuf[6] = desc[n].u.kid[1] >> 8;
+          kidbuf[7] = desc[n].u.kid[1];
+          make_key (keys + n*INDEX_KEYLEN, INDEX_TYPE_KID, kidbuf, 8);
+          break;
+        case KEYDB_SEARCH_MODE_KEYGRIP:
+          make_key (keys + n*INDEX_KEYLEN, INDEX_TYPE_GRIP,
+                    desc[n].u.grip, 20);
+          break;
+        case KEYDB_SEARCH_MODE_UBID:
+          make_key (keys + n*INDEX_KEYLEN, INDEX_TYPE_UBID,
+                    desc[n].u.ubid, UBID_LEN);
+          break;
+        case KEYDB_SEARCH_MODE_MAIL:
+          /* Normalize the same way has_mail does.  */
+          name = desc[n].u.name;
+          if (!name)
+            goto not_supported;
+          if (*name == '<')
+            name++;
+          namelen = strlen (name);
+          if (namelen && name[namelen-1] == '>')
+            namelen--;
+          make_mail_key (keys + n*INDEX_KEYLEN, name, namelen);
+          break;
+        default:
+          goto not_supported;
+        }
+    }
+
+  if (fstat (es_fileno (hd->fp), &st))
+    goto not_supported;
+  stamp_from_stat (&filestamp, &st);
+
+  idxfname = index_fname (hd->kb->fname);
+  if (!idxfname)
+    goto not_supported;
+  fp = es_fopen (idxfname, "rb,sysopen");
+  if (!fp)
+    goto not_supported;
+  if (read_header (fp, &stamp, &flags, &nitems)
+      || !stamp_equal_p (&stamp, &filestamp)
+      || (!want_blobtype && !(flags & INDEX_FLAG_PGP_ONLY)))
+    goto not_supported;
+
+  size = 0;
+  for (n=0; n < ndesc; n++)
+    {
+      err = lookup_key (fp, nitems, keys + n*INDEX_KEYLEN,
+                        r_offsets, r_noffsets, &size);
+      if (err)
+        {
+          /* A damaged index is not fatal.  */
+          xfree (*r_offsets);
+          *r_offsets = NULL;
+          *r_noffsets = 0;
+          goto not_supported;
+        }
+    }
+
+  /* Sort and remove duplicates.  */
+  if (*r_noffsets)
+    {
+      qsort (*r_offsets, *r_noffsets, sizeof **r_offsets, compare_offsets);
+      for (n=i=1; n < *r_noffsets; n++)
+        if ((*r_offsets)[n] != (*r_offsets)[i-1])
+          (*r_offsets)[i++] = (*r_offsets)[n];
+      *r_noffsets = i;
+    }
+  err = 0;
+  goto leave;
+
+ not_supported:
+  err = gpg_error (GPG_ERR_NOT_SUPPORTED);
+ leave:
+  es_fclose (fp);
+  xfree (idxfname);
+  xfree (keys);
+  return err;
+}
@@ -82,6 +82,9 @@ keybox_register_file (const char *fname, int secret, void **r_token)
   kr->lockhd = NULL;
   kr->is_locked = 0;
   kr->did_full_scan = 0;
+  kr->verified_len = 0;
+  kr->verified_last = 0;
+  kr->verified_ino = 0;
   /* keep a list of all issued pointers */
   kr->next = kb_names;
   kb_names = kr;
@@ -202,6 +205,7 @@ keybox_fp_close (KEYBOX_HANDLE hd)
       _keybox_ll_close (hd->fp);
       hd->fp = NULL;
     }
+  _keybox_drop_map (hd);
 }
 
 void
@@ -218,6 +222,7 @@ keybox_release (KEYBOX_HANDLE hd)
     }
   _keybox_release_blob (hd->found.blob);
   _keybox_release_blob (hd->saved_found.blob);
+  _keybox_drop_map (hd);
   xfree (hd->word_match.name);
   xfree (hd->word_match.pattern);
   xfree (hd);
@@ -385,6 +390,7 @@ _keybox_close_file (KEYBOX_HANDLE hd)
             _keybox_ll_close (roverhd->fp);
             roverhd->fp = NULL;
           }
+        _keybox_drop_map (roverhd);
       }
   log_assert (!hd->fp);
 }
@@ -748,3 +748,53 @@ kbx_get_first_opgp_keyid (const void *buffer, size_t len, u32 *kid)
   _keybox_destroy_openpgp_info (&info);
   return 0;
 }
+
+
+/* Return the fingerprints and keyids of all keys of the OpenPGP
+ * keyblock in BUFFER.  On success a malloced array with the primary
+ * key first is stored at R_KEYS and its number of items at R_NKEYS.  */
+gpg_error_t
+kbx_get_opgp_keyinfo (const void *buffer, size_t len,
+                      struct kbx_opgp_keyinfo_s **r_keys,
+                      unsigned int *r_nkeys)
+{
+  struct _keybox_openpgp_info info;
+  struct _keybox_openpgp_key_info *k;
+  struct kbx_opgp_keyinfo_s *keys;
+  unsigned int n;
+  gpg_error_t err;
+
+  *r_keys = NULL;
+  *r_nkeys = 0;
+
+  err = _keybox_parse_openpgp (buffer, len, 0, NULL, &info);
+  if (err)
+    return err;
+
+  keys = xtrycalloc (1 + info.nsubkeys, sizeof *keys);
+  if (!keys)
+    {
+      err = gpg_error_from_syserror ();
+      _keybox_destroy_openpgp_info (&info);
+      return err;
+    }
+
+  n = 0;
+  keys[n].fprlen = info.primary.fprlen;
+  memcpy (keys[n].fpr, info.primary.fpr, info.primary.fprlen);
+  memcpy (keys[n].keyid, info.primary.keyid, 8);
+  n++;
+  if (info.nsubkeys)
+    for (k = &info.subkeys; k; k = k->next)
+      {
+        keys[n].fprlen = k->fprlen;
+        memcpy (keys[n].fpr, k->fpr, k->fprlen);
+        memcpy (keys[n].keyid, k->keyid, 8);
+        n++;
+      }
+
+  _keybox_destroy_openpgp_info (&info);
+  *r_keys = keys;
+  *r_nkeys = n;
+  return 0;
+}
@@ -100,5 +100,16 @@ typedef struct keydb_search_desc KEYBOX_SEARCH_DESC;
  * extra header file.  */
 gpg_error_t kbx_get_first_opgp_keyid (const void *buffer, size_t len, u32 *kid);
 
+/* Fingerprint and keyid of a key as returned by kbx_get_opgp_keyinfo.  */
+struct kbx_opgp_keyinfo_s
+{
+  unsigned char fprlen;
+  unsigned char fpr[32];
+  unsigned char keyid[8];
+};
+gpg_error_t kbx_get_opgp_keyinfo (const void *buffer, size_t len,
+                                  struct kbx_opgp_keyinfo_s **r_keys,
+                                  unsigned int *r_nkeys);
+
 
 #endif /*KEYBOX_SEARCH_DESC_H*/
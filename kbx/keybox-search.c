@@ -19,11 +19,20 @@
  */
 
 #include <config.h>
+
+#ifdef WITHOUT_NPTH /* Give the Makefile a chance to build without Pth.  */
+# undef HAVE_NPTH
+# undef USE_NPTH
+#endif
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
 #include <errno.h>
+#ifdef HAVE_NPTH
+# include <npth.h>
+#endif
 
 #include "keybox-defs.h"
 #include <gcrypt.h>
@@ -45,6 +54,50 @@ struct sn_array_s {
 #define get16(a) buf16_to_ulong ((a))
 
 
+/* The maximum number of threads used to scan a mapped keybox file.  */
+#define SCAN_MAX_THREADS 64
+
+/* The initial and the maximum size of the file segment scanned by one
+ * thread in one round.  The size is doubled for each round without a
+ * match so that the first matches are found fast but long scans
+ * don't create too many threads.  Threads are only started after a
+ * search did not find a match in the first SCAN_MIN_SEGMENT bytes;
+ * thus searches with many matches don't pay for the threads.  */
+#define SCAN_MIN_SEGMENT (256*1024)
+#define SCAN_MAX_SEGMENT (16*1024*1024)
+
+/* The number of threads keybox_search may use for searches which
+ * need to look at all blobs.  */
+static int search_threads;
+
+
+#ifdef HAVE_NPTH
+/* The parameters of a parallel scan shared by all threads.  */
+struct scan_parm_s
+{
+  keybox_map_t map;
+  int ephemeral;
+  KEYBOX_SEARCH_DESC *desc;
+  size_t ndesc;
+  keybox_blobtype_t want_blobtype;
+};
+
+/* The state of one scan thread.  The thread scans the blobs starting
+ * at START up to END and stores the offset of the first candidate at
+ * HIT.  */
+struct scan_worker_s
+{
+  npth_t thd;
+  struct scan_parm_s *parm;
+  KEYBOXBLOB blob;         /* A view blob owned by this thread.  */
+  off_t start;
+  off_t end;
+  off_t hit;               /* -1 if no candidate was found.  */
+  unsigned long skipped;   /* Number of too large blobs before HIT.  */
+};
+#endif /*HAVE_NPTH*/
+
+
 static inline unsigned int
 blob_get_blob_flags (KEYBOXBLOB blob)
 {
@@ -871,6 +924,210 @@ release_sn_array (struct sn_array_s *array, size_t size)
 
 
 
+#ifdef HAVE_NPTH
+/* Return true if BLOB matches one of the descriptions in PARM.  This
+ * mirrors the checks done by keybox_search for the search modes which
+ * may be scanned in parallel except for the skip function; it must
+ * not call any non-reentrant function.  */
+static int
+scan_blob_matches (struct scan_parm_s *parm, KEYBOXBLOB blob)
+{
+  int blobtype;
+  size_t n;
+
+  blobtype = blob_get_type (blob);
+  if (blobtype == KEYBOX_BLOBTYPE_HEADER)
+    return 0;
+  if (parm->want_blobtype && blobtype != parm->want_blobtype)
+    return 0;
+  if (!parm->ephemeral && (blob_get_blob_flags (blob) & 2))
+    return 0;
+
+  for (n=0; n < parm->ndesc; n++)
+    {
+      const char *name = parm->desc[n].u.name;
+
+      switch (parm->desc[n].mode)
+        {
+        case KEYDB_SEARCH_MODE_EXACT:
+          if (has_username (blob, name, 0))
+            return 1;
+          break;
+        case KEYDB_SEARCH_MODE_MAIL:
+          if (has_mail (blob, name, 0))
+            return 1;
+          break;
+        case KEYDB_SEARCH_MODE_MAILSUB:
+          if (has_mail (blob, name, 1))
+            return 1;
+          break;
+        case KEYDB_SEARCH_MODE_SUBSTR:
+          if (has_username (blob, name, 1))
+            return 1;
+          break;
+        default:
+          break;
+        }
+    }
+  return 0;
+}
+
+
+/* The thread function to scan a segment of a mapped file.  */
+static void *
+scan_worker_thread (void *arg)
+{
+  struct scan_worker_s *w = arg;
+  off_t pos, blobpos;
+  int rc;
+
+  npth_unprotect ();
+  for (pos = w->start; pos < w->end; )
+    {
+      blobpos = pos;
+      rc = _keybox_read_mapped_view (w->blob, w->parm->map, &pos);
+      if (gpg_err_code (rc) == GPG_ERR_TOO_LARGE
+          && gpg_err_source (rc) == GPG_ERR_SOURCE_KEYBOX)
+        {
+          w->skipped++;
+          continue;
+        }
+      if (rc == -1)
+        break;
+      /* On error we also stop here so that keybox_search will read
+       * that blob and see the error.  */
+      if (rc || scan_blob_matches (w->parm, w->blob))
+        {
+          w->hit = blobpos;
+          break;
+        }
+    }
+  npth_protect ();
+  return NULL;
+}
+
+
+/* Return true if the search for DESC may be done by
+ * parallel_prescan.  These are the searches which can't use an index
+ * and thus need to compare the user ids of all blobs.  */
+static int
+parallel_scan_possible (KEYBOX_SEARCH_DESC *desc, size_t ndesc)
+{
+  size_t n;
+
+  if (search_threads < 2 || !ndesc)
+    return 0;
+  for (n=0; n < ndesc; n++)
+    switch (desc[n].mode)
+      {
+      case KEYDB_SEARCH_MODE_EXACT:
+      case KEYDB_SEARCH_MODE_MAIL:
+      case KEYDB_SEARCH_MODE_MAILSUB:
+      case KEYDB_SEARCH_MODE_SUBSTR:
+        break;
+      default:
+        return 0;
+      }
+  return 1;
+}
+
+
+/* Scan the mapping of HD starting at HD->MAPPOS using the NWORKERS
+ * threads described by WORKERS.  The file is split into blob aligned
+ * segments of about *SEGSIZE bytes, one for each thread.  Returns the
+ * offset of the first blob which matches or the length of the mapping
+ * if no blob matches.  The number of too large blobs skipped before
+ * that blob is added to R_SKIPPED.  */
+static off_t
+parallel_prescan (KEYBOX_HANDLE hd, struct scan_worker_s *workers,
+                  int nworkers, size_t *segsize, unsigned long *r_skipped)
+{
+  keybox_map_t map = hd->map;
+  size_t pos = hd->mappos;
+  size_t target, imagelen;
+  npth_attr_t tattr;
+  int i, n, nused;
+  int rc;
+
+  rc = npth_attr_init (&tattr);
+  if (rc)
+    return hd->mappos;  /* Let keybox_search scan the file.  */
+  npth_attr_setdetachstate (&tattr, NPTH_CREATE_JOINABLE);
+
+  while (pos < map->len)
+    {
+      /* Split the next part of the file into blob aligned segments.
+       * An invalid blob ends the segment at the end of the file so
+       * that the thread stops there with an error.  */
+      for (n=0; n < nworkers && pos < map->len; n++)
+        {
+          workers[n].start = pos;
+          workers[n].hit = -1;
+          workers[n].skipped = 0;
+          target = pos + *segsize;
+          while (pos < target && pos < map->len)
+            {
+              if (map->len - pos < 5
+                  || (imagelen = get32 (map->data + pos)) < 5
+                  || imagelen > map->len - pos)
+                pos = map->len;
+              else
+                pos += imagelen;
+            }
+          workers[n].end = pos;
+        }
+      nused = n;
+
+      for (i=0; i < nused; i++)
+        if (npth_create (&workers[i].thd, &tattr,
+                         scan_worker_thread, workers + i))
+          break;
+      /* If we were not able to start all threads, we do the remaining
+       * segments ourself.  */
+      for (n=i; n < nused; n++)
+        scan_worker_thread (workers + n);
+      for (n=0; n < i; n++)
+        npth_join (workers[n].thd, NULL);
+
+      for (n=0; n < nused; n++)
+        {
+          *r_skipped += workers[n].skipped;
+          if (workers[n].hit != -1)
+            {
+              npth_attr_destroy (&tattr);
+              return workers[n].hit;
+            }
+        }
+
+      if (*segsize < SCAN_MAX_SEGMENT)
+        *segsize *= 2;
+    }
+
+  npth_attr_destroy (&tattr);
+  return map->len;
+}
+#endif /*HAVE_NPTH*/
+
+
+/* Allow keybox_search to use up to NTHREADS threads for searches
+ * which need to look at all user ids, like substring searches.  This
+ * is only done if the file has been mapped into memory (see
+ * keybox_enable_mmap) and requires that npth has been initialized.  A
+ * value below 2 disables the use of threads.  */
+void
+keybox_set_search_threads (int nthreads)
+{
+#ifdef HAVE_NPTH
+  if (nthreads > SCAN_MAX_THREADS)
+    nthreads = SCAN_MAX_THREADS;
+  search_threads = nthreads < 2? 0 : nthreads;
+#else
+  (void)nthreads;
+#endif
+}
+
+
+
 /*
  *
  * The search API
@@ -889,7 +1146,9 @@ keybox_search_reset (KEYBOX_HANDLE hd)
       hd->found.blob = NULL;
     }
 
-  if (hd->fp)
+  if (hd->map)
+    hd->mappos = 0;
+  else if (hd->fp)
     {
       if (es_fseeko (hd->fp, 0, SEEK_SET))
         {
@@ -922,6 +1181,18 @@ keybox_search (KEYBOX_HANDLE hd, KEYBOX_SEARCH_DESC *desc, size_t ndesc,
   struct sn_array_s *sn_array = NULL;
   int pk_no, uid_no;
   off_t lastfoundoff;
+  int use_index;
+  off_t *idx_offsets = NULL;
+  size_t idx_noffsets = 0;
+  size_t idx_pos = 0;
+#ifdef HAVE_NPTH
+  int scan_possible = 0;
+  struct scan_parm_s scan_parm;
+  struct scan_worker_s *scan_workers = NULL;
+  int scan_nworkers = 0;
+  size_t scan_segsize = SCAN_MIN_SEGMENT;
+  off_t scan_next = 0;
+#endif
 
   if (!hd)
     return gpg_error (GPG_ERR_INV_VALUE);
@@ -996,7 +1267,10 @@ keybox_search (KEYBOX_HANDLE hd, KEYBOX_SEARCH_DESC *desc, size_t ndesc,
             }
           /* log_debug ("%s: re-opened file and sought to last offset\n", */
           /*            __func__); */
-          rc = _keybox_read_blob (NULL, hd->fp, NULL);
+          /* Note that the blob may have been deleted or updated
+           * meanwhile; thus we can't use _keybox_read_blob which
+           * would then also skip the next blob.  */
+          rc = _keybox_skip_blob (hd->fp);
           if (rc)
             {
               log_debug ("%s: skipping last found blob failed: %s\n",
@@ -1007,6 +1281,10 @@ keybox_search (KEYBOX_HANDLE hd, KEYBOX_SEARCH_DESC *desc, size_t ndesc,
         }
     }
 
+  /* Read from a mapping of the file if enabled.  This is done for
+   * each search so that we notice a changed file size.  */
+  _keybox_update_map (hd);
+
   /* Kludge: We need to convert an SN given as hexstring to its binary
      representation - in some cases we are not able to store it in the
      search descriptor, because due to the way we use it, it is not
@@ -1067,6 +1345,21 @@ keybox_search (KEYBOX_HANDLE hd, KEYBOX_SEARCH_DESC *desc, size_t ndesc,
         }
     }
 
+  /* For exact searches an index may tell us the offsets of all
+   * candidate blobs so that we don't need to scan the entire file.  */
+  use_index = !_keybox_index_lookup (hd, desc, ndesc, want_blobtype,
+                                     &idx_offsets, &idx_noffsets);
+
+#ifdef HAVE_NPTH
+  /* Searches which can't use an index are done by several threads if
+   * the file is mapped.  */
+  if (!use_index && hd->map && hd->mappos >= 0
+      && parallel_scan_possible (desc, ndesc))
+    {
+      scan_possible = 1;
+      scan_next = hd->mappos + SCAN_MIN_SEGMENT;
+    }
+#endif /*HAVE_NPTH*/
 
   pk_no = uid_no = 0;
   for (;;)
@@ -1075,13 +1368,84 @@ keybox_search (KEYBOX_HANDLE hd, KEYBOX_SEARCH_DESC *desc, size_t ndesc,
       int blobtype;
 
       _keybox_release_blob (blob); blob = NULL;
-      rc = _keybox_read_blob (&blob, hd->fp, NULL);
+      if (use_index)
+        {
+          off_t curoff = hd->map? hd->mappos : es_ftello (hd->fp);
+
+          while (idx_pos < idx_noffsets && idx_offsets[idx_pos] < curoff)
+            idx_pos++;
+          if (idx_pos == idx_noffsets)
+            {
+              /* No more candidates; act as if we hit the end of the
+               * file.  */
+              if (hd->map)
+                hd->mappos = hd->map->len;
+              else
+                es_fseeko (hd->fp, 0, SEEK_END);
+              rc = -1;
+              break;
+            }
+          if (hd->map)
+            hd->mappos = idx_offsets[idx_pos];
+          else if (es_fseeko (hd->fp, idx_offsets[idx_pos], SEEK_SET))
+            {
+              rc = gpg_error_from_syserror ();
+              break;
+            }
+        }
+#ifdef HAVE_NPTH
+      else if (scan_possible && hd->mappos >= scan_next)
+        {
+          /* No match in the last SCAN_MIN_SEGMENT bytes; let the
+           * threads find the next candidate.  Failing to set them up
+           * is not an error; we then scan the file in this thread.  */
+          if (!scan_workers)
+            {
+              scan_workers = xtrycalloc (search_threads,
+                                         sizeof *scan_workers);
+              if (scan_workers)
+                {
+                  scan_parm.map = hd->map;
+                  scan_parm.ephemeral = hd->ephemeral;
+                  scan_parm.desc = desc;
+                  scan_parm.ndesc = ndesc;
+                  scan_parm.want_blobtype = want_blobtype;
+                  for (; scan_nworkers < search_threads; scan_nworkers++)
+                    {
+                      scan_workers[scan_nworkers].parm = &scan_parm;
+                      if (_keybox_new_view_blob
+                          (&scan_workers[scan_nworkers].blob))
+                        break;
+                    }
+                }
+            }
+          if (scan_nworkers < 2)
+            scan_possible = 0;
+          else
+            {
+              hd->mappos = parallel_prescan (hd, scan_workers, scan_nworkers,
+                                             &scan_segsize, r_skipped);
+              scan_next = hd->mappos + SCAN_MIN_SEGMENT;
+            }
+        }
+#endif /*HAVE_NPTH*/
+      if (hd->map)
+        rc = _keybox_read_mapped_blob (&blob, hd->map, &hd->mappos, NULL);
+      else
+        rc = _keybox_read_blob (&blob, hd->fp, NULL);
       if (gpg_err_code (rc) == GPG_ERR_TOO_LARGE
           && gpg_err_source (rc) == GPG_ERR_SOURCE_KEYBOX)
         {
           ++*r_skipped;
           continue; /* Skip too large records.  */
         }
+      if (gpg_err_code (rc) == GPG_ERR_TRUNCATED
+          && gpg_err_source (rc) == GPG_ERR_SOURCE_KEYBOX)
+        {
+          /* An incomplete last blob as left by a crash while
+           * appending.  It is removed by the next append.  */
+          rc = -1;
+        }
 
       if (rc)
         break;
@@ -1220,6 +1584,15 @@ keybox_search (KEYBOX_HANDLE hd, KEYBOX_SEARCH_DESC *desc, size_t ndesc,
 
   if (sn_array)
     release_sn_array (sn_array, ndesc);
+  xfree (idx_offsets);
+#ifdef HAVE_NPTH
+  if (scan_workers)
+    {
+      for (n=0; n < search_threads; n++)
+        _keybox_release_blob (scan_workers[n].blob);
+      xfree (scan_workers);
+    }
+#endif
 
   return rc;
 }
@@ -1453,6 +1826,8 @@ keybox_offset (KEYBOX_HANDLE hd)
 {
   if (!hd->fp)
     return 0;
+  if (hd->map)
+    return hd->mappos;
   return es_ftello (hd->fp);
 }
 
@@ -1478,6 +1853,12 @@ keybox_seek (KEYBOX_HANDLE hd, off_t offset)
         return err;
     }
 
+  if (hd->map)
+    {
+      hd->mappos = offset;
+      return 0;
+    }
+
   err = es_fseeko (hd->fp, offset, SEEK_SET);
   hd->error = gpg_error_from_errno (err);
 
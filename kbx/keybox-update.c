@@ -25,6 +25,7 @@
 #include <time.h>
 #include <unistd.h>
 #include <assert.h>
+#include <sys/stat.h>
 
 #include "keybox-defs.h"
 #include "../common/sysutils.h"
@@ -37,6 +38,10 @@
 #define FILECOPY_DELETE 2
 #define FILECOPY_UPDATE 3
 
+#if defined(HAVE_DOSISH_SYSTEM) && !defined(ftruncate)
+#define ftruncate chsize
+#endif
+
 
 #if !defined(HAVE_FSEEKO) && !defined(fseeko)
 
@@ -167,6 +172,10 @@ blob_filecopy (int mode, const char *fname, KEYBOXBLOB blob,
   char *tmpfname = NULL;
   char buffer[4096];  /* (Must be at least 32 bytes) */
   int nread, nbytes;
+  keybox_index_t idx = NULL;
+  off_t blob_off = start_offset;
+  off_t oldlen = 0;
+  size_t newlen = 0;
 
   /* Open the source file. Because we do a rename, we have to check the
      permissions of the file */
@@ -214,6 +223,9 @@ blob_filecopy (int mode, const char *fname, KEYBOXBLOB blob,
       goto leave;
     }
 
+  /* Get the index before we change the file.  */
+  _keybox_index_load (fname, &idx);
+
   /* Create the new file.  On success NEWFP is initialized.  */
   rc = create_tmp_file (fname, &bakfname, &tmpfname, &newfp);
   if (rc)
@@ -296,11 +308,14 @@ blob_filecopy (int mode, const char *fname, KEYBOXBLOB blob,
           _keybox_ll_close (newfp);
           goto leave;
         }
+      oldlen = es_ftello (fp) - start_offset;
     }
 
   /* Do an insert or update. */
   if ( mode == FILECOPY_INSERT || mode == FILECOPY_UPDATE )
     {
+      blob_off = es_ftello (newfp);
+      _keybox_get_blob_image (blob, &newlen);
       rc = _keybox_write_blob (blob, newfp, NULL);
       if (rc)
         {
@@ -344,14 +359,216 @@ blob_filecopy (int mode, const char *fname, KEYBOXBLOB blob,
     goto leave;
 
   rc = rename_tmp_file (bakfname, tmpfname, fname, secret);
+  if (!rc)
+    _keybox_index_update (idx, fname, blob_off, oldlen, newlen,
+                          mode == FILECOPY_DELETE? NULL : blob);
 
  leave:
+  _keybox_index_release (idx);
   xfree(bakfname);
   xfree(tmpfname);
   return rc;
 }
 
 
+/* Truncate the keybox file FP to LENGTH bytes.  es_ftruncate works
+ * only with memory streams, thus the file descriptor is used.  Note
+ * that another process which has mapped the keybox gets a SIGBUS if
+ * it accesses the removed part of the mapping.  */
+static gpg_error_t
+truncate_file (estream_t fp, off_t length)
+{
+  if (es_fflush (fp) || ftruncate (es_fileno (fp), length))
+    return gpg_error_from_syserror ();
+  return 0;
+}
+
+
+/* Make sure that the keybox FP ends with a complete blob.  If the
+ * last blob has been cut short, for example because the process
+ * appending it crashed, the file is truncated to the end of the
+ * previous blob; otherwise the blobs appended thereafter could not
+ * be found.  KB describes the keybox; the blobs it records as
+ * complete are not checked again so that a series of appends does
+ * not need to walk over the entire file each time.  */
+static gpg_error_t
+remove_torn_tail (estream_t fp, KB_NAME kb)
+{
+  unsigned char buffer[5];
+  struct stat st;
+  off_t off, last, filesize;
+  size_t n, imagelen;
+
+  if (es_fflush (fp) || fstat (es_fileno (fp), &st))
+    return gpg_error_from_syserror ();
+  filesize = st.st_size;
+
+  /* Start after the known complete blobs if this is still the same
+   * file.  To be safe against a reused inode number we also check
+   * that the last of those blobs is where we expect it.  */
+  off = last = 0;
+  if (kb->verified_len && kb->verified_ino == (uint64_t)st.st_ino
+      && kb->verified_len <= filesize
+      && !es_fseeko (fp, kb->verified_last, SEEK_SET)
+      && es_fread (buffer, sizeof buffer, 1, fp) == 1
+      && buf32_to_size_t (buffer) == kb->verified_len - kb->verified_last)
+    {
+      off = kb->verified_len;
+      last = kb->verified_last;
+    }
+  kb->verified_len = 0;
+
+  for (; off < filesize; off += imagelen)
+    {
+      n = filesize - off < sizeof buffer? filesize - off : sizeof buffer;
+      if (es_fseeko (fp, off, SEEK_SET)
+          || es_fread (buffer, n, 1, fp) != 1)
+        return gpg_error_from_syserror ();
+      if (n < sizeof buffer)
+        break;  /* Torn blob header.  */
+      imagelen = buf32_to_size_t (buffer);
+      if (imagelen < 5)
+        return gpg_error (GPG_ERR_TOO_SHORT);  /* Corrupted keybox.  */
+      if (imagelen > filesize - off)
+        break;  /* Torn blob.  */
+      last = off;
+    }
+  if (off != filesize)
+    {
+      gpg_error_t err;
+
+      log_info ("keybox '%s': removing incomplete blob at offset %llu\n",
+                kb->fname, (unsigned long long)off);
+      err = truncate_file (fp, off);
+      if (err)
+        return err;
+    }
+
+  if (off)
+    {
+      kb->verified_len = off;
+      kb->verified_last = last;
+      kb->verified_ino = st.st_ino;
+    }
+  return 0;
+}
+
+
+/* Append BLOB to the keybox KB.  If OLD_OFFSET is not -1 the
+ * blob of length OLDLEN at this offset is thereafter marked as
+ * deleted; this is how an update is done.  In contrast to
+ * blob_filecopy only the new blob is written and the old one is not
+ * removed from the file; this is left to the next run of
+ * keybox_compress_when_no_other_users.  FOR_OPENPGP indicates that
+ * this is called due to an OpenPGP keyblock change.
+ *
+ * Because the file is modified in place no backup file is created.
+ * A crash while appending leaves an incomplete blob at the end of
+ * the file which is removed by the next append.  The new blob is
+ * synced to disk before the old one is marked as deleted; thus a
+ * crash during an update leaves either the old blob or both blobs
+ * in the keybox.  */
+static gpg_error_t
+blob_append (KB_NAME kb, KEYBOXBLOB blob, int for_openpgp,
+             off_t old_offset, size_t oldlen)
+{
+  const char *fname = kb->fname;
+  gpg_error_t err, err2;
+  gpg_err_code_t ec;
+  estream_t fp;
+  keybox_index_t idx;
+  unsigned char header[8];
+  off_t blob_off = (off_t)-1;
+  size_t newlen;
+
+  if ((ec = gnupg_access (fname, W_OK)))
+    return gpg_error (ec);
+
+  /* Get the index before we change the file.  */
+  _keybox_index_load (fname, &idx);
+
+  err = _keybox_ll_open (&fp, fname, KEYBOX_LL_OPEN_UPDATE);
+  if (err)
+    {
+      _keybox_index_release (idx);
+      return err;
+    }
+
+  /* If this is for OpenPGP, we make sure that the openpgp flag is
+     set in the header.  */
+  if (for_openpgp
+      && es_fread (header, sizeof header, 1, fp) == 1
+      && header[4] == KEYBOX_BLOBTYPE_HEADER
+      && !(header[7] & 0x02))
+    {
+      header[7] |= 0x02; /* OpenPGP data may be available.  */
+      if (es_fseeko (fp, 7, SEEK_SET) || es_fputc (header[7], fp) == EOF)
+        {
+          err = gpg_error_from_syserror ();
+          goto leave;
+        }
+    }
+
+  /* A valid index guarantees that the last write was completed;
+   * otherwise we need to check the end of the file.  */
+  if (!_keybox_index_valid_p (idx))
+    {
+      err = remove_torn_tail (fp, kb);
+      if (err)
+        goto leave;
+    }
+
+  if (es_fseeko (fp, 0, SEEK_END)
+      || (blob_off = es_ftello (fp)) == (off_t)-1)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+
+  _keybox_get_blob_image (blob, &newlen);
+  err = _keybox_write_blob (blob, fp, NULL);
+  if (!err && es_fflush (fp))
+    err = gpg_error_from_syserror ();
+#ifdef HAVE_FSYNC
+  if (!err && old_offset != (off_t)-1 && fsync (es_fileno (fp)))
+    err = gpg_error_from_syserror ();
+#endif
+  if (err)
+    {
+      /* Do not leave a partial blob at the end of the file.  */
+      es_clearerr (fp);
+      truncate_file (fp, blob_off);
+      goto leave;
+    }
+  if (kb->verified_len == blob_off)
+    {
+      kb->verified_len = blob_off + newlen;
+      kb->verified_last = blob_off;
+    }
+
+  /* Only now that the new blob is on disk we delete the old one.  */
+  if (old_offset != (off_t)-1)
+    {
+      if (es_fseeko (fp, old_offset + 4, SEEK_SET)
+          || es_fputc (0, fp) == EOF)
+        err = gpg_error_from_syserror ();
+    }
+
+ leave:
+  err2 = _keybox_ll_close (fp);
+  if (!err)
+    err = err2;
+  if (!err)
+    {
+      if (old_offset != (off_t)-1)
+        _keybox_index_drop (idx, old_offset, oldlen);
+      _keybox_index_update (idx, fname, blob_off, 0, newlen, blob);
+    }
+  _keybox_index_release (idx);
+  return err;
+}
+
+
 /* Insert the OpenPGP keyblock {IMAGE,IMAGELEN} into HD. */
 gpg_error_t
 keybox_insert_keyblock (KEYBOX_HANDLE hd, const void *image, size_t imagelen)
@@ -385,7 +602,9 @@ keybox_insert_keyblock (KEYBOX_HANDLE hd, const void *image, size_t imagelen)
   _keybox_destroy_openpgp_info (&info);
   if (!err)
     {
-      err = blob_filecopy (FILECOPY_INSERT, fname, blob, hd->secret, 1, 0);
+      err = blob_append (hd->kb, blob, 1, (off_t)-1, 0);
+      if (gpg_err_code (err) == GPG_ERR_ENOENT)
+        err = blob_filecopy (FILECOPY_INSERT, fname, blob, hd->secret, 1, 0);
       _keybox_release_blob (blob);
       /*    if (!rc && !hd->secret && kb_offtbl) */
       /*      { */
@@ -404,6 +623,7 @@ keybox_update_keyblock (KEYBOX_HANDLE hd, const void *image, size_t imagelen)
   gpg_error_t err;
   const char *fname;
   off_t off;
+  size_t oldlen;
   KEYBOXBLOB blob;
   size_t nparsed;
   struct _keybox_openpgp_info info;
@@ -421,6 +641,7 @@ keybox_update_keyblock (KEYBOX_HANDLE hd, const void *image, size_t imagelen)
   off = _keybox_get_blob_fileoffset (hd->found.blob);
   if (off == (off_t)-1)
     return gpg_error (GPG_ERR_GENERAL);
+  _keybox_get_blob_image (hd->found.blob, &oldlen);
 
   /* Close the file so that we do no mess up the position for a
      next search.  */
@@ -435,10 +656,10 @@ keybox_update_keyblock (KEYBOX_HANDLE hd, const void *image, size_t imagelen)
                                      hd->ephemeral);
   _keybox_destroy_openpgp_info (&info);
 
-  /* Update the keyblock.  */
+  /* Append the new keyblock and delete the old one.  */
   if (!err)
     {
-      err = blob_filecopy (FILECOPY_UPDATE, fname, blob, hd->secret, 1, off);
+      err = blob_append (hd->kb, blob, 1, off, oldlen);
       _keybox_release_blob (blob);
     }
   return err;
@@ -471,7 +692,9 @@ keybox_insert_cert (KEYBOX_HANDLE hd, ksba_cert_t cert,
   rc = _keybox_create_x509_blob (&blob, cert, sha1_digest, hd->ephemeral);
   if (!rc)
     {
-      rc = blob_filecopy (FILECOPY_INSERT, fname, blob, hd->secret, 0, 0);
+      rc = blob_append (hd->kb, blob, 0, (off_t)-1, 0);
+      if (gpg_err_code (rc) == GPG_ERR_ENOENT)
+        rc = blob_filecopy (FILECOPY_INSERT, fname, blob, hd->secret, 0, 0);
       _keybox_release_blob (blob);
       /*    if (!rc && !hd->secret && kb_offtbl) */
       /*      { */
@@ -508,6 +731,7 @@ keybox_set_flags (KEYBOX_HANDLE hd, int what, int idx, unsigned int value)
   size_t flag_pos, flag_size;
   const unsigned char *buffer;
   size_t length;
+  keybox_index_t kbidx;
 
   (void)idx;  /* Not yet used.  */
 
@@ -536,9 +760,13 @@ keybox_set_flags (KEYBOX_HANDLE hd, int what, int idx, unsigned int value)
 
   _keybox_close_file (hd);
 
+  _keybox_index_load (fname, &kbidx);
   err = _keybox_ll_open (&fp, fname, KEYBOX_LL_OPEN_UPDATE);
   if (err)
-    return err;
+    {
+      _keybox_index_release (kbidx);
+      return err;
+    }
 
   ec = 0;
   if (es_fseeko (fp, off, SEEK_SET))
@@ -573,6 +801,11 @@ keybox_set_flags (KEYBOX_HANDLE hd, int what, int idx, unsigned int value)
         ec = gpg_err_code (err);
     }
 
+  /* The offsets did not change but the index needs a new stamp.  */
+  if (!ec)
+    _keybox_index_update (kbidx, fname, off, 0, 0, NULL);
+  _keybox_index_release (kbidx);
+
   return gpg_error (ec);
 }
 
@@ -585,6 +818,8 @@ keybox_delete (KEYBOX_HANDLE hd)
   const char *fname;
   estream_t fp;
   int rc, rc2;
+  size_t length;
+  keybox_index_t idx;
 
   if (!hd)
     return gpg_error (GPG_ERR_INV_VALUE);
@@ -599,12 +834,17 @@ keybox_delete (KEYBOX_HANDLE hd)
   off = _keybox_get_blob_fileoffset (hd->found.blob);
   if (off == (off_t)-1)
     return gpg_error (GPG_ERR_GENERAL);
+  _keybox_get_blob_image (hd->found.blob, &length);
   off += 4;
 
   _keybox_close_file (hd);
+  _keybox_index_load (fname, &idx);
   rc = _keybox_ll_open (&fp, hd->kb->fname, KEYBOX_LL_OPEN_UPDATE);
   if (rc)
-    return rc;
+    {
+      _keybox_index_release (idx);
+      return rc;
+    }
 
   if (es_fseeko (fp, off, SEEK_SET))
     rc = gpg_error_from_syserror ();
@@ -620,6 +860,11 @@ keybox_delete (KEYBOX_HANDLE hd)
         rc = rc2;
     }
 
+  /* The blob has been overwritten in place by a deleted blob.  */
+  if (!rc)
+    _keybox_index_update (idx, fname, off - 4, length, length, NULL);
+  _keybox_index_release (idx);
+
   return rc;
 }
 
@@ -641,6 +886,7 @@ keybox_compress_when_no_other_users (void *token, int for_openpgp)
   u32 cut_time;
   int any_changes = 0;
   int skipped_deleted;
+  keybox_index_t idx = NULL;
 
   if (for_openpgp)
     hd = keybox_new_openpgp (token, 0);
@@ -722,6 +968,11 @@ keybox_compress_when_no_other_users (void *token, int for_openpgp)
       goto leave;
     }
 
+  /* All blobs are written anew; thus we build a fresh index on the
+   * fly.  This also repairs a stale index.  */
+  _keybox_index_load (fname, &idx);
+  _keybox_index_reset (idx);
+
 
   /* Processing loop.  By reading using _keybox_read_blob we
      automagically skip any blobs flagged as deleted.  Thus what we
@@ -794,6 +1045,7 @@ keybox_compress_when_no_other_users (void *token, int for_openpgp)
             }
         }
 
+      _keybox_index_add (idx, blob, es_ftello (newfp));
       rc = _keybox_write_blob (blob, newfp, NULL);
       if (rc)
         break;
@@ -816,7 +1068,12 @@ keybox_compress_when_no_other_users (void *token, int for_openpgp)
   if (rc || !any_changes)
     gnupg_remove (tmpfname);
   else
-    rc = rename_tmp_file (bakfname, tmpfname, fname, hd->secret);
+    {
+      rc = rename_tmp_file (bakfname, tmpfname, fname, hd->secret);
+      if (!rc)
+        _keybox_index_update (idx, fname, 0, 0, 0, NULL);
+    }
+  _keybox_index_release (idx);
 
   xfree(bakfname);
   xfree(tmpfname);
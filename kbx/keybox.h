@@ -83,6 +83,7 @@ gpg_error_t keybox_lock (KEYBOX_HANDLE hd, int yes, long timeout);
 /* Fixme: This function does not belong here: Provide a better
    interface to create a new keybox file.  */
 gpg_error_t _keybox_write_header_blob (estream_t fp, int openpgp_flag);
+void keybox_enable_mmap (int enable);
 
 /*-- keybox-search.c --*/
 gpg_error_t keybox_get_data (KEYBOX_HANDLE hd,
@@ -96,6 +97,7 @@ int keybox_get_cert (KEYBOX_HANDLE hd, ksba_cert_t *ret_cert);
 #endif /*KEYBOX_WITH_X509*/
 int keybox_get_flags (KEYBOX_HANDLE hd, int what, int idx, unsigned int *value);
 
+void keybox_set_search_threads (int nthreads);
 gpg_error_t keybox_search_reset (KEYBOX_HANDLE hd);
 gpg_error_t keybox_search (KEYBOX_HANDLE hd,
                            KEYBOX_SEARCH_DESC *desc, size_t ndesc,
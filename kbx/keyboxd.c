@@ -90,6 +90,7 @@ enum cmd_and_opt_values
     oFakedSystemTime,
     oListenBacklog,
     oDisableCheckOwnSocket,
+    oCacheSize,
 
     oDummy
   };
@@ -123,6 +124,8 @@ static gpgrt_opt_t opts[] = {
   ARGPARSE_s_n (oDisableCheckOwnSocket, "disable-check-own-socket", "@"),
   ARGPARSE_s_s (oFakedSystemTime, "faked-system-time", "@"),
   ARGPARSE_s_i (oListenBacklog, "listen-backlog", "@"),
+  ARGPARSE_s_u (oCacheSize, "cache-size",
+                N_("|N|use up to N MiB of memory for the cache")),
 
   ARGPARSE_end () /* End of list */
 };
@@ -380,6 +383,7 @@ parse_rereadable_options (gpgrt_argparse_t *pargs, int reread)
       opt.quiet = 0;
       opt.verbose = 0;
       opt.debug = 0;
+      opt.cache_size = DEFAULT_CACHE_SIZE;
       disable_check_own_socket = 0;
       return 1;
     }
@@ -408,6 +412,8 @@ parse_rereadable_options (gpgrt_argparse_t *pargs, int reread)
 
     case oDisableCheckOwnSocket: disable_check_own_socket = 1; break;
 
+    case oCacheSize: opt.cache_size = pargs->r.ret_ulong; break;
+
     default:
       return 0; /* not handled */
     }
@@ -420,6 +426,7 @@ parse_rereadable_options (gpgrt_argparse_t *pargs, int reread)
 static void
 finalize_rereadable_options (void)
 {
+  kbxd_set_cache_size (opt.cache_size);
 }
 
 
@@ -43,6 +43,9 @@ struct
   /* True if we are running detached from the tty. */
   int running_detached;
 
+  /* The memory budget for the cache in MiB.  */
+  unsigned int cache_size;
+
   /*
    * Global state variables.
    */
@@ -52,9 +55,21 @@ struct
   pid_t transaction_pid;
   unsigned int in_transaction : 1;
   unsigned int active_transaction : 1;
+
+  /* Set if the global transaction was started in bulk mode.  In this
+   * mode the search indices are only rebuilt at the end of the
+   * transaction.  If TRANSACTION_BATCH_SIZE is not 0 the transaction
+   * is committed after that many stores and then continued.  */
+  unsigned int bulk_mode : 1;
+  unsigned int transaction_batch_size;
 } opt;
 
 
+/* The default value for --cache-size.  Searches are not yet answered
+ * from the cache; thus we keep the default small.  */
+#define DEFAULT_CACHE_SIZE 4
+
+
 /* Bit values for the --debug option.  */
 #define DBG_MPI_VALUE	  2	/* debug mpi details */
 #define DBG_CRYPTO_VALUE  4	/* debug low level crypto */
@@ -117,6 +132,10 @@ struct server_control_s
    * auto-created as needed.  */
   db_request_t db_req;
 
+  /* The kind of database lock held by the connection: 0 = none,
+   * 1 = read, 2 = read-write (frontend.c).  */
+  int db_lock_mode;
+
   /* Flags for the current request.  */
 
   /* If the any of the filter flags are set a search returns only
@@ -34,3 +34,18 @@
        (tr:assert-identity source)))
     (append plain-files data-files)))
  (force all-compression-algos))
+
+(for-each-p
+ "Checking encryption using compression threads"
+ (lambda (compression)
+   (for-each-p
+    ""
+    (lambda (source)
+      (tr:do
+       (tr:open source)
+       (tr:gpg "" `(--yes --encrypt --recipient ,usrname2
+			  --compress-algo ,compression --compress-threads 4))
+       (tr:gpg "" '(--yes --decrypt))
+       (tr:assert-identity source)))
+    (append plain-files data-files)))
+ (filter have-compression-algo? '("ZIP" "ZLIB")))
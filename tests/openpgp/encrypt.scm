@@ -124,3 +124,36 @@
        (unless (string-contains? c "[GNUPG:] BEGIN_ENCRYPTION 0 9 2")
 	  (fail (string-append "Unexpected status: " c)))))))
  '("plain-1"))
+
+(for-each-p
+ "Checking OCB mode using AEAD threads"
+ (lambda (chunk-size)
+   (for-each-p
+    ""
+    (lambda (source)
+      (tr:do
+       (tr:open source)
+       (tr:gpg "" `(--yes -er ,"patrice.lumumba"
+			  --chunk-size ,chunk-size --aead-threads 4))
+       (tr:gpg "" '(--yes -d))
+       (tr:assert-identity source))
+      (tr:do
+       (tr:open source)
+       (tr:gpg "" `(--yes -er ,"patrice.lumumba" --chunk-size ,chunk-size))
+       (tr:gpg "" '(--yes -d --aead-threads 4))
+       (tr:assert-identity source)))
+    all-files))
+ '("6" "8" "12"))
+
+(info "Checking that AEAD threads detect a modified chunk")
+(lettmp (cipher plain)
+  (call-check `(,@GPG --yes -o ,cipher -er ,"patrice.lumumba"
+		      --chunk-size 6 --aead-threads 4 "data-80000"))
+  ;; Modify a chunk in the middle of the message.
+  (letfd ((fd (open cipher (logior O_WRONLY O_BINARY))))
+    (seek fd 40000 SEEK_SET)
+    (display "XXXX" (fdopen fd "wb")))
+  (let ((result (call-with-io `(,@GPG --yes -o ,plain -d --aead-threads 4
+				      ,cipher) "")))
+    (if (= 0 (:retcode result))
+	(fail "Modified AEAD message decrypted without error"))))
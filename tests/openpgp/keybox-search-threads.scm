@@ -0,0 +1,102 @@
+#!/usr/bin/env gpgscm
+
+;; Copyright (C) 2026 g10 Code GmbH
+;;
+;; This file is part of GnuPG.
+;;
+;; GnuPG is free software; you can redistribute it and/or modify
+;; it under the terms of the GNU General Public License as published by
+;; the Free Software Foundation; either version 3 of the License, or
+;; (at your option) any later version.
+;;
+;; GnuPG is distributed in the hope that it will be useful,
+;; but WITHOUT ANY WARRANTY; without even the implied warranty of
+;; MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+;; GNU General Public License for more details.
+;;
+;; You should have received a copy of the GNU General Public License
+;; along with this program; if not, see <http://www.gnu.org/licenses/>.
+
+;; Check that searching a mapped keybox with --search-threads returns
+;; the same keys in the same order as a plain search and counts the
+;; same too large keyblocks.
+
+(load (in-srcdir "tests" "openpgp" "defs.scm"))
+(setup-environment)
+
+(if (or (flag "--use-keyring" *args*) (flag "--use-keyboxd" *args*))
+    (skip "This test requires a keybox file."))
+
+(define THREADS '(--mmap-keybox --search-threads 4))
+
+;; Return a blob of LENGTH bytes with TYPE.  Only the header is valid.
+(define (make-blob length type)
+  (string-append
+   (list->string (map integer->char
+		      (list (quotient length #x1000000)
+			    (remainder (quotient length #x10000) 256)
+			    (remainder (quotient length 256) 256)
+			    (remainder length 256)
+			    type)))
+   (make-string (- length 5) #\X)))
+
+(info "Appending a deleted and a too large blob to the keybox.")
+;; The threads are only used after the first 256 KiB without a
+;; match.  The deleted blob makes sure that the too large blob is
+;; skipped by one of the threads.
+(letfd ((fd (open (path-join GNUPGHOME "pubring.kbx")
+		  (logior O_WRONLY O_APPEND O_BINARY) #o600)))
+  (let ((port (fdopen fd "wb")))
+    (display (make-blob (* 300 1024) 0) port)
+    (display (make-blob (+ (* 5 1024 1024) 1024) 2) port)))
+
+;; Keys appended after the too large blob.
+(for-each
+ (lambda (name)
+   (call-check `(,@GPG --import ,(in-srcdir "tests" "openpgp" "samplekeys"
+					     name))))
+ '("dda252ebb8ebe1af-1.asc" "dda252ebb8ebe1af-2.asc"))
+
+;; Return the number of skipped keys reported in the log LOG.
+(define (skipped-keys log)
+  (let ((lines (filter (lambda (line)
+			 (string-contains? line "skipped due to"))
+		       (string-split-newlines log))))
+    (if (null? lines)
+	0
+	(let loop ((words (string-split (car lines) #\space)))
+	  (cond
+	   ((or (null? words) (null? (cdr words)))
+	    (fail "no count in" (car lines)))
+	   ((string=? (car words) "Warning:")
+	    (string->number (cadr words)))
+	   (else (loop (cdr words))))))))
+
+;; List the keys matching PATTERNS with ARGS and return the listing
+;; and the number of skipped keys.
+(define (list-keys args patterns)
+  (let ((result (call-with-io `(,@GPG --with-colons ,@args
+				      --list-keys ,@patterns) "")))
+    (unless (= 0 (:retcode result))
+	    (fail "listing failed:" (:stderr result)))
+    (list (:stdout result) (skipped-keys (:stderr result)))))
+
+(for-each-p'
+ "Checking searches with threads"
+ (lambda (patterns)
+   (let ((plain (list-keys '() patterns))
+	 (threaded (list-keys THREADS patterns)))
+     (unless (string=? (car plain) (car threaded))
+	     (fail "listings differ for" patterns))
+     (unless (= (cadr plain) (cadr threaded) 1)
+	     (fail "skipped keys differ for" patterns ":"
+		   (cadr plain) (cadr threaded)))
+     ;; The keys after the too large blob must have been found.
+     (unless (or (null? (cdr patterns))
+		 (string-contains? (car threaded)
+				   "A55120427374F3F7AA5F1166DDA252EBB8EBE1AF"))
+	     (fail "key after the too large blob not found"))))
+ car
+ '(("@example.net" "*DDA252EBB8EBE1AF")
+   ("<zulu@example.net>" "*9E669861368BCA0BE42DAF7DDDA252EBB8EBE1AF")
+   ("Test (demo key)")))
@@ -0,0 +1,47 @@
+#!/usr/bin/env gpgscm
+
+;; Copyright (C) 2026 g10 Code GmbH
+;;
+;; This file is part of GnuPG.
+;;
+;; GnuPG is free software; you can redistribute it and/or modify
+;; it under the terms of the GNU General Public License as published by
+;; the Free Software Foundation; either version 3 of the License, or
+;; (at your option) any later version.
+;;
+;; GnuPG is distributed in the hope that it will be useful,
+;; but WITHOUT ANY WARRANTY; without even the implied warranty of
+;; MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+;; GNU General Public License for more details.
+;;
+;; You should have received a copy of the GNU General Public License
+;; along with this program; if not, see <http://www.gnu.org/licenses/>.
+
+;; New blobs are appended to the keybox in place.  Check that an
+;; incomplete blob left at the end of the file by a crash is removed
+;; by the next append and does not hide the keys appended thereafter.
+
+(load (in-srcdir "tests" "openpgp" "defs.scm"))
+(setup-environment)
+
+(if (or (flag "--use-keyring" *args*) (flag "--use-keyboxd" *args*))
+    (skip "This test requires a keybox file."))
+
+(define fpr1 "9E669861368BCA0BE42DAF7DDDA252EBB8EBE1AF")
+(define fpr2 "A55120427374F3F7AA5F1166DDA252EBB8EBE1AF")
+
+(call-check `(,@GPG --import ,(in-srcdir "tests" "openpgp"
+					  "samplekeys/dda252ebb8ebe1af-1.asc")))
+
+(info "Appending an incomplete blob to the keybox.")
+;; The header of a blob claiming to be far longer than the rest of
+;; the file, as if the process writing it had been killed.
+(letfd ((fd (open (path-join GNUPGHOME "pubring.kbx")
+		  (logior O_WRONLY O_APPEND O_BINARY) #o600)))
+  (display (list->string (map integer->char '(1 1 1 1 2 1 1 1 1 1)))
+	   (fdopen fd "wb")))
+
+(info "Checking that a key appended thereafter can be found.")
+(call-check `(,@GPG --import ,(in-srcdir "tests" "openpgp"
+					  "samplekeys/dda252ebb8ebe1af-2.asc")))
+(call-check `(,@GPG --list-keys ,fpr1 ,fpr2))
@@ -0,0 +1,89 @@
+#!/usr/bin/env gpgscm
+
+;; Copyright (C) 2026 g10 Code GmbH
+;;
+;; This file is part of GnuPG.
+;;
+;; GnuPG is free software; you can redistribute it and/or modify
+;; it under the terms of the GNU General Public License as published by
+;; the Free Software Foundation; either version 3 of the License, or
+;; (at your option) any later version.
+;;
+;; GnuPG is distributed in the hope that it will be useful,
+;; but WITHOUT ANY WARRANTY; without even the implied warranty of
+;; MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+;; GNU General Public License for more details.
+;;
+;; You should have received a copy of the GNU General Public License
+;; along with this program; if not, see <http://www.gnu.org/licenses/>.
+
+;; Check that more clients than the keyboxd has reader connections can
+;; keep a search open while keys are stored and that each of them
+;; still gets all results of its search.
+
+(load (in-srcdir "tests" "openpgp" "defs.scm"))
+(setup-environment)
+
+(unless (flag "--use-keyboxd" *args*)
+	(skip "This test requires the keyboxd."))
+
+;; More than MAX_READER_CONNS in kbx/backend-sqlite.c.
+(define NCLIENTS 12)
+(define NNEXT 30)
+
+(define client-numbers
+  (let loop ((n (- NCLIENTS 1)) (acc '()))
+    (if (< n 0) acc (loop (- n 1) (cons n acc)))))
+
+;; Return the commands for a client which searches for all demo keys
+;; and sleeps after the first result if SLEEP is true.
+(define (client-commands sleep)
+  (apply string-append
+	 "SEARCH --no-data @example.net\n"
+	 (if sleep "/sleep\n/sleep\n" "")
+	 (append (vector->list (make-vector NNEXT "NEXT --no-data\n"))
+		 '("/bye\n"))))
+
+;; Return the PUBKEY_INFO lines in the output OUTPUT of a client.
+(define (pubkey-infos output)
+  (filter (lambda (line) (string-prefix? line "S PUBKEY_INFO"))
+	  (string-split-newlines output)))
+
+(define (gpg-connect-keyboxd commands)
+  (call-popen `(,(tool 'gpg-connect-agent) --keyboxd) commands))
+
+(define reference (pubkey-infos (gpg-connect-keyboxd (client-commands #f))))
+(assert (> (length reference) 8))
+
+(info "Starting" NCLIENTS "clients with an open search.")
+(define command-file (path-join GNUPGHOME "client-commands"))
+(create-file command-file (client-commands #t))
+(define (output-file n)
+  (path-join GNUPGHOME (string-append "client-" (number->string n))))
+
+(define clients
+  (map (lambda (n)
+	 (letfd ((source (open command-file (logior O_RDONLY O_BINARY)))
+		 (sink (open (output-file n)
+			     (logior O_WRONLY O_CREAT O_BINARY) #o600)))
+	   (process-spawn-fd `(,(tool 'gpg-connect-agent) --keyboxd)
+			     source sink CLOSED_FD)))
+       client-numbers))
+
+(info "Storing and searching keys while the searches are open.")
+(call-check `(,@GPG --import ,(in-srcdir "tests" "openpgp" "samplekeys"
+					  "dda252ebb8ebe1af-1.asc")))
+(call-check `(,@GPG --list-keys alpha@example.net
+		    9E669861368BCA0BE42DAF7DDDA252EBB8EBE1AF))
+
+(info "Checking the results of the clients.")
+(for-each (lambda (retcode) (assert (= 0 retcode)))
+	  (process-wait-list clients #t))
+(for-each
+ (lambda (n)
+   (let ((result (call-with-input-file (output-file n)
+		   (lambda (port) (pubkey-infos (read-all port))))))
+     (unless (equal? result reference)
+	     (fail "client" n "got" (length result) "instead of"
+		   (length reference) "keys"))))
+ client-numbers)
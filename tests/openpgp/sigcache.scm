@@ -0,0 +1,115 @@
+#!/usr/bin/env gpgscm
+
+;; Copyright (C) 2026 g10 Code GmbH
+;;
+;; This file is part of GnuPG.
+;;
+;; GnuPG is free software; you can redistribute it and/or modify
+;; it under the terms of the GNU General Public License as published by
+;; the Free Software Foundation; either version 3 of the License, or
+;; (at your option) any later version.
+;;
+;; GnuPG is distributed in the hope that it will be useful,
+;; but WITHOUT ANY WARRANTY; without even the implied warranty of
+;; MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+;; GNU General Public License for more details.
+;;
+;; You should have received a copy of the GNU General Public License
+;; along with this program; if not, see <http://www.gnu.org/licenses/>.
+
+;; Check that --persistent-sig-cache does not change the result of
+;; --check-sigs and that a damaged cache or an unsafe key file is
+;; ignored.
+
+(load (in-srcdir "tests" "openpgp" "defs.scm"))
+(setup-environment)
+
+;; With a keyring the validity of the signatures is also cached in
+;; the keyring and the signatures are not checked again.
+(if (flag "--use-keyring" *args*)
+    (skip "This test requires a keybox or keyboxd."))
+
+(define cache-file (path-join GNUPGHOME "sigcache.bin"))
+(define key-file (path-join GNUPGHOME "sigcache.key"))
+
+;; A scenario with many certifications.
+(call-check `(,@GPG --import ,(in-srcdir "tests" "openpgp" "trust-pgp"
+					  "scenario1.asc")))
+
+;; Run --check-sigs with ARGS and return the result.
+(define (check-sigs . args)
+  (let ((result (call-with-io `(,@GPG --with-colons --check-sigs
+				      --debug memstat ,@args) "")))
+    (unless (= 0 (:retcode result))
+	    (fail "--check-sigs failed:" (:stderr result)))
+    result))
+
+;; Return the number of cache hits reported in the statistics of
+;; RESULT.
+(define (sigcache-hits result)
+  (let ((lines (filter (lambda (line)
+			 (string-contains? line "sigcache: entries="))
+		       (string-split-newlines (:stderr result)))))
+    (if (null? lines)
+	(fail "no statistics of the signature cache:" (:stderr result)))
+    (let loop ((words (string-split (car lines) #\space)))
+      (cond
+       ((null? words)
+	(fail "no hit count in" (car lines)))
+       ((string-prefix? (car words) "hits=")
+	(string->number (substring (car words) 5
+				   (string-length (car words)))))
+       (else (loop (cdr words)))))))
+
+;; Check --check-sigs with the cache against REFERENCE.  If HITS is
+;; true the cache must have been used, otherwise it must have been
+;; ignored.  If MESSAGE is given it must show up in the log.
+(define (check-cached reference hits . message)
+  (let ((result (check-sigs '--persistent-sig-cache)))
+    (unless (string=? (:stdout result) reference)
+	    (fail "--check-sigs output differs with the cache"))
+    (if hits
+	(assert (> (sigcache-hits result) 0))
+	(assert (= (sigcache-hits result) 0)))
+    (unless (or (null? message)
+		(string-contains? (:stderr result) (car message)))
+	    (fail "expected" (car message) "in" (:stderr result)))))
+
+;; Overwrite the file NAME at OFFSET with STRING.
+(define (overwrite-file name offset string)
+  (letfd ((fd (open name (logior O_WRONLY O_BINARY))))
+    (seek fd offset SEEK_SET)
+    (display string (fdopen fd "wb"))))
+
+(define reference (:stdout (check-sigs)))
+
+(info "Checking the signatures with a cold and a warm cache.")
+(check-cached reference #f)
+(assert (file-exists? cache-file))
+(assert (file-exists? key-file))
+(check-cached reference #t)
+
+(info "Checking that a tampered cache is ignored.")
+;; Overwrite the start of the first entry.
+(overwrite-file cache-file 12 "XXXXXXXX")
+(check-cached reference #f "is invalid - ignored")
+(check-cached reference #t)
+
+(info "Checking that a truncated cache is ignored.")
+(catch #f (unlink cache-file))
+(letfd ((fd (open cache-file (logior O_WRONLY O_CREAT O_BINARY) #o600)))
+  (display (string-append "GPGsigc" (string (integer->char 2)))
+	   (fdopen fd "wb")))
+(check-cached reference #f "is invalid - ignored")
+(check-cached reference #t)
+
+(unless *win32*
+  (info "Checking that a key readable by others disables the cache.")
+  ;; Copy the key to a file readable by others.  This assumes that
+  ;; the umask does not clear these bits.
+  (let ((tmp (string-append key-file ".tmp")))
+    (pipe:do
+     (pipe:open key-file (logior O_RDONLY O_BINARY))
+     (pipe:write-to tmp (logior O_WRONLY O_CREAT O_BINARY) #o644))
+    (rename tmp key-file))
+  (check-cached reference #f "unsafe permissions"))
@@ -0,0 +1,91 @@
+#!/usr/bin/env gpgscm
+
+;; Copyright (C) 2026 g10 Code GmbH
+;;
+;; This file is part of GnuPG.
+;;
+;; GnuPG is free software; you can redistribute it and/or modify
+;; it under the terms of the GNU General Public License as published by
+;; the Free Software Foundation; either version 3 of the License, or
+;; (at your option) any later version.
+;;
+;; GnuPG is distributed in the hope that it will be useful,
+;; but WITHOUT ANY WARRANTY; without even the implied warranty of
+;; MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+;; GNU General Public License for more details.
+;;
+;; You should have received a copy of the GNU General Public License
+;; along with this program; if not, see <http://www.gnu.org/licenses/>.
+
+(load (in-srcdir "tests" "openpgp" "trust-pgp" "common.scm"))
+
+(if (or (flag "--use-keyring" *args*) (flag "--use-keyboxd" *args*))
+    (skip "This test requires a keybox file."))
+
+(display "Checking incremental trustdb checks...\n")
+
+(define KEYS (list ALICE BOBBY CAROL DAVID FRANK GRACE))
+
+;; Return the validities of all keys.
+(define (alltrust)
+  (map gettrust KEYS))
+
+;; Check the trustdb and return true if only the changed keys have
+;; been revalidated.
+(define (updatetrustdb-incremental?)
+  (let ((result (call-with-io `(,@GPG --check-trustdb --yes) "")))
+    (unless (= 0 (:retcode result))
+	    (fail "--check-trustdb failed:" (:stderr result)))
+    (string-contains? (:stderr result) "revalidated")))
+
+;; Force a full run and return the validities of all keys.
+(define (fulltrust)
+  (catch #f (unlink (path-join GNUPGHOME "trustdb.gpg.wot")))
+  (assert (not (updatetrustdb-incremental?)))
+  (alltrust))
+
+(define (copy-file from to)
+  (pipe:do
+   (pipe:open from (logior O_RDONLY O_BINARY))
+   (pipe:write-to to (logior O_WRONLY O_CREAT O_BINARY) #o600)))
+
+;; Delete KEY and import it again so that it is recorded as changed.
+;; The trustdb is not checked by the import so that the next check
+;; sees the changed key.
+(define (reimport key)
+  (call-check `(,@GPG --yes --delete-keys ,key))
+  (call-check `(,@GPG --no-auto-check-trustdb --import
+		      ,(in-srcdir "tests" "openpgp" "trust-pgp"
+				  "scenario1.asc"))))
+
+(initscenario "scenario1")
+(setownertrust BOBBY FULLTRUST)
+(setownertrust CAROL MARGINALTRUST)
+(setownertrust DAVID MARGINALTRUST)
+(setownertrust FRANK MARGINALTRUST)
+(updatetrustdb)
+(checktrust GRACE "f")
+
+(info "Checking that a changed key is revalidated incrementally.")
+(reimport GRACE)
+(assert (updatetrustdb-incremental?))
+(let ((incremental (alltrust)))
+  (assert (equal? incremental (fulltrust))))
+(checktrust GRACE "f")
+
+(info "Checking that an unrecorded change forces a full run.")
+;; Save the keybox with Frank's key, delete that key, and put the
+;; saved keybox back like an older gpg would do without recording
+;; the change.
+(define saved-keybox (path-join GNUPGHOME "pubring.kbx.saved"))
+(copy-file (path-join GNUPGHOME "pubring.kbx") saved-keybox)
+(call-check `(,@GPG --yes --delete-keys ,FRANK))
+(updatetrustdb)
+(checktrust GRACE "m")
+(unlink (path-join GNUPGHOME "pubring.kbx"))
+(copy-file saved-keybox (path-join GNUPGHOME "pubring.kbx"))
+(reimport GRACE)
+(assert (not (updatetrustdb-incremental?)))
+(let ((validities (alltrust)))
+  (assert (equal? validities (fulltrust))))
+(checktrust GRACE "f")
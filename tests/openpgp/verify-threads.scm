@@ -0,0 +1,93 @@
+#!/usr/bin/env gpgscm
+
+;; Copyright (C) 2026 g10 Code GmbH
+;;
+;; This file is part of GnuPG.
+;;
+;; GnuPG is free software; you can redistribute it and/or modify
+;; it under the terms of the GNU General Public License as published by
+;; the Free Software Foundation; either version 3 of the License, or
+;; (at your option) any later version.
+;;
+;; GnuPG is distributed in the hope that it will be useful,
+;; but WITHOUT ANY WARRANTY; without even the implied warranty of
+;; MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+;; GNU General Public License for more details.
+;;
+;; You should have received a copy of the GNU General Public License
+;; along with this program; if not, see <http://www.gnu.org/licenses/>.
+
+;; Check that verifying signatures with --verify-threads gives the
+;; same results as verifying them one after the other.
+
+(load (in-srcdir "tests" "openpgp" "trust-pgp" "common.scm"))
+(setup-environment)
+
+(define THREADS '(--verify-threads 4))
+(define KEYS (list ALICE BOBBY CAROL DAVID FRANK GRACE HEIDI))
+
+;; Return the output of --check-sigs with ARGS.
+(define (check-sigs . args)
+  (call-check `(,@GPG --with-colons --check-sigs ,@args)))
+
+;; Do a full trustdb check with ARGS and return the validities of all
+;; keys.  Keys which are not part of the scenario are skipped.
+(define (validities . args)
+  (catch #f (unlink (path-join (getenv "GNUPGHOME") "trustdb.gpg.wot")))
+  (call-check `(,@GPG --check-trustdb --yes ,@args))
+  (map (lambda (key)
+	 (catch "none" (gettrust key '--no-auto-check-trustdb)))
+       KEYS))
+
+;; Import the trust scenario NAME into a new home directory, set the
+;; OWNERTRUSTS, which is a list of fingerprint and ownertrust pairs,
+;; and compare the results with and without threads.
+(define (check-scenario name ownertrusts)
+  (with-ephemeral-home-directory setup-environment-no-atexit stop-agent
+    (let ((trust-model (gpg-config 'gpg "trust-model")))
+      (trust-model::update "pgp"))
+    (call-check `(,@GPG --import
+			,(in-srcdir "tests" "openpgp" "trust-pgp"
+				    (string-append name ".asc"))))
+    (setownertrust ALICE ULTIMATETRUST)
+    (for-each (lambda (x) (setownertrust (car x) (cadr x))) ownertrusts)
+    (let ((serial (validities))
+	  (threaded (apply validities THREADS)))
+      (unless (equal? serial threaded)
+	      (fail name ": validities differ:" serial threaded)))
+    (unless (string=? (check-sigs) (apply check-sigs THREADS))
+	    (fail name ": --check-sigs output differs"))))
+
+(for-each-p'
+ "Checking trust scenarios with verify threads"
+ (lambda (x) (check-scenario (car x) (cdr x)))
+ car
+ `(("scenario1" (,BOBBY ,FULLTRUST) (,CAROL ,MARGINALTRUST)
+    (,DAVID ,MARGINALTRUST) (,FRANK ,MARGINALTRUST))
+   ("scenario2" (,DAVID ,FULLTRUST))
+   ("scenario3")
+   ("scenario4")))
+
+(info "Checking the import of a key with many user IDs.")
+(setenv "PINENTRY_USER_DATA" "test" #t)
+(define uid "Many <many@invalid.example.net>")
+(call-check `(,@GPG --quick-generate-key ,uid))
+(do ((i 1 (+ i 1))) ((> i 24))
+  (call-check `(,@GPG --quick-add-uid ,(string-append "=" uid)
+		      ,(string-append "Many " (number->string i)
+				      " <many" (number->string i)
+				      "@invalid.example.net>"))))
+
+(define many-key (path-join (getenv "GNUPGHOME") "many.asc"))
+(call-check `(,@GPG --yes --armor --output ,many-key
+		    --export ,(string-append "=" uid)))
+
+;; Import the key into a new home directory with ARGS and return the
+;; output of --check-sigs.
+(define (import-many . args)
+  (with-ephemeral-home-directory setup-environment-no-atexit stop-agent
+    (call-check `(,@GPG --import ,@args ,many-key))
+    (apply check-sigs args)))
+
+(unless (string=? (import-many) (apply import-many THREADS))
+	(fail "--check-sigs output differs after the import"))